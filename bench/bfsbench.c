@@ -0,0 +1,455 @@
+// ============================================================================
+// bfsbench.c - microbenchmarks for each layer of BFS, with JSON results
+//
+// Formats a scratch BFSDISK in the current directory (or the one -C names),
+// mounts it, and times, one call at a time:
+//
+//   bioRead, bioWrite         : one block, sequential and random DBNs
+//   fsRead, fsWrite           : several transfer sizes, sequential and random
+//   bfsFbnToDbn               : random FBNs of a large file
+//   mixed                     : threads doing 70% reads, 30% writes, each on
+//                               a file of its own, then all on one file
+//   bfsFindFreeBlock          : allocation from a mostly-full bitmap
+//
+// Each run reports ops/sec, MB/s (1 MB = 10^6 bytes) and the p50, p99 and
+// p999 latency of one call, in microseconds, as one JSON object on stdout.
+// Build with `make bfsbench`
+// ============================================================================
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bfs.h"
+#include "fs.h"
+
+#define BENCHMAXTHREADS 16        // each thread needs its own OFT entry
+#define BENCHMIXEDSIZE  4096      // transfer size of the mixed workload
+
+typedef struct {          // result of one benchmark run
+  str  bench;             // name of the call timed
+  str  pattern;           // "seq", "rand", "private" or "shared"
+  i32  size;              // bytes per call.  0 => no data moved
+  i32  threads;
+  i32  num;               // # of calls timed
+  i64* lat;               // 'num' latencies, in ns
+  i64  elapsed;           // wall time of the whole run, in ns
+} BenchRun;
+
+typedef struct {          // one thread of a mixed run
+  i32  fd;                // file to use: opened by the thread itself
+  str  fname;
+  i32  fileBytes;
+  i32  num;               // # of calls to make
+  i64* lat;
+  u64  seed;
+} BenchThread;
+
+static i32 g_maxOps    = 4000;    // most calls timed in one run
+static i32 g_fileBytes = 16 << 20;
+static i32 g_threads   = 4;
+static u64 g_seed      = 1;
+static i32 g_first     = 1;       // 1 => no result printed yet
+static i8* g_buf       = NULL;    // data for every transfer
+
+
+
+// ============================================================================
+// Return a monotonic time, in ns
+// ============================================================================
+static i64 benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (i64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+// ============================================================================
+// Return the next pseudo-random number from the xorshift64* state 's'
+// ============================================================================
+static u64 benchRand(u64* s) {
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 2685821657736338717ull;
+}
+
+
+
+// ============================================================================
+// Order latencies, for qsort
+// ============================================================================
+static int benchCompare(const void* a, const void* b) {
+  i64 x = *(i64*)a;
+  i64 y = *(i64*)b;
+  return (x > y) - (x < y);
+}
+
+
+
+// ============================================================================
+// Return the 'p' quantile, 0 < p <= 1, of the 'num' sorted latencies 'lat',
+// in microseconds.  Nearest rank
+// ============================================================================
+static double benchQuantile(i64* lat, i32 num, double p) {
+  if (num == 0) return 0;
+  i32 rank = (i32)(p * num + 0.999999);
+  if (rank < 1)   rank = 1;
+  if (rank > num) rank = num;
+  return lat[rank - 1] / 1000.0;
+}
+
+
+
+// ============================================================================
+// Print 'run' as one JSON object of the "results" array
+// ============================================================================
+static void benchReport(BenchRun* run) {
+  qsort(run->lat, run->num, sizeof(i64), benchCompare);
+
+  double secs = run->elapsed / 1e9;
+  double ops  = (secs > 0) ? run->num / secs : 0;
+  double mb   = ops * run->size / 1e6;
+
+  printf("%s\n    {\"bench\": \"%s\", \"pattern\": \"%s\", \"size\": %d, "
+         "\"threads\": %d, \"ops\": %d, \"secs\": %.6f,\n"
+         "     \"opsPerSec\": %.1f, \"mbPerSec\": %.2f, "
+         "\"p50Us\": %.3f, \"p99Us\": %.3f, \"p999Us\": %.3f}",
+         g_first ? "" : ",", run->bench, run->pattern, run->size,
+         run->threads, run->num, secs, ops, mb,
+         benchQuantile(run->lat, run->num, 0.50),
+         benchQuantile(run->lat, run->num, 0.99),
+         benchQuantile(run->lat, run->num, 0.999));
+  fflush(stdout);
+  g_first = 0;
+}
+
+
+
+// ============================================================================
+// Start 'run' for 'num' calls of 'bench'
+// ============================================================================
+static void benchStart(BenchRun* run, str bench, str pattern, i32 size,
+                       i32 num) {
+  run->bench   = bench;
+  run->pattern = pattern;
+  run->size    = size;
+  run->threads = 1;
+  run->num     = num;
+  run->lat     = malloc((num > 0 ? num : 1) * sizeof(i64));
+  if (run->lat == NULL) FATAL(ENOMEM);
+  run->elapsed = benchNow();
+}
+
+
+
+// ============================================================================
+// End 'run': report it, and release its latencies
+// ============================================================================
+static void benchEnd(BenchRun* run) {
+  run->elapsed = benchNow() - run->elapsed;
+  benchReport(run);
+  free(run->lat);
+}
+
+
+
+// ============================================================================
+// Time bioRead and bioWrite of single blocks in the data area, which holds
+// no files yet.  'rand' picks the DBNs at random
+// ============================================================================
+static void benchBio(i32 rand) {
+  i32 first = g_geo.numMeta;
+  i32 span  = g_geo.numBlocks - first;
+  i32 num   = (g_maxOps < span) ? g_maxOps : span;
+  u64 seed  = g_seed;
+  str pat   = rand ? "rand" : "seq";
+
+  BenchRun run;
+  benchStart(&run, "bioWrite", pat, BLOCKSIZE, num);
+  for (i32 i = 0; i < num; ++i) {
+    i32 dbn = first + (rand ? (i32)(benchRand(&seed) % span) : i);
+    i64 t   = benchNow();
+    bioWrite(dbn, g_buf);
+    run.lat[i] = benchNow() - t;
+  }
+  benchEnd(&run);
+
+  seed = g_seed;
+  benchStart(&run, "bioRead", pat, BLOCKSIZE, num);
+  for (i32 i = 0; i < num; ++i) {
+    i32 dbn = first + (rand ? (i32)(benchRand(&seed) % span) : i);
+    i64 t   = benchNow();
+    bioRead(dbn, g_buf);
+    run.lat[i] = benchNow() - t;
+  }
+  benchEnd(&run);
+}
+
+
+
+// ============================================================================
+// Time fsWrite then fsRead of 'size' bytes at a time through the file open
+// on 'fd', of 'fileBytes' bytes.  Sequential runs walk the file from the
+// start; random ones take fsPWrite and fsPRead at 'size'-aligned offsets
+// ============================================================================
+static void benchFs(i32 fd, i32 fileBytes, i32 size, i32 rand) {
+  i32 slots = fileBytes / size;
+  i32 num   = (g_maxOps < slots) ? g_maxOps : slots;
+  u64 seed  = g_seed;
+  str pat   = rand ? "rand" : "seq";
+
+  BenchRun run;
+  fsSeek(fd, 0, SEEK_SET);
+  benchStart(&run, "fsWrite", pat, size, num);
+  for (i32 i = 0; i < num; ++i) {
+    i64 t = benchNow();
+    if (rand) {
+      fsPWrite(fd, (i32)(benchRand(&seed) % slots) * size, size, g_buf);
+    } else {
+      fsWrite(fd, size, g_buf);
+    }
+    run.lat[i] = benchNow() - t;
+  }
+  benchEnd(&run);
+
+  seed = g_seed;
+  fsSeek(fd, 0, SEEK_SET);
+  benchStart(&run, "fsRead", pat, size, num);
+  for (i32 i = 0; i < num; ++i) {
+    i64 t = benchNow();
+    if (rand) {
+      fsPRead(fd, (i32)(benchRand(&seed) % slots) * size, size, g_buf);
+    } else {
+      fsRead(fd, size, g_buf);
+    }
+    run.lat[i] = benchNow() - t;
+  }
+  benchEnd(&run);
+}
+
+
+
+// ============================================================================
+// Time bfsFbnToDbn on random FBNs of file 'inum', which holds 'numFbns'
+// ============================================================================
+static void benchFbnToDbn(i32 inum, i32 numFbns) {
+  u64 seed = g_seed;
+
+  BenchRun run;
+  benchStart(&run, "bfsFbnToDbn", "rand", 0, g_maxOps);
+  for (i32 i = 0; i < g_maxOps; ++i) {
+    i32 fbn = (i32)(benchRand(&seed) % numFbns);
+    i64 t   = benchNow();
+    bfsFbnToDbn(inum, fbn);
+    run.lat[i] = benchNow() - t;
+  }
+  benchEnd(&run);
+}
+
+
+
+// ============================================================================
+// Thread of a mixed run: 'bt->num' random BENCHMIXEDSIZE transfers on its
+// own descriptor for 'bt->fname', 70% fsPRead and 30% fsPWrite
+// ============================================================================
+static void* benchMixedThread(void* arg) {
+  BenchThread* bt    = (BenchThread*)arg;
+  i32          slots = bt->fileBytes / BENCHMIXEDSIZE;
+  i8*          buf   = malloc(BENCHMIXEDSIZE);
+  if (buf == NULL) FATAL(ENOMEM);
+  memcpy(buf, g_buf, BENCHMIXEDSIZE);
+
+  bt->fd = fsOpen(bt->fname);
+  for (i32 i = 0; i < bt->num; ++i) {
+    u64 r   = benchRand(&bt->seed);
+    i32 off = (i32)((r >> 8) % slots) * BENCHMIXEDSIZE;
+    i64 t   = benchNow();
+    if (r % 10 < 7) {
+      fsPRead (bt->fd, off, BENCHMIXEDSIZE, buf);
+    } else {
+      fsPWrite(bt->fd, off, BENCHMIXEDSIZE, buf);
+    }
+    bt->lat[i] = benchNow() - t;
+  }
+  fsClose(bt->fd);
+  free(buf);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Time a mixed run of g_threads threads.  With 'shared', all of them work
+// on file "data", 'sharedBytes' long; otherwise each on its own file
+// "mixed<i>", made here
+// ============================================================================
+static void benchMixed(i32 shared, i32 sharedBytes) {
+  BenchThread bt[BENCHMAXTHREADS];
+  pthread_t   tid[BENCHMAXTHREADS];
+  char        names[BENCHMAXTHREADS][FNAMESIZE];
+  i32         perFile = g_fileBytes / g_threads;
+
+  if (!shared) {
+    for (i32 i = 0; i < g_threads; ++i) {
+      sprintf(names[i], "mixed%d", i);
+      i32 fd = fsCreate(names[i]);
+      for (i32 off = 0; off < perFile; off += BENCHMIXEDSIZE) {
+        fsWrite(fd, BENCHMIXEDSIZE, g_buf);
+      }
+      fsClose(fd);
+    }
+  }
+
+  i32 each = g_maxOps / g_threads;
+  if (each < 1) each = 1;
+
+  BenchRun run;
+  benchStart(&run, "mixed", shared ? "shared" : "private", BENCHMIXEDSIZE,
+             each * g_threads);
+  run.threads = g_threads;
+  for (i32 i = 0; i < g_threads; ++i) {
+    bt[i].fname     = shared ? "data" : names[i];
+    bt[i].fileBytes = shared ? sharedBytes : perFile;
+    bt[i].num       = each;
+    bt[i].lat       = run.lat + i * each;
+    bt[i].seed      = g_seed + i + 1;
+    if (pthread_create(&tid[i], NULL, benchMixedThread, &bt[i]) != 0) {
+      FATAL(ENOMEM);
+    }
+  }
+  for (i32 i = 0; i < g_threads; ++i) pthread_join(tid[i], NULL);
+  benchEnd(&run);
+}
+
+
+
+// ============================================================================
+// Time bfsFindFreeBlock.  Takes up to half the blocks still free, which are
+// then lost: run last
+// ============================================================================
+static void benchAlloc(i32 usedBlocks) {
+  i32 spare = (g_geo.numBlocks - g_geo.numMeta - usedBlocks) / 2;
+  i32 num   = (g_maxOps < spare) ? g_maxOps : spare;
+  if (num <= 0) return;
+
+  BenchRun run;
+  benchStart(&run, "bfsFindFreeBlock", "seq", 0, num);
+  for (i32 i = 0; i < num; ++i) {
+    i64 t = benchNow();
+    bfsFindFreeBlock();
+    run.lat[i] = benchNow() - t;
+  }
+  benchEnd(&run);
+}
+
+
+
+// ============================================================================
+// Print how to run bfsbench, and exit
+// ============================================================================
+static void benchUsage() {
+  fprintf(stderr,
+    "usage: bfsbench [-C dir] [-F] [-b backend] [-B bytesPerBlock]\n"
+    "                [-N numBlocks] [-f fileMB] [-o maxOps] [-t threads]\n"
+    "                [-c cacheBlocks] [-j journalBlocks] [-s seed]\n"
+    "  -C dir   work in 'dir', which must not hold a BFSDISK, unless -F\n"
+    "  -b       0 default, 1 stdio, 2 pread, 3 io_uring, 4 mmap\n"
+    "  -j       0 default, -1 no journal\n");
+  exit(2);
+}
+
+
+
+int main(int argc, char* argv[]) {
+  FormatOpts fo = { 4096, 16384, 64, 0 };
+  MountOpts  mo;
+  memset(&mo, 0, sizeof(mo));
+  str dir   = ".";
+  i32 force = 0;
+
+  i32 opt;
+  while ((opt = getopt(argc, argv, "C:Fb:B:N:f:o:t:c:j:s:")) != -1) {
+    switch (opt) {
+      case 'C': dir              = optarg;                  break;
+      case 'F': force            = 1;                       break;
+      case 'b': mo.ioBackend     = atoi(optarg);            break;
+      case 'B': fo.bytesPerBlock = atoi(optarg);            break;
+      case 'N': fo.numBlocks     = atoi(optarg);            break;
+      case 'f': g_fileBytes      = atoi(optarg) << 20;      break;
+      case 'o': g_maxOps         = atoi(optarg);            break;
+      case 't': g_threads        = atoi(optarg);            break;
+      case 'c': mo.cacheBlocks   = atoi(optarg);            break;
+      case 'j': fo.journalBlocks = atoi(optarg);            break;
+      case 's': g_seed           = strtoull(optarg, NULL, 0); break;
+      default:  benchUsage();
+    }
+  }
+  if (g_maxOps < 1 || g_fileBytes < (1 << 20)) benchUsage();
+  if (g_threads < 1 || g_threads > BENCHMAXTHREADS) benchUsage();
+  if (g_seed == 0) g_seed = 1;                // xorshift needs a nonzero state
+
+  if (chdir(dir) != 0) {
+    fprintf(stderr, "bfsbench: cannot enter %s\n", dir);
+    return 1;
+  }
+  if (!force && access(BFSDISK, F_OK) == 0) {
+    fprintf(stderr, "bfsbench: %s/%s exists: -F to overwrite it\n", dir,
+            BFSDISK);
+    return 1;
+  }
+
+  g_buf = malloc(1 << 20);                    // largest transfer
+  if (g_buf == NULL) FATAL(ENOMEM);
+  for (i32 i = 0; i < (1 << 20); ++i) g_buf[i] = (i8)(i * 31 + i / 4093);
+
+  fsFormatOpts(&fo);
+  fsMountOpts(&mo);
+  bfsInitOFT();
+
+  // file "data", and the mixed run's files, each take g_fileBytes
+  i64 room = (i64)(g_geo.numBlocks - g_geo.numMeta) * BLOCKSIZE;
+  if (2 * (i64)g_fileBytes + (2 << 20) > room) {
+    fprintf(stderr, "bfsbench: disk too small for -f %d\n", g_fileBytes >> 20);
+    return 1;
+  }
+
+  printf("{\n  \"config\": {\"backend\": \"%s\", \"bytesPerBlock\": %d, "
+         "\"numBlocks\": %d, \"journalBlocks\": %d,\n             "
+         "\"fileBytes\": %d, \"maxOps\": %d, \"threads\": %d, "
+         "\"seed\": %llu},\n  \"results\": [",
+         bioBackendName(), BLOCKSIZE, g_geo.numBlocks,
+         g_geo.numJournalBlocks, g_fileBytes, g_maxOps, g_threads,
+         (unsigned long long)g_seed);
+
+  benchBio(0);
+  benchBio(1);
+
+  // file "data" is written first in 1 MB appends, so what the fsWrite runs
+  // time is overwrites, not allocation
+  i32 fd = fsCreate("data");
+  for (i32 off = 0; off < g_fileBytes; off += 1 << 20) {
+    fsWrite(fd, 1 << 20, g_buf);
+  }
+  fsClose(fd);
+  fd = fsOpen("data");
+
+  i32 sizes[] = { 512, 4096, 65536, 1 << 20 };
+  for (i32 i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    benchFs(fd, g_fileBytes, sizes[i], 0);
+    benchFs(fd, g_fileBytes, sizes[i], 1);
+  }
+  i32 numFbns = g_fileBytes / BLOCKSIZE;
+  benchFbnToDbn(bfsFdToInum(fd), numFbns);
+  fsClose(fd);
+
+  benchMixed(0, 0);
+  benchMixed(1, g_fileBytes);
+  benchAlloc(2 * numFbns);
+
+  printf("\n  ]\n}\n");
+  fsUnmount();
+  free(g_buf);
+  return 0;
+}
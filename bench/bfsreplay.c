@@ -0,0 +1,307 @@
+// ============================================================================
+// bfsreplay.c - re-run a trace recorded with MountOpts.tracePath
+//
+// Formats a scratch BFSDISK with the geometry the trace was recorded on,
+// then replays the trace on one thread, in the order it was recorded:
+//
+//   fs mode (default) : each fs* call again, through a freshly mounted disk,
+//                       so cache, readahead and backend variants can be
+//                       compared on the same workload.  Block IO records
+//                       are skipped: the calls make their own
+//   block mode (-k)   : each BioReq again, straight to the backend, with no
+//                       file system above it
+//
+// By default records run back to back; with -t, each waits until its
+// recorded time.  Data written is a fixed pattern: traces hold no data.
+// Files the trace opened were made before it started, so they are created
+// empty on replay.  Prints one JSON object of results on stdout.  Build
+// with `make bfsreplay`
+// ============================================================================
+
+#include <time.h>
+#include <unistd.h>
+
+#include "bfs.h"
+#include "fs.h"
+
+typedef struct {          // what a replay did
+  i64 records;            // records read
+  i64 replayed;           // calls made
+  i64 skipped;            // calls on an fd opened before the trace began
+  i64 lastNs;             // TrcRec.ns of the last record
+} Replay;
+
+static i8* g_buf    = NULL;     // data for every transfer
+static i32 g_bufLen = 0;
+static i32 g_fdMap[NUMOFTENTRIES];  // traced fd - FDBASE => replay fd
+
+
+
+// ============================================================================
+// Make g_buf at least 'numb' bytes long
+// ============================================================================
+static void replayGrow(i32 numb) {
+  if (numb <= g_bufLen) return;
+  i8* buf = realloc(g_buf, numb);
+  if (buf == NULL) FATAL(ENOMEM);
+  for (i32 i = g_bufLen; i < numb; ++i) buf[i] = (i8)(i * 31 + i / 4093);
+  g_buf    = buf;
+  g_bufLen = numb;
+}
+
+
+
+// ============================================================================
+// Wait until 'ns' after 'start', both from statsNow()
+// ============================================================================
+static void replayWait(i64 start, i64 ns) {
+  i64 left = start + ns - statsNow();
+  if (left <= 0) return;
+  struct timespec ts = { left / 1000000000, left % 1000000000 };
+  nanosleep(&ts, NULL);
+}
+
+
+
+// ============================================================================
+// Return the replay fd for traced fd 'fd', or -1 if there is none
+// ============================================================================
+static i32 replayFd(i32 fd) {
+  i32 i = fd - FDBASE;
+  return (i >= 0 && i < NUMOFTENTRIES) ? g_fdMap[i] : -1;
+}
+
+
+
+// ============================================================================
+// Replay fs* call 'rec', whose file name, if any, is 'fname'.  Return 1 if
+// it was made; 0 if it had to be skipped
+// ============================================================================
+static i32 replayFs(TrcRec* rec, str fname) {
+  i32 slot = rec->fd - FDBASE;
+  i32 fd   = replayFd(rec->fd);
+
+  switch (rec->op) {
+    case TRCOPEN:
+    case TRCCREATE:
+      fd = (rec->op == TRCOPEN) ? fsOpen(fname) : fsCreate(fname);
+      if (fd == EFNF && rec->fd >= 0) fd = fsCreate(fname);
+      if (slot >= 0 && slot < NUMOFTENTRIES) g_fdMap[slot] = fd;
+      return 1;
+    case TRCSYNC:
+      fsSync();
+      return 1;
+    case TRCDELETE:
+      fsDelete(fname);
+      return 1;
+    case TRCBIOREAD:
+    case TRCBIOWRITE:
+      return 0;
+  }
+
+  if (fd < 0) return 0;
+  switch (rec->op) {
+    case TRCCLOSE:
+      fsClose(fd);
+      g_fdMap[slot] = -1;
+      break;
+    case TRCREAD:
+      replayGrow(rec->a);
+      fsRead(fd, rec->a, g_buf);
+      break;
+    case TRCWRITE:
+      replayGrow(rec->a);
+      fsWrite(fd, rec->a, g_buf);
+      break;
+    case TRCPREAD:
+      replayGrow(rec->a);
+      fsPRead(fd, rec->b, rec->a, g_buf);
+      break;
+    case TRCPWRITE:
+      replayGrow(rec->a);
+      fsPWrite(fd, rec->b, rec->a, g_buf);
+      break;
+    case TRCSEEK:
+      fsSeek(fd, rec->a, rec->b);
+      break;
+    case TRCFSYNC:
+      fsFsync(fd);
+      break;
+    case TRCTRUNCATE:
+      fsTruncate(fd, rec->a);
+      break;
+    case TRCCLONE:
+      fsClone(fd, fname);
+      break;
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+
+
+// ============================================================================
+// Replay BioReq 'rec'.  Return 1 if it was made; 0 for any other record
+// ============================================================================
+static i32 replayBio(TrcRec* rec) {
+  if (rec->op != TRCBIOREAD && rec->op != TRCBIOWRITE) return 0;
+
+  replayGrow(rec->a * BLOCKSIZE);
+  BioVec* vec = malloc(rec->a * sizeof(BioVec));
+  if (vec == NULL) FATAL(ENOMEM);
+  for (i32 i = 0; i < rec->a; ++i) {
+    vec[i].dbn = rec->fd + i;
+    vec[i].buf = g_buf + (size_t)i * BLOCKSIZE;
+  }
+  if (rec->op == TRCBIOREAD) bioReadv(vec, rec->a); else bioWritev(vec, rec->a);
+  free(vec);
+  return 1;
+}
+
+
+
+// ============================================================================
+// Replay every record in 'fp', which is positioned just past the header,
+// into 'rep'.  'block' picks block mode, 'timed' the recorded timing
+// ============================================================================
+static void replayAll(FILE* fp, i32 block, i32 timed, Replay* rep) {
+  i64    start = statsNow();
+  TrcRec rec;
+  char   fname[FNAMESIZE + 1];
+
+  while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+    if (rec.nameLen < 0 || rec.nameLen > FNAMESIZE) break;   // corrupt
+    if (fread(fname, 1, rec.nameLen, fp) != (size_t)rec.nameLen) break;
+    fname[rec.nameLen] = 0;
+
+    ++rep->records;
+    rep->lastNs = rec.ns;
+    if (timed) replayWait(start, rec.ns);
+
+    i32 made = block ? replayBio(&rec) : replayFs(&rec, fname);
+    if (made) {
+      ++rep->replayed;
+    } else if (!block && rec.op != TRCBIOREAD && rec.op != TRCBIOWRITE) {
+      ++rep->skipped;
+    }
+  }
+}
+
+
+
+// ============================================================================
+// Print how to run bfsreplay, and exit
+// ============================================================================
+static void replayUsage() {
+  fprintf(stderr,
+    "usage: bfsreplay [-C dir] [-F] [-k] [-t] [-b backend] [-c cacheBlocks]\n"
+    "                 [-r readAheadBlocks] [-a] trace\n"
+    "  -C dir  work in 'dir', which must not hold a BFSDISK, unless -F\n"
+    "  -k      replay the block IO, not the fs* calls\n"
+    "  -t      keep the recorded timing\n"
+    "  -b      0 default, 1 stdio, 2 pread, 3 io_uring, 4 mmap\n"
+    "  -a      read ahead on a background thread\n");
+  exit(2);
+}
+
+
+
+int main(int argc, char* argv[]) {
+  MountOpts mo;
+  memset(&mo, 0, sizeof(mo));
+  str dir   = ".";
+  i32 force = 0;
+  i32 block = 0;
+  i32 timed = 0;
+
+  i32 opt;
+  while ((opt = getopt(argc, argv, "C:Fktb:c:r:a")) != -1) {
+    switch (opt) {
+      case 'C': dir                = optarg;           break;
+      case 'F': force              = 1;                break;
+      case 'k': block              = 1;                break;
+      case 't': timed              = 1;                break;
+      case 'b': mo.ioBackend       = atoi(optarg);     break;
+      case 'c': mo.cacheBlocks     = atoi(optarg);     break;
+      case 'r': mo.readAheadBlocks = atoi(optarg);     break;
+      case 'a': mo.asyncReadAhead  = 1;                break;
+      default:  replayUsage();
+    }
+  }
+  if (optind != argc - 1) replayUsage();
+  str path = argv[optind];
+
+  FILE* fp = fopen(path, "rb");
+  TrcHeader hdr;
+  if (fp == NULL || fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      hdr.magic != TRCMAGIC || hdr.version != TRCVERSION) {
+    fprintf(stderr, "bfsreplay: %s is not a BFS trace\n", path);
+    return 1;
+  }
+
+  if (chdir(dir) != 0) {
+    fprintf(stderr, "bfsreplay: cannot enter %s\n", dir);
+    return 1;
+  }
+  if (!force && access(BFSDISK, F_OK) == 0) {
+    fprintf(stderr, "bfsreplay: %s/%s exists: -F to overwrite it\n", dir,
+            BFSDISK);
+    return 1;
+  }
+
+  FormatOpts fo = { hdr.bytesPerBlock, hdr.numBlocks, hdr.numInodes,
+                    (hdr.journalBlocks > 0) ? hdr.journalBlocks : -1 };
+  fsFormatOpts(&fo);
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i) g_fdMap[i] = -1;
+
+  if (block) {
+    bioOpen(BFSDISK, mo.ioBackend);
+    bfsLoadGeometry();                  // for BLOCKSIZE, and statsIo
+  } else {
+    fsMountOpts(&mo);
+    bfsInitOFT();
+  }
+  statsReset();
+
+  Replay rep;
+  memset(&rep, 0, sizeof(rep));
+  i64 start = statsNow();
+  replayAll(fp, block, timed, &rep);
+  if (!block) fsSync();                 // as fsUnmount would, but timed
+  i64 elapsed = statsNow() - start;
+  fclose(fp);
+
+  IoStats io;
+  statsGet(&io);
+  str backend = bioBackendName();
+  if (block) bioClose(); else fsUnmount();
+
+  double secs = elapsed / 1e9;
+  printf("{\n  \"trace\": \"%s\", \"mode\": \"%s\", \"timing\": \"%s\", "
+         "\"backend\": \"%s\",\n", path, block ? "block" : "fs",
+         timed ? "recorded" : "full", backend);
+  printf("  \"records\": %lld, \"replayed\": %lld, \"skipped\": %lld,\n",
+         (long long)rep.records, (long long)rep.replayed,
+         (long long)rep.skipped);
+  printf("  \"recordedSecs\": %.6f, \"secs\": %.6f, \"opsPerSec\": %.1f,\n",
+         rep.lastNs / 1e9, secs, (secs > 0) ? rep.replayed / secs : 0);
+  printf("  \"io\": {\"metaReads\": %lld, \"metaWrites\": %lld, "
+         "\"dataReads\": %lld, \"dataWrites\": %lld,\n"
+         "         \"requests\": %lld, \"cacheHits\": %lld, "
+         "\"cacheMisses\": %lld, \"allocs\": %lld},\n",
+         (long long)io.metaReads, (long long)io.metaWrites,
+         (long long)io.dataReads, (long long)io.dataWrites,
+         (long long)io.requests, (long long)io.cacheHits,
+         (long long)io.cacheMisses, (long long)io.allocs);
+  printf("  \"fs\": {");
+  for (i32 op = 0; op < NUMFSOPS; ++op) {
+    printf("%s\n    \"%s\": {\"calls\": %lld, \"ns\": %lld}",
+           (op == 0) ? "" : ",", statsFsOpName(op),
+           (long long)io.fsCalls[op], (long long)io.fsNs[op]);
+  }
+  printf("\n  }\n}\n");
+
+  free(g_buf);
+  return 0;
+}
@@ -4,439 +4,3099 @@
 
 #include "bfs.h"
 
+// Locking.  Each shared table has its own lock, held only for the table
+// update itself.  A lock may be taken while holding one higher in this list,
+// never the other way round:
+//
+//   g_inodeLocks[inum]  one file's size and block map, across fsRead/fsWrite.
+//                       fsClone holds two, taken in inum order
+//   g_dirLock           the Directory and its hash index
+//   OFTE.lock           one OFTE's cursor and translation window
+//   g_oftLock           the stack of free OFT slots
+//   g_allocLock         the bitmap and reference counts, or the Freelist
+//   g_inodesLock        the in-memory Inode table
+//   g_raLock            the readahead queue
+//   g_freeLock          the background free queue
+//   cache lock          the buffer cache.  See cache.c
+//   g_jnlLock           the journal.  See journal.c
+//
+// Mount, unmount and format must not run alongside other calls
+
+typedef struct {          // readahead request
+  i32 inum;
+  i32 fbn;                // first FBN to fetch
+  i32 num;                // # of FBNs to fetch
+} RaReq;
+
+typedef struct {          // blocks held back for one file
+  i32 fbn;                // FBN of the first.  From here on, none has a DBN
+  i32 num;                // # held.  0 => none: every FBN in the file is mapped
+  i32 cap;                // room for this many
+  i8* data;               // 'cap' blocks
+} Delay;
+
+struct BfsState {         // one volume's tables.  See bfsNewState
+
+  // In-memory copy of the Inode table, loaded by bfsLoadInodes at mount.
+  // bfsReadInode and bfsWriteInode work on this table; changed Inode blocks
+  // are written on each bfsWriteInode (write-through) or on bfsSyncInodes
+  // (write-back)
+
+  Inode* inodes;
+  u8*    inodesDirty;             // per Inode-table block: 1 => newer
+  i32    inodesWriteThrough;      // 1 => no batching
+
+  pthread_mutex_t   inodesLock;
+  pthread_rwlock_t* inodeLocks;   // one per Inode
+  i32               numInodeLocks;
+
+  // In-memory copy of the free-space bitmap, loaded by bfsLoadBitmap at
+  // mount.  A 1 bit marks a DBN in use.  Disks formatted before FSVERSION 1
+  // have no bitmap, and keep using the Freelist.  With a journal, a freed
+  // data block stays in use until the transaction that frees it commits; it
+  // is marked in 'bitmapHeld' meanwhile, and written to disk as free.  See
+  // jnlDefer
+
+  u64*  bitmap;
+  u64*  bitmapHeld;               // 1 => freed, not yet reusable
+  i32   bitmapWords;              // # of u64s in 'bitmap'
+  i32   bitmapDirty;              // 1 => newer than the disk
+  i32   bitmapNext;               // word to start the next search
+
+  // Reference counts, from FSVERSION 7: for each DBN, the # of files beyond
+  // the first that share it - 0 for all but the blocks of clones.  Loaded
+  // and written back along with the bitmap, and guarded by the same lock.
+  // fsClone shares the data blocks of a file, never its indirect blocks;
+  // freeing a shared block just drops one from its count.  See bfsRelocate
+
+  u16*  refs;                     // one per DBN.  NULL => none
+  u8*   refsDirty;                // per table block: 1 => newer
+  i32   refsShared;               // # of DBNs with a nonzero count
+
+  pthread_mutex_t allocLock;
+
+  // In-memory copy of the Directory, loaded by bfsLoadDir at mount, with a
+  // hash index from fname to inum.  bfsLookupFile and bfsCreateFile use
+  // these, and never read the Directory blocks.  Slot 'inum' is the
+  // FNAMESIZE bytes at dir + inum * FNAMESIZE, in whichever Directory block
+  // holds it.  A deleted file leaves a tombstone in the hash index, so that
+  // lookups probe on past it; once they mount up, the index is rebuilt
+
+  i8*   dir;                      // numDirBlocks blocks
+  i32*  dirHash;                  // inum + 1 per hash slot.  0 => empty,
+                                  //   -1 => tombstone
+  i32   dirHashMask;              // # of hash slots - 1 (power of 2)
+  i32   dirTombs;                 // # of tombstones in 'dirHash'
+  i32   dirFree;                  // no free slot below this inum
+
+  pthread_rwlock_t dirLock;
+
+  // OFT slots not in use, as a stack: each open pops one, each close pushes
+  // it back.  File descriptor 'fd' is OFT slot fd - FDBASE
+
+  i32              oftFree[NUMOFTENTRIES];
+  i32              oftNumFree;
+  pthread_mutex_t  oftLock;
+
+  // Readahead.  bfsReadAhead spots an open file being read front to back,
+  // and keeps the blocks just past the last read in the cache.  With
+  // 'async' set, they are fetched by raThread from a queue of requests, so
+  // the reader does not wait for them
+
+  i32             raMax;          // largest window.  0 => off
+  i32             raAsync;        // 1 => raThread is running
+  i32             raStop;         // 1 => raThread should exit
+  pthread_t       raThread;
+  RaReq           raQueue[RAQUEUESIZE];
+  i32             raHead;         // next request to take
+  i32             raCount;        // # of requests queued
+  pthread_mutex_t raLock;
+  pthread_cond_t  raCond;
+
+  // Delayed allocation.  Blocks appended to a file are held back in its
+  // Delay, with no DBNs, and are allocated in one batch - so contiguous,
+  // and with one Inode update - by bfsDelayFlush: at each commit, or once
+  // the file holds delayMax blocks.  The held blocks always run to the end
+  // of the file.  A Delay is guarded by its file's Inode lock; 'num' is also
+  // read, unlocked, by bfsDelayFlushAll
+
+  Delay* delay;                   // one per Inode
+  i32    delayNum;                // # of entries in 'delay'
+  i32    delayMax;                // most blocks held per file.  0 => off
+
+  // Background freeing.  A file cut to nothing - deleted, or truncated to
+  // 0 - drops its indirect tree from the Inode at once, and queues just the
+  // tree's root for freeThread, which reads the tree and frees every block
+  // in it.  So the caller never waits on a large tree.  With no thread
+  // running, the tree is freed at once.  Each time the queue runs dry,
+  // freeThread commits, so the blocks it freed can be reused.  With a
+  // journal, the queue is also kept in DBNSUPER, by bfsSyncOrphans, and
+  // holds at most MAXORPHANS roots: see bfs.h
+
+  i32*            freeQueue;      // roots of trees to free
+  i32             freeCount;      // # of roots queued
+  i32             freeCap;        // room in 'freeQueue'
+  i32             freeBusy;       // 1 => freeThread is freeing a tree
+  i32             freeDirty;      // 1 => queue newer than DBNSUPER
+  i32             freeAsync;      // 1 => freeThread is running
+  i32             freeStop;       // 1 => drain the queue, and exit
+  pthread_t       freeThread;
+  pthread_mutex_t freeLock;
+  pthread_cond_t  freeCond;
+};
+
+#define g_inodes             (t_vol->bfs->inodes)
+#define g_inodesDirty        (t_vol->bfs->inodesDirty)
+#define g_inodesWriteThrough (t_vol->bfs->inodesWriteThrough)
+#define g_inodesLock         (t_vol->bfs->inodesLock)
+#define g_inodeLocks         (t_vol->bfs->inodeLocks)
+#define g_numInodeLocks      (t_vol->bfs->numInodeLocks)
+#define g_bitmap             (t_vol->bfs->bitmap)
+#define g_bitmapHeld         (t_vol->bfs->bitmapHeld)
+#define g_bitmapWords        (t_vol->bfs->bitmapWords)
+#define g_bitmapDirty        (t_vol->bfs->bitmapDirty)
+#define g_bitmapNext         (t_vol->bfs->bitmapNext)
+#define g_refs               (t_vol->bfs->refs)
+#define g_refsDirty          (t_vol->bfs->refsDirty)
+#define g_refsShared         (t_vol->bfs->refsShared)
+#define g_allocLock          (t_vol->bfs->allocLock)
+#define g_dir                (t_vol->bfs->dir)
+#define g_dirHash            (t_vol->bfs->dirHash)
+#define g_dirHashMask        (t_vol->bfs->dirHashMask)
+#define g_dirTombs           (t_vol->bfs->dirTombs)
+#define g_dirFree            (t_vol->bfs->dirFree)
+#define g_dirLock            (t_vol->bfs->dirLock)
+#define g_oftFree            (t_vol->bfs->oftFree)
+#define g_oftNumFree         (t_vol->bfs->oftNumFree)
+#define g_oftLock            (t_vol->bfs->oftLock)
+#define g_raMax              (t_vol->bfs->raMax)
+#define g_raAsync            (t_vol->bfs->raAsync)
+#define g_raStop             (t_vol->bfs->raStop)
+#define g_raThread           (t_vol->bfs->raThread)
+#define g_raQueue            (t_vol->bfs->raQueue)
+#define g_raHead             (t_vol->bfs->raHead)
+#define g_raCount            (t_vol->bfs->raCount)
+#define g_raLock             (t_vol->bfs->raLock)
+#define g_raCond             (t_vol->bfs->raCond)
+#define g_delay              (t_vol->bfs->delay)
+#define g_delayNum           (t_vol->bfs->delayNum)
+#define g_delayMax           (t_vol->bfs->delayMax)
+#define g_freeQueue          (t_vol->bfs->freeQueue)
+#define g_freeCount          (t_vol->bfs->freeCount)
+#define g_freeCap            (t_vol->bfs->freeCap)
+#define g_freeBusy           (t_vol->bfs->freeBusy)
+#define g_freeDirty          (t_vol->bfs->freeDirty)
+#define g_freeAsync          (t_vol->bfs->freeAsync)
+#define g_freeStop           (t_vol->bfs->freeStop)
+#define g_freeThread         (t_vol->bfs->freeThread)
+#define g_freeLock           (t_vol->bfs->freeLock)
+#define g_freeCond           (t_vol->bfs->freeCond)
+
+// Compressed files.  A cluster that compresses is stored as a ClusterHeader
+// then the compEncode output, padded with zeroes to whole blocks.  Bytes of
+// the last cluster past the end of the file are always zero
+
+#define CLUSTERMAGIC  0x5a534642          // "BFSZ"
+
+typedef struct {          // start of a compressed cluster's first block
+  u32 magic;              // CLUSTERMAGIC
+  i32 numb;               // # of bytes of compEncode output that follow
+} ClusterHeader;
+
+// The indirect blocks met while walking one Inode's tree, so that a run of
+// FBNs costs one read, and at most one write, of each.  For version 3,
+// 'outer' is the double-indirect table and 'inner' the indirect block it
+// points to.  For versions 0 .. 2, only 'inner' is used
+
+typedef struct {
+  i32 dbn;                // DBN held.  0 => nothing held yet
+  i32 dirty;              // 1 => must be written back
+  i8* buf;                // one block
+} WalkBlock;
+
+typedef struct {
+  WalkBlock outer;
+  WalkBlock inner;
+} Walk;
+
+
+
+// ============================================================================
+// Hash slot at which to start looking for 'fname'.  FNV-1a
+// ============================================================================
+static i32 bfsDirHash(str fname) {
+  u32 h = 2166136261u;
+  for (i32 i = 0; i < FNAMESIZE && fname[i] != 0; ++i) {
+    h = (h ^ (u8)fname[i]) * 16777619u;
+  }
+  return h & g_dirHashMask;
+}
+
+
+
+// ============================================================================
+// Add Directory slot 'inum' to the hash index, in the first empty slot or
+// tombstone on its probe path
+// ============================================================================
+static void bfsDirIndex(i32 inum) {
+  i32 h = bfsDirHash((str)g_dir + inum * FNAMESIZE);
+  while (g_dirHash[h] > 0) h = (h + 1) & g_dirHashMask;
+  if (g_dirHash[h] < 0) --g_dirTombs;
+  g_dirHash[h] = inum + 1;
+}
+
+
+
+// ============================================================================
+// Return the hash slot that indexes file 'fname', or -1 if there is none.
+// Called with g_dirLock held
+// ============================================================================
+static i32 bfsDirFind(str fname) {
+  for (i32 h = bfsDirHash(fname); g_dirHash[h] != 0;
+       h = (h + 1) & g_dirHashMask) {
+    i32 inum = g_dirHash[h] - 1;
+    if (inum < 0) continue;                           // tombstone
+    if (strncmp(fname, (char*)g_dir + inum * FNAMESIZE, FNAMESIZE) == 0) {
+      return h;
+    }
+  }
+  return -1;
+}
+
+
+
+// ============================================================================
+// Take hash slot 'h' out of the Directory hash index, leaving a tombstone.
+// Once tombstones fill a quarter of the index, rebuild it from the
+// Directory slots still in use, other than the one just dropped.  Called
+// with g_dirLock held for writing
+// ============================================================================
+static void bfsDirUnindex(i32 h) {
+  i32 inum = g_dirHash[h] - 1;
+  g_dirHash[h] = -1;
+  if (++g_dirTombs <= (g_dirHashMask + 1) / 4) return;
+
+  memset(g_dirHash, 0, (g_dirHashMask + 1) * sizeof(i32));
+  g_dirTombs = 0;
+  for (i32 i = 0; i <= MAXINUM; ++i) {
+    if (i != inum && g_dir[i * FNAMESIZE] != 0) bfsDirIndex(i);
+  }
+}
+
+
+
+// ============================================================================
+// Allocate the next free block, with g_allocLock held.  See bfsFindFreeBlock
+// ============================================================================
+static i32 bfsTakeFreeBlock() {
+  if (g_geo.dbnBitmap == 0) return bfsFindFreeListBlock();
+
+  // Find the first word, from where the last search stopped, with a zero
+  // bit.  Wrap round once, to pick up blocks freed below that point
+
+  for (i32 n = 0; n < g_bitmapWords; ++n) {
+    i32 w = (g_bitmapNext + n) % g_bitmapWords;
+    if (g_bitmap[w] == ~(u64)0) continue;
+
+    i32 bit = __builtin_ctzll(~g_bitmap[w]);
+    g_bitmap[w] |= (u64)1 << bit;
+    g_bitmapDirty = 1;
+    g_bitmapNext  = w;
+    return w * 64 + bit;
+  }
+
+  FATAL(EDISKFULL);
+  return 0;                           // pacify compiler
+}
+
+
+
+// ============================================================================
+// Push block 'dbn' onto the head of the Freelist, on disks formatted before
+// FSVERSION 1.  Called with g_allocLock held.  See bfsFindFreeListBlock
+// ============================================================================
+static void bfsPushFreeListBlock(i32 dbn) {
+  i8 buf8[BLOCKSIZE];
+  cacheRead(DBNSUPER, buf8);
+  Super* super = (Super*)buf8;
+
+  i8 next[BLOCKSIZE];                 // links to the old head
+  memset(next, 0, BLOCKSIZE);
+  bfsSetPtr(next, 0, super->firstFree);
+  cacheWrite(dbn, next);
+
+  super->firstFree = dbn;
+  cacheWrite(DBNSUPER, buf8);
+}
+
+
+
+// ============================================================================
+// Clear the bitmap bits of the 'num' blocks from DBN 'dbn' on, a word at a
+// time.  FATAL if any is free already.  Called with g_allocLock held
+// ============================================================================
+static void bfsClearRun(i32 dbn, i32 num) {
+  for (i32 d = dbn; d < dbn + num; ) {
+    i32 bit = d % 64;
+    i32 n   = (dbn + num - d < 64 - bit) ? dbn + num - d : 64 - bit;
+    u64 mask = (n == 64) ? ~(u64)0 : (((u64)1 << n) - 1) << bit;
+    if ((g_bitmap[d / 64] & mask) != mask) FATAL(EBADDBN);  // free already
+    g_bitmap[d / 64] &= ~mask;
+    d += n;
+  }
+  g_bitmapDirty = 1;
+}
+
+
+
+// ============================================================================
+// Mark the 'num' blocks from DBN 'dbn' on as freed, but not yet reusable:
+// their bitmap bits stay set.  FATAL if any is free already.  Called with
+// g_allocLock held.  See bfsReleaseRun
+// ============================================================================
+static void bfsHoldRun(i32 dbn, i32 num) {
+  for (i32 d = dbn; d < dbn + num; ++d) {
+    u64 bit = (u64)1 << (d % 64);
+    if (!(g_bitmap[d / 64] & bit))   FATAL(EBADDBN);    // free already
+    if (g_bitmapHeld[d / 64] & bit)  FATAL(EBADDBN);
+    g_bitmapHeld[d / 64] |= bit;
+  }
+  g_bitmapDirty = 1;                  // the disk copy shows them free
+}
+
+
+
+// ============================================================================
+// Return the # of files beyond the first that share block 'dbn'.  0 on a
+// disk with no reference counts
+// ============================================================================
+static i32 bfsGetRef(i32 dbn) {
+  if (g_refs == NULL) return 0;
+  pthread_mutex_lock(&g_allocLock);
+  i32 n = g_refs[dbn];
+  pthread_mutex_unlock(&g_allocLock);
+  return n;
+}
+
+
+
+// ============================================================================
+// Set the reference count of block 'dbn' to 'n'.  Called with g_allocLock
+// held
+// ============================================================================
+static void bfsSetRef(i32 dbn, i32 n) {
+  if ((g_refs[dbn] == 0) != (n == 0)) {
+    __atomic_add_fetch(&g_refsShared, (n == 0) ? -1 : 1, __ATOMIC_RELAXED);
+  }
+  g_refs[dbn] = n;
+  g_refsDirty[(i64)dbn * sizeof(u16) / BLOCKSIZE] = 1;
+}
+
+
+
+// ============================================================================
+// Add one more file to each of the 'num' blocks from DBN 'dbn' on, which
+// are in use.  FATAL if one is free, or would be shared by more than
+// MAXSHARE files beyond its first
+// ============================================================================
+static void bfsShareRun(i32 dbn, i32 num) {
+  if (dbn < g_geo.numMeta || dbn > g_geo.numBlocks - num) FATAL(EBADDBN);
+
+  pthread_mutex_lock(&g_allocLock);
+  for (i32 d = dbn; d < dbn + num; ++d) {
+    if (!(g_bitmap[d / 64] & ((u64)1 << (d % 64)))) FATAL(EBADDBN);
+    if (g_refs[d] == MAXSHARE) FATAL(EBIGSHARE);
+    bfsSetRef(d, g_refs[d] + 1);
+  }
+  pthread_mutex_unlock(&g_allocLock);
+}
+
+
+
+// ============================================================================
+// Return the index of the last extent in 'inode' that starts at or before
+// FBN 'fbn', by binary search.  Return -1 if there is none
+// ============================================================================
+static i32 bfsFindExtent(Inode* inode, i32 fbn) {
+  i32 lo = 0;
+  i32 hi = inode->numExtents;
+  while (lo < hi) {
+    i32 mid = (lo + hi) / 2;
+    if (inode->extent[mid].fbn <= fbn) lo = mid + 1;
+    else                               hi = mid;
+  }
+  return lo - 1;
+}
+
+
+
+// ============================================================================
+// Return the DBN of FBN 'fbn' if one of the extents of 'inode' holds it.
+// Otherwise, return 0
+// ============================================================================
+static i32 bfsExtentDbn(Inode* inode, i32 fbn) {
+  i32 i = bfsFindExtent(inode, fbn);
+  if (i < 0) return 0;
+  Extent* e = &inode->extent[i];
+  return (fbn < e->fbn + e->len) ? e->dbn + fbn - e->fbn : 0;
+}
+
+
+
+// ============================================================================
+// Fill 'inode' from the fields of a version 0 .. 2 Inode.  See bfs.h
+// ============================================================================
+static void bfsFromDirect(Inode* inode, i32 size, i32* direct, i32 indirect) {
+  memset(inode, 0, sizeof(Inode));
+  inode->size       = size;
+  inode->numExtents = NUMDIRECT;
+  for (i32 d = 0; d < NUMDIRECT; ++d) {
+    inode->extent[d].fbn = d;
+    inode->extent[d].dbn = direct[d];
+    inode->extent[d].len = (direct[d] == 0) ? 0 : 1;
+  }
+  inode->indirect = indirect;
+}
+
+
+
+// ============================================================================
+// Write back the block held in 'wb', if it has changed
+// ============================================================================
+static void bfsWalkClean(WalkBlock* wb) {
+  if (wb->dirty) cacheWrite(wb->dbn, wb->buf);
+  wb->dirty = 0;
+}
+
+
+
+// ============================================================================
+// Give 'wb' room for one block, on the heap, if it has none yet.  Blocks can
+// be MAXBLOCKSIZE, too big for the stacks of the worker threads
+// ============================================================================
+static void bfsWalkAlloc(WalkBlock* wb) {
+  if (wb->buf != NULL) return;
+  wb->buf = malloc(BLOCKSIZE);
+  if (wb->buf == NULL) FATAL(ENOMEM);
+}
+
+
+
+// ============================================================================
+// Write back both blocks held in 'w', and free their room.  'w' is left
+// empty, as it started
+// ============================================================================
+static void bfsWalkDone(Walk* w) {
+  bfsWalkClean(&w->outer);
+  bfsWalkClean(&w->inner);
+  free(w->outer.buf);
+  free(w->inner.buf);
+  memset(w, 0, sizeof(Walk));
+}
+
+
+
+// ============================================================================
+// Make 'wb' hold block 'dbn'
+// ============================================================================
+static void bfsWalkLoad(WalkBlock* wb, i32 dbn) {
+  if (wb->dbn == dbn) return;
+  bfsWalkClean(wb);
+  bfsWalkAlloc(wb);
+  cacheRead(dbn, wb->buf);
+  wb->dbn = dbn;
+}
+
+
+
+// ============================================================================
+// Allocate a new, all-zero, indirect block into 'wb'.  Return its DBN
+// ============================================================================
+static i32 bfsWalkNew(WalkBlock* wb) {
+  bfsWalkClean(wb);
+  bfsWalkAlloc(wb);
+  wb->dbn   = bfsFindFreeBlock();
+  wb->dirty = 1;
+  memset(wb->buf, 0, BLOCKSIZE);
+  return wb->dbn;
+}
+
+
+
+// ============================================================================
+// Return the DBN that the indirect tree of 'inode' holds for FBN 'fbn', or
+// 0 if none.  Blocks are read through 'w'
+// ============================================================================
+static i32 bfsWalkGet(Inode* inode, Walk* w, i32 fbn) {
+  if (inode->indirect == 0) return 0;
+
+  if (g_geo.version < 3) {
+    if (fbn < NUMDIRECT) return 0;
+    bfsWalkLoad(&w->inner, inode->indirect);
+    return bfsGetPtr(w->inner.buf, fbn - NUMDIRECT);
+  }
+
+  bfsWalkLoad(&w->outer, inode->indirect);
+  i32 dbnInner = bfsGetPtr(w->outer.buf, fbn / NUMINDIRECT);
+  if (dbnInner == 0) return 0;
+  bfsWalkLoad(&w->inner, dbnInner);
+  return bfsGetPtr(w->inner.buf, fbn % NUMINDIRECT);
+}
+
+
+
+// ============================================================================
+// Record, in the indirect tree of 'inode', that FBN 'fbn' lives in DBN
+// 'dbn'.  Any indirect blocks missing on the way are allocated.  Changed
+// blocks stay in 'w' until bfsWalkClean
+// ============================================================================
+static void bfsWalkSet(Inode* inode, Walk* w, i32 fbn, i32 dbn) {
+  i32 slot;
+
+  if (g_geo.version < 3) {
+    if (inode->indirect == 0) inode->indirect = bfsWalkNew(&w->inner);
+    else                      bfsWalkLoad(&w->inner, inode->indirect);
+    slot = fbn - NUMDIRECT;
+  } else {
+    if (inode->indirect == 0) inode->indirect = bfsWalkNew(&w->outer);
+    else                      bfsWalkLoad(&w->outer, inode->indirect);
+
+    i32 dbnInner = bfsGetPtr(w->outer.buf, fbn / NUMINDIRECT);
+    if (dbnInner == 0) {
+      dbnInner = bfsWalkNew(&w->inner);
+      bfsSetPtr(w->outer.buf, fbn / NUMINDIRECT, dbnInner);
+      w->outer.dirty = 1;
+    } else {
+      bfsWalkLoad(&w->inner, dbnInner);
+    }
+    slot = fbn % NUMINDIRECT;
+  }
+
+  bfsSetPtr(w->inner.buf, slot, dbn);
+  w->inner.dirty = 1;
+}
+
+
+
+// ============================================================================
+// Bring the 'num' FBNs from 'fbn' on, of file 'inum', into the cache.  FBNs
+// not mapped are skipped.  The caller holds the file's Inode lock
+// ============================================================================
+static void bfsPrefetch(i32 inum, i32 fbn, i32 num) {
+  Inode inode;
+  bfsReadInode(inum, &inode);
+
+  Walk walk = { { 0, 0, NULL }, { 0, 0, NULL } };
+
+  i32* dbns = malloc(num * sizeof(i32));
+  if (dbns == NULL) FATAL(ENOMEM);
+  i32 n = 0;
+  for (i32 f = fbn; f < fbn + num && f <= MAXFBN; ++f) {
+    i32 dbn = bfsExtentDbn(&inode, f);
+    if (dbn == 0) dbn = bfsWalkGet(&inode, &walk, f);
+    if (dbn != 0) dbns[n++] = dbn;
+  }
+  bfsWalkDone(&walk);
+
+  cachePrefetch(dbns, n);
+  free(dbns);
+}
+
+
+
+// ============================================================================
+// Body of the readahead thread: take each request off the queue, and fetch
+// its blocks with the file locked for reading.  Requests still queued when
+// bfsStopReadAhead is called are dropped
+// ============================================================================
+static void* bfsReadAheadThread(void* arg) {
+  pthread_mutex_lock(&g_raLock);
+  for (;;) {
+    while (g_raCount == 0 && !g_raStop) {
+      pthread_cond_wait(&g_raCond, &g_raLock);
+    }
+    if (g_raStop) break;
+
+    RaReq req = g_raQueue[g_raHead];
+    g_raHead = (g_raHead + 1) % RAQUEUESIZE;
+    --g_raCount;
+    pthread_mutex_unlock(&g_raLock);
+
+    bfsLockInode(req.inum, 0);
+    bfsPrefetch(req.inum, req.fbn, req.num);
+    bfsUnlockInode(req.inum);
+
+    pthread_mutex_lock(&g_raLock);
+  }
+  pthread_mutex_unlock(&g_raLock);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Map the 'len' unmapped FBNs from 'fbn' on, of 'inode', onto the DBNs from
+// 'dbn' on.  From version 3, the run grows a neighbouring extent if it
+// continues it on disk, or else takes a free extent slot.  When the slots
+// are all used, or for older versions past the direct blocks, the FBNs go
+// into the indirect tree - as do all those of a compressed file
+// ============================================================================
+static void bfsMapRun(Inode* inode, Walk* w, i32 fbn, i32 dbn, i32 len) {
+
+  if (g_geo.version < 3) {
+    for (i32 i = 0; i < len; ++i) {
+      i32 f = fbn + i;
+      if (f < NUMDIRECT) {
+        inode->extent[f].dbn = dbn + i;
+        inode->extent[f].len = 1;
+      } else {
+        bfsWalkSet(inode, w, f, dbn + i);
+      }
+    }
+    return;
+  }
+
+  if (inode->flags & INODECOMPRESS) {      // tree only: see bfsWriteCluster
+    for (i32 k = 0; k < len; ++k) bfsWalkSet(inode, w, fbn + k, dbn + k);
+    return;
+  }
+
+  i32     i    = bfsFindExtent(inode, fbn);
+  Extent* prev = (i >= 0) ? &inode->extent[i] : NULL;
+  Extent* next = (i + 1 < inode->numExtents) ? &inode->extent[i + 1] : NULL;
+
+  if (prev && prev->fbn + prev->len == fbn && prev->dbn + prev->len == dbn) {
+    prev->len += len;
+    return;
+  }
+
+  if (next && fbn + len == next->fbn && dbn + len == next->dbn) {
+    next->fbn  = fbn;
+    next->dbn  = dbn;
+    next->len += len;
+    return;
+  }
+
+  if (inode->numExtents < NUMEXTENTS) {
+    memmove(&inode->extent[i + 2], &inode->extent[i + 1],
+            (inode->numExtents - i - 1) * sizeof(Extent));
+    inode->extent[i + 1] = (Extent){ fbn, dbn, len };
+    ++inode->numExtents;
+    return;
+  }
+
+  for (i32 k = 0; k < len; ++k) bfsWalkSet(inode, w, fbn + k, dbn + k);
+}
+
+
+
+// ============================================================================
+// Move FBN 'fbn' of 'inode', which is mapped, to DBN 'dbn'.  An extent that
+// holds it is split round it: the part after goes back in with bfsMapRun,
+// into the indirect tree if no extent slot is left
+// ============================================================================
+static void bfsRemapFbn(Inode* inode, Walk* w, i32 fbn, i32 dbn) {
+  i32 i = bfsFindExtent(inode, fbn);
+  if (i < 0 || fbn >= inode->extent[i].fbn + inode->extent[i].len) {
+    bfsWalkSet(inode, w, fbn, dbn);         // held by the tree
+    return;
+  }
+
+  Extent e    = inode->extent[i];
+  i32    head = fbn - e.fbn;                // FBNs of 'e' before 'fbn'
+  i32    tail = e.len - head - 1;           // ... and after it
+  if (head > 0) {
+    inode->extent[i].len = head;
+  } else {
+    memmove(&inode->extent[i], &inode->extent[i + 1],
+            (inode->numExtents - i - 1) * sizeof(Extent));
+    --inode->numExtents;
+  }
+  if (tail > 0) bfsMapRun(inode, w, fbn + 1, e.dbn + head + 1, tail);
+  bfsMapRun(inode, w, fbn, dbn, 1);
+}
+
+
+
+// ============================================================================
+// Allocate and map 'num' new blocks for FBNs 'fbns', in ascending order, of
+// file 'inum', which have none yet, returning their DBNs in 'dbns'.  All are
+// reserved in one pass, contiguous where the disk allows, then mapped with a
+// single Inode update: each stretch contiguous in both FBN and DBN becomes
+// one run.  See bfsMapRun
+// ============================================================================
+static void bfsMapNew(i32 inum, i32* fbns, i32 num, i32* dbns) {
+  Inode inode;
+  bfsReadInode(inum, &inode);
+
+  Walk walk = { { 0, 0, NULL }, { 0, 0, NULL } };
+
+  // Before version 3, grab the indirect block first, if the new FBNs need
+  // one, so that the data blocks can be one contiguous run
+
+  if (g_geo.version < 3 && fbns[num - 1] >= NUMDIRECT &&
+      inode.indirect == 0) {
+    inode.indirect = bfsWalkNew(&walk.inner);
+  }
+
+  bfsFindFreeBlocks(num, dbns);
+
+  for (i32 i = 0; i < num; ) {
+    i32 len = 1;
+    while (i + len < num && dbns[i + len] == dbns[i] + len &&
+           fbns[i + len] == fbns[i] + len) ++len;
+    bfsMapRun(&inode, &walk, fbns[i], dbns[i], len);
+    i += len;
+  }
+
+  bfsWalkDone(&walk);
+  bfsWriteInode(inum, &inode);
+}
+
+
+
+// ============================================================================
+// Order two DBNs, for qsort
+// ============================================================================
+static int bfsCompareDbn(const void* a, const void* b) {
+  i32 x = *(const i32*)a;
+  i32 y = *(const i32*)b;
+  return (x > y) - (x < y);
+}
+
+
+
+// ============================================================================
+// Free the 'num' data blocks in 'dbns', which are put in order, so that each
+// run of neighbours costs one bfsFreeRun
+// ============================================================================
+static void bfsFreeDbns(i32* dbns, i32 num) {
+  qsort(dbns, num, sizeof(i32), bfsCompareDbn);
+  for (i32 i = 0; i < num; ) {
+    i32 len = 1;
+    while (i + len < num && dbns[i + len] == dbns[i] + len) ++len;
+    bfsFreeRun(dbns[i], len);
+    i += len;
+  }
+}
+
+
+
+// ============================================================================
+// Add one more file to each of the 'num' data blocks in 'dbns', which are
+// put in order, so that each run of neighbours costs one bfsShareRun
+// ============================================================================
+static void bfsShareDbns(i32* dbns, i32 num) {
+  qsort(dbns, num, sizeof(i32), bfsCompareDbn);
+  for (i32 i = 0; i < num; ) {
+    i32 len = 1;
+    while (i + len < num && dbns[i + len] == dbns[i] + len) ++len;
+    bfsShareRun(dbns[i], len);
+    i += len;
+  }
+}
+
+
+
+// ============================================================================
+// Copy the indirect tree whose root is 'root' - a version 3 double-indirect
+// table - onto new blocks, taken in one batch, and share every data block
+// it maps.  Return the root of the copy
+// ============================================================================
+static i32 bfsCloneTree(i32 root) {
+  i8* outer = malloc(2 * BLOCKSIZE);
+  if (outer == NULL) FATAL(ENOMEM);
+  i8* inner = outer + BLOCKSIZE;
+  cacheRead(root, outer);
+
+  i32 num = 1;                              // the root, and each inner block
+  for (i32 k = 0; k < NUMINDIRECT; ++k) {
+    if (bfsGetPtr(outer, k) != 0) ++num;
+  }
+  i32* dbns = malloc(num * sizeof(i32));
+  if (dbns == NULL) FATAL(ENOMEM);
+  bfsFindFreeBlocks(num, dbns);
+
+  i32* data = malloc(NUMINDIRECT * sizeof(i32));
+  if (data == NULL) FATAL(ENOMEM);
+  i32 n = 1;
+  for (i32 k = 0; k < NUMINDIRECT; ++k) {
+    i32 dbnInner = bfsGetPtr(outer, k);
+    if (dbnInner == 0) continue;
+    cacheRead(dbnInner, inner);
+    i32 m = 0;
+    for (i32 i = 0; i < NUMINDIRECT; ++i) {
+      i32 d = bfsGetPtr(inner, i);
+      if (d != 0) data[m++] = d;
+    }
+    bfsShareDbns(data, m);
+    cacheWrite(dbns[n], inner);
+    bfsSetPtr(outer, k, dbns[n++]);
+  }
+  cacheWrite(dbns[0], outer);
+
+  root = dbns[0];
+  free(data);
+  free(dbns);
+  free(outer);
+  return root;
+}
+
+
+
+// ============================================================================
+// Free indirect block 'dbn', once the journal can no longer write an old
+// copy of it over whatever reuses it.  See jnlForget.  Meanwhile it is held,
+// as a data block freed in the running transaction is, so the disk shows it
+// free: after a crash, the replay that could write the old copy runs before
+// anything can reuse it
+// ============================================================================
+static void bfsFreeMeta(i32 dbn) {
+  if (!jnlForget(dbn)) {
+    bfsFreeRun(dbn, 1);
+    return;
+  }
+  pthread_mutex_lock(&g_allocLock);
+  bfsHoldRun(dbn, 1);
+  pthread_mutex_unlock(&g_allocLock);
+}
+
+
+
+// ============================================================================
+// Free the data blocks that indirect block 'dbn' maps from slot 'from' on,
+// and clear those slots.  If none is left, free the block itself and return
+// 1; otherwise write it back if it changed, and return 0.  'buf' is room
+// for one block
+// ============================================================================
+static i32 bfsFreeInner(i32 dbn, i32 from, i8* buf) {
+  cacheRead(dbn, buf);
+
+  i32* dbns = malloc(NUMINDIRECT * sizeof(i32));
+  if (dbns == NULL) FATAL(ENOMEM);
+  i32  n    = 0;
+  i32 kept = 0;
+  for (i32 i = 0; i < NUMINDIRECT; ++i) {
+    i32 d = bfsGetPtr(buf, i);
+    if (d == 0) continue;
+    if (i < from) { ++kept; continue; }
+    dbns[n++] = d;
+    bfsSetPtr(buf, i, 0);
+  }
+  bfsFreeDbns(dbns, n);
+  free(dbns);
+
+  if (kept == 0) {
+    bfsFreeMeta(dbn);
+    return 1;
+  }
+  if (n > 0) cacheWrite(dbn, buf);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Free the FBNs from 'end' on that the indirect tree of 'inode' maps, along
+// with any indirect block left empty.  A tree left with nothing in it is
+// dropped from 'inode'
+// ============================================================================
+static void bfsFreeTree(Inode* inode, i32 end) {
+  if (inode->indirect == 0) return;
+  i8* inner = malloc(2 * BLOCKSIZE);
+  if (inner == NULL) FATAL(ENOMEM);
+
+  if (g_geo.version < 3) {
+    i32 from = (end > NUMDIRECT) ? end - NUMDIRECT : 0;
+    if (bfsFreeInner(inode->indirect, from, inner)) inode->indirect = 0;
+    free(inner);
+    return;
+  }
+
+  i8* outer = inner + BLOCKSIZE;
+  cacheRead(inode->indirect, outer);
+
+  i32 dirty = 0;
+  i32 kept  = 0;
+  for (i32 k = 0; k < NUMINDIRECT; ++k) {
+    i32 dbnInner = bfsGetPtr(outer, k);
+    if (dbnInner == 0) continue;
+    i32 from = end - k * NUMINDIRECT;         // first slot to free
+    if (from >= NUMINDIRECT) { ++kept; continue; }
+    if (bfsFreeInner(dbnInner, (from > 0) ? from : 0, inner)) {
+      bfsSetPtr(outer, k, 0);
+      dirty = 1;
+    } else {
+      ++kept;
+    }
+  }
+
+  if (kept == 0) {
+    bfsFreeMeta(inode->indirect);
+    inode->indirect = 0;
+  } else if (dirty) {
+    cacheWrite(inode->indirect, outer);
+  }
+  free(inner);
+}
+
+
+
+// ============================================================================
+// Free the FBNs from 'end' on that the extents of 'inode' hold, trimming or
+// dropping each extent they fall in.  Before version 3, the direct slots
+// just go empty
+// ============================================================================
+static void bfsFreeExtents(Inode* inode, i32 end) {
+  if (g_geo.version < 3) {
+    for (i32 d = end; d < NUMDIRECT; ++d) {
+      if (inode->extent[d].len == 0) continue;
+      bfsFreeRun(inode->extent[d].dbn, 1);
+      inode->extent[d].dbn = 0;
+      inode->extent[d].len = 0;
+    }
+    return;
+  }
+
+  i32 n = 0;
+  for (i32 i = 0; i < inode->numExtents; ++i) {
+    Extent e = inode->extent[i];
+    if (e.fbn >= end) {
+      bfsFreeRun(e.dbn, e.len);
+      continue;
+    }
+    if (e.fbn + e.len > end) {
+      bfsFreeRun(e.dbn + end - e.fbn, e.fbn + e.len - end);
+      e.len = end - e.fbn;
+    }
+    inode->extent[n++] = e;
+  }
+  inode->numExtents = n;
+}
+
+
+
+// ============================================================================
+// Free a whole indirect tree, whose root 'dbn' no Inode holds any longer
+// ============================================================================
+static void bfsFreeRoot(i32 dbn) {
+  Inode inode;
+  memset(&inode, 0, sizeof(Inode));
+  inode.indirect = dbn;
+  bfsFreeTree(&inode, 0);
+}
+
+
+
+// ============================================================================
+// Body of the free thread: take each root off the queue, and free its tree.
+// Both happen in one operation of the journal, so no commit sees the tree
+// half freed, or freed but still queued.  Once the queue is empty, commit,
+// so that the journal hands back the blocks freed: see jnlDefer.  Roots
+// still queued when bfsStopFree is called are freed before it exits
+// ============================================================================
+static void* bfsFreeThread(void* arg) {
+  pthread_mutex_lock(&g_freeLock);
+  for (;;) {
+    while (g_freeCount == 0 && !g_freeStop) {
+      pthread_cond_wait(&g_freeCond, &g_freeLock);
+    }
+    if (g_freeCount == 0) break;            // stopping, and drained
+
+    g_freeBusy = 1;
+    pthread_mutex_unlock(&g_freeLock);
+    jnlBegin();
+    pthread_mutex_lock(&g_freeLock);
+    i32 dbn = g_freeQueue[--g_freeCount];   // only this thread takes any
+    g_freeDirty = 1;
+    pthread_mutex_unlock(&g_freeLock);
+    bfsFreeRoot(dbn);
+    jnlEnd();
+    pthread_mutex_lock(&g_freeLock);
+    if (g_freeCount > 0) continue;
+
+    pthread_mutex_unlock(&g_freeLock);
+    jnlCommit();                            // outside any operation
+    pthread_mutex_lock(&g_freeLock);
+    g_freeBusy = 0;
+    pthread_cond_broadcast(&g_freeCond);    // for bfsFreeWait
+  }
+  pthread_mutex_unlock(&g_freeLock);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Free the indirect tree whose root is 'dbn': on the free thread if it runs,
+// else at once.  Called within the operation that drops 'dbn' from its
+// Inode, so with a journal the root joins the list in DBNSUPER in the same
+// transaction.  When that list is full, the tree is freed at once too
+// ============================================================================
+static void bfsFreeLater(i32 dbn) {
+  pthread_mutex_lock(&g_freeLock);
+  i32 full = (g_geo.numJournalBlocks > 0 && g_freeCount >= MAXORPHANS);
+  if (!g_freeAsync || full) {
+    pthread_mutex_unlock(&g_freeLock);
+    bfsFreeRoot(dbn);
+    return;
+  }
+  if (g_freeCount == g_freeCap) {
+    i32  cap   = (g_freeCap == 0) ? 16 : 2 * g_freeCap;
+    i32* queue = realloc(g_freeQueue, cap * sizeof(i32));
+    if (queue == NULL) FATAL(ENOMEM);
+    g_freeQueue = queue;
+    g_freeCap   = cap;
+  }
+  g_freeQueue[g_freeCount++] = dbn;
+  g_freeDirty = 1;
+  pthread_cond_signal(&g_freeCond);
+  pthread_mutex_unlock(&g_freeLock);
+}
+
+
+
+// ============================================================================
+// Return into 'dbns' the DBNs of cluster 'c' of compressed file 'inum', and
+// return how many it has: the first that many FBNs are mapped, and none
+// after.  FATAL if the cluster is mapped any other way
+// ============================================================================
+static i32 bfsClusterMap(i32 inum, i32 c, i32* dbns) {
+  Inode inode;
+  bfsReadInode(inum, &inode);
+
+  Walk walk = { { 0, 0, NULL }, { 0, 0, NULL } };
+
+  i32 first = c * CLUSTERBLOCKS;
+  i32 num   = 0;
+  for (i32 i = 0; i < CLUSTERBLOCKS && first + i <= MAXFBN; ++i) {
+    dbns[i] = bfsWalkGet(&inode, &walk, first + i);
+    if (dbns[i] == 0) continue;
+    if (num != i) FATAL(EBADCOMP);          // not a prefix
+    ++num;
+  }
+  bfsWalkDone(&walk);
+  return num;
+}
+
+
+
+// ============================================================================
+// Map the first 'num' FBNs of cluster 'c' of compressed file 'inum' to
+// 'dbns', and leave the rest, up to 'oldNum', with no DBN
+// ============================================================================
+static void bfsClusterRemap(i32 inum, i32 c, i32* dbns, i32 num, i32 oldNum) {
+  Inode inode;
+  bfsReadInode(inum, &inode);
+
+  Walk walk = { { 0, 0, NULL }, { 0, 0, NULL } };
+
+  i32 first = c * CLUSTERBLOCKS;
+  for (i32 i = 0; i < num; ++i) bfsWalkSet(&inode, &walk, first + i, dbns[i]);
+  for (i32 i = num; i < oldNum; ++i) bfsWalkSet(&inode, &walk, first + i, 0);
+
+  bfsWalkDone(&walk);
+  bfsWriteInode(inum, &inode);
+}
+
+
+
+// ============================================================================
+// Body of bfsSeekData, for file 'inum' whose Inode is 'inode'.  Indirect
+// blocks are read through 'walk'
+// ============================================================================
+static i32 bfsSeekWalk(i32 inum, Inode* inode, Walk* walk, i32 fbn, i32 data) {
+  i32 end = (inode->size + BLOCKSIZE - 1) / BLOCKSIZE;
+
+  if (inode->flags & INODECOMPRESS) {       // a cluster at a time
+    for (i32 c = fbn / CLUSTERBLOCKS; c * CLUSTERBLOCKS < end; ++c) {
+      i32 first = c * CLUSTERBLOCKS;
+      if ((bfsWalkGet(inode, walk, first) != 0) != (data != 0)) continue;
+      return (first > fbn) ? first : fbn;
+    }
+    return end;
+  }
+
+  Delay* d       = (g_delay != NULL) ? &g_delay[inum] : NULL;
+  i32    heldFbn = (d != NULL && d->num > 0) ? d->fbn : end;
+  i32    heldEnd = (d != NULL && d->num > 0) ? d->fbn + d->num : end;
+
+  while (fbn < end) {
+    i32 i      = bfsFindExtent(inode, fbn);
+    i32 runEnd = 0;                         // end of a run of data
+    if (i >= 0 && fbn < inode->extent[i].fbn + inode->extent[i].len) {
+      runEnd = inode->extent[i].fbn + inode->extent[i].len;
+    } else if (fbn >= heldFbn && fbn < heldEnd) {
+      runEnd = heldEnd;
+    } else if (bfsWalkGet(inode, walk, fbn) != 0) {
+      runEnd = fbn + 1;
+    }
+
+    if (runEnd > 0) {                       // data
+      if (data) return fbn;
+      fbn = runEnd;
+      continue;
+    }
+    if (!data) return fbn;                  // a hole
+
+    // step to whichever could hold data next: the next extent, the held
+    // run, or the next inner indirect block
+    i32 next = fbn + 1;
+    if (inode->indirect == 0) {
+      next = end;
+    } else if (g_geo.version >= 3 &&
+               bfsGetPtr(walk->outer.buf, fbn / NUMINDIRECT) == 0) {
+      next = (fbn / NUMINDIRECT + 1) * NUMINDIRECT;
+    }
+    if (i + 1 < inode->numExtents && inode->extent[i + 1].fbn < next) {
+      next = inode->extent[i + 1].fbn;
+    }
+    if (heldFbn > fbn && heldFbn < next) next = heldFbn;
+    fbn = next;
+  }
+  return end;
+}
+
+
+
+// ============================================================================
+// Return 1 if the 'numb' bytes at 'buf' are all zero
+// ============================================================================
+static i32 bfsIsZero(i8* buf, i32 numb) {
+  for (i32 i = 0; i < numb; i += sizeof(u64)) {
+    u64 word;
+    memcpy(&word, buf + i, sizeof(u64));
+    if (word != 0) return 0;
+  }
+  return 1;
+}
+
+
+
+// ============================================================================
+// Claim up to 'numb' bytes from the cursor of File Descriptor 'fd', stopping
+// short of byte 'end'.  Return, in 'curs', where the bytes start, and move
+// the cursor past them in one step, so that threads sharing 'fd' each get
+// their own bytes.  Return the # of bytes claimed: 0 at or past 'end'
+// ============================================================================
+i32 bfsAdvanceCursor(i32 fd, i32 numb, i32 end, i32* curs) {
+
+  if (curs == NULL) FATAL(ENULLPTR);
+
+  OFTE* ofte = &g_oft[bfsFdToOFTE(fd)];
+
+  pthread_mutex_lock(&ofte->lock);
+  *curs = ofte->curs;
+  if (numb > end - ofte->curs) numb = end - ofte->curs;
+  if (numb > 0) ofte->curs += numb;
+  pthread_mutex_unlock(&ofte->lock);
+
+  return (numb > 0) ? numb : 0;
+}
+
+
+
+// ============================================================================
+// Allocate a free disk block for the file whose Inode number is 'inum' and
+// assign it to FBN 'fbn' in the file's Inode.  On success, return the DBN
+// allocated.  On failure, abort
+// ============================================================================
+i32 bfsAllocBlock(i32 inum, i32 fbn) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (fbn  < 0)       FATAL(EBADFBN);
+  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+
+  // Grab the next free block in the BFS disk
+
+  i32 dbn = bfsFindFreeBlock();
+
+  // Update the corresponding Inode, or indirect tree
+
+  Inode inode;
+  bfsReadInode(inum, &inode);
+
+  Walk walk = { { 0, 0, NULL }, { 0, 0, NULL } };
+
+  bfsMapRun(&inode, &walk, fbn, dbn, 1);
+  bfsWalkDone(&walk);
+  bfsWriteInode(inum, &inode);
+
+  return dbn;                             // allocated DBN
+
+}
+
+
+
+// ============================================================================
+// Give a DBN to each FBN from 'fbnFirst' to 'fbnLast' of file 'inum' that
+// has none, in one batch: see bfsMapNew.  FBNs already mapped keep their
+// DBNs, and file blocks outside the range stay as they are - holes, from
+// version 3 on.  Disks older than that have no holes, so there every FBN
+// from the end of the file up to 'fbnLast' is allocated.  None of the FBNs
+// may be held back: see bfsDelayFlush.  Return 0
+// ============================================================================
+i32 bfsAllocRange(i32 inum, i32 fbnFirst, i32 fbnLast) {
+
+  if (inum < 0)         FATAL(EBADINUM);
+  if (inum > MAXINUM)   FATAL(EBADINUM);
+  if (fbnFirst < 0)     FATAL(EBADFBN);
+  if (fbnLast > MAXFBN) FATAL(EBADFBN);
+
+  i32 end = (bfsGetSize(inum) + BLOCKSIZE - 1) / BLOCKSIZE;
+  if (g_geo.version < 3) fbnFirst = end;    // all below 'end' are mapped
+  if (fbnLast < fbnFirst) return 0;
+
+  Inode inode;
+  bfsReadInode(inum, &inode);
+
+  Walk walk = { { 0, 0, NULL }, { 0, 0, NULL } };
+
+  i32  num  = fbnLast - fbnFirst + 1;
+  i32* fbns = malloc(num * sizeof(i32));
+  i32* dbns = malloc(num * sizeof(i32));
+  if (fbns == NULL || dbns == NULL) FATAL(ENOMEM);
+
+  i32 n = 0;
+  for (i32 f = fbnFirst; f <= fbnLast; ++f) {
+    if (f < end && bfsExtentDbn(&inode, f) != 0)        continue;
+    if (f < end && bfsWalkGet(&inode, &walk, f) != 0)   continue;
+    fbns[n++] = f;
+  }
+  bfsWalkDone(&walk);
+  if (n > 0) bfsMapNew(inum, fbns, n, dbns);
+
+  free(dbns);
+  free(fbns);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Make file 'dst', which is empty, a copy of file 'src' that shares its data
+// blocks, each of which gains a file in the reference counts.  No data is
+// read or written: only the indirect tree is copied, with its blocks taken
+// in one batch.  Blocks 'src' holds back are allocated first.  The caller
+// holds the Inode locks of both files for writing.  Return 0, or ENOCLONE
+// on a disk with no reference counts: older than version 7
+// ============================================================================
+i32 bfsCloneFile(i32 src, i32 dst) {
+
+  if (src < 0)       FATAL(EBADINUM);
+  if (src > MAXINUM) FATAL(EBADINUM);
+  if (dst < 0)       FATAL(EBADINUM);
+  if (dst > MAXINUM) FATAL(EBADINUM);
+  if (dst == src)    FATAL(EBADINUM);
+
+  if (g_refs == NULL) return ENOCLONE;
+  bfsDelayFlush(src);
+
+  Inode inode;
+  bfsReadInode(src, &inode);
+  for (i32 i = 0; i < inode.numExtents; ++i) {
+    bfsShareRun(inode.extent[i].dbn, inode.extent[i].len);
+  }
+  if (inode.indirect != 0) inode.indirect = bfsCloneTree(inode.indirect);
+  bfsWriteInode(dst, &inode);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Close File Descriptor 'fd', returning its OFT slot to the free stack
+// ============================================================================
+i32 bfsCloseFd(i32 fd) {
+  i32 i = bfsFdToOFTE(fd);
+  __atomic_store_n(&g_oft[i].inum, -1, __ATOMIC_RELEASE);
+
+  pthread_mutex_lock(&g_oftLock);
+  g_oftFree[g_oftNumFree++] = i;
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Create file 'fname'.  Find a free inum; ie, free slot in the Directory.
+// Leave the size of the file as zero, until the user performs a write, or a
+// seek into the file.  If 'fname' exists already, it is left as it is.  On
+// success, return the file's inum.  On failure, abort
+// ============================================================================
+i32 bfsCreateFile(str fname) {
+
+  if (fname == NULL) FATAL(ENULLPTR);
+
+  if (strlen(fname) > FNAMESIZE - 1) FATAL(EBIGFNAME);  // fname too big
+
+  pthread_rwlock_wrlock(&g_dirLock);
+  i32 h = bfsDirFind(fname);
+  if (h >= 0) {                                         // exists already
+    i32 inum = g_dirHash[h] - 1;
+    pthread_rwlock_unlock(&g_dirLock);
+    return inum;
+  }
+  while (g_dirFree <= MAXINUM && g_dir[g_dirFree * FNAMESIZE] != 0) {
+    ++g_dirFree;                                        // skip used slots
+  }
+  if (g_dirFree > MAXINUM) FATAL(EDIRFULL);             // Directory full
+
+  i32 inum = g_dirFree++;
+  strcpy((char*)g_dir + inum * FNAMESIZE, fname);
+  bfsDirIndex(inum);
+
+  i32 b = inum * FNAMESIZE / BLOCKSIZE;                 // write its block
+  cacheWrite(g_geo.dbnDir + b, g_dir + b * BLOCKSIZE);
+  pthread_rwlock_unlock(&g_dirLock);
+  return inum;
+}
+
+
+
+// ============================================================================
+// Return the first FBN of file 'inum' held back, or else the first past the
+// end of the file.  From there on, no FBN has a DBN yet.  The caller holds
+// the file's Inode lock
+// ============================================================================
+i32 bfsDelayFirst(i32 inum) {
+  if (g_delay != NULL && g_delay[inum].num > 0) return g_delay[inum].fbn;
+  return (bfsGetSize(inum) + BLOCKSIZE - 1) / BLOCKSIZE;
+}
+
+
+
+// ============================================================================
+// Allocate the blocks held back for file 'inum', in one batch, and write
+// them with one bioWritev.  The caller holds the file's Inode lock for
+// writing.  Return 0
+// ============================================================================
+i32 bfsDelayFlush(i32 inum) {
+  if (g_delay == NULL || g_delay[inum].num == 0) return 0;
+  Delay* d = &g_delay[inum];
+
+  i32*    fbns = malloc(d->num * sizeof(i32));
+  i32*    dbns = malloc(d->num * sizeof(i32));
+  BioVec* vec  = malloc(d->num * sizeof(BioVec));
+  if (fbns == NULL || dbns == NULL || vec == NULL) FATAL(ENOMEM);
+
+  for (i32 i = 0; i < d->num; ++i) fbns[i] = d->fbn + i;
+  bfsMapNew(inum, fbns, d->num, dbns);
+  for (i32 i = 0; i < d->num; ++i) {
+    vec[i].dbn = dbns[i];
+    vec[i].buf = d->data + (size_t)i * BLOCKSIZE;
+  }
+  cacheWritev(vec, d->num);
+  free(vec);
+  free(dbns);
+  free(fbns);
+
+  __atomic_store_n(&d->num, 0, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Allocate the blocks held back for every file: see bfsDelayFlush.  Takes
+// each such file's Inode lock, so the caller must hold none.  Return 0
+// ============================================================================
+i32 bfsDelayFlushAll() {
+  for (i32 inum = 0; inum < g_delayNum; ++inum) {
+    if (__atomic_load_n(&g_delay[inum].num, __ATOMIC_RELAXED) == 0) continue;
+    bfsLockInode(inum, 1);
+    bfsDelayFlush(inum);
+    bfsUnlockInode(inum);
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// If FBN 'fbn' of file 'inum' is held back, copy it into 'buf' and return
+// 1.  Otherwise return 0.  The caller holds the file's Inode lock
+// ============================================================================
+i32 bfsDelayGet(i32 inum, i32 fbn, i8* buf) {
+  if (g_delay == NULL) return 0;
+  Delay* d = &g_delay[inum];
+  if (fbn < d->fbn || fbn >= d->fbn + d->num) return 0;
+  memcpy(buf, d->data + (size_t)(fbn - d->fbn) * BLOCKSIZE, BLOCKSIZE);
+  return 1;
+}
+
+
+
+// ============================================================================
+// Hold back 'block', the new contents of FBN 'fbn' of file 'inum', which has
+// no DBN.  'fbn' is held already, or comes just after the blocks held, or
+// starts them, at or past the end of the file: any FBNs skipped are holes.
+// bfsDelayRoom must have said there is room.  The caller holds the file's
+// Inode lock for writing.  Return 0
+// ============================================================================
+i32 bfsDelayPut(i32 inum, i32 fbn, void* block) {
+  Delay* d = &g_delay[inum];
+  if (d->num == 0) d->fbn = fbn;
+
+  i32 i = fbn - d->fbn;
+  if (i < 0 || i > d->num || i >= g_delayMax) FATAL(EBADFBN);
+  if (i >= d->cap) {
+    i8* data = realloc(d->data, (size_t)g_delayMax * BLOCKSIZE);
+    if (data == NULL) FATAL(ENOMEM);
+    d->data = data;
+    d->cap  = g_delayMax;
+  }
+  memcpy(d->data + (size_t)i * BLOCKSIZE, block, BLOCKSIZE);
+  if (i >= d->num) __atomic_store_n(&d->num, i + 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return 1 if FBNs 'fbnFirst' to 'fbnLast' of file 'inum', which have no
+// DBNs, may be held back, along with any held already; 0 if they must be
+// allocated at once.  Only extent-based disks (version 3 on) delay
+// allocation, so older images are laid out as before.  The caller holds the
+// file's Inode lock
+// ============================================================================
+i32 bfsDelayRoom(i32 inum, i32 fbnFirst, i32 fbnLast) {
+  if (g_delayMax == 0 || g_geo.version < 3) return 0;
+  i32 from = (g_delay[inum].num > 0) ? g_delay[inum].fbn : fbnFirst;
+  return fbnLast - from < g_delayMax;
+}
+
+
+
+// ============================================================================
+// Delete file 'fname', whose inum is 'inum': free its blocks and its
+// Directory slot.  Return EFNF if 'fname' is no longer 'inum', or EFILEOPEN,
+// changing nothing, while any File Descriptor has it open.  The caller holds
+// the file's Inode lock for writing.  Return 0 on success
+// ============================================================================
+i32 bfsDeleteFile(i32 inum, str fname) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (fname == NULL)  FATAL(ENULLPTR);
+
+  // Drop the name from the hash index first, so no new open can find it.
+  // An open that found it before re-checks the name, under g_dirLock, once
+  // its OFTE holds 'inum': see fsOpen
+
+  pthread_rwlock_wrlock(&g_dirLock);
+  i32 h = bfsDirFind(fname);
+  if (h < 0 || g_dirHash[h] - 1 != inum) {
+    pthread_rwlock_unlock(&g_dirLock);
+    return EFNF;
+  }
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
+    if (__atomic_load_n(&g_oft[i].inum, __ATOMIC_ACQUIRE) != inum) continue;
+    pthread_rwlock_unlock(&g_dirLock);
+    return EFILEOPEN;
+  }
+  bfsDirUnindex(h);
+  pthread_rwlock_unlock(&g_dirLock);
+
+  bfsTruncate(inum, 0);
+
+  // Only now may bfsCreateFile hand the slot out again
+
+  pthread_rwlock_wrlock(&g_dirLock);
+  memset(g_dir + inum * FNAMESIZE, 0, FNAMESIZE);
+  if (inum < g_dirFree) g_dirFree = inum;
+
+  i32 b = inum * FNAMESIZE / BLOCKSIZE;                 // write its block
+  cacheWrite(g_geo.dbnDir + b, g_dir + b * BLOCKSIZE);
+  pthread_rwlock_unlock(&g_dirLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Extend file 'inum' out to FBN 'fbn', allocating now: first the blocks held
+// back, if any, then the new ones, in one batch.  See bfsMapNew
+// ============================================================================
+i32 bfsExtend(i32 inum, i32 fbn) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+
+  bfsDelayFlush(inum);
+  i32 size = bfsGetSize(inum);
+  i32 fbnLast = (size + BLOCKSIZE - 1) / BLOCKSIZE;   // first unused
+  return bfsAllocRange(inum, fbnLast, fbn);
+}
+
+
+
+// ============================================================================
+// Use Inode to find the DBN used to store file block 'fbn'.  Return ENODBN
+// if not yet mapped.  Never allocates, and never changes the Inode
+// ============================================================================
+i32 bfsFbnToDbn(i32 inum, i32 fbn) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (fbn  < 0)       FATAL(EBADFBN);
+  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+
+  Inode inode;
+  
+  bfsReadInode(inum, &inode);
+
+  i32 dbn = bfsExtentDbn(&inode, fbn);      // no block reads
+  if (dbn != 0) return dbn;
+
+  // fbn is in no extent, so check the indirect tree.  This is a pure
+  // lookup: nothing is allocated here.  See bfsMapFbn
+
+  Walk walk = { { 0, 0, NULL }, { 0, 0, NULL } };
+
+  dbn = bfsWalkGet(&inode, &walk, fbn);
+  bfsWalkDone(&walk);
+  return (dbn == 0) ? ENODBN : dbn;
+}
+
+
+
+// ============================================================================
+// Find the DBN for FBN 'fbn' of the file open on File Descriptor 'fd', using
+// the translation window in its OFTE.  On a miss, the window is refilled
+// with XLATESIZE FBNs from 'fbn' on, for a single read of the Inode and of
+// each indirect block needed.  Return ENODBN if not yet mapped
+// ============================================================================
+i32 bfsFdFbnToDbn(i32 fd, i32 fbn) {
+
+  if (fbn  < 0)       FATAL(EBADFBN);
+  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+
+  OFTE* ofte = &g_oft[bfsFdToOFTE(fd)];
+  i32   inum = ofte->inum;
+
+  pthread_mutex_lock(&ofte->lock);
+
+  i32 i = fbn - ofte->xlateFbn;
+  if (i < 0 || i >= ofte->xlateLen) {   // miss: refill the window
+    Inode inode;
+    bfsReadInode(inum, &inode);
+
+    Walk walk = { { 0, 0, NULL }, { 0, 0, NULL } };
+
+    ofte->xlateFbn = fbn;
+    ofte->xlateLen = 0;
+    for (i32 f = fbn; f < fbn + XLATESIZE && f <= MAXFBN; ++f) {
+      i32 dbn = bfsExtentDbn(&inode, f);
+      if (dbn == 0) dbn = bfsWalkGet(&inode, &walk, f);
+      ofte->xlateDbn[ofte->xlateLen++] = dbn;
+    }
+    bfsWalkDone(&walk);
+    i = 0;
+  }
+
+  i32 dbn = ofte->xlateDbn[i];
+  pthread_mutex_unlock(&ofte->lock);
+  return (dbn == 0) ? ENODBN : dbn;
+}
+
+
+
+// ============================================================================
+// Convert FileDescriptor (user-visible) to Inum (internal)
+// ============================================================================
+i32 bfsFdToInum(i32 fd) { 
+  return g_oft[bfsFdToOFTE(fd)].inum;
+}
+
+
+
+// ============================================================================
+// Convert FileDescriptor (user-visible) to its OFT slot.  FATAL if 'fd' is
+// not open
+// ============================================================================
+i32 bfsFdToOFTE(i32 fd) {
+  i32 i = fd - FDBASE;
+  if (i < 0 || i >= NUMOFTENTRIES) FATAL(EBADFD);
+  if (__atomic_load_n(&g_oft[i].inum, __ATOMIC_ACQUIRE) < 0) FATAL(EBADFD);
+  return i;
+}
+
+
+
+
+// ============================================================================
+// Allocate the next free block.  On success, return DBN.  FATAL otherwise
+// ============================================================================
+i32 bfsFindFreeBlock() {
+  pthread_mutex_lock(&g_allocLock);
+  i32 dbn = bfsTakeFreeBlock();
+  pthread_mutex_unlock(&g_allocLock);
+  STATSADD(allocs, 1);
+  return dbn;
+}
+
+
+
+// ============================================================================
+// Allocate 'num' free blocks into 'dbns'.  On a bitmap disk, take the first
+// run of 'num' contiguous free blocks if there is one, else the first 'num'
+// free blocks found.  FATAL if the disk fills up
+// ============================================================================
+i32 bfsFindFreeBlocks(i32 num, i32* dbns) {
+
+  if (dbns == NULL) FATAL(ENULLPTR);
+
+  STATSADD(allocs, num);
+  pthread_mutex_lock(&g_allocLock);
+  i32 start = (g_geo.dbnBitmap == 0) ? -1 : bfsFindFreeRun(num);
+
+  if (start < 0) {                    // Freelist, or no run long enough
+    for (i32 i = 0; i < num; ++i) dbns[i] = bfsTakeFreeBlock();
+    pthread_mutex_unlock(&g_allocLock);
+    return 0;
+  }
+
+  for (i32 i = 0; i < num; ++i) {
+    i32 dbn = start + i;
+    g_bitmap[dbn / 64] |= (u64)1 << (dbn % 64);
+    dbns[i] = dbn;
+  }
+  g_bitmapDirty = 1;
+  g_bitmapNext  = (start + num - 1) / 64;
+  pthread_mutex_unlock(&g_allocLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return the first DBN of a run of 'num' free blocks in the bitmap, looking
+// from where the last search stopped, then from the start of the disk.
+// Return -1 if there is no such run.  The bitmap is not changed.  Called with
+// g_allocLock held
+// ============================================================================
+i32 bfsFindFreeRun(i32 num) {
+  i32 numBits = g_bitmapWords * 64;
+  i32 from    = g_bitmapNext * 64;
+
+  for (i32 pass = 0; pass < 2; ++pass) {
+    i32 lo = (pass == 0) ? from    : 0;
+    i32 hi = (pass == 0) ? numBits : from + num - 1;
+    if (hi > numBits) hi = numBits;
+
+    i32 run = 0;
+    for (i32 dbn = lo; dbn < hi; ++dbn) {
+      if (dbn % 64 == 0 && g_bitmap[dbn / 64] == ~(u64)0) {
+        run = 0;                        // skip a full word
+        dbn += 63;
+        continue;
+      }
+      if (g_bitmap[dbn / 64] & ((u64)1 << (dbn % 64))) { run = 0; continue; }
+      if (++run == num) return dbn - num + 1;
+    }
+  }
+  return -1;
+}
+
+
+
+// ============================================================================
+// Allocate the next free block from the Freelist, on disks formatted before
+// FSVERSION 1.  Adjust Freelist accordingly.  On success, return DBN.
+// FATAL otherwise.  Called with g_allocLock held
+// ============================================================================
+i32 bfsFindFreeListBlock() {
+  i8 buf8[BLOCKSIZE];
+  cacheRead(DBNSUPER, buf8);
+  Super* super = (Super*)buf8;
+
+  i32 dbn = super->firstFree;
+  if (dbn == 0) FATAL(EDISKFULL);
+
+  i8 next[BLOCKSIZE];                 // for next free block
+  cacheRead(dbn, next);
+
+  super->firstFree = bfsGetPtr(next, 0);  // new head of Freelist
+
+  cacheWrite(DBNSUPER, buf8);           // update SuperBlock
+
+  return dbn;
+}
+
+
+
+// ============================================================================
+// Free the 'num' blocks from DBN 'dbn' on.  On a bitmap disk this clears
+// their bits a word at a time, and forgets their checksums; on older disks
+// each goes onto the Freelist.  With a journal, the bits stay set until the
+// running transaction commits, and bfsReleaseRun clears them.  A block
+// another file still shares is not freed: it just loses one file from its
+// reference count.  FATAL if any is metadata, past the end of the disk, or
+// free already.  Return 0
+// ============================================================================
+i32 bfsFreeRun(i32 dbn, i32 num) {
+
+  if (dbn < g_geo.numMeta)              FATAL(EBADDBN);
+  if (num < 0)                          FATAL(EBADDBN);
+  if (dbn > g_geo.numBlocks - num)      FATAL(EBADDBN);
+
+  pthread_mutex_lock(&g_allocLock);
+  if (g_geo.dbnBitmap == 0) {
+    for (i32 i = 0; i < num; ++i) bfsPushFreeListBlock(dbn + i);
+    pthread_mutex_unlock(&g_allocLock);
+    return 0;
+  }
+
+  for (i32 d = dbn; d < dbn + num; ) {
+    i32 n = 0;                              // blocks no other file holds
+    while (d + n < dbn + num && (g_refs == NULL || g_refs[d + n] == 0)) ++n;
+    if (n == 0) {                           // still shared
+      bfsSetRef(d, g_refs[d] - 1);
+      ++d;
+      continue;
+    }
+    csumClear(d, n);
+    if (jnlDefer(d, n)) {
+      bfsHoldRun(d, n);
+    } else {
+      bfsClearRun(d, n);
+    }
+    d += n;
+  }
+  pthread_mutex_unlock(&g_allocLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Free 'state', made by bfsNewState, and every table it holds.  Its
+// background threads must be stopped - see bfsInitFree, bfsInitReadAhead
+// ============================================================================
+i32 bfsFreeState(BfsState* state) {
+  if (state == NULL)                          FATAL(ENULLPTR);
+  if (state->raAsync || state->freeAsync)     FATAL(EBADVOLUME);
+
+  for (i32 i = 0; i < state->numInodeLocks; ++i) {
+    pthread_rwlock_destroy(&state->inodeLocks[i]);
+  }
+  free(state->inodeLocks);
+  free(state->inodes);
+  free(state->inodesDirty);
+  free(state->bitmap);
+  free(state->bitmapHeld);
+  free(state->refs);
+  free(state->refsDirty);
+  free(state->dir);
+  free(state->dirHash);
+  for (i32 i = 0; i < state->delayNum; ++i) free(state->delay[i].data);
+  free(state->delay);
+  free(state->freeQueue);
+
+  pthread_mutex_destroy(&state->inodesLock);
+  pthread_mutex_destroy(&state->allocLock);
+  pthread_rwlock_destroy(&state->dirLock);
+  pthread_mutex_destroy(&state->oftLock);
+  pthread_mutex_destroy(&state->raLock);
+  pthread_cond_destroy(&state->raCond);
+  pthread_mutex_destroy(&state->freeLock);
+  pthread_cond_destroy(&state->freeCond);
+  free(state);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Wait until the free thread has freed every tree queued so far, and
+// committed.  Return 0
+// ============================================================================
+i32 bfsFreeWait() {
+  pthread_mutex_lock(&g_freeLock);
+  while (g_freeAsync && (g_freeCount > 0 || g_freeBusy)) {
+    pthread_cond_wait(&g_freeCond, &g_freeLock);
+  }
+  pthread_mutex_unlock(&g_freeLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return the Inode flags of file 'inum': INODECOMPRESS, or 0
+// ============================================================================
+i32 bfsGetFlags(i32 inum) {
+  Inode inode;
+  bfsReadInode(inum, &inode);
+  return inode.flags;
+}
+
+
+
+// ============================================================================
+// Return entry 'i' of the DBN array in 'block' (eg: an indirect block),
+// stored as i16 or i32 according to the mounted geometry
+// ============================================================================
+i32 bfsGetPtr(void* block, i32 i) {
+  if (g_geo.bytesPerPtr == sizeof(i16)) return ((i16*)block)[i];
+  return ((i32*)block)[i];
+}
+
+
+// ============================================================================
+// Write the initial free-space bitmap: the metadata blocks, and the bits
+// past the end of the disk, are marked in use.  Only the bitmap blocks are
+// written; the data blocks are left as they are
+// ============================================================================
+i32 bfsInitBitmap() {
+  i8*  buf = malloc(BLOCKSIZE);
+  if (buf == NULL) FATAL(ENOMEM);
+  u64* map = (u64*)buf;
+  i32 bitsPerBlock = BLOCKSIZE * 8;
+
+  for (i32 b = 0; b < g_geo.numBitmapBlocks; ++b) {
+    memset(buf, 0, BLOCKSIZE);
+    for (i32 i = 0; i < bitsPerBlock; ++i) {
+      i32 dbn = b * bitsPerBlock + i;
+      if (dbn < g_geo.numMeta || dbn >= g_geo.numBlocks) {
+        map[i / 64] |= (u64)1 << (i % 64);
+      }
+    }
+    bioWrite(g_geo.dbnBitmap + b, buf);
+  }
+
+  free(buf);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write the initial Directory blocks, of all zeroes
+// ============================================================================
+i32 bfsInitDir(FILE* fp) {
+  if (fp == NULL) FATAL(ENULLPTR);
+  i8* buf = calloc(1, BLOCKSIZE);
+  if (buf == NULL) FATAL(ENOMEM);
+  for (i32 b = 0; b < g_geo.numDirBlocks; ++b) bioWrite(g_geo.dbnDir + b, buf);
+  free(buf);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write the initial Inode table blocks, of all zeroes
+// ============================================================================
+i32 bfsInitInodes(FILE* fp) {
+  if (fp == NULL) FATAL(ENULLPTR);
+  i8* buf = calloc(1, BLOCKSIZE);
+  if (buf == NULL) FATAL(ENOMEM);
+  for (i32 b = 0; b < g_geo.numInodeBlocks; ++b) {
+    bioWrite(g_geo.dbnInodes + b, buf);
+  }
+  free(buf);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Initialize the Open File Table: every slot free, with slot 0 on top of the
+// free stack
+// ============================================================================
+i32 bfsInitOFT() {
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
+    g_oft[i].inum = -1;
+    g_oft[i].curs = 0;
+    g_oft[i].xlateLen = 0;
+    g_oft[i].raLast = -1;
+    g_oft[i].raWindow = 0;
+    g_oft[i].raEnd = 0;
+    pthread_mutex_init(&g_oft[i].lock, NULL);
+    g_oftFree[i] = NUMOFTENTRIES - 1 - i;
+  }
+  g_oftNumFree = NUMOFTENTRIES;
+  return 0;
+}
+
+
+// ============================================================================
+// Turn delayed allocation on, holding back up to 'maxBlocks' appended blocks
+// per file, for a disk with 'numInodes' files.  A 'maxBlocks' of 0 turns it
+// off.  Any blocks held from before are dropped: flush them first
+// ============================================================================
+i32 bfsInitDelay(i32 maxBlocks, i32 numInodes) {
+  for (i32 i = 0; i < g_delayNum; ++i) free(g_delay[i].data);
+  free(g_delay);
+
+  g_delay    = calloc(numInodes, sizeof(Delay));
+  g_delayNum = numInodes;
+  if (g_delay == NULL) FATAL(ENOMEM);
+  g_delayMax = (maxBlocks > 0) ? maxBlocks : 0;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Start the free thread, which frees the indirect trees of files cut to
+// nothing.  See bfsFreeLater.  Return 0
+// ============================================================================
+i32 bfsInitFree() {
+  bfsStopFree();
+
+  g_freeStop  = 0;
+  g_freeCount = 0;
+  if (volSpawn(&g_freeThread, bfsFreeThread, NULL) != 0) {
+    FATAL(ENOMEM);
+  }
+  pthread_mutex_lock(&g_freeLock);
+  g_freeAsync = 1;
+  pthread_mutex_unlock(&g_freeLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Turn readahead on, with a window of up to 'maxBlocks' blocks per open file.
+// If 'async' is 1, start the thread that fetches them.  A 'maxBlocks' of 0
+// turns readahead off
+// ============================================================================
+i32 bfsInitReadAhead(i32 maxBlocks, i32 async) {
+  bfsStopReadAhead();
+
+  g_raMax   = (maxBlocks > 0) ? maxBlocks : 0;
+  g_raStop  = 0;
+  g_raHead  = 0;
+  g_raCount = 0;
+  if (g_raMax > 0 && async) {
+    if (volSpawn(&g_raThread, bfsReadAheadThread, NULL) != 0) {
+      FATAL(ENOMEM);
+    }
+    g_raAsync = 1;
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write the initial reference counts, of all zeroes: no block is shared
+// ============================================================================
+i32 bfsInitRefs() {
+  i8* buf = calloc(1, BLOCKSIZE);
+  if (buf == NULL) FATAL(ENOMEM);
+  for (i32 b = 0; b < g_geo.numRefBlocks; ++b) bioWrite(g_geo.dbnRefs + b, buf);
+  free(buf);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write the initial Super block into DBN 0, recording the geometry
+// ============================================================================
+i32 bfsInitSuper(FILE* fp) {
+
+  if (fp == NULL) FATAL(ENULLPTR);
+
+  Super sb = {0};
+  sb.firstFree     = 0;                   // no Freelist: see the bitmap
+  sb.version       = FSVERSION;           // eg: 8
+  sb.bytesPerBlock = g_geo.bytesPerBlock; // eg: 512
+  sb.blocksPerDisk = g_geo.numBlocks;     // eg: 100
+  sb.inodesPerDisk = g_geo.numInodes;     // eg: 8
+  sb.journalBlocks = g_geo.numJournalBlocks; // eg: 8
+
+  i8* buf = calloc(1, BLOCKSIZE);
+  if (buf == NULL) FATAL(ENOMEM);
+  memcpy(buf, &sb, sizeof(Super));
+
+  i32 ret = bioWrite(DBNSUPER, buf);
+  free(buf);
+  return ret;
+}
+
+
+
+// ============================================================================
+// Return 1 if block 'dbn' is metadata, or in use by a file; 0 if it is free.
+// A disk with a Freelist says 1 for every block
+// ============================================================================
+i32 bfsInUse(i32 dbn) {
+
+  if (dbn < 0)                 FATAL(EBADDBN);
+  if (dbn >= g_geo.numBlocks)  FATAL(EBADDBN);
+
+  if (dbn < g_geo.numMeta || g_geo.dbnBitmap == 0) return 1;
+  pthread_mutex_lock(&g_allocLock);
+  i32 used = (g_bitmap[dbn / 64] >> (dbn % 64)) & 1;
+  pthread_mutex_unlock(&g_allocLock);
+  return used;
+}
+
+
+
+// ============================================================================
+// Work out, in 'geo', where each metadata region lives on a disk of format
+// 'version' with the given block size, # of blocks and # of Inodes.  Versions
+// 0 and 1 have the fixed layout of DBNSUPER, DBNINODES, DBNDIR and DBNBITMAP.
+// Later versions lay out the Inode table, then the Directory, then the
+// bitmap, each as many blocks as it needs.  From version 7 the reference
+// counts follow, a u16 per DBN.  From version 8 every disk, and from
+// version 6 a disk with a journal, has the checksum table next, a u32 per
+// DBN: see csum.c.  From version 4 the
+// journal, of 'journalBlocks' blocks, comes last: 0 => none.
+// On success, return 0.  If the geometry is not valid, return EBADGEOM
+// ============================================================================
+i32 bfsLayout(Geo* geo, i32 version, i32 bytesPerBlock, i32 numBlocks,
+              i32 numInodes, i32 journalBlocks) {
+
+  if (geo == NULL) FATAL(ENULLPTR);
+
+  if (bytesPerBlock < MINBLOCKSIZE)            return EBADGEOM;
+  if (bytesPerBlock > MAXBLOCKSIZE)            return EBADGEOM;
+  if (bytesPerBlock & (bytesPerBlock - 1))     return EBADGEOM;  // power of 2
+  if (numInodes < 1)                           return EBADGEOM;
+  if (journalBlocks < 0)                       return EBADGEOM;
+  if (journalBlocks > 0 && journalBlocks < JNLMINBLOCKS) return EBADGEOM;
+
+  memset(geo, 0, sizeof(Geo));
+  geo->version       = version;
+  geo->bytesPerBlock = bytesPerBlock;
+  geo->numBlocks     = numBlocks;
+  geo->numInodes     = numInodes;
+
+  if (version < 2) {
+    if (bytesPerBlock != BYTESPERBLOCK) return EBADGEOM;
+    if (numInodes * sizeof(InodeV1) > BYTESPERBLOCK) return EBADGEOM;
+    geo->dbnInodes       = DBNINODES;
+    geo->numInodeBlocks  = 1;
+    geo->inodesPerBlock  = numInodes;
+    geo->dbnDir          = DBNDIR;
+    geo->numDirBlocks    = 1;
+    geo->dbnBitmap       = (version == 1) ? DBNBITMAP : 0;
+    geo->numBitmapBlocks = (version == 1) ? 1 : 0;
+    geo->numMeta         = (version == 1) ? NUMMETA : DBNDIR + 1;
+    geo->bytesPerPtr     = sizeof(i16);
+  } else {
+    i32 bitsPerBlock     = bytesPerBlock * 8;
+    geo->inodesPerBlock  = bytesPerBlock / ((version == 2) ? sizeof(InodeV2)
+                                          : (version < 5)  ? sizeof(InodeV3)
+                                                           : sizeof(Inode));
+    geo->dbnInodes       = DBNSUPER + 1;
+    geo->numInodeBlocks  = (numInodes + geo->inodesPerBlock - 1)
+                         / geo->inodesPerBlock;
+    geo->dbnDir          = geo->dbnInodes + geo->numInodeBlocks;
+    geo->numDirBlocks    = (numInodes * FNAMESIZE + bytesPerBlock - 1)
+                         / bytesPerBlock;
+    geo->dbnBitmap       = geo->dbnDir + geo->numDirBlocks;
+    geo->numBitmapBlocks = (numBlocks + bitsPerBlock - 1) / bitsPerBlock;
+    geo->dbnJournal      = geo->dbnBitmap + geo->numBitmapBlocks;
+    if (version >= 7) {
+      geo->dbnRefs       = geo->dbnJournal;
+      geo->numRefBlocks  = ((i64)numBlocks * sizeof(u16) + bytesPerBlock - 1)
+                         / bytesPerBlock;
+      geo->dbnJournal   += geo->numRefBlocks;
+    }
+    if (version >= 8 || (version >= 6 && journalBlocks > 0)) {
+      geo->dbnCsum       = geo->dbnJournal;
+      geo->numCsumBlocks = ((i64)numBlocks * sizeof(u32) + bytesPerBlock - 1)
+                         / bytesPerBlock;
+      geo->dbnJournal   += geo->numCsumBlocks;
+    }
+    if (version >= 4) geo->numJournalBlocks = journalBlocks;
+    geo->numMeta         = geo->dbnJournal + geo->numJournalBlocks;
+    geo->bytesPerPtr     = sizeof(i32);
+  }
+
+  geo->ptrsPerBlock = bytesPerBlock / geo->bytesPerPtr;
+
+  // From version 3 the double-indirect table bounds a file, as does the
+  // i32 file size
+
+  i64 maxBlocks = (version < 3) ? NUMDIRECT + geo->ptrsPerBlock
+                                : (i64)geo->ptrsPerBlock * geo->ptrsPerBlock;
+  if (maxBlocks > INT32_MAX / bytesPerBlock) {
+    maxBlocks = INT32_MAX / bytesPerBlock;
+  }
+  geo->maxFbn = maxBlocks - 1;
+
+  if (numBlocks <= geo->numMeta) return EBADGEOM;   // no room for data
+  return 0;
+}
+
+
+
+// ============================================================================
+// Load the free-space bitmap of the mounted disk into memory, along with the
+// reference counts.  For disks formatted before FSVERSION 1 there is no
+// bitmap, and before FSVERSION 7 no reference counts
+// ============================================================================
+i32 bfsLoadBitmap() {
+  free(g_bitmap);
+  free(g_bitmapHeld);
+  free(g_refs);
+  free(g_refsDirty);
+  g_bitmap      = NULL;
+  g_bitmapHeld  = NULL;
+  g_bitmapWords = 0;
+  g_bitmapDirty = 0;
+  g_bitmapNext  = 0;
+  g_refs        = NULL;
+  g_refsDirty   = NULL;
+  g_refsShared  = 0;
+
+  if (g_geo.dbnBitmap == 0) return 0;
+
+  g_bitmapWords = g_geo.numBitmapBlocks * (BLOCKSIZE / sizeof(u64));
+  g_bitmap     = malloc(g_bitmapWords * sizeof(u64));
+  g_bitmapHeld = calloc(g_bitmapWords, sizeof(u64));
+  if (g_bitmap == NULL || g_bitmapHeld == NULL) FATAL(ENOMEM);
+
+  for (i32 b = 0; b < g_geo.numBitmapBlocks; ++b) {
+    cacheRead(g_geo.dbnBitmap + b, (i8*)g_bitmap + b * BLOCKSIZE);
+  }
+
+  if (g_geo.dbnRefs == 0) return 0;
+
+  g_refs      = malloc((size_t)g_geo.numRefBlocks * BLOCKSIZE);
+  g_refsDirty = calloc(g_geo.numRefBlocks, sizeof(u8));
+  if (g_refs == NULL || g_refsDirty == NULL) FATAL(ENOMEM);
+
+  for (i32 b = 0; b < g_geo.numRefBlocks; ++b) {
+    cacheRead(g_geo.dbnRefs + b, (i8*)g_refs + (size_t)b * BLOCKSIZE);
+  }
+  for (i32 dbn = 0; dbn < g_geo.numBlocks; ++dbn) {
+    if (g_refs[dbn] != 0) ++g_refsShared;
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Load the Directory of the mounted disk into memory, and build its hash
+// index: one hash slot for each used Directory slot, at least, and never
+// more than half full
+// ============================================================================
+i32 bfsLoadDir() {
+  free(g_dir);
+  free(g_dirHash);
+
+  i32 numHash = 2;
+  while (numHash < 2 * g_geo.numInodes) numHash *= 2;
+
+  g_dir         = malloc(g_geo.numDirBlocks * BLOCKSIZE);
+  g_dirHash     = calloc(numHash, sizeof(i32));
+  g_dirHashMask = numHash - 1;
+  g_dirTombs    = 0;
+  g_dirFree     = 0;
+  if (g_dir == NULL || g_dirHash == NULL) FATAL(ENOMEM);
+
+  for (i32 b = 0; b < g_geo.numDirBlocks; ++b) {
+    cacheRead(g_geo.dbnDir + b, g_dir + b * BLOCKSIZE);
+  }
+
+  for (i32 inum = 0; inum <= MAXINUM; ++inum) {
+    if (g_dir[inum * FNAMESIZE] != 0) bfsDirIndex(inum);
+  }
+  return 0;
+}
+
+
+
 // ============================================================================
-// Allocate a free disk block for the file whose Inode number is 'inum' and
-// assign it to FBN 'fbn' in the file's Inode.  On success, return the DBN
-// allocated.  On failure, abort
+// Read the SuperBlock of the disk just opened by bioOpen, and make its
+// geometry the mounted geometry.  On success, return 0.  On failure, abort
 // ============================================================================
-i32 bfsAllocBlock(i32 inum, i32 fbn) {
+i32 bfsLoadGeometry() {
+  i8 buf[MINBLOCKSIZE] = {0};
+  bioRead(DBNSUPER, buf);                   // bio block size is still 512
+  Super* super = (Super*)buf;
+
+  Geo geo;
+  i32 ret;
+  if (super->version < 2) {
+    ret = bfsLayout(&geo, super->version, BYTESPERBLOCK, super->numBlocks,
+                    super->numInodes, 0);
+  } else {
+    i32 journalBlocks = (super->version >= 4) ? super->journalBlocks : 0;
+    ret = bfsLayout(&geo, super->version, super->bytesPerBlock,
+                    super->blocksPerDisk, super->inodesPerDisk, journalBlocks);
+  }
+  if (ret != 0) FATAL(ret);
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (fbn  < 0)       FATAL(EBADFBN);
-  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+  return bfsSetGeometry(&geo);
+}
 
-  // Grab the next free block in the BFS disk
 
-  i32 dbn = bfsFindFreeBlock();
 
-  // Update the corresponding Inode, or IndirectBlock
-
-  i8 buf8[BYTESPERBLOCK] = {0};           // 1-block buffer
-  bioRead(DBNINODES, buf8);
- 
-  Inode* pinodes = (Inode*)buf8;          // array of Inodes
-  Inode* pinode  = &pinodes[inum];        // target Inode
-
-  if (fbn < NUMDIRECT) {                  // in direct[] array?
-    pinode->direct[fbn] = dbn;
-    bioWrite(DBNINODES, buf8);
-    return dbn;
-  } else {                                // in indirect block?
-    i16 buf16[I16SPERBLOCK]= {0};
-    i32 dbnIndirect = pinode->indirect;   // DBN of indirect block
-
-    if (dbnIndirect == 0) {               // not yet allocated
-      dbnIndirect = bfsFindFreeBlock();
-      pinode->indirect = dbnIndirect;
+// ============================================================================
+// Load the Inode table into memory.  If 'writeThrough' is 1, each later
+// bfsWriteInode also updates the Inode table on disk; if 0, updates are
+// batched until bfsSyncInodes
+// ============================================================================
+i32 bfsLoadInodes(i32 writeThrough) {
+  free(g_inodes);
+  free(g_inodesDirty);
+  g_inodes      = malloc(g_geo.numInodes * sizeof(Inode));
+  g_inodesDirty = calloc(g_geo.numInodeBlocks, sizeof(u8));
+  if (g_inodes == NULL || g_inodesDirty == NULL) FATAL(ENOMEM);
+
+  i8* buf = malloc(BLOCKSIZE);
+  if (buf == NULL) FATAL(ENOMEM);
+  for (i32 inum = 0; inum < g_geo.numInodes; ++inum) {
+    i32 slot = inum % g_geo.inodesPerBlock;
+    if (slot == 0) {
+      cacheRead(g_geo.dbnInodes + inum / g_geo.inodesPerBlock, buf);
     }
 
-    bioRead(dbnIndirect, buf16);
-    buf16[fbn - NUMDIRECT] = dbn;
-    bioWrite(dbnIndirect, buf16);
-    bioWrite(DBNINODES, buf8);
+    if (g_geo.version < 2) {                // widen 16-bit DBNs
+      InodeV1* old = &((InodeV1*)buf)[slot];
+      i32 direct[NUMDIRECT];
+      for (i32 d = 0; d < NUMDIRECT; ++d) direct[d] = old->direct[d];
+      bfsFromDirect(&g_inodes[inum], old->size, direct, old->indirect);
+    } else if (g_geo.version == 2) {
+      InodeV2* old = &((InodeV2*)buf)[slot];
+      bfsFromDirect(&g_inodes[inum], old->size, old->direct, old->indirect);
+    } else if (g_geo.version < 5) {         // no flags
+      memset(&g_inodes[inum], 0, sizeof(Inode));
+      memcpy(&g_inodes[inum], &((InodeV3*)buf)[slot], sizeof(InodeV3));
+    } else {
+      memcpy(&g_inodes[inum], &((Inode*)buf)[slot], sizeof(Inode));
+    }
   }
+  free(buf);
 
-  return dbn;                             // allocated DBN
+  for (i32 i = 0; i < g_numInodeLocks; ++i) {
+    pthread_rwlock_destroy(&g_inodeLocks[i]);
+  }
+  free(g_inodeLocks);
+  g_inodeLocks = malloc(g_geo.numInodes * sizeof(pthread_rwlock_t));
+  if (g_inodeLocks == NULL) FATAL(ENOMEM);
+  g_numInodeLocks = g_geo.numInodes;
+  for (i32 i = 0; i < g_numInodeLocks; ++i) {
+    pthread_rwlock_init(&g_inodeLocks[i], NULL);
+  }
 
+  g_inodesWriteThrough = writeThrough;
+  return 0;
 }
 
 
 
 // ============================================================================
-// Create file 'fname'.  Find a free inum; ie, free slot in the Directory.
-// Leave the size of the file as zero, until the user performs a write, or a
-// seek into the file.  On success, return the file's inum.  On failure, abort
+// Queue for the free thread the roots listed in DBNSUPER: trees that Inodes
+// dropped in a committed transaction, but that were not freed before a
+// crash.  Called at mount, once the journal is replayed and bfsInitFree has
+// started the thread.  With no journal, there is no list.  Return 0
 // ============================================================================
-i32 bfsCreateFile(str fname) {
+i32 bfsLoadOrphans() {
+  if (g_geo.numJournalBlocks == 0) return 0;
+
+  i8* buf = malloc(BLOCKSIZE);
+  if (buf == NULL) FATAL(ENOMEM);
+  cacheRead(DBNSUPER, buf);
+  i32* list = (i32*)(buf + ORPHANOFF);
+  if (list[0] < 0 || list[0] > MAXORPHANS) FATAL(EBADDBN);
+
+  for (i32 i = 1; i <= list[0]; ++i) {
+    if (list[i] < g_geo.numMeta || list[i] >= g_geo.numBlocks) FATAL(EBADDBN);
+    bfsFreeLater(list[i]);
+  }
+  free(buf);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Lock file 'inum' for reading, shared with other readers, or, if 'write' is
+// 1, for writing, alone.  Held across an fsRead or fsWrite, so that the size
+// and block map do not change under it
+// ============================================================================
+i32 bfsLockInode(i32 inum, i32 write) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+
+  if (write) pthread_rwlock_wrlock(&g_inodeLocks[inum]);
+  else       pthread_rwlock_rdlock(&g_inodeLocks[inum]);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Lookup 'fname' in the Directory.  If found, return its inum.  If not,
+// return EFNF
+// ============================================================================
+i32 bfsLookupFile(str fname) {
 
   if (fname == NULL) FATAL(ENULLPTR);
 
-  if (strlen(fname) > FNAMESIZE - 1) FATAL(EBIGFNAME);  // fname too big
+  i32 found = EFNF;
 
-  i8 buf[BYTESPERBLOCK] = {0};
+  pthread_rwlock_rdlock(&g_dirLock);
+  i32 h = bfsDirFind(fname);
+  if (h >= 0) found = g_dirHash[h] - 1;
+  pthread_rwlock_unlock(&g_dirLock);
 
-  bioRead(DBNDIR, buf);
+  return found;
+
+}
 
-  Dir* dir = (Dir*)buf;
 
-  for (int inum = 0; inum < NUMINODES; ++inum) {        // search Directory
-    if (strlen(dir->fname[inum]) == 0) {                // free slot
-      strcpy(dir->fname[inum], fname);
-      bioWrite(DBNDIR, dir);
-      bfsRefOFT(inum);
-      return inum;
-    }
-  }
 
-  FATAL(EDIRFULL);                                      // Directory full
-  return 0;                                             // pacify compiler
+// ============================================================================
+// Return the DBN that holds FBN 'fbn' of file 'inum', allocating a block for
+// it first if it is not yet mapped
+// ============================================================================
+i32 bfsMapFbn(i32 inum, i32 fbn) {
+  i32 dbn = bfsFbnToDbn(inum, fbn);
+  if (dbn == ENODBN) dbn = bfsAllocBlock(inum, fbn);
+  return dbn;
 }
 
 
 
 // ============================================================================
-// Dereference file with Inode number 'inum' in the Open File Table.  If
-// refcount reaches 0, free up that entry in the OFT
+// Allocate the tables of one volume, empty until it is mounted.  See vol.c
 // ============================================================================
-i32 bfsDerefOFT(i32 inum) {
-  i32 ofte = bfsFindOFTE(inum);
-  --g_oft[ofte].refs;
-  if (g_oft[ofte].refs == 0) {
-    g_oft[ofte].inum = -1;
-    g_oft[ofte].curs = 0;
-  }
-  return 0;
+BfsState* bfsNewState() {
+  BfsState* state = calloc(1, sizeof(BfsState));
+  if (state == NULL) FATAL(ENOMEM);
+  pthread_mutex_init(&state->inodesLock, NULL);
+  pthread_mutex_init(&state->allocLock, NULL);
+  pthread_rwlock_init(&state->dirLock, NULL);
+  pthread_mutex_init(&state->oftLock, NULL);
+  pthread_mutex_init(&state->raLock, NULL);
+  pthread_cond_init(&state->raCond, NULL);
+  pthread_mutex_init(&state->freeLock, NULL);
+  pthread_cond_init(&state->freeCond, NULL);
+  return state;
 }
 
 
 
 // ============================================================================
-// Extend file 'inum' out to FBN 'fbn'
+// Open file 'inum' in a free OFT slot, with its own cursor at 0.  Return the
+// new File Descriptor.  On failure, EOFTFULL
 // ============================================================================
-i32 bfsExtend(i32 inum, i32 fbn) {
-  i32 size = bfsGetSize(inum);
-  i32 fbnLast = (size + 1) / BYTESPERBLOCK;
-  for (i32 f = fbnLast; f <= fbn; ++f) {
-    bfsAllocBlock(inum, f);
+i32 bfsOpenFd(i32 inum) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+
+  pthread_mutex_lock(&g_oftLock);
+  if (g_oftNumFree == 0) {
+    pthread_mutex_unlock(&g_oftLock);
+    FATAL(EOFTFULL);
   }
-  return 0;
+  i32 i = g_oftFree[--g_oftNumFree];
+  pthread_mutex_unlock(&g_oftLock);
+
+  g_oft[i].curs     = 0;
+  g_oft[i].xlateLen = 0;
+  g_oft[i].raLast   = -1;
+  g_oft[i].raWindow = 0;
+  g_oft[i].raEnd    = 0;
+  __atomic_store_n(&g_oft[i].inum, inum, __ATOMIC_RELEASE);
+  return i + FDBASE;
 }
 
 
 
 // ============================================================================
-// Use Inode to find the DBN used to store file block 'fbn'.  Return ENODBN
-// if not yet mapped
+// Read FBN 'fbn' for the file whose inum is 'inum' into 'buf'
 // ============================================================================
-i32 bfsFbnToDbn(i32 inum, i32 fbn) {
+i32 bfsRead(i32 inum, i32 fbn, i8* buf) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
   if (fbn  < 0)       FATAL(EBADFBN);
   if (fbn  > MAXFBN)  FATAL(EBADFBN);
 
-  Inode inode;
-  
-  bfsReadInode(inum, &inode);
+  if (bfsDelayGet(inum, fbn, buf)) return 0;  // held back: not on disk yet
 
-  if (fbn < NUMDIRECT) {            // in direct[] array?
-    i32 dbn = inode.direct[fbn];
-    return (dbn == 0) ? ENODBN : dbn;
+  i32 dbn = bfsFbnToDbn(inum, fbn);
+  if (dbn == ENODBN) {                        // a hole reads as zeroes
+    memset(buf, 0, BLOCKSIZE);
+    return 0;
   }
 
-  // fbn is not in direct, so check indirect block.  If it doesn't exist,
-  // then allocate an empty indirect block.  But return ENODBN for the
-  // caller to handle grabing a new data block.
+  cacheRead(dbn, buf);
+  return 0;
+}
 
-  if (inode.indirect == 0) {      // no indirect block yet allocated
-    i32 dbn = bfsFindFreeBlock();
-    inode.indirect = dbn;
-    bfsWriteInode(inum, &inode);
-    return ENODBN;
+
+// ============================================================================
+// Note that FBNs 'fbnFirst' .. 'fbnLast' were just read on File Descriptor
+// 'fd'.  A read that starts where the last one ended is sequential: the
+// window of blocks kept read ahead then starts at RAMINBLOCKS and doubles on
+// each sequential read, up to the mount's limit.  Any other read closes the
+// window.  Once less than half the window lies ahead of the reader, it is
+// topped up, in the background if the readahead thread is running
+// ============================================================================
+i32 bfsReadAhead(i32 fd, i32 fbnFirst, i32 fbnLast) {
+
+  if (g_raMax == 0) return 0;
+
+  OFTE* ofte   = &g_oft[bfsFdToOFTE(fd)];
+  i32   inum   = ofte->inum;
+  i32   numFbn = (bfsGetSize(inum) + BLOCKSIZE - 1) / BLOCKSIZE;
+  i32   from   = 0;
+  i32   num    = 0;
+
+  pthread_mutex_lock(&ofte->lock);
+  i32 seq = (fbnFirst == ofte->raLast || fbnFirst == ofte->raLast + 1);
+  ofte->raLast = fbnLast;
+
+  if (!seq) {
+    ofte->raWindow = 0;
+    ofte->raEnd    = 0;
+  } else {
+    i32 window = (ofte->raWindow == 0) ? RAMINBLOCKS : 2 * ofte->raWindow;
+    ofte->raWindow = (window < g_raMax) ? window : g_raMax;
+
+    i32 next = fbnLast + 1;
+    if (ofte->raEnd < next) ofte->raEnd = next;
+    if (ofte->raEnd - next <= ofte->raWindow / 2) {
+      from = ofte->raEnd;
+      num  = next + ofte->raWindow - from;
+      if (from + num > numFbn) num = numFbn - from;
+      if (num > 0) ofte->raEnd = from + num;
+    }
   }
+  pthread_mutex_unlock(&ofte->lock);
 
-  // Check the indirect block
+  if (num <= 0) return 0;
 
-  i16 buf[NUMINDIRECT] = {0};
-  bioRead(inode.indirect, buf);
+  if (!g_raAsync) {                     // caller holds the Inode lock
+    bfsPrefetch(inum, from, num);
+    return 0;
+  }
 
-  i32 dbn = buf[fbn - NUMDIRECT];
-  return (dbn == 0) ? ENODBN : dbn;
+  pthread_mutex_lock(&g_raLock);
+  if (g_raCount < RAQUEUESIZE) {        // full => drop: it is only a hint
+    RaReq* req = &g_raQueue[(g_raHead + g_raCount) % RAQUEUESIZE];
+    req->inum = inum;
+    req->fbn  = from;
+    req->num  = num;
+    ++g_raCount;
+    pthread_cond_signal(&g_raCond);
+  }
+  pthread_mutex_unlock(&g_raLock);
+  return 0;
 }
 
 
 
 // ============================================================================
-// Convert FileDescriptor (user-visible) to Inum (internal)
+// Read cluster 'c' of compressed file 'inum' into 'buf', which has room for
+// CLUSTERBLOCKS blocks: with one cacheReadv, then decoded if it was stored
+// compressed.  A hole reads as zeroes.  The caller holds the file's Inode
+// lock.  Return 0
 // ============================================================================
-i32 bfsFdToInum(i32 fd) { 
-  i32 inum = fd - INUMTOFD; 
-  if (inum < 0) FATAL(EBADINUM);
-  return inum;
-}
-
+i32 bfsReadCluster(i32 inum, i32 c, i8* buf) {
 
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (c < 0)          FATAL(EBADFBN);
+  if (buf == NULL)    FATAL(ENULLPTR);
+
+  i32 bytes = CLUSTERBLOCKS * BLOCKSIZE;
+  i32 dbns[CLUSTERBLOCKS];
+  i32 num = bfsClusterMap(inum, c, dbns);
+  if (num == 0) {                             // a hole
+    memset(buf, 0, bytes);
+    return 0;
+  }
 
+  i8* raw = (num == CLUSTERBLOCKS) ? buf : malloc(num * BLOCKSIZE);
+  if (raw == NULL) FATAL(ENOMEM);
 
-// ============================================================================
-// Find 'inum' in the Open File Table (OFT).  If not found, create an entry.
-// Return the index within the OFT.  On failure, EOFTFULL
-// ============================================================================
-i32 bfsFindOFTE(i32 inum) {
-  for (int i = 0; i < NUMOFTENTRIES; ++i) {
-    if (g_oft[i].inum == inum) return i;
+  BioVec vec[CLUSTERBLOCKS];
+  for (i32 i = 0; i < num; ++i) {
+    vec[i].dbn = dbns[i];
+    vec[i].buf = raw + i * BLOCKSIZE;
   }
-  
-  // Not found, so look for an empty OFTE
-
-  for (int i = 0; i < NUMOFTENTRIES; ++i) {
-    if (g_oft[i].inum == -1) {
-      g_oft[i].inum = inum;
-      g_oft[i].curs = 0;
-      g_oft[i].refs = 1;
-      return i;
-    }
+  cacheReadv(vec, num);
+  if (raw == buf) return 0;                   // stored as is
+
+  ClusterHeader* h = (ClusterHeader*)raw;
+  if (h->magic != CLUSTERMAGIC ||
+      h->numb < 0 || h->numb > num * BLOCKSIZE - (i32)sizeof(ClusterHeader) ||
+      compDecode(h + 1, h->numb, buf, bytes) != 0) {
+    FATAL(EBADCOMP);
   }
-  FATAL(EOFTFULL);      // no-return
-  return 0;             // pacify compiler
+  free(raw);
+  return 0;
 }
 
 
 
 // ============================================================================
-// Allocate the next free block from the Freelist.  Adjust Freelist
-// accordingly.  On success, return DBN.  FATAL otherwise
+// Return, in 'inode', the Inode whose number is 'inum', from the in-memory
+// Inode table.  On success, return 0.  On failure, abort
 // ============================================================================
-i32 bfsFindFreeBlock() {
-  i8 buf8[BYTESPERBLOCK] = {0};
-  bioRead(DBNSUPER, buf8);
-  Super* super = (Super*)buf8;
+i32 bfsReadInode(i32 inum, Inode* inode) {
 
-  i32 dbn = super->firstFree;
-  if (dbn == 0) FATAL(EDISKFULL);
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (inode == NULL)  FATAL(ENULLPTR);
 
-  i16 buf16[I16SPERBLOCK] = {0};      // for next free block
-  bioRead(dbn, buf16);
+  pthread_mutex_lock(&g_inodesLock);
+  memcpy(inode, &g_inodes[inum], sizeof(Inode));
+  pthread_mutex_unlock(&g_inodesLock);
+  return 0;
+}
 
-  super->firstFree = buf16[0];        // new head of Freelist
 
-  bioWrite(DBNSUPER, buf8);           // update SuperBlock
 
-  return dbn;
+// ============================================================================
+// Make the 'num' blocks from DBN 'dbn' on free for reuse.  Called by the
+// journal for the blocks it kept back - see jnlForget and jnlDefer - once no
+// crash can bring back the metadata that used them.  Return 0
+// ============================================================================
+i32 bfsReleaseRun(i32 dbn, i32 num) {
+  pthread_mutex_lock(&g_allocLock);
+  for (i32 d = dbn; d < dbn + num; ++d) {
+    g_bitmapHeld[d / 64] &= ~((u64)1 << (d % 64));
+  }
+  bfsClearRun(dbn, num);
+  csumClear(dbn, num);
+  pthread_mutex_unlock(&g_allocLock);
+  return 0;
 }
 
 
+
 // ============================================================================
-// Initialize the Freelist
+// Give each mapped FBN of file 'inum' from 'fbnFirst' to 'fbnLast' whose
+// block must not be overwritten in place a new DBN of its own: a block
+// shared with another file, so that a write there leaves the other file as
+// it was, or one whose checksum is sealed, so that the committed metadata
+// keeps mapping what it checks - see csum.c.  The new blocks are not
+// written: the caller writes every one of them whole.  The old are released
+// with bfsFreeDbns, which just drops one from the count of a block still
+// shared, and holds the rest until the write commits.  The caller holds the
+// file's Inode lock for writing.  Return the # of FBNs moved
 // ============================================================================
-i32 bfsInitFreeList() {
-  i16 buf[I16SPERBLOCK] = {0};
-  i32 ret = 0;
+i32 bfsRelocate(i32 inum, i32 fbnFirst, i32 fbnLast) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
 
-  for (int dbn = NUMMETA; dbn < BLOCKSPERDISK - 1; ++dbn) {
-    buf[0] = dbn + 1;
-    bioWrite(dbn, (i8*)buf);
+  if (g_geo.numCsumBlocks == 0 &&
+      __atomic_load_n(&g_refsShared, __ATOMIC_RELAXED) == 0) return 0;
+  if (fbnFirst > fbnLast) return 0;
+
+  Inode inode;
+  bfsReadInode(inum, &inode);
+  Walk walk = { { 0, 0, NULL }, { 0, 0, NULL } };
+
+  i32  cap  = fbnLast - fbnFirst + 1;
+  i32* fbns = malloc(cap * sizeof(i32));
+  i32* old  = malloc(cap * sizeof(i32));
+  if (fbns == NULL || old == NULL) FATAL(ENOMEM);
+
+  i32 num = 0;
+  for (i32 fbn = fbnFirst; fbn <= fbnLast; ++fbn) {
+    i32 dbn = bfsExtentDbn(&inode, fbn);
+    if (dbn == 0) dbn = bfsWalkGet(&inode, &walk, fbn);
+    if (dbn == 0 || (bfsGetRef(dbn) == 0 && !csumSealed(dbn))) continue;
+    fbns[num] = fbn;
+    old[num]  = dbn;
+    ++num;
   }
 
-  buf[0] = 0;
-  bioWrite(BLOCKSPERDISK - 1, (i8*)buf);      // end of Freelist
+  if (num > 0) {
+    i32* dbns = malloc(num * sizeof(i32));
+    if (dbns == NULL) FATAL(ENOMEM);
+    bfsFindFreeBlocks(num, dbns);
+    for (i32 i = 0; i < num; ++i) bfsRemapFbn(&inode, &walk, fbns[i], dbns[i]);
+    bfsWalkDone(&walk);
+    bfsWriteInode(inum, &inode);
+    bfsFreeDbns(old, num);
+    free(dbns);
+  }
+  bfsWalkDone(&walk);
 
-  return ret;
+  free(fbns);
+  free(old);
+  return num;
 }
 
 
 
 // ============================================================================
-// Write the initial Dir block, of all zeroes, into DBN 2
+// Return the first FBN of file 'inum', from 'fbn' on, that holds data - it
+// has a DBN, or is held back - if 'data' is 1; or that is a hole, if 'data'
+// is 0.  If there is none, return the first FBN past the end of the file.
+// An extent, a held run, or the FBNs of an inner indirect block never
+// allocated, is stepped over at once.  The caller holds the file's Inode
+// lock
 // ============================================================================
-i32 bfsInitDir(FILE* fp) {
-  if (fp == NULL) FATAL(ENULLPTR);
-  i8 buf[BYTESPERBLOCK] = {0};
-  return bioWrite(DBNDIR, buf);
-}
+i32 bfsSeekData(i32 inum, i32 fbn, i32 data) {
 
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (fbn  < 0)       FATAL(EBADFBN);
 
+  Inode inode;
+  bfsReadInode(inum, &inode);
 
-// ============================================================================
-// Write the initial Inodes block, of all zeroes, into DBN 1
-// ============================================================================
-i32 bfsInitInodes(FILE* fp) {
-  if (fp == NULL) FATAL(ENULLPTR);
-  i8 buf[BYTESPERBLOCK] = {0};
-  return bioWrite(DBNINODES, buf);
+  Walk walk = { { 0, 0, NULL }, { 0, 0, NULL } };
+  i32  ret  = bfsSeekWalk(inum, &inode, &walk, fbn, data);
+  bfsWalkDone(&walk);
+  return ret;
 }
 
 
 
 // ============================================================================
-// Initialize the Open File Table to all zeroes
+// Set cursor position for the file open on File Descriptor 'fd' to 'newCurs'
 // ============================================================================
-i32 bfsInitOFT() {
-  for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
-    g_oft[i].inum = -1;
-    g_oft[i].curs = 0;
-    g_oft[i].refs = 0;
-  }
+i32 bfsSetCursor(i32 fd, i32 newCurs) {
+
+  if (newCurs < 0) FATAL(EBADCURS);
+
+  OFTE* ofte = &g_oft[bfsFdToOFTE(fd)];
+  pthread_mutex_lock(&ofte->lock);
+  ofte->curs = newCurs;
+  pthread_mutex_unlock(&ofte->lock);
   return 0;
 }
 
 
+
 // ============================================================================
-// Write the initial Super block into DBN 0
+// Set the Inode flags of file 'inum' to 'flags'.  Return 0
 // ============================================================================
-i32 bfsInitSuper(FILE* fp) {
+i32 bfsSetFlags(i32 inum, i32 flags) {
 
-  if (fp == NULL) FATAL(ENULLPTR);
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+
+  Inode inode;
+  bfsReadInode(inum, &inode);
+  inode.flags = flags;
+  bfsWriteInode(inum, &inode);
+  return 0;
+}
 
-  Super sb;
-  sb.numBlocks = BLOCKSPERDISK;           // eg: 100
-  sb.numInodes = NUMINODES;               // eg: 8
-  sb.firstFree = NUMMETA;                 // eg: 3
 
-  i8 buf[BYTESPERBLOCK] = {0};
-  memcpy(buf, &sb, sizeof(Super));
 
-  return bioWrite(DBNSUPER, buf);
+// ============================================================================
+// Make 'geo' the geometry of the open disk, for bfs and bio
+// ============================================================================
+i32 bfsSetGeometry(Geo* geo) {
+  if (geo == NULL) FATAL(ENULLPTR);
+  g_geo = *geo;
+  return bioSetGeometry(geo->bytesPerBlock, geo->numBlocks);
 }
 
 
 
 // ============================================================================
-// Convert between inum (internal) and FileDescriptor (user-visible)
+// Set entry 'i' of the DBN array in 'block' to 'dbn'.  See bfsGetPtr
 // ============================================================================
-i32 bfsInumToFd(i32 inum) { return inum + INUMTOFD; }
+i32 bfsSetPtr(void* block, i32 i, i32 dbn) {
+  if (g_geo.bytesPerPtr == sizeof(i16)) ((i16*)block)[i] = dbn;
+  else                                  ((i32*)block)[i] = dbn;
+  return 0;
+}
+
 
 
 // ============================================================================
-// Lookup 'fname' in the Directory.  If found, return its inum.  If not,
-// return EFNF
+// Return the cursor position for the file open on File Descriptor 'fd'
 // ============================================================================
-i32 bfsLookupFile(str fname) {
-
-  if (fname == NULL) FATAL(ENULLPTR);
+i32 bfsTell(i32 fd) {
+  OFTE* ofte = &g_oft[bfsFdToOFTE(fd)];
+  pthread_mutex_lock(&ofte->lock);
+  i32 curs = ofte->curs;
+  pthread_mutex_unlock(&ofte->lock);
+  return curs;
+}
 
-  i8 buf[BYTESPERBLOCK] = {0};
 
-  bioRead(DBNDIR, buf);
 
-  Dir* dir = (Dir*)buf;
+// ============================================================================
+// Return the size of the file whose Inode number is 'inum'
+// ============================================================================
+i32 bfsGetSize(i32 inum) {
 
-  for (int inum = 0; inum < NUMINODES; ++inum) {
-    if (strcmp(fname, dir->fname[inum]) == 0) {
-      bfsRefOFT(inum);
-      return inum;
-    }
-  }
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
 
-  return EFNF;
+  Inode inode;
+  bfsReadInode(inum, &inode);
 
+  return inode.size;
 }
 
 
 
 // ============================================================================
-// Read FBN 'fbn' for the file whose inum is 'inum' into 'buf'
+// Set size of file 'inum' to 'size
 // ============================================================================
-i32 bfsRead(i32 inum, i32 fbn, i8* buf) {
+i32 bfsSetSize(i32 inum, i32 size) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
-  if (fbn  < 0)       FATAL(EBADFBN);
-  if (fbn  > MAXFBN)  FATAL(EBADFBN);
-
-  i32 dbn = bfsFbnToDbn(inum, fbn);
 
-  bioRead(dbn, buf);
+  Inode inode;
+  bfsReadInode(inum, &inode);
+  
+  inode.size = size;
+  bfsWriteInode(inum, &inode);
   return 0;
 }
 
 
+
 // ============================================================================
-// Read the Inodes block.  Extract and return the Inode whose number is 'inum'.
-// On success, return 0.  On failure, abort
+// Stop the free thread, once it has freed every tree queued.  From then on,
+// trees are freed at once.  Return 0
 // ============================================================================
-i32 bfsReadInode(i32 inum, Inode* inode) {
-
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (inode == NULL)  FATAL(ENULLPTR);
-
-  i8 buf[BYTESPERBLOCK] = {0};
+i32 bfsStopFree() {
+  pthread_mutex_lock(&g_freeLock);
+  i32 async = g_freeAsync;
+  g_freeAsync = 0;
+  g_freeStop  = 1;
+  pthread_cond_signal(&g_freeCond);
+  pthread_mutex_unlock(&g_freeLock);
+
+  if (async) pthread_join(g_freeThread, NULL);
+  return 0;
+}
 
-  bioRead(DBNINODES, buf);
 
-  Inode* inodes = (Inode*)buf;
 
-  memcpy(inode, &inodes[inum], sizeof(Inode));
+// ============================================================================
+// Turn readahead off, stopping the readahead thread if it is running
+// ============================================================================
+i32 bfsStopReadAhead() {
+  if (g_raAsync) {
+    pthread_mutex_lock(&g_raLock);
+    g_raStop = 1;
+    pthread_cond_signal(&g_raCond);
+    pthread_mutex_unlock(&g_raLock);
+    pthread_join(g_raThread, NULL);
+    g_raAsync = 0;
+  }
+  g_raMax = 0;
   return 0;
 }
 
 
 
 // ============================================================================
-// Reference file with Inode number 'inum' in the Open File Table
+// Write the in-memory free-space bitmap back to disk, if it has changed, and
+// the blocks of reference counts that have.  Blocks held for the journal are
+// written as free: the bitmap is committed along with the change that frees
+// them
 // ============================================================================
-i32 bfsRefOFT(i32 inum) {
-  i32 ofte = bfsFindOFTE(inum);
-  ++g_oft[ofte].refs;
+i32 bfsSyncBitmap() {
+  pthread_mutex_lock(&g_allocLock);
+  if (g_bitmapDirty) {
+    i32  per = BLOCKSIZE / sizeof(u64);
+    u64* buf = malloc(BLOCKSIZE);
+    if (buf == NULL) FATAL(ENOMEM);
+    for (i32 b = 0; b < g_geo.numBitmapBlocks; ++b) {
+      for (i32 i = 0; i < per; ++i) {
+        buf[i] = g_bitmap[b * per + i] & ~g_bitmapHeld[b * per + i];
+      }
+      cacheWrite(g_geo.dbnBitmap + b, buf);
+    }
+    free(buf);
+    g_bitmapDirty = 0;
+  }
+  for (i32 b = 0; g_refs != NULL && b < g_geo.numRefBlocks; ++b) {
+    if (!g_refsDirty[b]) continue;
+    cacheWrite(g_geo.dbnRefs + b, (i8*)g_refs + (size_t)b * BLOCKSIZE);
+    g_refsDirty[b] = 0;
+  }
+  pthread_mutex_unlock(&g_allocLock);
   return 0;
 }
 
 
 
 // ============================================================================
-// Set cursor position for the file open on File Descriptor 'fd' to 'newCurs'
+// Write the changed blocks of the in-memory Inode table back to disk
 // ============================================================================
-i32 bfsSetCursor(i32 inum, i32 newCurs) {
+i32 bfsSyncInodes() {
+  i8* buf = malloc(BLOCKSIZE);
+  if (buf == NULL) FATAL(ENOMEM);
+
+  pthread_mutex_lock(&g_inodesLock);
+
+  for (i32 b = 0; b < g_geo.numInodeBlocks; ++b) {
+    if (!g_inodesDirty[b]) continue;
+
+    i32 dbn = g_geo.dbnInodes + b;
+    cacheRead(dbn, buf);                  // keep any bytes past the table
+
+    for (i32 slot = 0; slot < g_geo.inodesPerBlock; ++slot) {
+      i32 inum = b * g_geo.inodesPerBlock + slot;
+      if (inum > MAXINUM) break;
+      Inode* inode = &g_inodes[inum];
+      if (g_geo.version < 2) {            // narrow to 16-bit DBNs
+        InodeV1* old = &((InodeV1*)buf)[slot];
+        old->size = inode->size;
+        for (i32 d = 0; d < NUMDIRECT; ++d) {
+          old->direct[d] = inode->extent[d].dbn;
+        }
+        old->indirect = inode->indirect;
+      } else if (g_geo.version == 2) {
+        InodeV2* old = &((InodeV2*)buf)[slot];
+        old->size = inode->size;
+        for (i32 d = 0; d < NUMDIRECT; ++d) {
+          old->direct[d] = inode->extent[d].dbn;
+        }
+        old->indirect = inode->indirect;
+      } else if (g_geo.version < 5) {
+        memcpy(&((InodeV3*)buf)[slot], &g_inodes[inum], sizeof(InodeV3));
+      } else {
+        memcpy(&((Inode*)buf)[slot], &g_inodes[inum], sizeof(Inode));
+      }
+    }
 
-  if (inum < 0) FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
+    cacheWrite(dbn, buf);
+    g_inodesDirty[b] = 0;
+  }
+  pthread_mutex_unlock(&g_inodesLock);
 
-  i32 ofte = bfsFindOFTE(inum);
-  g_oft[ofte].curs = newCurs;
+  free(buf);
   return 0;
 }
 
 
 
 // ============================================================================
-// Return the cursor position for the file open on File Descriptor 'fd'
+// Write the roots queued for the free thread into DBNSUPER, past the Super,
+// if the queue has changed.  With a journal, this is called by each commit,
+// so the list always matches the committed Inodes.  With no journal, do
+// nothing.  Return 0
 // ============================================================================
-i32 bfsTell(i32 fd) {
-  i32 inum = bfsFdToInum(fd);
-  i32 ofte = bfsFindOFTE(inum);
-  return g_oft[ofte].curs;
+i32 bfsSyncOrphans() {
+  if (g_geo.numJournalBlocks == 0) return 0;
+
+  pthread_mutex_lock(&g_freeLock);
+  if (g_freeDirty) {
+    i8* buf = malloc(BLOCKSIZE);
+    if (buf == NULL) FATAL(ENOMEM);
+    cacheRead(DBNSUPER, buf);
+    i32* list = (i32*)(buf + ORPHANOFF);
+    list[0] = g_freeCount;
+    memcpy(list + 1, g_freeQueue, g_freeCount * sizeof(i32));
+    cacheWrite(DBNSUPER, buf);
+    free(buf);
+    g_freeDirty = 0;
+  }
+  pthread_mutex_unlock(&g_freeLock);
+  return 0;
 }
 
 
 
 // ============================================================================
-// Return the size of the file whose Inode number is 'inum'
+// Set the size of file 'inum' to 'size' bytes.  Shrinking frees every block
+// past the new end - extents trimmed in place, the indirect tree pruned, or,
+// when cut to nothing, handed whole to the free thread - and zeroes the
+// rest of the last block kept, so that growing the file again reads zeroes.
+// A compressed file keeps whole clusters, and its last is rewritten.
+// Growing leaves a hole, from version 3; older disks are allocated out to
+// the new end, and zeroed.  The caller holds the file's Inode lock for
+// writing.  Return 0
 // ============================================================================
-i32 bfsGetSize(i32 inum) {
+i32 bfsTruncate(i32 inum, i32 size) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
+  if (size < 0)       FATAL(EBADCURS);
+  if ((i64)size > (i64)(MAXFBN + 1) * BLOCKSIZE) FATAL(EBADCURS);
+
+  i32 oldSize = bfsGetSize(inum);
+  i32 packed  = bfsGetFlags(inum) & INODECOMPRESS;
+  i32 unit    = packed ? CLUSTERBLOCKS : 1;   // blocks kept or freed together
+  i64 bytes   = (i64)unit * BLOCKSIZE;
+  i32 end     = (i32)((size + bytes - 1) / bytes) * unit;
+  if (size == oldSize) return 0;
+
+  if (size > oldSize) {                       // grow
+    bfsDelayFlush(inum);                      // held blocks end at the end
+    i32 oldEnd = (oldSize + BLOCKSIZE - 1) / BLOCKSIZE;
+    if (g_geo.version < 3 && end > oldEnd) {
+      bfsAllocRange(inum, oldEnd, end - 1);
+      i8*     zero = calloc(1, BLOCKSIZE);
+      BioVec* vec  = malloc((end - oldEnd) * sizeof(BioVec));
+      if (zero == NULL || vec == NULL) FATAL(ENOMEM);
+      for (i32 f = oldEnd; f < end; ++f) {
+        vec[f - oldEnd].dbn = bfsFbnToDbn(inum, f);
+        vec[f - oldEnd].buf = zero;
+      }
+      cacheWritev(vec, end - oldEnd);
+      free(vec);
+      free(zero);
+    }
+    return bfsSetSize(inum, size);
+  }
+
+  // Blocks held back past the new end are just dropped
+
+  Delay* d = (g_delay != NULL) ? &g_delay[inum] : NULL;
+  if (d != NULL && d->num > 0 && d->fbn + d->num > end) {
+    i32 num = (d->fbn < end) ? end - d->fbn : 0;
+    __atomic_store_n(&d->num, num, __ATOMIC_RELAXED);
+  }
+
+  i32 tail = size % bytes;                    // bytes kept in the last unit
+  if (tail != 0 && packed) {
+    i8* buf = malloc(bytes);
+    if (buf == NULL) FATAL(ENOMEM);
+    bfsReadCluster(inum, size / bytes, buf);
+    memset(buf + tail, 0, bytes - tail);
+    bfsWriteCluster(inum, size / bytes, buf);
+    free(buf);
+  } else if (tail != 0) {
+    i32 fbn = size / BLOCKSIZE;
+    if (d != NULL && d->num > 0 && fbn >= d->fbn) {
+      memset(d->data + (size_t)(fbn - d->fbn) * BLOCKSIZE + tail, 0,
+             BLOCKSIZE - tail);
+    } else {
+      BioVec vec = { bfsFbnToDbn(inum, fbn), NULL };
+      if (vec.dbn != ENODBN) {
+        i8* buf = malloc(BLOCKSIZE);
+        if (buf == NULL) FATAL(ENOMEM);
+        vec.buf = buf;
+        cacheReadv(&vec, 1);
+        memset(buf + tail, 0, BLOCKSIZE - tail);
+        if (bfsRelocate(inum, fbn, fbn)) vec.dbn = bfsFbnToDbn(inum, fbn);
+        cacheWritev(&vec, 1);
+        free(buf);
+      }
+    }
+  }
 
   Inode inode;
   bfsReadInode(inum, &inode);
 
-  return inode.size;
+  i32 root = 0;
+  if (end == 0) {                             // the whole tree goes
+    root = inode.indirect;
+    inode.indirect = 0;
+  } else {
+    bfsFreeTree(&inode, end);
+  }
+  bfsFreeExtents(&inode, end);
+  inode.size = size;
+  bfsWriteInode(inum, &inode);
+
+  if (root != 0) bfsFreeLater(root);
+  return 0;
 }
 
 
 
 // ============================================================================
-// Set size of file 'inum' to 'size
+// Release the lock taken on file 'inum' by bfsLockInode
 // ============================================================================
-i32 bfsSetSize(i32 inum, i32 size) {
+i32 bfsUnlockInode(i32 inum) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
 
-  Inode inode;
-  bfsReadInode(inum, &inode);
-  
-  inode.size = size;
-  bfsWriteInode(inum, &inode);
+  pthread_rwlock_unlock(&g_inodeLocks[inum]);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write 'buf', CLUSTERBLOCKS blocks, as cluster 'c' of compressed file
+// 'inum'.  A cluster of zeroes becomes a hole.  Any other is coded with
+// compEncode, and kept that way if it then fits in fewer blocks; else it is
+// stored as is.  The new blocks overwrite the old in place only when both
+// are coded, or both stored as is, the new need no more, and none of the old
+// is shared with another file or has a sealed checksum; otherwise new DBNs
+// are taken, contiguous where the disk allows, and written before the Inode
+// maps them, so a crash leaves the old cluster whole.  The caller
+// holds the file's Inode lock for writing.  Return 0
+// ============================================================================
+i32 bfsWriteCluster(i32 inum, i32 c, i8* buf) {
+
+  if (inum < 0)                        FATAL(EBADINUM);
+  if (inum > MAXINUM)                  FATAL(EBADINUM);
+  if (c < 0)                           FATAL(EBADFBN);
+  if (c > MAXFBN / CLUSTERBLOCKS)      FATAL(EBADFBN);
+  if (buf == NULL)                     FATAL(ENULLPTR);
+
+  i32 bytes = CLUSTERBLOCKS * BLOCKSIZE;
+  i8* out   = malloc(bytes);
+  if (out == NULL) FATAL(ENOMEM);
+
+  i32 num = 0;                                // blocks to write
+  i8* src = out;
+  if (!bfsIsZero(buf, bytes)) {
+    ClusterHeader* h    = (ClusterHeader*)out;
+    i32            room = bytes - BLOCKSIZE - sizeof(ClusterHeader);
+    i32            numb = compEncode(buf, bytes, h + 1, room);
+    if (numb < 0) {                           // would not compress
+      num = CLUSTERBLOCKS;
+      src = buf;
+    } else {
+      h->magic = CLUSTERMAGIC;
+      h->numb  = numb;
+      i32 used = sizeof(ClusterHeader) + numb;
+      num = (used + BLOCKSIZE - 1) / BLOCKSIZE;
+      memset(out + used, 0, num * BLOCKSIZE - used);
+    }
+  }
+
+  i32 old[CLUSTERBLOCKS];
+  i32 oldNum = bfsClusterMap(inum, c, old);
+  i32 reuse  = num > 0 && num <= oldNum &&
+               (num == CLUSTERBLOCKS) == (oldNum == CLUSTERBLOCKS);
+  for (i32 i = 0; reuse && i < oldNum; ++i) {
+    if (bfsGetRef(old[i]) != 0) reuse = 0;  // shared: see fsClone
+    if (csumSealed(old[i]))     reuse = 0;  // see bfsRelocate
+  }
+
+  i32 dbns[CLUSTERBLOCKS];
+  if (reuse) memcpy(dbns, old, num * sizeof(i32));
+  else if (num > 0) bfsFindFreeBlocks(num, dbns);
+
+  BioVec vec[CLUSTERBLOCKS];
+  for (i32 i = 0; i < num; ++i) {
+    vec[i].dbn = dbns[i];
+    vec[i].buf = src + i * BLOCKSIZE;
+  }
+  if (num > 0) cacheWritev(vec, num);
+  free(out);
+
+  if (reuse && num == oldNum) return 0;       // same DBNs: map unchanged
+  bfsClusterRemap(inum, c, dbns, num, oldNum);
+  i32 from = reuse ? num : 0;                 // first old DBN not kept
+  bfsFreeDbns(old + from, oldNum - from);
   return 0;
 }
 
 
 
 // ============================================================================
-// Update the Inodes block on disk with the info in 'inode'
+// Update the in-memory Inode table with the info in 'inode'.  In
+// write-through mode, also update the Inode table on disk
 // ============================================================================
 i32 bfsWriteInode(i32 inum, Inode* inode) {
 
@@ -444,12 +3104,18 @@ i32 bfsWriteInode(i32 inum, Inode* inode) {
   if (inum > MAXINUM) FATAL(EBADINUM);
   if (inode == NULL)  FATAL(ENULLPTR);
 
-  i8 buf[BYTESPERBLOCK];
-  bioRead(DBNINODES, buf);
-  Inode* inodes = (Inode*)buf;
-  memcpy(&inodes[inum], inode, sizeof(Inode));
-  bioWrite(DBNINODES, buf);
+  pthread_mutex_lock(&g_inodesLock);
+  memcpy(&g_inodes[inum], inode, sizeof(Inode));
+  g_inodesDirty[inum / g_geo.inodesPerBlock] = 1;
+  pthread_mutex_unlock(&g_inodesLock);
+
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i) {   // mapping may have changed
+    if (__atomic_load_n(&g_oft[i].inum, __ATOMIC_ACQUIRE) != inum) continue;
+    pthread_mutex_lock(&g_oft[i].lock);
+    g_oft[i].xlateLen = 0;
+    pthread_mutex_unlock(&g_oft[i].lock);
+  }
 
+  if (g_inodesWriteThrough) bfsSyncInodes();
   return 0;
 }
-
@@ -5,89 +5,294 @@
 // bfs.h - API to Bothell File System
 // ===================================================================
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "alias.h"
 #include "bio.h"
+#include "cache.h"
+#include "comp.h"
+#include "csum.h"
 #include "errors.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
-#define BYTESPERBLOCK 512
-#define I16SPERBLOCK  256
-#define BLOCKSPERDISK 100
+#define BYTESPERBLOCK 512         // versions 0 and 1; default for fsFormat
+#define BLOCKSPERDISK 100         // default for fsFormat
 #define BYTESPERDISK  (BLOCKSPERDISK * BYTESPERBLOCK)
-#define NUMINODES     8
-#define MAXINUM       NUMINODES - 1
-#define NUMMETA       3
-#define MINDBN        3
+#define NUMINODES     8           // versions 0 and 1; default for fsFormat
+#define MINBLOCKSIZE  512
+#define MAXBLOCKSIZE  65536
+#define NUMMETA       4           // metadata blocks, version 1
+#define MINDBN        4
 #define BFSDISK       "BFSDISK"
 #define NUMDIRECT     5
-#define NUMINDIRECT   BYTESPERBLOCK / sizeof(i16)
-#define MAXFBN        NUMDIRECT + NUMINDIRECT
 #define FNAMESIZE     16
 
 #define DBNSUPER      0
-#define DBNINODES     1
-#define DBNDIR        2
+#define DBNINODES     1           // versions 0 and 1.  See Geo for later
+#define DBNDIR        2           // versions 0 and 1
+#define DBNBITMAP     3           // version 1: free-space bitmap
 
-#define INUMTOFD      5
+#define FSVERSION     8           // on-disk format written by fsFormat
+#define NUMEXTENTS    5           // extents held in an Inode: >= NUMDIRECT
+
+// Geometry of the mounted disk, replacing the fixed sizes above
+
+#define BLOCKSIZE     (g_geo.bytesPerBlock)
+#define MAXINUM       (g_geo.numInodes - 1)
+#define NUMINDIRECT   (g_geo.ptrsPerBlock)
+#define MAXFBN        (g_geo.maxFbn)
+
+#define FDBASE        5           // fd of OFT slot 0
 
 #define NUMOFTENTRIES 20
+#define XLATESIZE     16          // FBN->DBN translations cached per OFTE
+#define RAMINBLOCKS   2           // first readahead window, in blocks
+#define RAMAXBLOCKS   8           // default largest readahead window
+#define RAQUEUESIZE   32          // readahead requests awaiting the thread
+#define AIOTHREADS    4           // default # of fsReadAsync/fsWriteAsync
+                                  //   worker threads
+#define AIOMAXTHREADS 64          // most worker threads allowed
+#define DELAYBLOCKS   64          // default most appended blocks held back
+                                  //   per file, awaiting allocation
+#define CLUSTERBLOCKS 8           // FBNs compressed together, in a file with
+                                  //   INODECOMPRESS set
+#define MAXSHARE      65535       // most files a block is shared with, beyond
+                                  //   its first.  See fsClone
+
+#define INODECOMPRESS 1           // Inode.flags: data in compressed clusters
 
 
 typedef struct {          // SuperBlock
-  i16 numBlocks;          // total # of blocks in BFSDISK = 1,000
-  i16 numInodes;          // total # of inodes = 8
-  i16 firstFree;          // DBN of first free block
+  i16 numBlocks;          // total # of blocks.  Versions 0, 1 only
+  i16 numInodes;          // total # of inodes.  Versions 0, 1 only
+  i16 firstFree;          // DBN of first free block.  Version 0 only
+  i16 version;            // on-disk format: 0 => Freelist, 1 => bitmap,
+                          // 2 => geometry below and 32-bit DBNs,
+                          // 3 => extent-based Inodes,
+                          // 4 => metadata journal,
+                          // 5 => Inode flags, and compressed files,
+                          // 6 => block checksums,
+                          // 7 => block reference counts,
+                          // 8 => block checksums without a journal too
+  i32 bytesPerBlock;      // block size, from version 2
+  i32 blocksPerDisk;      // total # of blocks, from version 2
+  i32 inodesPerDisk;      // total # of inodes, from version 2
+  i32 journalBlocks;      // # of journal blocks, from version 4.  0 => none
 } Super;
 
+// With a journal, DBNSUPER also holds, past the Super, the roots of the
+// indirect trees that Inodes have dropped but that the free thread has not
+// yet freed: an i32 count, then that many DBNs.  Each root is committed with
+// the Inode change that drops it, and leaves the list in the transaction
+// that frees its tree, so a mount after a crash finishes the job.  See
+// bfsFreeLater
+
+#define ORPHANOFF     sizeof(Super)   // offset of the count in DBNSUPER
+#define MAXORPHANS    ((i32)((BLOCKSIZE - ORPHANOFF) / sizeof(i32)) - 1)
+
+
+
+typedef struct {          // Geometry of the mounted disk.  See bfsLayout
+  i32 version;            // Super.version
+  i32 bytesPerBlock;      // 512 .. 65,536
+  i32 numBlocks;          // total # of blocks in BFSDISK
+  i32 numInodes;          // total # of inodes, and Directory slots
+  i32 dbnInodes;          // first block of the Inode table
+  i32 numInodeBlocks;
+  i32 inodesPerBlock;
+  i32 dbnDir;             // first block of the Directory
+  i32 numDirBlocks;
+  i32 dbnBitmap;          // first block of the bitmap.  0 => Freelist
+  i32 numBitmapBlocks;
+  i32 dbnRefs;            // first block of the reference counts.  0 => none
+  i32 numRefBlocks;
+  i32 dbnCsum;            // first block of the checksum table.  0 => none
+  i32 numCsumBlocks;
+  i32 dbnJournal;         // header block of the journal
+  i32 numJournalBlocks;   // 0 => no journal
+  i32 numMeta;            // DBNs below this are metadata
+  i32 bytesPerPtr;        // size of a DBN on disk: 2 or 4
+  i32 ptrsPerBlock;       // DBNs per indirect block
+  i32 maxFbn;             // last FBN a file can map
+} Geo;
+
+
+
+typedef struct {          // Extent: a run of FBNs held in contiguous DBNs
+  i32 fbn;                // first FBN of the run
+  i32 dbn;                // DBN holding FBN 'fbn'
+  i32 len;                // # of blocks in the run.  0 => empty
+} Extent;
+
 
 
 typedef struct {          // Inode
-  i32 size;               // # of bytes in file
-  i16 direct[NUMDIRECT];  // DBNs for first 5 FBNs
-  i16 indirect;           // DBN of the indirect table
+  i32    size;                  // # of bytes in file
+  i32    numExtents;            // # of entries in use in extent[]
+  Extent extent[NUMEXTENTS];    // runs of the file, sorted by FBN
+  i32    indirect;              // DBN of the double-indirect table, for FBNs
+                                // in no extent.  Versions 0 .. 2: see below
+  i32    flags;                 // INODECOMPRESS.  From version 5
 } Inode;
 
+// Disks formatted before version 3 have no extents.  Their Inodes are held
+// in memory with extent[d] standing for direct[d]: FBN d, length 1, or
+// length 0 if not mapped.  'indirect' is then a single-indirect table for
+// FBNs from NUMDIRECT on
+//
+// A file with INODECOMPRESS set is stored a cluster of CLUSTERBLOCKS FBNs
+// at a time, mapped only by the indirect tree.  The first k FBNs of a
+// cluster hold it: k = 0 for a hole, CLUSTERBLOCKS for a cluster that would
+// not compress, and anything between for a compressed one.  See
+// bfsWriteCluster
+//
+// From version 7 two files may map the same data block, after fsClone.  The
+// block's reference count holds how many files map it beyond the first; a
+// write to a shared block first moves that FBN to a block of its own, with
+// bfsRelocate.  Indirect blocks are never shared
+
 
 
-typedef struct {          // Dir
-  char fname[NUMINODES][FNAMESIZE];
-} Dir;
+typedef struct {          // Inode, as stored by versions 0 and 1
+  i32 size;
+  i16 direct[NUMDIRECT];
+  i16 indirect;
+} InodeV1;
 
 
-typedef struct {          // Open File Table Entry
-  i32 inum;               // inum of file. O => slot not used
-  i32 refs;               // # processes fsOpen'd this file
+
+typedef struct {          // Inode, as stored by version 2
+  i32 size;
+  i32 direct[NUMDIRECT];
+  i32 indirect;
+} InodeV2;
+
+
+
+typedef struct {          // Inode, as stored by versions 3 and 4
+  i32    size;
+  i32    numExtents;
+  Extent extent[NUMEXTENTS];
+  i32    indirect;
+} InodeV3;
+
+
+typedef struct {          // Open File Table Entry: one per fsOpen/fsCreate
+  i32 inum;               // inum of file. -1 => slot not used
+  pthread_mutex_t lock;   // guards curs and the translation window
   i32 curs;               // cursor into file
+  i32 xlateFbn;           // first FBN in the translation window
+  i32 xlateLen;           // # valid entries in xlateDbn.  0 => empty
+  i32 xlateDbn[XLATESIZE];// DBNs for FBNs xlateFbn, xlateFbn + 1, ...
+  i32 raLast;             // last FBN read.  -1 => none yet
+  i32 raWindow;           // # of FBNs to keep read ahead.  0 => not sequential
+  i32 raEnd;              // first FBN not yet read ahead
 } OFTE;
 
-OFTE g_oft[NUMOFTENTRIES];
 
+
+typedef struct BfsState BfsState;
+
+typedef struct BfsVolume {  // one disk, and all the state of its mount
+  str   path;             // host file holding the disk
+  Geo   geo;              // geometry of the mounted disk
+  OFTE  oft[NUMOFTENTRIES];
+  struct BfsState*   bfs;
+  struct BioState*   bio;
+  struct CacheState* cache;
+  struct CsumState*  csum;
+  struct FsState*    fs;
+  struct JnlState*   jnl;
+} BfsVolume;
+
+// The volume each thread works on.  Every module reaches its own state
+// through this, so one volume's calls never touch another's tables, locks
+// or threads.  See vol.c
+
+extern __thread BfsVolume* t_vol;
+
+#define g_geo         (t_vol->geo)
+#define g_oft         (t_vol->oft)
+
+i32 bfsAdvanceCursor(i32 fd, i32 numb, i32 end, i32* curs);
 i32 bfsAllocBlock(i32 inum, i32 fbn);
+i32 bfsAllocRange(i32 inum, i32 fbnFirst, i32 fbnLast);
+i32 bfsCloneFile(i32 src, i32 dst);
+i32 bfsCloseFd(i32 fd);
 i32 bfsCreateFile(str fname);
-i32 bfsDerefOFT(i32 inum);
+i32 bfsDelayFirst(i32 inum);
+i32 bfsDelayFlush(i32 inum);
+i32 bfsDelayFlushAll();
+i32 bfsDelayGet(i32 inum, i32 fbn, i8* buf);
+i32 bfsDelayPut(i32 inum, i32 fbn, void* block);
+i32 bfsDelayRoom(i32 inum, i32 fbnFirst, i32 fbnLast);
+i32 bfsDeleteFile(i32 inum, str fname);
 i32 bfsExtend(i32 inum, i32 fbn);
 i32 bfsFbnToDbn(i32 inum,   i32 fbn);
+i32 bfsFdFbnToDbn(i32 fd, i32 fbn);
 i32 bfsFdToInum(i32 fd);
+i32 bfsFdToOFTE(i32 fd);
 i32 bfsFindFreeBlock();
-i32 bfsFindOFTE(i32 inum);
+i32 bfsFindFreeBlocks(i32 num, i32* dbns);
+i32 bfsFindFreeListBlock();
+i32 bfsFindFreeRun(i32 num);
+i32 bfsFreeRun(i32 dbn, i32 num);
+i32 bfsFreeState(BfsState* state);
+i32 bfsFreeWait();
+i32 bfsGetFlags(i32 inum);
+i32 bfsGetPtr(void* block, i32 i);
 i32 bfsGetSize(i32 inum);
 i32 bfsInitDir(FILE*  fp);
-i32 bfsInitFreeList();
+i32 bfsInitBitmap();
+i32 bfsInitDelay(i32 maxBlocks, i32 numInodes);
+i32 bfsInitFree();
 i32 bfsInitInodes(FILE* fp);
 i32 bfsInitOFT();
+i32 bfsInitReadAhead(i32 maxBlocks, i32 async);
+i32 bfsInitRefs();
 i32 bfsInitSuper(FILE* fp);
-i32 bfsInumToFd(i32 inum);
+i32 bfsInUse(i32 dbn);
+i32 bfsLayout(Geo* geo, i32 version, i32 bytesPerBlock, i32 numBlocks,
+              i32 numInodes, i32 journalBlocks);
+i32 bfsLoadBitmap();
+i32 bfsLoadDir();
+i32 bfsLoadGeometry();
+i32 bfsLoadInodes(i32 writeThrough);
+i32 bfsLoadOrphans();
+i32 bfsLockInode(i32 inum, i32 write);
 i32 bfsLookupFile(str fname);
+i32 bfsMapFbn(i32 inum, i32 fbn);
+BfsState* bfsNewState();
+i32 bfsOpenFd(i32 inum);
 i32 bfsRead(i32 inum, i32 fbn, i8* buf);
+i32 bfsReadAhead(i32 fd, i32 fbnFirst, i32 fbnLast);
+i32 bfsReadCluster(i32 inum, i32 c, i8* buf);
 i32 bfsReadInode(i32 inum, Inode* inode);
-i32 bfsRefOFT(i32 inum);
-i32 bfsSetCursor(i32 inum, i32 newCurs);
+i32 bfsReleaseRun(i32 dbn, i32 num);
+i32 bfsRelocate(i32 inum, i32 fbnFirst, i32 fbnLast);
+i32 bfsSeekData(i32 inum, i32 fbn, i32 data);
+i32 bfsSetCursor(i32 fd, i32 newCurs);
+i32 bfsSetFlags(i32 inum, i32 flags);
+i32 bfsSetGeometry(Geo* geo);
+i32 bfsSetPtr(void* block, i32 i, i32 dbn);
 i32 bfsSetSize(i32 inum, i32 size);
+i32 bfsStopFree();
+i32 bfsStopReadAhead();
+i32 bfsSyncBitmap();
+i32 bfsSyncInodes();
+i32 bfsSyncOrphans();
 i32 bfsTell(i32 fd);
+i32 bfsTruncate(i32 inum, i32 size);
+i32 bfsUnlockInode(i32 inum);
+i32 bfsWriteCluster(i32 inum, i32 c, i8* buf);
 i32 bfsWriteInode(i32 inum, Inode* inode);
 
+i32 volSpawn(pthread_t* thread, void* (*fn)(void*), void* arg);
+
 #endif
 
@@ -1,49 +1,756 @@
 // ============================================================================
 // bio.c - low level Block IO functions
 // ============================================================================
+//
+// Every transfer is built from BioReqs: bioSubmit starts one, bioWait waits
+// for it.  A request is carried out by one of four backends, picked at
+// bioOpen: BIOSTDIO (a FILE*), BIOPREAD (preadv/pwritev), BIOURING (an
+// io_uring, read through raw syscalls, so no liburing is needed) or BIOMMAP
+// (memcpy to and from one shared mapping of the whole disk).  All but
+// io_uring finish each request inside bioSubmit; io_uring lets many runs be
+// in flight at once, so bioReadv and bioWritev submit all their runs before
+// waiting for any.  One thread at a time reaps completions for all waiters
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#undef  ENOMEM                          // errors.h gives these its own values
+#undef  EBADFD
 #include "bfs.h"
 #include "bio.h"
 
+#ifdef __linux__
+#include <linux/fs.h>                   // FICLONE
+#include <linux/io_uring.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define URINGDEPTH 64                   // io_uring submission queue entries
+#define COPYRUN    256                  // most blocks bioCopy moves at once
+
+typedef struct {          // a block-device backend
+  str    name;
+  i32  (*open)  ();                     // set up on g_diskFd.  0 => ok
+  void (*close) ();
+  void (*submit)(BioReq* req);          // start 'req': bioComplete it later
+  i32  (*reap)  (i32 wait);             // 1 => wait for one.  Return # done
+  i32  (*sync)  ();                     // make writes durable.  0 => ok
+} Backend;
+
+struct BioState {         // one volume's disk.  See bioNewState
+  int  diskFd;                          // BFSDISK descriptor, while mounted
+  i32  bytesPerBlock;                   // block size of the open disk
+  i32  numBlocks;                       // # of blocks, once known
+
+  Backend*        backend;              // chosen at bioOpen
+  pthread_mutex_t bioLock;
+  pthread_cond_t  bioCond;
+  i32             bioReaping;           // 1 => a thread is reaping
+
+  FILE* diskFp;                         // BIOSTDIO: dup of diskFd
+
+  i8*   map;                            // BIOMMAP: the whole disk
+  off_t mapSize;                        // bytes mapped
+
+#ifdef __linux__
+  int                  ringFd;          // BIOURING
+  pthread_mutex_t      ringLock;        // SQ
+  void*                sqRing;
+  size_t               sqRingSize;
+  u32*                 sqTail;
+  u32*                 sqMask;
+  u32*                 sqArray;
+  struct io_uring_sqe* sqes;
+  size_t               sqesSize;
+  void*                cqRing;
+  size_t               cqRingSize;
+  u32*                 cqHead;
+  u32*                 cqTail;
+  u32*                 cqMask;
+  struct io_uring_cqe* cqes;
+#endif
+};
+
+#define g_diskFd        (t_vol->bio->diskFd)
+#define g_bytesPerBlock (t_vol->bio->bytesPerBlock)
+#define g_numBlocks     (t_vol->bio->numBlocks)
+#define g_backend       (t_vol->bio->backend)
+#define g_bioLock       (t_vol->bio->bioLock)
+#define g_bioCond       (t_vol->bio->bioCond)
+#define g_bioReaping    (t_vol->bio->bioReaping)
+#define g_diskFp        (t_vol->bio->diskFp)
+#define g_map           (t_vol->bio->map)
+#define g_mapSize       (t_vol->bio->mapSize)
+#define g_ringFd        (t_vol->bio->ringFd)
+#define g_ringLock      (t_vol->bio->ringLock)
+#define g_sqRing        (t_vol->bio->sqRing)
+#define g_sqRingSize    (t_vol->bio->sqRingSize)
+#define g_sqTail        (t_vol->bio->sqTail)
+#define g_sqMask        (t_vol->bio->sqMask)
+#define g_sqArray       (t_vol->bio->sqArray)
+#define g_sqes          (t_vol->bio->sqes)
+#define g_sqesSize      (t_vol->bio->sqesSize)
+#define g_cqRing        (t_vol->bio->cqRing)
+#define g_cqRingSize    (t_vol->bio->cqRingSize)
+#define g_cqHead        (t_vol->bio->cqHead)
+#define g_cqTail        (t_vol->bio->cqTail)
+#define g_cqMask        (t_vol->bio->cqMask)
+#define g_cqes          (t_vol->bio->cqes)
+
+
+
+// ============================================================================
+// Record that 'req' has finished - 'ok' is 1 if every byte was moved - and
+// run its callback.  'done' is set last, so a waiter that sees it may reuse
+// the request at once
+// ============================================================================
+static void bioComplete(BioReq* req, i32 ok) {
+  req->result = ok ? 0 : (req->op == BIOREAD ? EBADREAD : EBADWRITE);
+  if (req->callback != NULL) req->callback(req);
+  __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+}
+
+
+
+// ============================================================================
+// BIOSTDIO: carry out each request with fseek and fread/fwrite on a FILE*
+// sharing the disk with g_diskFd.  The FILE is locked for the whole request
+// ============================================================================
+static i32 bioStdioOpen() {
+  int fd = dup(g_diskFd);
+  if (fd < 0) return -1;
+  g_diskFp = fdopen(fd, "r+b");
+  if (g_diskFp == NULL) { close(fd); return -1; }
+  return 0;
+}
+
+static void bioStdioClose() {
+  fclose(g_diskFp);
+  g_diskFp = NULL;
+}
+
+static void bioStdioSubmit(BioReq* req) {
+  flockfile(g_diskFp);
+  off_t boff = (off_t)req->dbn * g_bytesPerBlock;
+  i32   ok   = fseeko(g_diskFp, boff, SEEK_SET) == 0;
+  for (i32 i = 0; ok && i < req->numIov; ++i) {
+    struct iovec* v = &req->iov[i];
+    size_t numb = (req->op == BIOREAD)
+                ? fread (v->iov_base, 1, v->iov_len, g_diskFp)
+                : fwrite(v->iov_base, 1, v->iov_len, g_diskFp);
+    ok = (numb == v->iov_len);
+  }
+  if (ok && req->op == BIOWRITE) ok = fflush(g_diskFp) == 0;
+  funlockfile(g_diskFp);
+  bioComplete(req, ok);
+}
+
+static i32 bioStdioSync() {
+  if (fflush(g_diskFp) != 0) return -1;
+  return fdatasync(fileno(g_diskFp));
+}
+
+
+
+// ============================================================================
+// BIOPREAD: carry out each request with a single preadv or pwritev
+// ============================================================================
+static i32 bioPreadOpen() { return 0; }
+
+static void bioPreadClose() {}
+
+static void bioPreadSubmit(BioReq* req) {
+  off_t   boff = (off_t)req->dbn * g_bytesPerBlock;
+  ssize_t numb = (req->op == BIOREAD)
+               ? preadv (g_diskFd, req->iov, req->numIov, boff)
+               : pwritev(g_diskFd, req->iov, req->numIov, boff);
+  bioComplete(req, numb == (ssize_t)req->numIov * g_bytesPerBlock);
+}
+
+static i32 bioSyncReap(i32 wait) { return 0; }    // nothing is ever pending
+
+static i32 bioFdSync() { return fdatasync(g_diskFd); }
+
+
+
+// ============================================================================
+// BIOMMAP: map all of BFSDISK, as it stands at bioOpen, shared, so each
+// request is a memcpy and bioMap can hand out pointers into the disk.
+// Writes reach the file through msync, at bioSync and bioClose
+// ============================================================================
+static i32 bioMmapOpen() {
+  struct stat st;
+  if (fstat(g_diskFd, &st) != 0 || st.st_size == 0) return -1;
+  void* p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 g_diskFd, 0);
+  if (p == MAP_FAILED) return -1;
+  g_map     = p;
+  g_mapSize = st.st_size;
+  return 0;
+}
+
+static i32 bioMmapSync() {
+  return msync(g_map, g_mapSize, MS_SYNC);
+}
+
+static void bioMmapClose() {
+  bioMmapSync();
+  munmap(g_map, g_mapSize);
+  g_map     = NULL;
+  g_mapSize = 0;
+}
+
+static void bioMmapSubmit(BioReq* req) {
+  off_t boff = (off_t)req->dbn * g_bytesPerBlock;
+  i32   ok   = boff + (off_t)req->numIov * g_bytesPerBlock <= g_mapSize;
+  for (i32 i = 0; ok && i < req->numIov; ++i) {
+    struct iovec* v = &req->iov[i];
+    if (req->op == BIOREAD) memcpy(v->iov_base, g_map + boff, v->iov_len);
+    else                    memcpy(g_map + boff, v->iov_base, v->iov_len);
+    boff += v->iov_len;
+  }
+  bioComplete(req, ok);
+}
+
+
+
+#ifdef __linux__
+// ============================================================================
+// BIOURING: queue each request as an IORING_OP_READV or _WRITEV whose
+// user_data is the BioReq, and complete it when its CQE is reaped.  The
+// kernel must keep CQEs that overflow the ring (IORING_FEAT_NODROP), so no
+// cap on requests in flight is needed.  On failure, return -1
+// ============================================================================
+static void bioUringClose() {
+  if (g_sqes   != NULL) munmap(g_sqes,   g_sqesSize);
+  if (g_cqRing != NULL) munmap(g_cqRing, g_cqRingSize);
+  if (g_sqRing != NULL) munmap(g_sqRing, g_sqRingSize);
+  if (g_ringFd >= 0)    close(g_ringFd);
+  g_sqes = NULL; g_cqRing = NULL; g_sqRing = NULL; g_ringFd = -1;
+}
+
+static void* bioUringMap(size_t size, off_t which) {
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, g_ringFd, which);
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+static i32 bioUringOpen() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  g_ringFd = syscall(__NR_io_uring_setup, URINGDEPTH, &p);
+  if (g_ringFd < 0) return -1;
+  if ((p.features & IORING_FEAT_NODROP) == 0) { bioUringClose(); return -1; }
+
+  g_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(u32);
+  g_cqRingSize = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+  g_sqesSize   = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  g_sqRing = bioUringMap(g_sqRingSize, IORING_OFF_SQ_RING);
+  g_cqRing = bioUringMap(g_cqRingSize, IORING_OFF_CQ_RING);
+  g_sqes   = bioUringMap(g_sqesSize,   IORING_OFF_SQES);
+  if (g_sqRing == NULL || g_cqRing == NULL || g_sqes == NULL) {
+    bioUringClose(); return -1;
+  }
+
+  g_sqTail  = (u32*)((i8*)g_sqRing + p.sq_off.tail);
+  g_sqMask  = (u32*)((i8*)g_sqRing + p.sq_off.ring_mask);
+  g_sqArray = (u32*)((i8*)g_sqRing + p.sq_off.array);
+  g_cqHead  = (u32*)((i8*)g_cqRing + p.cq_off.head);
+  g_cqTail  = (u32*)((i8*)g_cqRing + p.cq_off.tail);
+  g_cqMask  = (u32*)((i8*)g_cqRing + p.cq_off.ring_mask);
+  g_cqes    = (struct io_uring_cqe*)((i8*)g_cqRing + p.cq_off.cqes);
+  return 0;
+}
+
+static void bioUringSubmit(BioReq* req) {
+  pthread_mutex_lock(&g_ringLock);
+
+  // each SQE is handed to the kernel at once, so the SQ ring never fills
+  u32 tail = *g_sqTail;
+  u32 slot = tail & *g_sqMask;
+  struct io_uring_sqe* sqe = &g_sqes[slot];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode    = (req->op == BIOREAD) ? IORING_OP_READV : IORING_OP_WRITEV;
+  sqe->fd        = g_diskFd;
+  sqe->addr      = (u64)(uintptr_t)req->iov;
+  sqe->len       = req->numIov;
+  sqe->off       = (u64)req->dbn * g_bytesPerBlock;
+  sqe->user_data = (u64)(uintptr_t)req;
+  g_sqArray[slot] = slot;
+  __atomic_store_n(g_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+  long ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, g_ringFd, 1, 0, 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  pthread_mutex_unlock(&g_ringLock);
+  if (ret != 1) FATAL(req->op == BIOREAD ? EBADREAD : EBADWRITE);
+}
+
+static i32 bioUringReap(i32 wait) {
+  if (wait) {
+    while (syscall(__NR_io_uring_enter, g_ringFd, 0, 1,
+                   IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno == EINTR) {}
+  }
+
+  // g_ringLock orders the submitter's writes to each BioReq before our
+  // reads.  Callbacks run after it is dropped, so they may submit again
+  BioReq* reqs[URINGDEPTH];
+  i32     oks [URINGDEPTH];
+  i32     num = 0;
+  for (;;) {
+    i32 n = 0;
+    pthread_mutex_lock(&g_ringLock);
+    u32 head = *g_cqHead;               // only the reaping thread moves it
+    u32 tail = __atomic_load_n(g_cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail && n < URINGDEPTH) {
+      struct io_uring_cqe* cqe = &g_cqes[head & *g_cqMask];
+      reqs[n] = (BioReq*)(uintptr_t)cqe->user_data;
+      oks [n] = (cqe->res == reqs[n]->numIov * g_bytesPerBlock);
+      ++n;
+      ++head;
+    }
+    __atomic_store_n(g_cqHead, head, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_ringLock);
+
+    for (i32 i = 0; i < n; ++i) bioComplete(reqs[i], oks[i]);
+    num += n;
+    if (n < URINGDEPTH) break;
+  }
+  return num;
+}
+#else
+static i32  bioUringOpen()  { return -1; }   // no io_uring: use BIOPREAD
+static void bioUringClose() {}
+#define bioUringSubmit bioPreadSubmit
+#define bioUringReap   bioSyncReap
+#endif
+
+static Backend g_backends[] = {                 // indexed by BIOSTDIO etc
+  { NULL, NULL, NULL, NULL, NULL, NULL },
+  { "stdio",    bioStdioOpen, bioStdioClose, bioStdioSubmit, bioSyncReap,
+                bioStdioSync },
+  { "pread",    bioPreadOpen, bioPreadClose, bioPreadSubmit, bioSyncReap,
+                bioFdSync },
+  { "io_uring", bioUringOpen, bioUringClose, bioUringSubmit, bioUringReap,
+                bioFdSync },
+  { "mmap",     bioMmapOpen,  bioMmapClose,  bioMmapSubmit,  bioSyncReap,
+                bioMmapSync },
+};
+
+
+
+// ============================================================================
+// Return the length of the run of contiguous DBNs starting at 'vec[0]', at
+// most 'num', and fill 'iov' with the matching buffers
+// ============================================================================
+static i32 bioRun(BioVec* vec, i32 num, struct iovec* iov) {
+  i32 len = 0;
+  while (len < num && len < IOV_MAX) {
+    if (vec[len].dbn < 0 || vec[len].dbn >= g_numBlocks) FATAL(EBADDBN);
+    if (len > 0 && vec[len].dbn != vec[0].dbn + len) break;
+    iov[len].iov_base = vec[len].buf;
+    iov[len].iov_len  = g_bytesPerBlock;
+    ++len;
+  }
+  return len;
+}
+
+
+
+// ============================================================================
+// Copy the 'num' blocks from DBN 'dbn' on of the disk to the same place in
+// file 'out': inside the kernel with copy_file_range while '*fast' is 1,
+// else with pread and pwrite through 'buf', of COPYRUN blocks.  If the
+// kernel cannot copy between the two, '*fast' is cleared.  Return 0, or -1
+// on failure
+// ============================================================================
+static i32 bioCopyRun(int out, i32 dbn, i32 num, i8* buf, i32* fast) {
+  off_t at   = (off_t)dbn * g_bytesPerBlock;
+  off_t left = (off_t)num * g_bytesPerBlock;
+  while (left > 0) {
+    ssize_t n = -1;
+#ifdef SYS_copy_file_range
+    if (*fast) {
+      off_t in = at;
+      off_t to = at;
+      n = syscall(SYS_copy_file_range, g_diskFd, &in, out, &to, left, 0);
+      if (n <= 0) *fast = 0;            // eg: EXDEV, ENOSYS.  Retry below
+    }
+#endif
+    if (n <= 0) {
+      n = pread(g_diskFd, buf, left, at);
+      if (n <= 0 || pwrite(out, buf, n, at) != n) return -1;
+    }
+    at   += n;
+    left -= n;
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read or write ('op') the 'num' blocks described by 'vec'.  Runs of
+// contiguous DBNs are merged into one BioReq each; all are submitted before
+// any is waited for.  On success, return 0.  On failure, abort
+// ============================================================================
+static i32 bioTransfer(i32 op, BioVec* vec, i32 num) {
+
+  if (vec == NULL)  FATAL(ENULLPTR);
+  if (g_diskFd < 0) FATAL(ENODISK);
+  if (num <= 0)     return 0;
+
+  struct iovec  iovOne;                 // a single block needs no malloc
+  BioReq        reqOne;
+  struct iovec* iov  = &iovOne;
+  BioReq*       reqs = &reqOne;
+  if (num > 1) {
+    iov  = malloc(num * sizeof(struct iovec));
+    reqs = malloc(num * sizeof(BioReq));
+    if (iov == NULL || reqs == NULL) FATAL(ENOMEM);
+  }
+
+  i32 numReqs = 0;
+  for (i32 i = 0; i < num; ) {
+    BioReq* req   = &reqs[numReqs++];
+    req->op       = op;
+    req->dbn      = vec[i].dbn;
+    req->iov      = iov + i;
+    req->numIov   = bioRun(vec + i, num - i, iov + i);
+    req->callback = NULL;
+    req->arg      = NULL;
+    bioSubmit(req);
+    i += req->numIov;
+  }
+
+  i32 ret = 0;
+  for (i32 r = 0; r < numReqs; ++r) {
+    i32 res = bioWait(&reqs[r]);
+    if (res != 0) ret = res;
+  }
+
+  if (num > 1) { free(iov); free(reqs); }
+  if (ret != 0) FATAL(ret);
+  return 0;
+}
+
+
+
 // ============================================================================
-// Read 512 bytes from block number 'dbn' in the BFS disk into buffer 'buf'
+// Return the name of the backend chosen by bioOpen: "stdio", "pread",
+// "io_uring" or "mmap".  Before bioOpen, return NULL
+// ============================================================================
+str bioBackendName() {
+  return (g_backend == NULL) ? NULL : g_backend->name;
+}
+
+
+
+// ============================================================================
+// Close the BFS disk descriptor opened by bioOpen, and its backend
+// ============================================================================
+i32 bioClose() {
+  if (g_diskFd < 0) return 0;           // not open
+  g_backend->close();
+  g_backend = NULL;
+  close(g_diskFd);
+  g_diskFd = -1;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Copy the open disk to a new file at 'path', replacing any there.  Where
+// the file system holding both can share extents, the copy is made at once
+// with the FICLONE ioctl, and the two then share blocks until either is
+// written.  Otherwise the file is sized as the disk, and only blocks for
+// which 'used' returns 1 are copied, in runs: the rest read as zeroes.  The
+// caller makes sure nothing is writing the disk meanwhile.  On success,
+// return 0.  On failure, EDISKCREATE
+// ============================================================================
+i32 bioCopy(str path, i32 (*used)(i32 dbn)) {
+
+  if (path == NULL || used == NULL) FATAL(ENULLPTR);
+  if (g_diskFd < 0)                 FATAL(ENODISK);
+
+  int out = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) return EDISKCREATE;
+
+#ifdef FICLONE
+  if (ioctl(out, FICLONE, g_diskFd) == 0) {
+    close(out);
+    return 0;
+  }
+#endif
+
+  struct stat st;
+  if (fstat(g_diskFd, &st) != 0 || ftruncate(out, st.st_size) != 0) {
+    close(out);
+    return EDISKCREATE;
+  }
+
+  i8* buf = malloc((size_t)COPYRUN * g_bytesPerBlock);
+  if (buf == NULL) FATAL(ENOMEM);
+  i32 ret  = 0;
+  i32 num  = (i32)(st.st_size / g_bytesPerBlock);
+  i32 fast = 1;
+  for (i32 dbn = 0; ret == 0 && dbn < num; ) {
+    if (!used(dbn)) { ++dbn; continue; }
+    i32 len = 1;
+    while (len < COPYRUN && dbn + len < num && used(dbn + len)) ++len;
+    if (bioCopyRun(out, dbn, len, buf, &fast) != 0) ret = EDISKCREATE;
+    dbn += len;
+  }
+  if (ret == 0 && fdatasync(out) != 0) ret = EDISKCREATE;
+
+  free(buf);
+  close(out);
+  return ret;
+}
+
+
+
+// ============================================================================
+// Free 'state', made by bioNewState.  Its disk must be closed
+// ============================================================================
+i32 bioFreeState(BioState* state) {
+  if (state == NULL)       FATAL(ENULLPTR);
+  if (state->diskFd >= 0)  FATAL(EBADVOLUME);
+  pthread_mutex_destroy(&state->bioLock);
+  pthread_cond_destroy(&state->bioCond);
+#ifdef __linux__
+  pthread_mutex_destroy(&state->ringLock);
+#endif
+  free(state);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return a pointer to block 'dbn' inside the mapping of the disk, which
+// stays valid until bioClose.  Stores through it are writes to the disk.  If
+// the BIOMMAP backend is not in use, or 'dbn' lies past the mapping, return
+// NULL
+// ============================================================================
+void* bioMap(i32 dbn) {
+  if (g_map == NULL || dbn < 0 || dbn >= g_numBlocks) return NULL;
+  off_t boff = (off_t)dbn * g_bytesPerBlock;
+  if (boff + g_bytesPerBlock > g_mapSize) return NULL;
+  return g_map + boff;
+}
+
+
+
+// ============================================================================
+// Return the block IO state of a new volume, with no disk open.  See vol.c
+// ============================================================================
+BioState* bioNewState() {
+  BioState* state = calloc(1, sizeof(BioState));
+  if (state == NULL) FATAL(ENOMEM);
+  state->diskFd        = -1;
+  state->bytesPerBlock = BYTESPERBLOCK;
+  state->numBlocks     = INT_MAX;
+  pthread_mutex_init(&state->bioLock, NULL);
+  pthread_cond_init(&state->bioCond, NULL);
+#ifdef __linux__
+  state->ringFd        = -1;
+  pthread_mutex_init(&state->ringLock, NULL);
+#endif
+  return state;
+}
+
+
+
+// ============================================================================
+// Open the BFS disk at 'path' and keep its descriptor for all later block IO,
+// carried out by 'backend': BIOSTDIO, BIOPREAD, BIOURING or BIOMMAP, or
+// BIODEFAULT for BIOPREAD.  If the backend cannot be set up - say, the
+// kernel has no io_uring - fall back to BIOPREAD: see bioBackendName.  Until
+// bioSetGeometry is called, blocks are BYTESPERBLOCK bytes.  On success,
+// return 0.  On failure, abort
+// ============================================================================
+i32 bioOpen(str path, i32 backend) {
+
+  if (path == NULL) FATAL(ENULLPTR);
+  if (backend == BIODEFAULT) backend = BIOPREAD;
+  if (backend < BIOSTDIO || backend > BIOMMAP) FATAL(EBADBACKEND);
+
+  if (g_diskFd >= 0) bioClose();        // re-mount: drop the old handle
+
+  g_diskFd = open(path, O_RDWR);
+  if (g_diskFd < 0) FATAL(ENODISK);
+
+  g_backend = &g_backends[backend];
+  if (g_backend->open() != 0) g_backend = &g_backends[BIOPREAD];
+
+  g_bytesPerBlock = BYTESPERBLOCK;      // enough to read the SuperBlock
+  g_numBlocks     = INT_MAX;
+
+  return 0;
+}
+
+
+
+// ============================================================================
+// Complete, without blocking, any requests that have finished, running their
+// callbacks on this thread.  Return how many were completed.  If another
+// thread is already reaping, return 0 at once
+// ============================================================================
+i32 bioPoll() {
+  if (g_backend == NULL) return 0;
+
+  pthread_mutex_lock(&g_bioLock);
+  i32 busy = g_bioReaping;
+  g_bioReaping = 1;
+  pthread_mutex_unlock(&g_bioLock);
+  if (busy) return 0;
+
+  i32 num = g_backend->reap(0);
+
+  pthread_mutex_lock(&g_bioLock);
+  g_bioReaping = 0;
+  pthread_cond_broadcast(&g_bioCond);
+  pthread_mutex_unlock(&g_bioLock);
+  return num;
+}
+
+
+
+// ============================================================================
+// Read one block from block number 'dbn' in the BFS disk into buffer 'buf'
 // ============================================================================
 i32 bioRead(i32 dbn, void* buf) {
+  BioVec vec = { dbn, buf };
+  return bioTransfer(BIOREAD, &vec, 1);
+}
 
-  if (dbn < 0)             FATAL(EBADDBN);
-  if (dbn > BLOCKSPERDISK) FATAL(EBADDBN);
 
-  FILE* fp = fopen(BFSDISK, "rb+");
-  if (fp == NULL) FATAL(ENODISK);
 
-  i32 boff = dbn * BYTESPERBLOCK;
-  i32 ret  = fseek(fp, boff, SEEK_SET);
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+// ============================================================================
+// Read the 'num' blocks described by 'vec'.  Runs of contiguous DBNs are
+// merged into a single request, and all are in flight at once
+// ============================================================================
+i32 bioReadv(BioVec* vec, i32 num) {
+  return bioTransfer(BIOREAD, vec, num);
+}
+
 
-  i32 numb = fread(buf, 1, BYTESPERBLOCK, fp);
-  if (numb != BYTESPERBLOCK) { fclose(fp); FATAL(EBADREAD); }
 
-  fclose(fp);
+// ============================================================================
+// Set the block size and # of blocks of the open disk, from its SuperBlock
+// ============================================================================
+i32 bioSetGeometry(i32 bytesPerBlock, i32 numBlocks) {
+  g_bytesPerBlock = bytesPerBlock;
+  g_numBlocks     = numBlocks;
   return 0;
 }
 
 
+
 // ============================================================================
-// Write 512 bytes from 'buf' into block number 'dbn' of the BFS disk
+// Start request 'req': 'op', 'dbn', 'iov' and 'numIov' describe it, and each
+// iovec must be one block long.  'callback', if not NULL, is run once it
+// completes - perhaps on another thread, perhaps before bioSubmit returns.
+// Its memory must stay valid until then.  On success, return 0.  On
+// failure, abort
 // ============================================================================
-i32 bioWrite(i32 dbn, void* buf) {
+i32 bioSubmit(BioReq* req) {
 
-  FILE* fp = fopen(BFSDISK, "rb+");
-  if (fp == NULL) FATAL(ENODISK);
+  if (req == NULL || req->iov == NULL) FATAL(ENULLPTR);
+  if (g_diskFd < 0)                    FATAL(ENODISK);
+  if (req->dbn < 0 || req->numIov <= 0 || req->numIov > IOV_MAX) {
+    FATAL(EBADDBN);
+  }
+  if ((i64)req->dbn + req->numIov > g_numBlocks) FATAL(EBADDBN);
 
-  i32 boff = dbn * BYTESPERBLOCK;
-  i32 ret  = fseek(fp, boff, SEEK_SET);
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+  req->result = 0;
+  req->done   = 0;
+  statsIo(req->op, req->dbn, req->numIov);
+  TRACE(req->op == BIOREAD ? TRCBIOREAD : TRCBIOWRITE, req->dbn, req->numIov,
+        0, statsNow(), NULL);
+  g_backend->submit(req);
+  return 0;
+}
 
-  i32 numb = fwrite(buf, 1, BYTESPERBLOCK, fp);
-  if (numb != BYTESPERBLOCK) { fclose(fp); FATAL(EBADWRITE); }
 
-  fclose(fp);
 
+// ============================================================================
+// Make every completed write durable in BFSDISK: msync for BIOMMAP, or else
+// fdatasync.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bioSync() {
+  if (g_diskFd < 0) FATAL(ENODISK);
+  if (g_backend->sync() != 0) FATAL(EBADWRITE);
   return 0;
 }
+
+
+
+// ============================================================================
+// Wait for request 'req', started by bioSubmit, to complete.  Whichever
+// waiter gets there first reaps completions for all; the rest sleep until it
+// is done.  Return the request's result: 0, or EBADREAD or EBADWRITE
+// ============================================================================
+i32 bioWait(BioReq* req) {
+
+  if (req == NULL) FATAL(ENULLPTR);
+
+  while (!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&g_bioLock);
+    if (g_bioReaping) {
+      if (!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&g_bioCond, &g_bioLock);
+      }
+      pthread_mutex_unlock(&g_bioLock);
+      continue;
+    }
+    g_bioReaping = 1;
+    pthread_mutex_unlock(&g_bioLock);
+
+    if (!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) g_backend->reap(1);
+
+    pthread_mutex_lock(&g_bioLock);
+    g_bioReaping = 0;
+    pthread_cond_broadcast(&g_bioCond);
+    pthread_mutex_unlock(&g_bioLock);
+  }
+
+  return req->result;
+}
+
+
+
+// ============================================================================
+// Write one block from 'buf' into block number 'dbn' of the BFS disk
+// ============================================================================
+i32 bioWrite(i32 dbn, void* buf) {
+  BioVec vec = { dbn, buf };
+  return bioTransfer(BIOWRITE, &vec, 1);
+}
+
+
+
+// ============================================================================
+// Write the 'num' blocks described by 'vec'.  Runs of contiguous DBNs are
+// merged into a single request, and all are in flight at once
+// ============================================================================
+i32 bioWritev(BioVec* vec, i32 num) {
+  return bioTransfer(BIOWRITE, vec, num);
+}
@@ -7,10 +7,52 @@
 // ===================================================================
 
 #include <stdio.h>
+#include <sys/uio.h>
 
 #include "alias.h"
 
-i32 bioRead (i32 dbn, void* buf);
-i32 bioWrite(i32 dbn, void* buf);
+#define BIODEFAULT 0      // backends for bioOpen: BIOPREAD
+#define BIOSTDIO   1      //   fseek + fread/fwrite on a FILE*
+#define BIOPREAD   2      //   preadv/pwritev, done at submit
+#define BIOURING   3      //   io_uring: many requests in flight
+#define BIOMMAP    4      //   memcpy to and from a mapping of BFSDISK
 
-#endif
\ No newline at end of file
+#define BIOREAD    0      // BioReq.op
+#define BIOWRITE   1
+
+typedef struct {          // one block of a vectored transfer
+  i32   dbn;              // DBN to read or write
+  void* buf;              // one block of memory
+} BioVec;
+
+typedef struct BioReq {   // one run of contiguous blocks.  See bioSubmit
+  i32           op;       // BIOREAD or BIOWRITE
+  i32           dbn;      // first DBN of the run
+  struct iovec* iov;      // one block per entry, for dbn, dbn + 1, ...
+  i32           numIov;   // # of entries in 'iov'
+  i32           result;   // once done: 0, or EBADREAD or EBADWRITE
+  i32           done;     // 1 => complete.  Set last
+  void        (*callback)(struct BioReq* req);  // on completion, or NULL
+  void*         arg;      // for use by 'callback'
+} BioReq;
+
+typedef struct BioState BioState;     // one volume's disk: see vol.h
+
+str bioBackendName();
+i32 bioClose ();
+i32 bioCopy  (str path, i32 (*used)(i32 dbn));
+i32 bioFreeState(BioState* state);
+void* bioMap (i32 dbn);
+BioState* bioNewState();
+i32 bioOpen  (str path, i32 backend);
+i32 bioPoll  ();
+i32 bioRead  (i32 dbn, void* buf);
+i32 bioReadv (BioVec* vec, i32 num);
+i32 bioSetGeometry(i32 bytesPerBlock, i32 numBlocks);
+i32 bioSubmit(BioReq* req);
+i32 bioSync  ();
+i32 bioWait  (BioReq* req);
+i32 bioWrite (i32 dbn, void* buf);
+i32 bioWritev(BioVec* vec, i32 num);
+
+#endif
@@ -0,0 +1,502 @@
+// ============================================================================
+// cache.c - write-back LRU block buffer cache
+//
+// Blocks are kept in 'numBufs' buffers, chained into an LRU list (most
+// recently used at the head) and into a hash table keyed on DBN.  Writes
+// only mark the buffer dirty; dirty buffers reach BFSDISK when they are
+// evicted, or when cacheFlush/cacheFree is called (fsClose, fsUnmount).
+// cacheReadv and cacheWritev, used for file data, bypass the buffers but keep
+// them coherent.  Until cacheInit is called, all IO goes straight to bio.
+// Every block written has its checksum set, and every block read from
+// BFSDISK has it checked: see csum.c.
+// With a journal, cacheWrite logs each block there instead, and leaves the
+// buffer clean: the journal writes it back.  A miss then checks the journal
+// for a newer copy before reading BFSDISK.
+//
+// One mutex, g_cacheLock, guards the buffers.  It is not held across the
+// bioReadv or bioWritev of file data, which the callers' Inode locks keep
+// apart from other writers of the same blocks.  It is taken before the
+// journal's lock, and the checksum table's
+// ============================================================================
+
+#include <pthread.h>
+
+#include "bfs.h"
+#include "cache.h"
+
+typedef struct {          // one cache buffer
+  i32 dbn;                // DBN held.  -1 => buffer not used
+  i32 dirty;              // 1 => must be written back before reuse
+  i32 prev;               // LRU neighbour, towards the head
+  i32 next;               // LRU neighbour, towards the tail
+  i32 hnext;              // next buffer in the same hash chain
+  i8* data;               // one block
+} CacheBuf;
+
+struct CacheState {       // one volume's cache.  See cacheNewState
+  struct {
+    CacheBuf*  bufs;      // the buffers
+    i32        numBufs;   // 0 => cache not initialized
+    i32*       hash;      // heads of the hash chains
+    i32        numHash;   // # of hash chains (power of 2)
+    i32        blockSize; // bytes per buffer
+    i32        head;      // most recently used buffer
+    i32        tail;      // least recently used buffer
+    i8*        mem;       // numBufs * blockSize bytes of block data
+    CacheStats stats;
+  } cache;
+  pthread_mutex_t lock;
+};
+
+#define g_cache     (t_vol->cache->cache)
+#define g_cacheLock (t_vol->cache->lock)
+
+
+
+// ============================================================================
+// Hash chain for block 'dbn'
+// ============================================================================
+static i32 cacheHash(i32 dbn) { return dbn & (g_cache.numHash - 1); }
+
+
+
+// ============================================================================
+// Return the buffer holding 'dbn', or -1 if not cached
+// ============================================================================
+static i32 cacheFind(i32 dbn) {
+  for (i32 b = g_cache.hash[cacheHash(dbn)]; b >= 0; b = g_cache.bufs[b].hnext) {
+    if (g_cache.bufs[b].dbn == dbn) return b;
+  }
+  return -1;
+}
+
+
+
+// ============================================================================
+// Unlink buffer 'b' from the LRU list
+// ============================================================================
+static void cacheUnlink(i32 b) {
+  CacheBuf* cb = &g_cache.bufs[b];
+  if (cb->prev >= 0) g_cache.bufs[cb->prev].next = cb->next;
+  else               g_cache.head = cb->next;
+  if (cb->next >= 0) g_cache.bufs[cb->next].prev = cb->prev;
+  else               g_cache.tail = cb->prev;
+  cb->prev = cb->next = -1;
+}
+
+
+
+// ============================================================================
+// Move buffer 'b' to the head (most recently used end) of the LRU list
+// ============================================================================
+static void cacheTouch(i32 b) {
+  if (g_cache.head == b) return;
+  cacheUnlink(b);
+  CacheBuf* cb = &g_cache.bufs[b];
+  cb->next = g_cache.head;
+  if (g_cache.head >= 0) g_cache.bufs[g_cache.head].prev = b;
+  g_cache.head = b;
+  if (g_cache.tail < 0) g_cache.tail = b;
+}
+
+
+
+// ============================================================================
+// Remove buffer 'b' from its hash chain
+// ============================================================================
+static void cacheUnhash(i32 b) {
+  i32* link = &g_cache.hash[cacheHash(g_cache.bufs[b].dbn)];
+  while (*link != b) link = &g_cache.bufs[*link].hnext;
+  *link = g_cache.bufs[b].hnext;
+  g_cache.bufs[b].hnext = -1;
+}
+
+
+
+// ============================================================================
+// Write buffer 'b' back to BFSDISK if it is dirty
+// ============================================================================
+static void cacheClean(i32 b) {
+  CacheBuf* cb = &g_cache.bufs[b];
+  if (cb->dbn < 0 || !cb->dirty) return;
+  bioWrite(cb->dbn, cb->data);
+  cb->dirty = 0;
+  ++g_cache.stats.writebacks;
+}
+
+
+
+// ============================================================================
+// Claim the least recently used buffer for block 'dbn', writing back its
+// old contents if dirty.  Return the buffer, now at the head of the LRU list
+// ============================================================================
+static i32 cacheClaim(i32 dbn) {
+  i32 b = g_cache.tail;
+  CacheBuf* cb = &g_cache.bufs[b];
+
+  if (cb->dbn >= 0) {
+    cacheClean(b);
+    cacheUnhash(b);
+  }
+
+  cb->dbn   = dbn;
+  cb->dirty = 0;
+  i32 h = cacheHash(dbn);
+  cb->hnext = g_cache.hash[h];
+  g_cache.hash[h] = b;
+
+  cacheTouch(b);
+  return b;
+}
+
+
+
+// ============================================================================
+// Order BioVecs by DBN, for qsort
+// ============================================================================
+static int cacheCompare(const void* a, const void* b) {
+  i32 x = ((BioVec*)a)->dbn;
+  i32 y = ((BioVec*)b)->dbn;
+  return (x > y) - (x < y);
+}
+
+
+
+// ============================================================================
+// Check the 'num' blocks described by 'vec', just read from BFSDISK, against
+// their checksums.  FATAL if one does not match
+// ============================================================================
+static void cacheCheck(BioVec* vec, i32 num) {
+  for (i32 i = 0; i < num; ++i) {
+    if (csumCheck(vec[i].dbn, vec[i].buf) != 0) FATAL(EBADCSUM);
+  }
+}
+
+
+
+// ============================================================================
+// Write every dirty buffer back to BFSDISK with one bioWritev, in DBN order,
+// so neighbouring blocks go out as single requests.  The caller holds
+// g_cacheLock
+// ============================================================================
+static void cacheCleanAll() {
+  if (g_cache.numBufs == 0) return;     // no cache
+
+  BioVec* vec = malloc(g_cache.numBufs * sizeof(BioVec));
+  if (vec == NULL) FATAL(ENOMEM);
+
+  i32 num = 0;
+  for (i32 b = 0; b < g_cache.numBufs; ++b) {
+    CacheBuf* cb = &g_cache.bufs[b];
+    if (cb->dbn < 0 || !cb->dirty) continue;
+    vec[num].dbn   = cb->dbn;
+    vec[num++].buf = cb->data;
+    cb->dirty = 0;
+  }
+
+  qsort(vec, num, sizeof(BioVec), cacheCompare);
+  bioWritev(vec, num);
+  g_cache.stats.writebacks += num;
+  free(vec);
+}
+
+
+
+// ============================================================================
+// Write every dirty buffer back to BFSDISK, in DBN order.  Buffers stay
+// cached
+// ============================================================================
+i32 cacheFlush() {
+  pthread_mutex_lock(&g_cacheLock);
+  cacheCleanAll();
+  pthread_mutex_unlock(&g_cacheLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Flush the cache and release its memory.  Later reads and writes go
+// straight to bio until the next cacheInit
+// ============================================================================
+i32 cacheFree() {
+  pthread_mutex_lock(&g_cacheLock);
+  cacheCleanAll();
+  free(g_cache.bufs);
+  free(g_cache.hash);
+  free(g_cache.mem);
+  memset(&g_cache, 0, sizeof(g_cache));
+  pthread_mutex_unlock(&g_cacheLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Free 'state', made by cacheNewState.  Its cache must be freed already
+// ============================================================================
+i32 cacheFreeState(CacheState* state) {
+  if (state == NULL)                FATAL(ENULLPTR);
+  if (state->cache.numBufs != 0)    FATAL(EBADVOLUME);
+  pthread_mutex_destroy(&state->lock);
+  free(state);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Copy the cache counters into 'stats'
+// ============================================================================
+i32 cacheGetStats(CacheStats* stats) {
+  if (stats == NULL) FATAL(ENULLPTR);
+  pthread_mutex_lock(&g_cacheLock);
+  *stats = g_cache.stats;
+  pthread_mutex_unlock(&g_cacheLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Set up a cache of 'numBlocks' buffers of 'bytesPerBlock' bytes each,
+// dropping any previous cache.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 cacheInit(i32 numBlocks, i32 bytesPerBlock) {
+
+  if (numBlocks < 1) FATAL(EBIGNUMB);
+
+  cacheFree();
+  pthread_mutex_lock(&g_cacheLock);
+
+  i32 numHash = 1;
+  while (numHash < 2 * numBlocks) numHash <<= 1;
+
+  g_cache.bufs = malloc(numBlocks * sizeof(CacheBuf));
+  g_cache.hash = malloc(numHash * sizeof(i32));
+  g_cache.mem  = malloc((size_t)numBlocks * bytesPerBlock);
+  if (g_cache.bufs == NULL || g_cache.hash == NULL || g_cache.mem == NULL) {
+    FATAL(ENOMEM);
+  }
+
+  g_cache.numBufs = numBlocks;
+  g_cache.numHash = numHash;
+  g_cache.blockSize = bytesPerBlock;
+  for (i32 h = 0; h < numHash; ++h) g_cache.hash[h] = -1;
+
+  for (i32 b = 0; b < numBlocks; ++b) {   // chain all buffers, 0 at head
+    CacheBuf* cb = &g_cache.bufs[b];
+    cb->dbn   = -1;
+    cb->dirty = 0;
+    cb->prev  = b - 1;
+    cb->next  = (b + 1 < numBlocks) ? b + 1 : -1;
+    cb->hnext = -1;
+    cb->data  = g_cache.mem + (size_t)b * bytesPerBlock;
+  }
+  g_cache.head = 0;
+  g_cache.tail = numBlocks - 1;
+
+  pthread_mutex_unlock(&g_cacheLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return the cache state of a new volume, with no cache set up.  See vol.c
+// ============================================================================
+CacheState* cacheNewState() {
+  CacheState* state = calloc(1, sizeof(CacheState));
+  if (state == NULL) FATAL(ENOMEM);
+  pthread_mutex_init(&state->lock, NULL);
+  return state;
+}
+
+
+
+// ============================================================================
+// Bring the blocks 'dbns[0]' .. 'dbns[num - 1]' into the cache, so that the
+// reads that follow are hits.  Blocks already cached are left alone, and the
+// rest are read with one bioReadv.  The lock is held across that read, so
+// no one sees a buffer before it is filled.  At most half the cache is used
+// ============================================================================
+i32 cachePrefetch(i32* dbns, i32 num) {
+
+  if (dbns == NULL) FATAL(ENULLPTR);
+
+  pthread_mutex_lock(&g_cacheLock);
+  if (num > g_cache.numBufs / 2) num = g_cache.numBufs / 2;
+  if (num <= 0) {
+    pthread_mutex_unlock(&g_cacheLock);
+    return 0;
+  }
+
+  BioVec* vec     = malloc(num * sizeof(BioVec));
+  if (vec == NULL) FATAL(ENOMEM);
+  i32     numMiss = 0;
+  for (i32 i = 0; i < num; ++i) {
+    if (cacheFind(dbns[i]) >= 0) continue;
+    i32 b = cacheClaim(dbns[i]);
+    vec[numMiss].dbn = dbns[i];
+    vec[numMiss].buf = g_cache.bufs[b].data;
+    ++numMiss;
+  }
+
+  bioReadv(vec, numMiss);
+  cacheCheck(vec, numMiss);
+  g_cache.stats.prefetches += numMiss;
+  pthread_mutex_unlock(&g_cacheLock);
+  free(vec);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read block 'dbn' into 'buf', from the cache if present
+// ============================================================================
+i32 cacheRead(i32 dbn, void* buf) {
+
+  pthread_mutex_lock(&g_cacheLock);
+  if (g_cache.numBufs == 0) {
+    pthread_mutex_unlock(&g_cacheLock);
+    if (!jnlRead(dbn, buf)) {
+      bioRead(dbn, buf);
+      if (csumCheck(dbn, buf) != 0) FATAL(EBADCSUM);
+    }
+    return 0;
+  }
+
+  i32 b = cacheFind(dbn);
+  if (b >= 0) {
+    ++g_cache.stats.hits;
+    STATSADD(cacheHits, 1);
+    cacheTouch(b);
+  } else {
+    ++g_cache.stats.misses;
+    STATSADD(cacheMisses, 1);
+    b = cacheClaim(dbn);
+    if (!jnlRead(dbn, g_cache.bufs[b].data)) {
+      bioRead(dbn, g_cache.bufs[b].data);
+      if (csumCheck(dbn, g_cache.bufs[b].data) != 0) FATAL(EBADCSUM);
+    }
+  }
+
+  memcpy(buf, g_cache.bufs[b].data, g_cache.blockSize);
+  pthread_mutex_unlock(&g_cacheLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read the 'num' blocks described by 'vec'.  Cached blocks are copied from
+// the cache; the rest are read with one bioReadv, without being cached, so
+// a large transfer does not evict the metadata blocks
+// ============================================================================
+i32 cacheReadv(BioVec* vec, i32 num) {
+
+  if (vec == NULL) FATAL(ENULLPTR);
+
+  BioVec* miss = malloc(num * sizeof(BioVec));
+  if (miss == NULL) FATAL(ENOMEM);
+  i32 numMiss = 0;
+
+  pthread_mutex_lock(&g_cacheLock);
+  if (g_cache.numBufs == 0) {
+    pthread_mutex_unlock(&g_cacheLock);
+    free(miss);
+    bioReadv(vec, num);
+    cacheCheck(vec, num);
+    return 0;
+  }
+
+  for (i32 i = 0; i < num; ++i) {
+    i32 b = cacheFind(vec[i].dbn);
+    if (b >= 0) {
+      ++g_cache.stats.hits;
+      STATSADD(cacheHits, 1);
+      cacheTouch(b);
+      memcpy(vec[i].buf, g_cache.bufs[b].data, g_cache.blockSize);
+    } else {
+      ++g_cache.stats.misses;
+      STATSADD(cacheMisses, 1);
+      miss[numMiss++] = vec[i];
+    }
+  }
+  pthread_mutex_unlock(&g_cacheLock);
+
+  bioReadv(miss, numMiss);
+  cacheCheck(miss, numMiss);
+  free(miss);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Zero the cache counters
+// ============================================================================
+i32 cacheResetStats() {
+  pthread_mutex_lock(&g_cacheLock);
+  memset(&g_cache.stats, 0, sizeof(CacheStats));
+  pthread_mutex_unlock(&g_cacheLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write 'buf' into block 'dbn'.  The block is only marked dirty: it reaches
+// BFSDISK when evicted, or on the next cacheFlush.  With a journal, it is
+// logged there instead
+// ============================================================================
+i32 cacheWrite(i32 dbn, void* buf) {
+
+  csumSet(dbn, buf);
+  pthread_mutex_lock(&g_cacheLock);
+  i32 logged = jnlLog(dbn, buf);
+  if (g_cache.numBufs == 0) {
+    pthread_mutex_unlock(&g_cacheLock);
+    return logged ? 0 : bioWrite(dbn, buf);
+  }
+
+  i32 b = cacheFind(dbn);
+  if (b >= 0) {
+    ++g_cache.stats.hits;
+    STATSADD(cacheHits, 1);
+    cacheTouch(b);
+  } else {
+    ++g_cache.stats.misses;          // whole block written: no need to read
+    STATSADD(cacheMisses, 1);
+    b = cacheClaim(dbn);
+  }
+
+  memcpy(g_cache.bufs[b].data, buf, g_cache.blockSize);
+  g_cache.bufs[b].dirty = !logged;
+  pthread_mutex_unlock(&g_cacheLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write the 'num' blocks described by 'vec' straight to BFSDISK with one
+// bioWritev.  Any cached copies are updated and left clean
+// ============================================================================
+i32 cacheWritev(BioVec* vec, i32 num) {
+
+  if (vec == NULL) FATAL(ENULLPTR);
+
+  for (i32 i = 0; i < num; ++i) csumSet(vec[i].dbn, vec[i].buf);
+  pthread_mutex_lock(&g_cacheLock);
+  for (i32 i = 0; g_cache.numBufs > 0 && i < num; ++i) {
+    i32 b = cacheFind(vec[i].dbn);
+    if (b < 0) continue;
+    memcpy(g_cache.bufs[b].data, vec[i].buf, g_cache.blockSize);
+    g_cache.bufs[b].dirty = 0;
+  }
+  pthread_mutex_unlock(&g_cacheLock);
+
+  return bioWritev(vec, num);
+}
@@ -0,0 +1,36 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+// ===================================================================
+// cache.h - Write-back LRU block buffer cache.  Sits between the bfs
+// layer and block IO (bio)
+// ===================================================================
+
+#include "alias.h"
+#include "bio.h"
+
+#define CACHEBLOCKS   16          // default # of blocks held in the cache
+
+typedef struct {          // Cache counters, for sizing the cache
+  i64 hits;               // cacheRead/cacheWrite found the block cached
+  i64 misses;             // block had to be brought into the cache
+  i64 writebacks;         // dirty blocks written to BFSDISK
+  i64 prefetches;         // blocks brought in ahead of use by cachePrefetch
+} CacheStats;
+
+typedef struct CacheState CacheState; // one volume's cache: see vol.h
+
+i32 cacheFlush();
+i32 cacheFree();
+i32 cacheFreeState(CacheState* state);
+i32 cacheGetStats(CacheStats* stats);
+i32 cacheInit(i32 numBlocks, i32 bytesPerBlock);
+CacheState* cacheNewState();
+i32 cachePrefetch(i32* dbns, i32 num);
+i32 cacheRead (i32 dbn, void* buf);
+i32 cacheReadv(BioVec* vec, i32 num);
+i32 cacheResetStats();
+i32 cacheWrite (i32 dbn, void* buf);
+i32 cacheWritev(BioVec* vec, i32 num);
+
+#endif
@@ -0,0 +1,157 @@
+// ============================================================================
+// comp.c - run-length codec for the clusters of compressed files
+//
+// The coded form is a series of tokens.  Each starts with a varint - 7 bits
+// a byte, low bits first - holding 'len << 1 | run'.  A run (run = 1) is
+// then one byte value, to repeat 'len' times; a literal (run = 0) is 'len'
+// bytes, copied as they are.  Only runs of at least COMPMINRUN bytes are
+// coded as runs, so a token never costs more than it saves.
+//
+// The work is done a u64 at a time.  The encoder finds where a run ends by
+// XORing each word with the run's byte copied into every lane, then
+// counting the zero bytes at the low end.  While it is in a literal, it
+// steps COMPMINRUN bytes at a time wherever no run can start in between.
+// The decoder leaves runs to memset and literals to memcpy, which libc
+// vectorizes.  No intrinsics are needed, so the codec builds anywhere
+// ============================================================================
+
+#include "bfs.h"
+#include "comp.h"
+
+#define COMPLANES     0x0101010101010101ull  // one byte, in each lane of a u64
+
+
+
+// ============================================================================
+// Return the length of the run of byte p[0] that starts at 'p', looking at
+// no more than 'max' bytes
+// ============================================================================
+static i32 compRunLength(u8* p, i32 max) {
+  u64 lanes = p[0] * COMPLANES;
+  i32 n     = 0;
+
+  while (n + (i32)sizeof(u64) <= max) {
+    u64 word;
+    memcpy(&word, p + n, sizeof(u64));
+    u64 diff = word ^ lanes;
+    if (diff != 0) {                        // first byte that differs
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      return n + __builtin_clzll(diff) / 8;
+#else
+      return n + __builtin_ctzll(diff) / 8;
+#endif
+    }
+    n += sizeof(u64);
+  }
+  while (n < max && p[n] == p[0]) ++n;
+  return n;
+}
+
+
+
+// ============================================================================
+// Append varint 'v' to 'dst' at 'pos', which holds 'cap' bytes.  Return the
+// new 'pos', or -1 if there is no room
+// ============================================================================
+static i32 compPutVarint(u8* dst, i32 pos, i32 cap, u32 v) {
+  do {
+    if (pos >= cap) return -1;
+    dst[pos++] = (v & 0x7f) | ((v > 0x7f) ? 0x80 : 0);
+    v >>= 7;
+  } while (v != 0);
+  return pos;
+}
+
+
+
+// ============================================================================
+// Append the literal of 'len' bytes at 'src' to 'dst' at 'pos'.  Return the
+// new 'pos', or -1 if there is no room in the 'cap' bytes of 'dst'
+// ============================================================================
+static i32 compPutLiteral(u8* dst, i32 pos, i32 cap, u8* src, i32 len) {
+  if (len == 0) return pos;
+  pos = compPutVarint(dst, pos, cap, (u32)len << 1);
+  if (pos < 0 || len > cap - pos) return -1;
+  memcpy(dst + pos, src, len);
+  return pos + len;
+}
+
+
+
+// ============================================================================
+// Decode the 'srcLen' bytes at 'src', made by compEncode, into the 'dstLen'
+// bytes at 'dst'.  Return 0, or EBADCOMP unless they decode to exactly
+// 'dstLen' bytes
+// ============================================================================
+i32 compDecode(void* src, i32 srcLen, void* dst, i32 dstLen) {
+
+  if (src == NULL || dst == NULL) FATAL(ENULLPTR);
+
+  u8* in  = (u8*)src;
+  u8* out = (u8*)dst;
+  i32 pos = 0;
+  i32 got = 0;
+
+  while (pos < srcLen) {
+    u32 v     = 0;
+    i32 shift = 0;
+    do {
+      if (pos >= srcLen || shift > 28) return EBADCOMP;
+      v |= (u32)(in[pos] & 0x7f) << shift;
+      shift += 7;
+    } while (in[pos++] & 0x80);
+
+    i32 len = (i32)(v >> 1);
+    if (len > dstLen - got) return EBADCOMP;
+    if (v & 1) {                            // run
+      if (pos >= srcLen) return EBADCOMP;
+      memset(out + got, in[pos++], len);
+    } else {                                // literal
+      if (len > srcLen - pos) return EBADCOMP;
+      memcpy(out + got, in + pos, len);
+      pos += len;
+    }
+    got += len;
+  }
+  return (got == dstLen) ? 0 : EBADCOMP;
+}
+
+
+
+// ============================================================================
+// Encode the 'srcLen' bytes at 'src' into 'dst', which has room for 'dstCap'
+// bytes.  Return the # of bytes written, or -1 if they do not fit
+// ============================================================================
+i32 compEncode(void* src, i32 srcLen, void* dst, i32 dstCap) {
+
+  if (src == NULL || dst == NULL) FATAL(ENULLPTR);
+
+  u8* in  = (u8*)src;
+  u8* out = (u8*)dst;
+  i32 pos = 0;
+  i32 lit = 0;                              // start of the pending literal
+  i32 i   = 0;
+
+  while (i < srcLen) {
+    if (srcLen - i >= COMPMINRUN &&
+        compRunLength(in + i, COMPMINRUN) == COMPMINRUN) {
+      i32 len = compRunLength(in + i, srcLen - i);
+      pos = compPutLiteral(out, pos, dstCap, in + lit, i - lit);
+      if (pos >= 0) pos = compPutVarint(out, pos, dstCap, (u32)len << 1 | 1);
+      if (pos < 0 || pos >= dstCap) return -1;
+      out[pos++] = in[i];
+      i  += len;
+      lit = i;
+      continue;
+    }
+
+    // No run starts at 'i'.  One starting in the next COMPMINRUN - 1 bytes
+    // would cover both of the bytes either side of i + COMPMINRUN - 1
+
+    i32 edge = i + COMPMINRUN - 1;
+    if (edge + 1 < srcLen && in[edge] != in[edge + 1]) i += COMPMINRUN;
+    else                                               ++i;
+  }
+
+  return compPutLiteral(out, pos, dstCap, in + lit, srcLen - lit);
+}
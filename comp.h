@@ -0,0 +1,16 @@
+#ifndef COMP_H
+#define COMP_H
+
+// ===================================================================
+// comp.h - Run-length codec for the clusters of compressed files.
+// See bfsWriteCluster
+// ===================================================================
+
+#include "alias.h"
+
+#define COMPMINRUN    8           // shortest run of one byte value coded
+
+i32 compDecode(void* src, i32 srcLen, void* dst, i32 dstLen);
+i32 compEncode(void* src, i32 srcLen, void* dst, i32 dstCap);
+
+#endif
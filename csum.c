@@ -0,0 +1,577 @@
+// ============================================================================
+// csum.c - CRC32C checksums of data blocks, and the scrubber
+//
+// From version 8 every disk keeps a table of one u32 per DBN, after the
+// bitmap - as do disks of versions 6 and 7 that have a journal: the CRC32C
+// of what the block last had written to it, or 0 for a block whose contents
+// are not known - free, or never written.  The table is held in memory while
+// the disk is mounted.  Only DBNs from the first past the metadata regions are
+// covered: file data, and indirect blocks.  The regions below are loaded at
+// mount, and reach the disk through the journal, which keeps checksums of
+// its own.
+//
+// The cache sets a block's checksum as each block is written, with csumSet,
+// and checks it with csumCheck as each block is read from BFSDISK - not one
+// found in the cache or the journal.  csumSync writes the changed table
+// blocks through cacheWrite, so they join the commit of the metadata they
+// describe.  Indirect blocks, and file data written to newly allocated
+// blocks, are then always in step with the table, even after a crash.
+//
+// File data overwritten in place would not be: it reaches the disk before
+// the commit that holds its new checksum.  So a block whose checksum has
+// been committed - 'sealed', see csumSealed - is not overwritten in place
+// until a commit has set its entry on disk to 0, 'not known'.  Before a
+// write, fs.c calls csumHeat on each block it overwrites.  That marks the
+// block's table block 'hot', and if the block is sealed, commits.  Each
+// commit writes a hot table block with every entry 0, while the table in
+// memory keeps the true checksums, so reads are still checked while the
+// disk is mounted.  Once a table block has had no writes for HOTCOMMITS
+// commits, or at unmount, it cools: the next commit writes its true
+// checksums, and seals its blocks again.  So a file being rewritten costs
+// one commit per table block it touches, keeps its blocks where they are,
+// and after a crash its blocks in hot table blocks are just not checked.
+// A sealed block that is written without csumHeat - a race with the commit
+// that cools it, or the tail of fsTruncate - moves its FBN to a new block,
+// as for a block shared by fsClone, and the old block is freed once the
+// write commits: see bfsRelocate.  A block written since the last commit
+// may be written again in place, since nothing on disk yet depends on it.
+// Without a journal nothing is sealed: the table is written in place along
+// with the other metadata, and a crash may leave it out of step, as it may
+// the rest.
+//
+// CRC32C is worked out 8 bytes at a time: with the SSE4.2 crc32 instruction
+// on x86-64 CPUs that have it, with the ARMv8 crc32c instructions when the
+// build targets them, and otherwise in software, slicing by 8.
+//
+// g_csumLock guards g_csumState, the dirty flags and hot counts, and the
+// table against csumSync's copy.
+// Table entries are also loaded and stored atomically, so csumCheck takes
+// no lock.  It is taken after the cache lock, and no other lock is taken
+// while it is held
+// ============================================================================
+
+#include <pthread.h>
+
+#include "bfs.h"
+#include "csum.h"
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define CRC32CPOLY    0x82f63b78u     // reflected Castagnoli polynomial
+#define SCRUBMAXTHREADS 64            // most csumScrub threads
+
+#define CSUMSEALED    1               // g_csumState: checksum may be on disk
+#define HOTCOMMITS    4               // quiet commits before a hot block cools
+
+struct CsumState {        // one volume's table.  See csumNewState
+  pthread_mutex_t lock;
+  u32* csums;                         // one per DBN.  NULL => no table
+  u8*  state;                         // one per DBN: CSUMSEALED, or 0
+  u8*  dirty;                         // one per table block: 1 => changed
+  u8*  hot;                           // one per table block: commits left
+                                      // while on disk as 0s.  0 => not hot
+  i32  dbn;                           // first block of the table
+  i32  tableBlocks;
+  i32  first;                         // first DBN covered
+  i32  blocks;                        // # of DBNs on the disk
+  i32  bps;                           // bytes per block
+};
+
+#define g_csumLock        (t_vol->csum->lock)
+#define g_csums           (t_vol->csum->csums)
+#define g_csumState       (t_vol->csum->state)
+#define g_csumDirty       (t_vol->csum->dirty)
+#define g_csumHot         (t_vol->csum->hot)
+#define g_csumDbn         (t_vol->csum->dbn)
+#define g_csumTableBlocks (t_vol->csum->tableBlocks)
+#define g_csumFirst       (t_vol->csum->first)
+#define g_csumBlocks      (t_vol->csum->blocks)
+#define g_csumBps         (t_vol->csum->bps)
+
+static pthread_once_t g_csumOnce = PTHREAD_ONCE_INIT;
+static u32  g_csumTable[8][256];      // software CRC32C, slicing by 8
+static u32 (*g_csumImpl)(u32 crc, u8* p, i32 numb) = NULL;
+static str  g_csumImplName = "software";
+
+typedef struct {          // shared by the threads of one csumScrub
+  i32             next;   // first DBN of the next run to read
+  ScrubStats      stats;
+  pthread_mutex_t lock;   // guards 'stats'
+} Scrub;
+
+
+
+// ============================================================================
+// Return 'crc', a CRC32C not yet inverted, updated by the 'numb' bytes at
+// 'p', in software: 8 bytes at a time through g_csumTable
+// ============================================================================
+static u32 csumCrcSoft(u32 crc, u8* p, i32 numb) {
+  for (; numb >= 8; p += 8, numb -= 8) {
+    u32 lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24);
+    u32 hi = p[4] | p[5] << 8 | p[6] << 16 | (u32)p[7] << 24;
+    crc = g_csumTable[7][lo & 0xff] ^ g_csumTable[6][(lo >> 8) & 0xff]
+        ^ g_csumTable[5][(lo >> 16) & 0xff] ^ g_csumTable[4][lo >> 24]
+        ^ g_csumTable[3][hi & 0xff] ^ g_csumTable[2][(hi >> 8) & 0xff]
+        ^ g_csumTable[1][(hi >> 16) & 0xff] ^ g_csumTable[0][hi >> 24];
+  }
+  for (; numb > 0; ++p, --numb) {
+    crc = (crc >> 8) ^ g_csumTable[0][(crc ^ *p) & 0xff];
+  }
+  return crc;
+}
+
+
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+// ============================================================================
+// As csumCrcSoft, with the SSE4.2 crc32 instruction.  Built for SSE4.2
+// whatever the build flags, and called only once the CPU is known to have it
+// ============================================================================
+__attribute__((target("sse4.2")))
+static u32 csumCrcHw(u32 crc, u8* p, i32 numb) {
+  u64 c = crc;
+  for (; numb >= 8; p += 8, numb -= 8) {
+    u64 word;
+    memcpy(&word, p, sizeof(u64));
+    c = __builtin_ia32_crc32di(c, word);
+  }
+  crc = (u32)c;
+  for (; numb > 0; ++p, --numb) crc = __builtin_ia32_crc32qi(crc, *p);
+  return crc;
+}
+
+static i32 csumHasHw()  { return __builtin_cpu_supports("sse4.2"); }
+#define CSUMHWNAME      "sse4.2"
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+
+// ============================================================================
+// As csumCrcSoft, with the ARMv8 crc32c instructions, which the build
+// targets
+// ============================================================================
+static u32 csumCrcHw(u32 crc, u8* p, i32 numb) {
+  for (; numb >= 8; p += 8, numb -= 8) {
+    u64 word;
+    memcpy(&word, p, sizeof(u64));
+    crc = __crc32cd(crc, word);
+  }
+  for (; numb > 0; ++p, --numb) crc = __crc32cb(crc, *p);
+  return crc;
+}
+
+static i32 csumHasHw()  { return 1; }
+#define CSUMHWNAME      "armv8 crc32"
+
+#endif
+
+
+
+// ============================================================================
+// Build g_csumTable, and pick the fastest CRC32C the CPU can run.  Called
+// once, through g_csumOnce
+// ============================================================================
+static void csumPick() {
+  for (u32 i = 0; i < 256; ++i) {
+    u32 c = i;
+    for (i32 k = 0; k < 8; ++k) c = (c >> 1) ^ (CRC32CPOLY & -(c & 1));
+    g_csumTable[0][i] = c;
+  }
+  for (i32 t = 1; t < 8; ++t) {
+    for (i32 i = 0; i < 256; ++i) {
+      u32 c = g_csumTable[t - 1][i];
+      g_csumTable[t][i] = (c >> 8) ^ g_csumTable[0][c & 0xff];
+    }
+  }
+
+  g_csumImpl = csumCrcSoft;
+#ifdef CSUMHWNAME
+  if (csumHasHw()) {
+    g_csumImpl     = csumCrcHw;
+    g_csumImplName = CSUMHWNAME;
+  }
+#endif
+}
+
+
+
+// ============================================================================
+// Return the checksum kept for the block in 'buf': its CRC32C, made non-zero
+// ============================================================================
+static u32 csumBlock(void* buf) {
+  u32 sum = csumCrc32c(0, buf, g_csumBps);
+  return (sum != 0) ? sum : 1;
+}
+
+
+
+// ============================================================================
+// Return 1 if 'dbn' has an entry in the table of the mounted disk, else 0
+// ============================================================================
+static i32 csumCovers(i32 dbn) {
+  return g_csums != NULL && dbn >= g_csumFirst && dbn < g_csumBlocks;
+}
+
+
+
+// ============================================================================
+// Note that the entry of 'dbn' has changed.  If its table block is hot, it
+// stays hot for HOTCOMMITS more commits, and is not written meanwhile.  Else
+// it is marked dirty, for csumSync.  The caller holds g_csumLock
+// ============================================================================
+static void csumChanged(i32 dbn) {
+  i32 b = (i64)dbn * sizeof(u32) / g_csumBps;
+  if (g_csumHot[b] > 0) g_csumHot[b] = HOTCOMMITS;
+  else                  g_csumDirty[b] = 1;
+}
+
+
+
+// ============================================================================
+// Check block 'dbn', just read into 'buf'.  Return 0 if it matches the
+// checksum kept for it, or none is kept.  Return EBADCSUM if it does not
+// ============================================================================
+i32 csumCheck(i32 dbn, void* buf) {
+
+  if (buf == NULL) FATAL(ENULLPTR);
+  if (!csumCovers(dbn)) return 0;
+
+  u32 want = __atomic_load_n(&g_csums[dbn], __ATOMIC_RELAXED);
+  if (want == 0) return 0;
+  return (csumBlock(buf) == want) ? 0 : EBADCSUM;
+}
+
+
+
+// ============================================================================
+// Forget the checksums of the 'num' blocks from DBN 'dbn' on, as they are
+// freed: none is on disk by the time they are reused.  Return 0
+// ============================================================================
+i32 csumClear(i32 dbn, i32 num) {
+  if (g_csums == NULL) return 0;
+
+  pthread_mutex_lock(&g_csumLock);
+  for (i32 d = dbn; d < dbn + num; ++d) {
+    if (!csumCovers(d)) continue;
+    __atomic_store_n(&g_csums[d], 0, __ATOMIC_RELAXED);
+    g_csumState[d] = 0;
+    csumChanged(d);
+  }
+  pthread_mutex_unlock(&g_csumLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Drop the in-memory table.  Called at unmount, once csumSync has written it
+// back.  Return 0
+// ============================================================================
+i32 csumClose() {
+  pthread_mutex_lock(&g_csumLock);
+  free(g_csums);
+  free(g_csumState);
+  free(g_csumDirty);
+  free(g_csumHot);
+  g_csums      = NULL;
+  g_csumState  = NULL;
+  g_csumDirty  = NULL;
+  g_csumHot    = NULL;
+  g_csumBlocks = 0;
+  pthread_mutex_unlock(&g_csumLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Cool every hot table block, so the next commit writes it with its true
+// checksums.  Called by fsUnmount, before its last commit.  Return 0
+// ============================================================================
+i32 csumCool() {
+  if (g_csums == NULL) return 0;
+
+  pthread_mutex_lock(&g_csumLock);
+  for (i32 b = 0; b < g_csumTableBlocks; ++b) {
+    if (g_csumHot[b] == 0) continue;
+    g_csumHot[b]   = 0;
+    g_csumDirty[b] = 1;
+  }
+  pthread_mutex_unlock(&g_csumLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return the CRC32C of the 'numb' bytes at 'buf', continuing from 'crc': 0
+// to start, or the CRC32C of the bytes before them
+// ============================================================================
+u32 csumCrc32c(u32 crc, void* buf, i32 numb) {
+  if (buf == NULL) FATAL(ENULLPTR);
+  pthread_once(&g_csumOnce, csumPick);
+  return ~g_csumImpl(~crc, (u8*)buf, numb);
+}
+
+
+
+// ============================================================================
+// Free 'state', made by csumNewState.  Its table must be closed
+// ============================================================================
+i32 csumFreeState(CsumState* state) {
+  if (state == NULL)         FATAL(ENULLPTR);
+  if (state->csums != NULL)  FATAL(EBADVOLUME);
+  pthread_mutex_destroy(&state->lock);
+  free(state);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Make block 'dbn' fit to be overwritten in place, before a write to it:
+// mark its table block hot, so commits write it as 0s.  Return 1 if the
+// block is still sealed, so that a commit must run before the write can
+// leave it where it is.  Else return 0.  With no journal, nothing is sealed
+// ============================================================================
+i32 csumHeat(i32 dbn) {
+  if (!csumCovers(dbn) || g_geo.numJournalBlocks == 0) return 0;
+
+  pthread_mutex_lock(&g_csumLock);
+  i32 b = (i64)dbn * sizeof(u32) / g_csumBps;
+  if (g_csumHot[b] == 0) g_csumDirty[b] = 1;  // for its 0s to be written
+  g_csumHot[b] = HOTCOMMITS;
+  i32 sealed = g_csumState[dbn] & CSUMSEALED;
+  pthread_mutex_unlock(&g_csumLock);
+  return sealed;
+}
+
+
+
+// ============================================================================
+// Return the name of the CRC32C code in use, eg: "sse4.2"
+// ============================================================================
+str csumImplName() {
+  pthread_once(&g_csumOnce, csumPick);
+  return g_csumImplName;
+}
+
+
+
+// ============================================================================
+// Return the checksum state of a new volume, with no table.  See vol.c
+// ============================================================================
+CsumState* csumNewState() {
+  CsumState* state = calloc(1, sizeof(CsumState));
+  if (state == NULL) FATAL(ENOMEM);
+  pthread_mutex_init(&state->lock, NULL);
+  return state;
+}
+
+
+
+// ============================================================================
+// Load the checksum table of the disk just mounted: 'numTableBlocks' blocks
+// from 'dbnTable' on, with an entry for each of its 'numBlocks' DBNs, those
+// from 'firstDbn' on in use.  With 'numTableBlocks' 0, the disk has no table,
+// and nothing is checked.  Must run after jnlOpen and cacheInit.  Return 0
+// ============================================================================
+i32 csumOpen(i32 dbnTable, i32 numTableBlocks, i32 firstDbn,
+             i32 numBlocks, i32 bytesPerBlock) {
+
+  csumClose();
+  if (numTableBlocks == 0) return 0;
+  if ((i64)numTableBlocks * bytesPerBlock < (i64)numBlocks * sizeof(u32)) {
+    FATAL(EBADGEOM);
+  }
+
+  u32* csums = malloc((size_t)numTableBlocks * bytesPerBlock);
+  u8*  state = calloc(numBlocks, sizeof(u8));
+  u8*  dirty = calloc(numTableBlocks, sizeof(u8));
+  u8*  hot   = calloc(numTableBlocks, sizeof(u8));
+  if (csums == NULL || state == NULL || dirty == NULL || hot == NULL) {
+    FATAL(ENOMEM);
+  }
+  for (i32 b = 0; b < numTableBlocks; ++b) {
+    cacheRead(dbnTable + b, (i8*)csums + (size_t)b * bytesPerBlock);
+  }
+  for (i32 d = 0; d < numBlocks; ++d) {
+    if (csums[d] != 0 && g_geo.numJournalBlocks > 0) state[d] = CSUMSEALED;
+  }
+
+  pthread_mutex_lock(&g_csumLock);
+  g_csums           = csums;
+  g_csumState       = state;
+  g_csumDirty       = dirty;
+  g_csumHot         = hot;
+  g_csumDbn         = dbnTable;
+  g_csumTableBlocks = numTableBlocks;
+  g_csumFirst       = firstDbn;
+  g_csumBlocks      = numBlocks;
+  g_csumBps         = bytesPerBlock;
+  pthread_mutex_unlock(&g_csumLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Scrub thread: check runs of SCRUBRUN blocks, each read from BFSDISK with
+// one bioReadv, until none are left
+// ============================================================================
+static void* csumScrubThread(void* arg) {
+  Scrub*     scrub = (Scrub*)arg;
+  ScrubStats mine  = { 0, 0, -1 };
+  i8*        buf   = malloc((size_t)SCRUBRUN * g_csumBps);
+  i8*        again = malloc(g_csumBps);
+  if (buf == NULL || again == NULL) FATAL(ENOMEM);
+
+  for (;;) {
+    i32 first = __atomic_fetch_add(&scrub->next, SCRUBRUN, __ATOMIC_RELAXED);
+    if (first >= g_csumBlocks) break;
+    i32 num = (first + SCRUBRUN <= g_csumBlocks) ? SCRUBRUN
+                                                 : g_csumBlocks - first;
+    BioVec vec[SCRUBRUN];
+    for (i32 i = 0; i < num; ++i) {
+      vec[i].dbn = first + i;
+      vec[i].buf = buf + (size_t)i * g_csumBps;
+    }
+    bioReadv(vec, num);
+
+    // A block that fails is read again: the journal may hold a newer copy,
+    // or a writer may have just replaced it
+
+    for (i32 i = 0; i < num; ++i) {
+      if (__atomic_load_n(&g_csums[first + i], __ATOMIC_RELAXED) == 0) continue;
+      ++mine.checked;
+      if (csumCheck(first + i, vec[i].buf) == 0) continue;
+      if (!jnlRead(first + i, again)) bioRead(first + i, again);
+      if (csumCheck(first + i, again) == 0) continue;
+      ++mine.bad;
+      if (mine.firstBad < 0) mine.firstBad = first + i;
+    }
+  }
+
+  pthread_mutex_lock(&scrub->lock);
+  scrub->stats.checked += mine.checked;
+  scrub->stats.bad     += mine.bad;
+  if (mine.firstBad >= 0 &&
+      (scrub->stats.firstBad < 0 || mine.firstBad < scrub->stats.firstBad)) {
+    scrub->stats.firstBad = mine.firstBad;
+  }
+  pthread_mutex_unlock(&scrub->lock);
+
+  free(buf);
+  free(again);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Check every block of the mounted disk that has a checksum against the
+// copy on BFSDISK, with 'numThreads' threads (0 => SCRUBTHREADS) reading
+// runs of SCRUBRUN blocks in parallel.  Fill in 'stats'.  The caller makes
+// sure that what has been written has reached BFSDISK, or the journal.
+// Return 0, or ENOCSUM if the disk keeps no checksums
+// ============================================================================
+i32 csumScrub(i32 numThreads, ScrubStats* stats) {
+
+  if (stats == NULL) FATAL(ENULLPTR);
+  memset(stats, 0, sizeof(ScrubStats));
+  stats->firstBad = -1;
+  if (g_csums == NULL) return ENOCSUM;
+
+  if (numThreads <= 0)              numThreads = SCRUBTHREADS;
+  if (numThreads > SCRUBMAXTHREADS) numThreads = SCRUBMAXTHREADS;
+
+  Scrub scrub;
+  scrub.next  = g_csumFirst;
+  scrub.stats = *stats;
+  pthread_mutex_init(&scrub.lock, NULL);
+
+  pthread_t threads[SCRUBMAXTHREADS];
+  for (i32 t = 0; t < numThreads; ++t) {
+    if (volSpawn(&threads[t], csumScrubThread, &scrub) != 0) {
+      FATAL(ENOMEM);
+    }
+  }
+  for (i32 t = 0; t < numThreads; ++t) pthread_join(threads[t], NULL);
+
+  pthread_mutex_destroy(&scrub.lock);
+  *stats = scrub.stats;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return 1 if the checksum of block 'dbn' may be on disk, so that the block
+// must not be overwritten in place.  Else return 0
+// ============================================================================
+i32 csumSealed(i32 dbn) {
+  if (!csumCovers(dbn)) return 0;
+
+  pthread_mutex_lock(&g_csumLock);
+  i32 sealed = g_csumState[dbn] & CSUMSEALED;
+  pthread_mutex_unlock(&g_csumLock);
+  return sealed;
+}
+
+
+
+// ============================================================================
+// Record the checksum of 'buf', about to be written to block 'dbn'.  Return 0
+// ============================================================================
+i32 csumSet(i32 dbn, void* buf) {
+
+  if (buf == NULL) FATAL(ENULLPTR);
+  if (!csumCovers(dbn)) return 0;
+
+  u32 sum = csumBlock(buf);
+  pthread_mutex_lock(&g_csumLock);
+  __atomic_store_n(&g_csums[dbn], sum, __ATOMIC_RELAXED);
+  csumChanged(dbn);
+  pthread_mutex_unlock(&g_csumLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write the table blocks that have changed through cacheWrite.  Each is
+// copied out under g_csumLock, which is dropped before the write; with a
+// journal, the blocks it covers are sealed if their checksum in the copy is
+// not 0.  A hot table block is written as 0s, and seals none; one that has
+// been hot for HOTCOMMITS commits with no writes cools, and is written as
+// it is.  Run at each commit, while no fs operation is running.  Return 0
+// ============================================================================
+i32 csumSync() {
+  if (g_csums == NULL) return 0;
+
+  i32 seal = g_geo.numJournalBlocks > 0;
+  i8* buf = malloc(g_csumBps);
+  if (buf == NULL) FATAL(ENOMEM);
+  for (i32 b = 0; b < g_csumTableBlocks; ++b) {
+    pthread_mutex_lock(&g_csumLock);
+    if (g_csumHot[b] > 0 && --g_csumHot[b] == 0) g_csumDirty[b] = 1;
+    i32 hot   = g_csumHot[b] > 0;
+    i32 dirty = g_csumDirty[b];
+    if (dirty) {
+      if (hot) memset(buf, 0, g_csumBps);
+      else     memcpy(buf, (i8*)g_csums + (size_t)b * g_csumBps, g_csumBps);
+      g_csumDirty[b] = 0;
+      i32 per = g_csumBps / sizeof(u32);
+      for (i32 d = b * per; d < (b + 1) * per && d < g_csumBlocks; ++d) {
+        if (seal && !hot && g_csums[d] != 0) g_csumState[d] |= CSUMSEALED;
+        else                                 g_csumState[d] &= ~CSUMSEALED;
+      }
+    }
+    pthread_mutex_unlock(&g_csumLock);
+    if (dirty) cacheWrite(g_csumDbn + b, buf);
+  }
+  free(buf);
+  return 0;
+}
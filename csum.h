@@ -0,0 +1,39 @@
+#ifndef CSUM_H
+#define CSUM_H
+
+// ===================================================================
+// csum.h - CRC32C checksums of data blocks, kept in a table on disk
+// from version 6 (with a journal) or 8, and the scrubber that checks
+// them all
+// ===================================================================
+
+#include "alias.h"
+
+#define SCRUBTHREADS  4           // default # of csumScrub threads
+#define SCRUBRUN      64          // blocks each csumScrub read covers
+
+typedef struct {          // Outcome of csumScrub
+  i64 checked;            // blocks whose checksum was checked
+  i64 bad;                // of those, blocks that failed
+  i32 firstBad;           // lowest DBN that failed.  -1 => none
+} ScrubStats;
+
+typedef struct CsumState CsumState;   // one volume's table: see vol.h
+
+i32 csumCheck (i32 dbn, void* buf);
+i32 csumClear (i32 dbn, i32 num);
+i32 csumClose ();
+i32 csumCool  ();
+u32 csumCrc32c(u32 crc, void* buf, i32 numb);
+i32 csumFreeState(CsumState* state);
+i32 csumHeat  (i32 dbn);
+str csumImplName();
+CsumState* csumNewState();
+i32 csumOpen  (i32 dbnTable, i32 numTableBlocks, i32 firstDbn,
+               i32 numBlocks, i32 bytesPerBlock);
+i32 csumScrub (i32 numThreads, ScrubStats* stats);
+i32 csumSealed(i32 dbn);
+i32 csumSet   (i32 dbn, void* buf);
+i32 csumSync  ();
+
+#endif
@@ -9,17 +9,17 @@
 // Dump block DBN
 // ============================================================================
 i32 debDumpDbn(i32 dbn, i32 size) {
-  i8 buf[BYTESPERBLOCK] = {0};
+  i8 buf[BLOCKSIZE];
 
   i8*  buf8  = (i8*) buf;
   i16* buf16 = (i16*)buf;
   i32* buf32 = (i32*)buf;
 
-  bioRead(dbn, buf);
+  cacheRead(dbn, buf);
 
   printf("\n");
   if (size == 1) {
-    for (int i = 0; i < BYTESPERBLOCK; ++i) {
+    for (int i = 0; i < BLOCKSIZE; ++i) {
       printf("%02x ", buf8[i]);
       if ((i + 1) % 16 == 0) {
         for (int i = 0; i < 16; ++i) {
@@ -31,12 +31,12 @@ i32 debDumpDbn(i32 dbn, i32 size) {
       }
     }
   } else if (size == 2) {
-    for (int i = 0; i < BYTESPERBLOCK / sizeof(i16); ++i) {
+    for (int i = 0; i < BLOCKSIZE / sizeof(i16); ++i) {
       printf("%04x ", buf16[i]);
       if ((i + 1) % 8 == 0) printf("\n");
     }
   } else if (size == 4) {
-    for (int i = 0; i < BYTESPERBLOCK / sizeof(i32); ++i) {
+    for (int i = 0; i < BLOCKSIZE / sizeof(i32); ++i) {
       printf("%08x ", buf32[i]);
       if ((i + 1) % 4 == 0) printf("\n");
     }
@@ -53,13 +53,15 @@ i32 debDumpDbn(i32 dbn, i32 size) {
 // Dump the Dir
 // ============================================================================
 i32 debDumpDir() {
-  i8 buf[BYTESPERBLOCK] = {0};
-  bioRead(DBNDIR, buf);
-  Dir* dir = (Dir*)buf;
+  i8  buf[BLOCKSIZE];
+  i32 slotsPerBlock = BLOCKSIZE / FNAMESIZE;
 
   printf("\n");
-  for (int inum = 0; inum < NUMINODES; ++inum) {
-    printf("[%02d]  %s \n", inum, dir->fname[inum]);
+  for (int inum = 0; inum < g_geo.numInodes; ++inum) {
+    if (inum % slotsPerBlock == 0) {
+      cacheRead(g_geo.dbnDir + inum / slotsPerBlock, buf);
+    }
+    printf("[%02d]  %s \n", inum, buf + (inum % slotsPerBlock) * FNAMESIZE);
   }
   printf("\n"); fflush(stdout);
 
@@ -72,17 +74,16 @@ i32 debDumpDir() {
 // Dump the Inodes
 // ============================================================================
 i32 debDumpInodes() {
-  i8 buf[BYTESPERBLOCK] = {0};
-  bioRead(DBNINODES, buf);
-
-  Inode* inodes = (Inode*) buf;
-
   printf("\n");
-  for (int inum = 0; inum < NUMINODES; ++inum) {
-    Inode inode = inodes[inum];
+  for (int inum = 0; inum < g_geo.numInodes; ++inum) {
+    Inode inode;
+    bfsReadInode(inum, &inode);
     printf("[%d] size = %d \n", inum, inode.size);
-    for (i32 d = 0; d < NUMDIRECT; ++d) {
-      printf("    [%d] direct[%d] = %d \n", inum, d, inode.direct[d]);
+    if (inode.flags & INODECOMPRESS) printf("    [%d] compressed \n", inum);
+    for (i32 e = 0; e < inode.numExtents; ++e) {
+      Extent* ext = &inode.extent[e];
+      printf("    [%d] extent[%d] = fbn %d, dbn %d, len %d \n",
+             inum, e, ext->fbn, ext->dbn, ext->len);
     }
     printf("        indirect  = %d \n", inode.indirect);
   }
@@ -92,13 +93,58 @@ i32 debDumpInodes() {
 }
 
 
+// ============================================================================
+// Dump the IO counters of all threads since the last statsReset, then the
+// cache and journal counters
+// ============================================================================
+i32 debDumpStats() {
+  IoStats io;
+  statsGet(&io);
+
+  printf("\n");
+  printf("meta reads  = %lld \n", (long long)io.metaReads);
+  printf("meta writes = %lld \n", (long long)io.metaWrites);
+  printf("data reads  = %lld \n", (long long)io.dataReads);
+  printf("data writes = %lld \n", (long long)io.dataWrites);
+  printf("requests    = %lld \n", (long long)io.requests);
+  printf("cache hits  = %lld \n", (long long)io.cacheHits);
+  printf("cache miss  = %lld \n", (long long)io.cacheMisses);
+  printf("allocs      = %lld \n", (long long)io.allocs);
+  for (i32 op = 0; op < NUMFSOPS; ++op) {
+    if (io.fsCalls[op] == 0) continue;
+    printf("%-8s calls = %lld, ns = %lld, ns/call = %lld \n",
+           statsFsOpName(op), (long long)io.fsCalls[op],
+           (long long)io.fsNs[op], (long long)(io.fsNs[op] / io.fsCalls[op]));
+  }
+
+  CacheStats cs;
+  cacheGetStats(&cs);
+  printf("Cache: hits = %lld, misses = %lld, writebacks = %lld, "
+         "prefetches = %lld \n", (long long)cs.hits, (long long)cs.misses,
+         (long long)cs.writebacks, (long long)cs.prefetches);
+
+  if (g_geo.numJournalBlocks > 0) {
+    JnlStats js;
+    jnlGetStats(&js);
+    printf("Journal: commits = %lld of %lld calls, blocks = %lld, "
+           "checkpoints = %lld \n", (long long)js.commits,
+           (long long)js.commitCalls, (long long)js.blocks,
+           (long long)js.checkpoints);
+  }
+  printf("\n"); fflush(stdout);
+
+  return 0;
+}
+
+
+
 // ============================================================================
 // Dump the Superblock
 // ============================================================================
 i32 debDumpSuper() {
-  i8 buf[BYTESPERBLOCK] = {0};
+  i8 buf[BLOCKSIZE];
 
-  bioRead(DBNSUPER, buf);
+  cacheRead(DBNSUPER, buf);
 
   Super* super = (Super*)buf;
 
@@ -106,11 +152,21 @@ i32 debDumpSuper() {
   printf("Super.numBlocks = %d \n", super->numBlocks);
   printf("Super.numInodes = %d \n", super->numInodes);
   printf("Super.firstFree = %d \n", super->firstFree);
+  printf("Super.version   = %d \n", super->version);
+  if (super->version >= 2) {
+    printf("Super.bytesPerBlock = %d \n", super->bytesPerBlock);
+    printf("Super.blocksPerDisk = %d \n", super->blocksPerDisk);
+    printf("Super.inodesPerDisk = %d \n", super->inodesPerDisk);
+  }
+  if (super->version >= 4) {
+    printf("Super.journalBlocks = %d \n", super->journalBlocks);
+  }
   printf("\n"); fflush(stdout);
 
   // Check that remainder of Superblock is all zeroes
 
-  for (i32 b = sizeof(Super); b < BYTESPERBLOCK; ++b) {
+  i32 used = (super->version >= 2) ? sizeof(Super) : 4 * sizeof(i16);
+  for (i32 b = used; b < BLOCKSIZE; ++b) {
     if (buf[b] != 0) {
       printf("Super[%d] == %02x, should be 0x00 \n", b, buf[b]);
     }
@@ -6,7 +6,7 @@
 #include <stdlib.h>
 #include "errors.h"
 
-void pause() {
+void Pause() {
   printf("\nHit any key to finish ");
   getchar();
   exit(0);
@@ -17,56 +17,84 @@ void pause() {
 void RepTest(int err, str file, int line) {
   RepError(err);
   printf(" in file %s at line %d \n", file, line);
-  pause();
+  Pause();
 }
 
 
 void RepError(i32 e) {
   switch(e) {
     case EBADDBN:
-      printf("\nERROR: Bad DBN: negative or too large \n");    pause(); break;
+      printf("\nERROR: Bad DBN: negative or too large \n");    Pause(); break;
     case EBADFBN:
-      printf("\nERROR: Bad FBN: negative or too large \n");    pause(); break;
+      printf("\nERROR: Bad FBN: negative or too large \n");    Pause(); break;
     case EBADINUM:
-      printf("\nERROR: Bad Inum: negative or too large \n");   pause(); break;
+      printf("\nERROR: Bad Inum: negative or too large \n");   Pause(); break;
     case EBADCURS:
-      printf("\nERROR: Bad cursor within file \n");           pause(); break;
+      printf("\nERROR: Bad cursor within file \n");           Pause(); break;
     case EBADREAD:
-      printf("\nERROR: Error writing to BFS disk \n");         pause(); break;
+      printf("\nERROR: Error writing to BFS disk \n");         Pause(); break;
     case EBADWRITE:
-      printf("\nERROR: Error writing to BFS disk \n");         pause(); break;
+      printf("\nERROR: Error writing to BFS disk \n");         Pause(); break;
     case EBIGFNAME:
-      printf("\nERROR: Filename too big \n");                  pause(); break;
+      printf("\nERROR: Filename too big \n");                  Pause(); break;
     case EBIGNUMB:
-      printf("\nERROR: Read or write is too big \n");          pause(); break;
+      printf("\nERROR: Read or write is too big \n");          Pause(); break;
     case EDIRFULL:
-      printf("\nERROR: Directory is already full \n");         pause(); break;
+      printf("\nERROR: Directory is already full \n");         Pause(); break;
     case EDISKCREATE:
-      printf("\nERROR: Failure creating BFS disk \n");         pause(); break;
+      printf("\nERROR: Failure creating BFS disk \n");         Pause(); break;
     case EDISKFULL:
-      printf("\nERROR: Disk is full \n");                      pause(); break;
+      printf("\nERROR: Disk is full \n");                      Pause(); break;
     case EEXISTS:
-      printf("\nERROR: Format would destroy current disk \n"); pause(); break;
+      printf("\nERROR: Format would destroy current disk \n"); Pause(); break;
     case EFNF:
-      printf("\nERROR: File Not Found \n");                    pause(); break;
+      printf("\nERROR: File Not Found \n");                    Pause(); break;
     case ENEGNUMB:
-      printf("\nERROR: Negative # bytes in read or write \n"); pause(); break;
+      printf("\nERROR: Negative # bytes in read or write \n"); Pause(); break;
     case ENODBN:
-      printf("\nERROR: No DBN yet allocated - non-fatal \n");  pause(); break;
+      printf("\nERROR: No DBN yet allocated - non-fatal \n");  Pause(); break;
     case ENODISK:
-      printf("\nERROR: Cannot open the BFS disk \n");          pause(); break;
+      printf("\nERROR: Cannot open the BFS disk \n");          Pause(); break;
     case ENOMEM:
-      printf("\nERROR: Failure to malloc memory \n");          pause(); break;
+      printf("\nERROR: Failure to malloc memory \n");          Pause(); break;
     case ENULLPTR:
-      printf("\nERROR: About to deref a null pointer \n");     pause(); break;
+      printf("\nERROR: About to deref a null pointer \n");     Pause(); break;
     case ENYI:
-      printf("\nERROR: Function Note Yet Implemented \n");     pause(); break;
+      printf("\nERROR: Function Note Yet Implemented \n");     Pause(); break;
     case EOFTFULL:
-      printf("\nERROR: OpenFileTable is full \n");             pause(); break;
+      printf("\nERROR: OpenFileTable is full \n");             Pause(); break;
     case EBADWHENCE:
-      printf("\nERROR: Invalid 'whence' in fsSeek \n");        pause(); break;
+      printf("\nERROR: Invalid 'whence' in fsSeek \n");        Pause(); break;
+    case EBADGEOM:
+      printf("\nERROR: Invalid disk geometry \n");             Pause(); break;
+    case EBADFD:
+      printf("\nERROR: File descriptor is not open \n");       Pause(); break;
+    case EBADBACKEND:
+      printf("\nERROR: Unknown block IO backend \n");          Pause(); break;
+    case ENOMMAP:
+      printf("\nERROR: BFSDISK is not memory-mapped \n");      Pause(); break;
+    case ETRACE:
+      printf("\nERROR: Cannot write the trace file \n");       Pause(); break;
+    case ENXDATA:
+      printf("\nERROR: No data or hole past the offset \n");   Pause(); break;
+    case EFILEOPEN:
+      printf("\nERROR: File is open, so not deleted \n");      Pause(); break;
+    case EBADCOMP:
+      printf("\nERROR: Compressed cluster is corrupt \n");     Pause(); break;
+    case ENOCOMP:
+      printf("\nERROR: File cannot be compressed \n");         Pause(); break;
+    case EBADCSUM:
+      printf("\nERROR: Block does not match its checksum \n"); Pause(); break;
+    case ENOCSUM:
+      printf("\nERROR: Disk keeps no checksums \n");           Pause(); break;
+    case ENOCLONE:
+      printf("\nERROR: Disk cannot share blocks \n");          Pause(); break;
+    case EBIGSHARE:
+      printf("\nERROR: Block shared by too many files \n");    Pause(); break;
+    case EBADVOLUME:
+      printf("\nERROR: Volume is in use \n");                  Pause(); break;
     default:
-      printf("\nERROR: Miscellaneous error \n");               pause(); break;
+      printf("\nERROR: Miscellaneous error \n");               Pause(); break;
   }
 }
 
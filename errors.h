@@ -29,8 +29,22 @@ void RepTest(int err, str file, int line);
 #define ENULLPTR    -19   // about to deref a NULL pointer
 #define ENYI        -20   // not yet implemented
 #define EOFTFULL    -21   // OpenFileTable is full
+#define EBADGEOM    -22   // invalid disk geometry
+#define EBADFD      -23   // file descriptor not open
+#define EBADBACKEND -24   // unknown block IO backend
+#define ENOMMAP     -25   // disk not memory-mapped - non fatal
+#define ETRACE      -26   // cannot write the trace file, or one is running
+#define ENXDATA     -27   // no data or hole past offset - non fatal
+#define EFILEOPEN   -28   // file still open, so not deleted - non fatal
+#define EBADCOMP    -29   // compressed cluster is corrupt
+#define ENOCOMP     -30   // file cannot be compressed - non fatal
+#define EBADCSUM    -31   // block does not match its checksum
+#define ENOCSUM     -32   // disk keeps no checksums - non fatal
+#define ENOCLONE    -33   // disk cannot share blocks - non fatal
+#define EBIGSHARE   -34   // block shared by too many files
+#define EBADVOLUME  -35   // volume still mounted, or the default one
 
-void pause();
+void Pause();
 void RepError(i32 ret);
 
 #endif
\ No newline at end of file
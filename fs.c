@@ -2,41 +2,429 @@
 // fs.c - user FileSytem API
 // ============================================================================
 
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "bfs.h"
 #include "fs.h"
 
+struct FsState {          // one volume's fs threads.  See fsNewState
+
+  // fsReadAsync and fsWriteAsync queue their FsAio for a small pool of worker
+  // threads, started on first use and stopped by fsUnmount.  Each worker runs
+  // fsPRead or fsPWrite, so it locks the file just as a caller would
+  pthread_mutex_t aioLock;
+  pthread_cond_t  aioWork;                // queue, stop
+  pthread_cond_t  aioDone;                // an FsAio done
+  FsAio*          aioHead;                // FIFO of FsAio yet to start
+  FsAio*          aioTail;
+  pthread_t       aioThreads[AIOMAXTHREADS];
+  i32             aioNumThreads;          // # running
+  i32             aioMaxThreads;
+  i32             aioStop;                // 1 => drain, then exit
+
+  // With MountOpts.flushMs set, a background thread calls fsSync that often,
+  // so a crash loses at most about flushMs of changes
+  pthread_mutex_t flushLock;
+  pthread_cond_t  flushCond;              // stop
+  pthread_t       flushThread;
+  i32             flushMs;                // 0 => no flush thread
+  i32             flushStop;              // 1 => exit
+};
+
+#define g_aioLock       (t_vol->fs->aioLock)
+#define g_aioWork       (t_vol->fs->aioWork)
+#define g_aioDone       (t_vol->fs->aioDone)
+#define g_aioHead       (t_vol->fs->aioHead)
+#define g_aioTail       (t_vol->fs->aioTail)
+#define g_aioThreads    (t_vol->fs->aioThreads)
+#define g_aioNumThreads (t_vol->fs->aioNumThreads)
+#define g_aioMaxThreads (t_vol->fs->aioMaxThreads)
+#define g_aioStop       (t_vol->fs->aioStop)
+#define g_flushLock     (t_vol->fs->flushLock)
+#define g_flushCond     (t_vol->fs->flushCond)
+#define g_flushThread   (t_vol->fs->flushThread)
+#define g_flushMs       (t_vol->fs->flushMs)
+#define g_flushStop     (t_vol->fs->flushStop)
+
+static i8 g_zeroes[MAXBLOCKSIZE];       // what fsReadView shows of a hole
+
+
+
+// ============================================================================
+// Worker thread for fsReadAsync and fsWriteAsync: carry out queued FsAio
+// until the queue is empty and fsUnmount asks it to stop
+// ============================================================================
+static void* fsAioThread(void* unused) {
+  for (;;) {
+    pthread_mutex_lock(&g_aioLock);
+    while (g_aioHead == NULL && !g_aioStop) {
+      pthread_cond_wait(&g_aioWork, &g_aioLock);
+    }
+    FsAio* aio = g_aioHead;
+    if (aio != NULL) {
+      g_aioHead = aio->next;
+      if (g_aioHead == NULL) g_aioTail = NULL;
+    }
+    pthread_mutex_unlock(&g_aioLock);
+    if (aio == NULL) return NULL;       // stopping, and nothing left
+
+    aio->result = (aio->op == BIOREAD)
+                ? fsPRead (aio->fd, aio->offset, aio->numb, aio->buf)
+                : fsPWrite(aio->fd, aio->offset, aio->numb, aio->buf);
+    if (aio->callback != NULL) aio->callback(aio);
+
+    pthread_mutex_lock(&g_aioLock);
+    aio->done = 1;
+    pthread_cond_broadcast(&g_aioDone);
+    pthread_mutex_unlock(&g_aioLock);
+  }
+}
+
+
+
+// ============================================================================
+// Queue 'aio' as a read or write ('op') for the worker threads, starting
+// them if need be.  On success, return 0.  On failure, abort
+// ============================================================================
+static i32 fsAioQueue(FsAio* aio, i32 op) {
+
+  if (aio == NULL || aio->buf == NULL) FATAL(ENULLPTR);
+  if (aio->offset < 0)                 FATAL(EBADCURS);
+  bfsFdToInum(aio->fd);                 // FATAL if 'fd' is not open
+
+  aio->op     = op;
+  aio->result = 0;
+  aio->done   = 0;
+  aio->next   = NULL;
+
+  pthread_mutex_lock(&g_aioLock);
+  while (g_aioNumThreads < g_aioMaxThreads) {
+    if (volSpawn(&g_aioThreads[g_aioNumThreads], fsAioThread, NULL) != 0) {
+      break;
+    }
+    ++g_aioNumThreads;
+  }
+  if (g_aioNumThreads == 0) FATAL(ENOMEM);
+
+  if (g_aioTail == NULL) g_aioHead = aio; else g_aioTail->next = aio;
+  g_aioTail = aio;
+  pthread_cond_signal(&g_aioWork);
+  pthread_mutex_unlock(&g_aioLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Finish every queued FsAio, then stop the worker threads.  Called by
+// fsUnmount
+// ============================================================================
+static void fsAioStop() {
+  pthread_mutex_lock(&g_aioLock);
+  g_aioStop = 1;
+  pthread_cond_broadcast(&g_aioWork);
+  pthread_mutex_unlock(&g_aioLock);
+
+  for (i32 i = 0; i < g_aioNumThreads; ++i) {
+    pthread_join(g_aioThreads[i], NULL);
+  }
+  g_aioNumThreads = 0;
+  g_aioStop       = 0;
+}
+
+
+
+// ============================================================================
+// Wait for 'aio', started by fsReadAsync or fsWriteAsync, to complete.
+// Return its result: as for fsPRead or fsPWrite
+// ============================================================================
+i32 fsAioWait(FsAio* aio) {
+  if (aio == NULL) FATAL(ENULLPTR);
+  pthread_mutex_lock(&g_aioLock);
+  while (!aio->done) pthread_cond_wait(&g_aioDone, &g_aioLock);
+  pthread_mutex_unlock(&g_aioLock);
+  return aio->result;
+}
+
+
+
+// ============================================================================
+// Allocate the appended blocks held back, writing their data, then write the
+// batched Inodes, bitmap and checksum table into the cache.  With a
+// journal, this is called by each commit, while no fs operation is running
+// ============================================================================
+static void fsSnapshot() {
+  bfsDelayFlushAll();                       // one batch of DBNs per file
+  bfsSyncInodes();                          // write back batched Inodes
+  bfsSyncOrphans();                         // trees the free thread owes
+  bfsSyncBitmap();
+  csumSync();                               // after the data that sets it
+}
+
+
+
+// ============================================================================
+// Make the metadata changes so far durable: with a journal, as one
+// transaction, shared with any other thread committing at the same time;
+// without, by writing them in place
+// ============================================================================
+static void fsCommit() {
+  if (g_geo.numJournalBlocks > 0) {
+    jnlCommit();
+    return;
+  }
+  fsSnapshot();
+  cacheFlush();                             // write back dirty blocks
+}
+
+
+
+// ============================================================================
+// Make every change so far durable.  File data is written through the cache,
+// so only metadata is pending: with a journal it is committed, and without,
+// the batched Inodes and bitmap and then every dirty cached block are
+// written back, in DBN order, with one bioWritev.  Then the device is synced
+// once - unless the commit already ended with a sync.  Trees queued for
+// the free thread are freed first.  Work of fsSync and fsFsync, and of the
+// flush thread, none of which it counts or traces
+// ============================================================================
+static void fsSyncAll() {
+  bfsFreeWait();
+  if (g_geo.numJournalBlocks > 0) {
+    if (!jnlCommit()) bioSync();
+    return;
+  }
+  fsSnapshot();
+  cacheFlush();                             // DBN order, one bioWritev
+  bioSync();
+}
+
+
+
+// ============================================================================
+// Open 'fname' on a new File Descriptor, creating it first if 'create' is 1.
+// The name is looked up again once the descriptor holds the inum, so that a
+// file deleted meanwhile is never opened: see bfsDeleteFile.  On success,
+// return the file descriptor.  On failure, EFNF
+// ============================================================================
+static i32 fsOpenName(str fname, i32 create) {
+  for (;;) {
+    i32 inum = create ? bfsCreateFile(fname) : bfsLookupFile(fname);
+    if (inum == EFNF) return EFNF;
+    i32 fd = bfsOpenFd(inum);
+    if (bfsLookupFile(fname) == inum) return fd;
+    bfsCloseFd(fd);                         // deleted: try again
+  }
+}
+
+
+
+// ============================================================================
+// Make the file called 'fname' a copy of the file open on 'fd', creating it
+// if need be, and dropping what it held if not.  The copy shares every data
+// block of the original, so it costs only indirect blocks, and takes
+// neither space nor IO for the data: a later write to either file gives just
+// the blocks written new ones.  See bfsCloneFile.  On success, return 0.  On
+// failure, EFNF, or ENOCLONE on a disk older than version 7
+// ============================================================================
+i32 fsClone(i32 fd, str fname) {
+  i64 start = statsNow();
+  jnlBegin();
+  i32 ret = (g_geo.dbnRefs == 0) ? ENOCLONE : EFNF;   // not even created
+  i32 dfd = (ret == EFNF) ? fsOpenName(fname, 1) : EFNF;
+  if (dfd != EFNF) {
+    i32 src  = bfsFdToInum(fd);
+    i32 dst  = bfsFdToInum(dfd);
+    i32 low  = (src < dst) ? src : dst;     // lock in inum order
+    i32 high = (src < dst) ? dst : src;
+    ret = 0;
+    if (src != dst) {
+      bfsLockInode(low, 1);
+      bfsLockInode(high, 1);
+      bfsTruncate(dst, 0);
+      ret = bfsCloneFile(src, dst);
+      bfsUnlockInode(high);
+      bfsUnlockInode(low);
+    }
+    bfsCloseFd(dfd);
+  }
+  jnlEnd();
+  statsTime(FSOPCLONE, start);
+  TRACE(TRCCLONE, fd, ret, 0, start, fname);
+  return ret;
+}
+
+
+
 // ============================================================================
 // Close the file currently open on file descriptor 'fd'.
 // ============================================================================
 i32 fsClose(i32 fd) { 
-  i32 inum = bfsFdToInum(fd);
-  bfsDerefOFT(inum);
+  i64 start = statsNow();
+  bfsCloseFd(fd);
+  fsCommit();
+  statsTime(FSOPCLOSE, start);
+  TRACE(TRCCLOSE, fd, 0, 0, start, NULL);
   return 0; 
 }
 
 
 
 // ============================================================================
-// Create the file called 'fname'.  Overwrite, if it already exsists.
-// On success, return its file descriptor.  On failure, EFNF
+// Make the file open on 'fd' a compressed one, if 'on' is 1, or a plain one:
+// its data is then coded a cluster at a time, see bfsWriteCluster.  Only an
+// empty file changes.  On success, return 0.  On failure, ENOCOMP: the file
+// is not empty, or the disk is older than version 5
+// ============================================================================
+i32 fsCompress(i32 fd, i32 on) {
+  i32 inum = bfsFdToInum(fd);
+  i32 ret  = ENOCOMP;
+  jnlBegin();
+  bfsLockInode(inum, 1);
+  if (g_geo.version >= 5 && bfsGetSize(inum) == 0) {
+    i32 flags = bfsGetFlags(inum) & ~INODECOMPRESS;
+    bfsSetFlags(inum, flags | (on ? INODECOMPRESS : 0));
+    ret = 0;
+  }
+  bfsUnlockInode(inum);
+  jnlEnd();
+  return ret;
+}
+
+
+
+// ============================================================================
+// Create the file called 'fname'.  Overwrite, if it already exists: its
+// blocks are freed, and it starts again at size 0.  On success, return its
+// file descriptor.  On failure, EFNF
 // ============================================================================
 i32 fsCreate(str fname) {
-  i32 inum = bfsCreateFile(fname);
-  if (inum == EFNF) return EFNF;
-  return bfsInumToFd(inum);
+  i64 start = statsNow();
+  jnlBegin();
+  i32 fd = fsOpenName(fname, 1);
+  if (fd != EFNF) {
+    i32 inum = bfsFdToInum(fd);
+    bfsLockInode(inum, 1);
+    bfsTruncate(inum, 0);
+    bfsUnlockInode(inum);
+  }
+  jnlEnd();
+  statsTime(FSOPCREATE, start);
+  TRACE(TRCCREATE, fd, 0, 0, start, fname);
+  return fd;
+}
+
+
+
+// ============================================================================
+// Delete the file called 'fname', freeing its blocks and its Directory slot.
+// A file still open is not deleted.  With a journal, the delete is then
+// committed, so the blocks freed can be reused.  On success, return 0.  On
+// failure, EFNF, or EFILEOPEN
+// ============================================================================
+i32 fsDelete(str fname) {
+  i64 start = statsNow();
+  jnlBegin();
+  i32 ret  = EFNF;
+  i32 inum = bfsLookupFile(fname);
+  if (inum != EFNF) {
+    bfsLockInode(inum, 1);
+    ret = bfsDeleteFile(inum, fname);
+    bfsUnlockInode(inum);
+  }
+  jnlEnd();
+  if (jnlHeld() > 0) fsCommit();            // see jnlDefer
+  statsTime(FSOPDELETE, start);
+  TRACE(TRCDELETE, ret, 0, 0, start, fname);
+  return ret;
+}
+
+
+
+// ============================================================================
+// Background flush thread: fsSync every g_flushMs ms, until fsUnmount asks
+// it to stop
+// ============================================================================
+static void* fsFlushThread(void* unused) {
+  pthread_mutex_lock(&g_flushLock);
+  while (!g_flushStop) {
+    struct timespec when;
+    clock_gettime(CLOCK_REALTIME, &when);
+    when.tv_sec  += g_flushMs / 1000;
+    when.tv_nsec += (long)(g_flushMs % 1000) * 1000000;
+    if (when.tv_nsec >= 1000000000) {
+      ++when.tv_sec;
+      when.tv_nsec -= 1000000000;
+    }
+    i32 rc = 0;                             // nonzero => timed out
+    while (!g_flushStop && rc == 0) {
+      rc = pthread_cond_timedwait(&g_flushCond, &g_flushLock, &when);
+    }
+    if (g_flushStop) break;
+
+    pthread_mutex_unlock(&g_flushLock);
+    fsSyncAll();
+    pthread_mutex_lock(&g_flushLock);
+  }
+  pthread_mutex_unlock(&g_flushLock);
+  return NULL;
 }
 
 
 
 // ============================================================================
-// Format the BFS disk by initializing the SuperBlock, Inodes, Directory and 
-// Freelist.  On succes, return 0.  On failure, abort
+// Format the BFS disk, with the default geometry.  See fsFormatOpts
 // ============================================================================
 i32 fsFormat() {
-  FILE* fp = fopen(BFSDISK, "w+b");
+  return fsFormatOpts(NULL);
+}
+
+
+
+// ============================================================================
+// Format the BFS disk by initializing the SuperBlock, Inodes, Directory,
+// free-space bitmap and journal.  The geometry comes from 'opts', which may
+// be NULL, or have fields left at 0, to take the defaults.  By default the
+// journal is 1/32 of the disk, within JNLMINBLOCKS .. JNLMAXBLOCKS.  On
+// succes, return 0.  On failure, abort
+// ============================================================================
+i32 fsFormatOpts(FormatOpts* opts) {
+  i32 bytesPerBlock = BYTESPERBLOCK;
+  i32 numBlocks     = BLOCKSPERDISK;
+  i32 numInodes     = NUMINODES;
+  i32 journalBlocks = 0;
+  if (opts != NULL) {
+    if (opts->bytesPerBlock > 0) bytesPerBlock = opts->bytesPerBlock;
+    if (opts->numBlocks     > 0) numBlocks     = opts->numBlocks;
+    if (opts->numInodes     > 0) numInodes     = opts->numInodes;
+    journalBlocks = opts->journalBlocks;
+  }
+  if (journalBlocks == 0) {
+    journalBlocks = numBlocks / 32;
+    if (journalBlocks < JNLMINBLOCKS) journalBlocks = JNLMINBLOCKS;
+    if (journalBlocks > JNLMAXBLOCKS) journalBlocks = JNLMAXBLOCKS;
+  }
+  if (journalBlocks < 0) journalBlocks = 0;
+
+  Geo geo;
+  i32 ret = bfsLayout(&geo, FSVERSION, bytesPerBlock, numBlocks, numInodes,
+                      journalBlocks);
+  if (ret != 0) FATAL(ret);
+
+  FILE* fp = fopen(t_vol->path, "w+b");
   if (fp == NULL) FATAL(EDISKCREATE);
 
-  i32 ret = bfsInitSuper(fp);               // initialize Super block
+  // size the disk without writing its data blocks: they read as zeroes
+  if (ftruncate(fileno(fp), (off_t)numBlocks * bytesPerBlock) != 0) {
+    fclose(fp); FATAL(EDISKCREATE);
+  }
+
+  bioOpen(t_vol->path, BIODEFAULT);         // block IO handle for the format
+  bfsSetGeometry(&geo);
+
+  ret = bfsInitSuper(fp);                   // initialize Super block
   if (ret != 0) { fclose(fp); FATAL(ret); }
 
   ret = bfsInitInodes(fp);                  // initialize Inodes block
@@ -45,107 +433,603 @@ i32 fsFormat() {
   ret = bfsInitDir(fp);                     // initialize Dir block
   if (ret != 0) { fclose(fp); FATAL(ret); }
 
-  ret = bfsInitFreeList();                  // initialize Freelist
+  ret = bfsInitBitmap();                    // initialize free-space bitmap
+  if (ret != 0) { fclose(fp); FATAL(ret); }
+
+  ret = bfsInitRefs();                      // initialize reference counts
+  if (ret != 0) { fclose(fp); FATAL(ret); }
+
+  ret = jnlFormat(geo.dbnJournal, geo.numJournalBlocks, bytesPerBlock);
   if (ret != 0) { fclose(fp); FATAL(ret); }
 
   ret = bfsInitOFT();                  	   // initialize OFT
   if (ret != 0) { fclose(fp); FATAL(ret); }
 
+  bioClose();
   fclose(fp);
   return 0;
 }
 
 
+
+// ============================================================================
+// Free 'state', made by fsNewState.  Its volume must be unmounted
+// ============================================================================
+i32 fsFreeState(FsState* state) {
+  if (state == NULL) FATAL(ENULLPTR);
+  if (state->aioNumThreads > 0 || state->flushMs > 0) FATAL(EBADVOLUME);
+  pthread_mutex_destroy(&state->aioLock);
+  pthread_cond_destroy(&state->aioWork);
+  pthread_cond_destroy(&state->aioDone);
+  pthread_mutex_destroy(&state->flushLock);
+  pthread_cond_destroy(&state->flushCond);
+  free(state);
+  return 0;
+}
+
+
+
 // ============================================================================
-// Mount the BFS disk.  It must already exist
+// Make the file open on 'fd' durable, as fsSync does.  The Inode table and
+// bitmap are shared by all files, so its metadata is committed along with
+// every other file's, as by fsSync.  On success, return 0.  On failure,
+// abort
 // ============================================================================
-i32 fsMount() {
-  FILE* fp = fopen(BFSDISK, "rb");
-  if (fp == NULL) FATAL(ENODISK);           // BFSDISK not found
-  fclose(fp);
+i32 fsFsync(i32 fd) {
+  i64 start = statsNow();
+  bfsFdToInum(fd);                          // FATAL if 'fd' is not open
+  fsSyncAll();
+  statsTime(FSOPFSYNC, start);
+  TRACE(TRCFSYNC, fd, 0, 0, start, NULL);
   return 0;
 }
 
 
 
+// ============================================================================
+// Build, in 'block', the new contents of FBN 'fbn' of file 'inum' when 'numb'
+// bytes from 'src' are written at byte 'off' within it.  The old contents
+// are read only if the block holds bytes below 'oldSize', the file size
+// before the write; a block past the old EOF starts out as zeroes
+// ============================================================================
+static void fsMergeBlock(i32 inum, i32 fbn, i32 oldSize, i8* block, i32 off,
+                         void* src, i32 numb) {
+  if (fbn * BLOCKSIZE < oldSize) {
+    bfsRead(inum, fbn, block);
+  } else {
+    memset(block, 0, BLOCKSIZE);
+  }
+  memcpy(block + off, src, numb);
+}
+
+
+
+// ============================================================================
+// Read, if 'write' is 0, or write the 'numb' bytes at byte 'offset' of
+// compressed file 'inum', to or from 'buf', a cluster at a time.  A cluster
+// only partly written is read first; one written whole is not.  The caller
+// holds the file's Inode lock, for writing if 'write' is 1
+// ============================================================================
+static void fsClusterIo(i32 inum, i32 offset, i32 numb, void* buf,
+                        i32 write) {
+  i32 bytes   = CLUSTERBLOCKS * BLOCKSIZE;
+  i8* cluster = malloc(bytes);
+  if (cluster == NULL) FATAL(ENOMEM);
+
+  i32 done = 0;
+  while (done < numb) {
+    i32 c   = (offset + done) / bytes;
+    i32 off = (offset + done) % bytes;
+    i32 len = bytes - off;
+    if (len > numb - done) len = numb - done;
+    i8* p   = (i8*)buf + done;
+
+    if (!write || len < bytes) bfsReadCluster(inum, c, cluster);
+    if (write) {
+      memcpy(cluster + off, p, len);
+      bfsWriteCluster(inum, c, cluster);
+    } else {
+      memcpy(p, cluster + off, len);
+    }
+    done += len;
+  }
+  free(cluster);
+}
+
+
+
+// ============================================================================
+// Mount the BFS disk, with default options.  See fsMountOpts
+// ============================================================================
+i32 fsMount() {
+  return fsMountOpts(NULL);
+}
+
+
+
+// ============================================================================
+// Mount the BFS disk.  It must already exist.  The disk stays open until
+// fsUnmount, and block IO goes through the backend 'opts->ioBackend' picks:
+// see bioOpen.  With 'opts->flushMs', a background thread calls fsSync
+// every flushMs ms; otherwise changes reach the disk only on fsClose, fsSync
+// and the like.  Up to 'opts->delayBlocks' blocks appended to each file are
+// held in memory, and given DBNs together at the next of those, so a file
+// written in small pieces still lands in one extent.  With
+// 'opts->tracePath', every fs* call and BioReq until fsUnmount is traced
+// into that file, for bfsreplay - unless a trace is already running, when
+// the disk is mounted untraced and ETRACE is returned.  'opts' may be NULL,
+// or have fields left at 0, to take the defaults.  Else return 0
+// ============================================================================
+i32 fsMountOpts(MountOpts* opts) {
+  i32 cacheBlocks       = CACHEBLOCKS;
+  i32 inodeWriteThrough = 0;
+  i32 readAheadBlocks   = RAMAXBLOCKS;
+  i32 asyncReadAhead    = 0;
+  i32 ioBackend         = BIODEFAULT;
+  i32 aioThreads        = AIOTHREADS;
+  i32 flushMs           = 0;
+  str tracePath         = NULL;
+  i32 delayBlocks       = DELAYBLOCKS;
+  if (opts != NULL) {
+    if (opts->cacheBlocks > 0) cacheBlocks = opts->cacheBlocks;
+    if (opts->readAheadBlocks != 0) readAheadBlocks = opts->readAheadBlocks;
+    if (opts->aioThreads > 0)  aioThreads  = opts->aioThreads;
+    inodeWriteThrough = opts->inodeWriteThrough;
+    asyncReadAhead    = opts->asyncReadAhead;
+    ioBackend         = opts->ioBackend;
+    flushMs           = opts->flushMs;
+    tracePath         = opts->tracePath;
+    if (opts->delayBlocks != 0) delayBlocks = opts->delayBlocks;
+  }
+  if (aioThreads > AIOMAXTHREADS) aioThreads = AIOMAXTHREADS;
+
+  // blocks read ahead must not push the metadata out of the cache
+  if (readAheadBlocks > cacheBlocks / 2) readAheadBlocks = cacheBlocks / 2;
+
+  bioOpen(t_vol->path, ioBackend);          // FATAL if the disk is not found
+  g_aioMaxThreads = aioThreads;
+  bfsLoadGeometry();                        // block size etc from Super
+  jnlOpen(g_geo.dbnJournal, g_geo.numJournalBlocks, BLOCKSIZE, fsSnapshot,
+          bfsReleaseRun);
+  cacheInit(cacheBlocks, BLOCKSIZE);
+  csumOpen(g_geo.dbnCsum, g_geo.numCsumBlocks, g_geo.numMeta,
+           g_geo.numBlocks, BLOCKSIZE);     // before any data is read
+  bfsLoadBitmap();                          // free-space bitmap, if any
+  bfsLoadDir();                             // Directory, hashed by fname
+  bfsLoadInodes(inodeWriteThrough);         // Inode table stays in memory
+  bfsInitDelay(delayBlocks, g_geo.numInodes);
+  bfsInitReadAhead(readAheadBlocks, asyncReadAhead);
+  bfsInitFree();
+  bfsLoadOrphans();                         // trees a crash left unfreed
+  i32 ret = (tracePath != NULL) ? trcStart(tracePath) : 0;
+
+  if (flushMs > 0) {
+    g_flushMs = flushMs;
+    if (volSpawn(&g_flushThread, fsFlushThread, NULL) != 0) {
+      FATAL(ENOMEM);
+    }
+  }
+  return ret;
+}
+
+
+
+// ============================================================================
+// Return the fs state of a new volume: no worker or flush threads yet.  See
+// vol.c
+// ============================================================================
+FsState* fsNewState() {
+  FsState* state = calloc(1, sizeof(FsState));
+  if (state == NULL) FATAL(ENOMEM);
+  state->aioMaxThreads = AIOTHREADS;
+  pthread_mutex_init(&state->aioLock, NULL);
+  pthread_cond_init(&state->aioWork, NULL);
+  pthread_cond_init(&state->aioDone, NULL);
+  pthread_mutex_init(&state->flushLock, NULL);
+  pthread_cond_init(&state->flushCond, NULL);
+  return state;
+}
+
+
+
 // ============================================================================
 // Open the existing file called 'fname'.  On success, return its file 
-// descriptor.  On failure, return EFNF
+// descriptor.  On failure, return EFNF.  Each open gets a descriptor of its
+// own, with its own cursor, so a file may be open several times at once
 // ============================================================================
 i32 fsOpen(str fname) {
-  i32 inum = bfsLookupFile(fname);        // lookup 'fname' in Directory
-  if (inum == EFNF) return EFNF;
-  return bfsInumToFd(inum);
+  i64 start = statsNow();
+  i32 fd    = fsOpenName(fname, 0);       // lookup 'fname' in Directory
+  statsTime(FSOPOPEN, start);
+  TRACE(TRCOPEN, fd, 0, 0, start, fname);
+  return fd;
 }
 
 
 
 // ============================================================================
-// Read 'numb' bytes of data from the cursor in the file currently fsOpen'd on
-// File Descriptor 'fd' into 'buf'.  On success, return actual number of bytes
-// read (may be less than 'numb' if we hit EOF).  On failure, abort
+// Read the 'numb' bytes at byte 'offset' of the file open on 'fd' into 'buf'.
+// The bytes must lie within the file, and the caller holds its Inode lock
 // ============================================================================
-i32 fsRead(i32 fd, i32 numb, void* buf) {
+static void fsReadAt(i32 fd, i32 offset, i32 numb, void* buf) {
+
+  i32 inum = bfsFdToInum(fd);
+  if (bfsGetFlags(inum) & INODECOMPRESS) {
+    fsClusterIo(inum, offset, numb, buf, 0);
+    return;
+  }
+
+  // find the first and last FBNs holding the bytes to read
+  i32 left = offset / BLOCKSIZE;
+  i32 right = (offset + numb - 1) / BLOCKSIZE;
+  i32 len = right - left + 1;
+
+  // read all the FBNs with one vectored request.  Blocks wholly inside the
+  // request go straight into 'buf'; only a partial head or tail block is
+  // bounced through a temporary buffer.  Blocks with no DBN need no IO:
+  // those held back are copied from memory, and holes read as zeroes
+  i8* headBuf = malloc(2 * BLOCKSIZE);
+  if (headBuf == NULL) FATAL(ENOMEM);
+  i8* tailBuf = headBuf + BLOCKSIZE;
+  i32 headOff = offset % BLOCKSIZE;
+  i32 tailEnd = (offset + numb) - right * BLOCKSIZE;
+  i32 headPartial = (headOff != 0) || (len == 1 && tailEnd != BLOCKSIZE);
+  i32 tailPartial = (len > 1) && (tailEnd != BLOCKSIZE);
+
+  BioVec* vec = malloc(len * sizeof(BioVec));
+  if (vec == NULL) FATAL(ENOMEM);
+
+  i32 num = 0;
+  for (i32 i = 0; i < len; i++) {
+    i8* dst = (i8*)buf + (left + i) * BLOCKSIZE - offset;
+    if (headPartial && i == 0)       dst = headBuf;
+    if (tailPartial && i == len - 1) dst = tailBuf;
+
+    i32 dbn = bfsFdFbnToDbn(fd, left + i);
+    if (dbn == ENODBN) {                // held back, or a hole
+      if (!bfsDelayGet(bfsFdToInum(fd), left + i, dst)) {
+        memset(dst, 0, BLOCKSIZE);
+      }
+      continue;
+    }
+    vec[num].dbn = dbn;
+    vec[num].buf = dst;
+    ++num;
+  }
+
+  if (num > 0) cacheReadv(vec, num);
+  free(vec);
+
+  // copy the partial head and tail blocks into the provided buffer
+  if (headPartial) {
+    i32 bytesToCopy = BLOCKSIZE - headOff;
+    if (bytesToCopy > numb) bytesToCopy = numb;
+    memcpy(buf, headBuf + headOff, bytesToCopy);
+  }
+  if (tailPartial) {
+    memcpy((i8*)buf + numb - tailEnd, tailBuf, tailEnd);
+  }
+  free(headBuf);
+
+  bfsReadAhead(fd, left, right);
+}
+
+
+
+// ============================================================================
+// Write the 'numb' bytes in 'buf' at byte 'offset' of the file open on 'fd',
+// extending the file if they reach past its end.  Blocks a write past the
+// end skips over stay holes, with no DBN.  The caller holds the file's Inode
+// lock for writing
+// ============================================================================
+static void fsWriteAt(i32 fd, i32 offset, i32 numb, void* buf) {
   i32 currInum = bfsFdToInum(fd);
-  i32 currCursor = bfsTell(fd);
 
-  // find FBNs for the file that is open
-  i32 left = currCursor / BYTESPERBLOCK;
-  i32 right = (currCursor + numb) / BYTESPERBLOCK;
+  // find the first and last FBNs written to
+  i32 left = offset / BLOCKSIZE;
+  i32 right = (offset + numb - 1) / BLOCKSIZE;
   i32 fileSize = bfsGetSize(currInum);
 
-  // re-adjust the FBN if reading more than the size of the file
-  if (numb + currCursor > fileSize) {
-    numb = fileSize - currCursor;
-    right = (currCursor + numb) / BYTESPERBLOCK;
+  if (bfsGetFlags(currInum) & INODECOMPRESS) {
+    fsClusterIo(currInum, offset, numb, buf, 1);
+    if (offset + numb > fileSize) bfsSetSize(currInum, offset + numb);
+    return;
   }
 
-  // start reading into a temporary buffer and then into the provided buffer
-  i8 tempBuf[BYTESPERBLOCK];
-  int offset = 0;
+  // write all the mapped FBNs with one vectored request.  Blocks wholly
+  // inside the write go straight from 'buf' to disk; only a partial head or
+  // tail block is merged with its old contents in a one-block buffer
+  i32 len = right - left + 1;
+  i8* headBuf = malloc(2 * BLOCKSIZE);
+  if (headBuf == NULL) FATAL(ENOMEM);
+  i8* tailBuf = headBuf + BLOCKSIZE;
+  i32 headOff = offset % BLOCKSIZE;
+  i32 tailEnd = (offset + numb) - right * BLOCKSIZE;
+  i32 headPartial = (headOff != 0) || (len == 1 && tailEnd != BLOCKSIZE);
+  i32 tailPartial = (len > 1) && (tailEnd != BLOCKSIZE);
 
-  // if reading from one FBN
-  if (left == right) {
-    bfsRead(currInum, left, tempBuf);
-
-    // offset in the block to where the cursor is before copying to buf
-    i32 startOffset = currCursor % BYTESPERBLOCK; 
-    memcpy(buf, tempBuf + startOffset, numb);
+  if (headPartial) {
+    i32 bytesToCopy = BLOCKSIZE - headOff;
+    if (bytesToCopy > numb) bytesToCopy = numb;
+    fsMergeBlock(currInum, left, fileSize, headBuf, headOff, buf, bytesToCopy);
+  }
+  if (tailPartial) {
+    fsMergeBlock(currInum, right, fileSize, tailBuf, 0,
+                 (i8*)buf + numb - tailEnd, tailEnd);
+  }
 
-    // move the current cursor
-    fsSeek(fd, numb, SEEK_CUR);
-    return numb;
+  // FBNs from 'hold' on have no DBN yet, and are held back while there is
+  // room.  Held blocks run on to the end of the file, so a write past it
+  // that leaves a hole first allocates any held.  Every other FBN written
+  // that has no DBN - in a hole, or with no room to hold it - is allocated
+  // now.  FBNs not written get no DBN: they read as zeroes
+  i32 end  = (fileSize + BLOCKSIZE - 1) / BLOCKSIZE;   // first past EOF
+  i32 hold = bfsDelayFirst(currInum);
+  if (left > end) {
+    bfsDelayFlush(currInum);
+    hold = left;
+  }
+  if (right >= hold && !bfsDelayRoom(currInum, hold, right)) {
+    bfsDelayFlush(currInum);
+    hold = right + 1;
   }
+  bfsAllocRange(currInum, left, (right < hold) ? right : hold - 1);
+  bfsRelocate(currInum, left, (right < hold) ? right : hold - 1);  // see fsHeat
 
-  // if reading from multiple FBNs
-  for (i32 i = left; i <= right; i++) {
-    bfsRead(currInum, i, tempBuf);
+  BioVec* vec = malloc(len * sizeof(BioVec));
+  if (vec == NULL) FATAL(ENOMEM);
 
-    i32 startOffset = 0;
-    i32 bytesToCopy = BYTESPERBLOCK;
+  i32 num = 0;
+  for (i32 i = 0; i < len; i++) {
+    i8* src = (i8*)buf + (left + i) * BLOCKSIZE - offset;
+    if (headPartial && i == 0)       src = headBuf;
+    if (tailPartial && i == len - 1) src = tailBuf;
 
-    // if on the first FBN, adjust startOffset to read only from the cursor onwards
-    if (i == left) {
-      startOffset = currCursor % BYTESPERBLOCK;
-      bytesToCopy -= startOffset;
+    if (left + i >= hold) {
+      bfsDelayPut(currInum, left + i, src);
+      continue;
     }
+    vec[num].dbn = bfsFdFbnToDbn(fd, left + i);
+    if (vec[num].dbn == ENODBN) vec[num].dbn = bfsMapFbn(currInum, left + i);
+    vec[num].buf = src;
+    ++num;
+  }
 
-    // if on the last FBN, adjust bytesToCopy to read only the required portion
-    if (i == right && (numb % BYTESPERBLOCK) != 0) {
-      bytesToCopy = numb % BYTESPERBLOCK;
-    }
+  if (num > 0) cacheWritev(vec, num);
+  free(vec);
+  free(headBuf);
+
+  if (offset + numb > fileSize) bfsSetSize(currInum, offset + numb);
+}
+
+
+
+// ============================================================================
+// Ready the blocks a write of 'numb' bytes at byte 'offset' of the file open
+// on 'fd' will overwrite to be written in place: see csumHeat.  If any was
+// sealed, commit, so the disk no longer holds its checksum.  Takes the
+// Inode lock for reading, so is called before jnlBegin.  The write still
+// moves any block shared with a clone, or sealed again by then: see
+// bfsRelocate
+// ============================================================================
+static void fsHeat(i32 fd, i32 offset, i32 numb) {
+  if (g_geo.numJournalBlocks == 0 || g_geo.numCsumBlocks == 0) return;
 
-    // copy from tempBuf into buf
-    memcpy(buf + offset, tempBuf + startOffset, bytesToCopy);
-    offset += bytesToCopy;
+  i32 inum = bfsFdToInum(fd);
+  i32 sealed = 0;
+  bfsLockInode(inum, 0);
+  i32 end = bfsGetSize(inum);
+  if (end > offset + numb) end = offset + numb;
+  if ((bfsGetFlags(inum) & INODECOMPRESS) == 0) {
+    for (i32 fbn = offset / BLOCKSIZE; fbn * BLOCKSIZE < end; ++fbn) {
+      i32 dbn = bfsFbnToDbn(inum, fbn);
+      if (dbn != ENODBN) sealed += csumHeat(dbn);
+    }
   }
+  bfsUnlockInode(inum);
+  if (sealed > 0) jnlCommit();              // outside any operation
+}
+
+
+
+// ============================================================================
+// Read up to 'numb' bytes at byte 'offset' of the file open on File
+// Descriptor 'fd' into 'buf'.  The cursor is neither used nor moved, so
+// threads sharing 'fd' can read at random without getting in each other's
+// way.  Return the # of bytes read: fewer than 'numb' at EOF
+// ============================================================================
+i32 fsPRead(i32 fd, i32 offset, i32 numb, void* buf) {
+
+  if (offset < 0) FATAL(EBADCURS);
+
+  i64 start = statsNow();
+  i32 inum = bfsFdToInum(fd);
+  bfsLockInode(inum, 0);                    // shared with other readers
+  i32 fileSize = bfsGetSize(inum);
+
+  if (numb > fileSize - offset) numb = fileSize - offset;
+  if (numb > 0) fsReadAt(fd, offset, numb, buf);
+
+  bfsUnlockInode(inum);
+  statsTime(FSOPPREAD, start);
+  TRACE(TRCPREAD, fd, numb, offset, start, NULL);
+  return (numb > 0) ? numb : 0;
+}
+
+
+
+// ============================================================================
+// Write 'numb' bytes from 'buf' at byte 'offset' of the file open on File
+// Descriptor 'fd', extending the file if need be.  The cursor is neither
+// used nor moved.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsPWrite(i32 fd, i32 offset, i32 numb, void* buf) {
+
+  if (offset < 0) FATAL(EBADCURS);
+  if (numb <= 0)  return 0;
+
+  i64 start = statsNow();
+  i32 inum = bfsFdToInum(fd);
+  fsHeat(fd, offset, numb);
+  jnlBegin();                               // before the Inode lock
+  bfsLockInode(inum, 1);
+  fsWriteAt(fd, offset, numb, buf);
+  bfsUnlockInode(inum);
+  jnlEnd();
+  statsTime(FSOPPWRITE, start);
+  TRACE(TRCPWRITE, fd, numb, offset, start, NULL);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read 'numb' bytes of data from the cursor in the file currently fsOpen'd on
+// File Descriptor 'fd' into 'buf'.  On success, return actual number of bytes
+// read (may be less than 'numb' if we hit EOF).  On failure, abort.  Threads
+// may read the same file at once: each read claims its bytes, and moves the
+// cursor past them, before any IO
+// ============================================================================
+i32 fsRead(i32 fd, i32 numb, void* buf) {
+  i64 start = statsNow();
+  i32 currInum = bfsFdToInum(fd);
+  bfsLockInode(currInum, 0);                // shared with other readers
+  i32 fileSize = bfsGetSize(currInum);
 
-  // move the current cursor
-  fsSeek(fd, numb, SEEK_CUR);
+  // re-adjust numb if reading more than the size of the file
+  i32 asked = numb;
+  i32 currCursor;
+  numb = bfsAdvanceCursor(fd, numb, fileSize, &currCursor);
+
+  if (numb > 0) fsReadAt(fd, currCursor, numb, buf);
+
+  bfsUnlockInode(currInum);
+  statsTime(FSOPREAD, start);
+  TRACE(TRCREAD, fd, asked, 0, start, NULL);
   return numb;
 }
 
 
+// ============================================================================
+// Start reading 'aio->numb' bytes at byte 'aio->offset' of the file open on
+// 'aio->fd' into 'aio->buf', and return 0 at once.  A worker thread does the
+// read, as fsPRead would, then runs 'aio->callback', if any, and sets
+// 'aio->done'.  The caller keeps 'aio' and its buffer until then: see
+// fsAioWait.  The cursor is neither used nor moved.  On failure, abort
+// ============================================================================
+i32 fsReadAsync(FsAio* aio) {
+  return fsAioQueue(aio, BIOREAD);
+}
+
+
+
+// ============================================================================
+// Zero-copy read: set '*view' to point straight at byte 'offset' of the file
+// open on 'fd', inside the mapping of BFSDISK, and return how many bytes may
+// be read there - at most 'numb', and fewer at EOF or where the file's
+// blocks stop being contiguous on disk.  The view must not be stored
+// through.  It stays valid only until the file is next written, truncated,
+// compressed or deleted: that may move or free the blocks it shows - see
+// bfsRelocate - and once the change commits they may be given to another
+// file, whose bytes the view would then show.  Writes, commits and deletes
+// of other files leave it be.  Over a hole, the view is of zeroes, to the
+// end of that block.  Return 0 at EOF, or ENOMMAP unless the disk was
+// mounted with BIOMMAP and the file is not compressed.  On failure, abort
+// ============================================================================
+i32 fsReadView(i32 fd, i32 offset, i32 numb, void** view) {
+
+  if (view == NULL) FATAL(ENULLPTR);
+  if (offset < 0)   FATAL(EBADCURS);
+  *view = NULL;
+  if (bioMap(DBNSUPER) == NULL) return ENOMMAP;
+
+  i32 inum = bfsFdToInum(fd);
+  bfsLockInode(inum, 0);
+  if (bfsGetFlags(inum) & INODECOMPRESS) {  // fsCompress needs the write lock
+    bfsUnlockInode(inum);
+    return ENOMMAP;
+  }
+  i32 fileSize = bfsGetSize(inum);
+  if (numb > fileSize - offset) numb = fileSize - offset;
+
+  // blocks held back have no DBN to map: allocate them first
+  while (numb > 0 && bfsDelayFirst(inum) * BLOCKSIZE < offset + numb) {
+    bfsUnlockInode(inum);
+    jnlBegin();                             // before the Inode lock
+    bfsLockInode(inum, 1);
+    bfsDelayFlush(inum);
+    bfsUnlockInode(inum);
+    jnlEnd();
+    bfsLockInode(inum, 0);
+  }
+
+  i32 fbn  = offset / BLOCKSIZE;
+  i32 dbn  = (numb > 0) ? bfsFdFbnToDbn(fd, fbn) : ENODBN;
+  i8* base = (dbn > 0) ? bioMap(dbn) : NULL;
+  i32 off   = offset % BLOCKSIZE;
+  i32 avail = BLOCKSIZE - off;
+  if (numb > 0 && dbn == ENODBN) {      // a hole
+    bfsUnlockInode(inum);
+    *view = g_zeroes + off;
+    return (avail < numb) ? avail : numb;
+  }
+  if (base == NULL) {                   // EOF, or no block there
+    bfsUnlockInode(inum);
+    return 0;
+  }
+
+  // grow the view while the next FBN sits in the next DBN
+  while (avail < numb && bfsFdFbnToDbn(fd, fbn + 1) == dbn + 1 &&
+         bioMap(dbn + 1) != NULL) {
+    ++fbn;
+    ++dbn;
+    avail += BLOCKSIZE;
+  }
+  bfsUnlockInode(inum);
+
+  *view = base + off;
+  return (avail < numb) ? avail : numb;
+}
+
+
+
+// ============================================================================
+// Check every block of the disk that has a checksum against BFSDISK, with
+// 'numThreads' threads in parallel (0 => SCRUBTHREADS), and fill in 'stats'
+// with how many were checked and how many failed.  Everything written so
+// far is committed first.  Meant for a quiet disk: a block rewritten while
+// the scrub runs is read again before it is counted as bad.  Return 0, or
+// ENOCSUM on a disk with no checksum table: one older than version 6, or
+// older than version 8 with no journal
+// ============================================================================
+i32 fsScrub(i32 numThreads, ScrubStats* stats) {
+  fsSyncAll();
+  return csumScrub(numThreads, stats);
+}
+
+
+
+// ============================================================================
+// Return the byte offset fsSeek moves to for SEEK_DATA, if 'data' is 1, or
+// SEEK_HOLE, from byte 'offset' of the file open on 'fd'; or ENXDATA
+// ============================================================================
+static i32 fsSeekData(i32 fd, i32 offset, i32 data) {
+  i32 inum = bfsFdToInum(fd);
+  bfsLockInode(inum, 0);
+  i32 size = bfsGetSize(inum);
+  i32 pos  = ENXDATA;
+  if (offset < size) {
+    i32 fbn = bfsSeekData(inum, offset / BLOCKSIZE, data);
+    pos = (fbn == offset / BLOCKSIZE) ? offset : fbn * BLOCKSIZE;
+    if (pos > size) pos = size;
+    if (data && pos == size) pos = ENXDATA;
+  }
+  bfsUnlockInode(inum);
+  return pos;
+}
+
+
+
 // ============================================================================
 // Move the cursor for the file currently open on File Descriptor 'fd' to the
 // byte-offset 'offset'.  'whence' can be any of:
@@ -153,16 +1037,31 @@ i32 fsRead(i32 fd, i32 numb, void* buf) {
 //  SEEK_SET : set cursor to 'offset'
 //  SEEK_CUR : add 'offset' to the current cursor
 //  SEEK_END : add 'offset' to the size of the file
+//  SEEK_DATA: set cursor to the first byte of data at or after 'offset'
+//  SEEK_HOLE: set cursor to the first byte of a hole at or after 'offset';
+//             the end of the file counts as one
 //
-// On success, return 0.  On failure, abort
+// Holes are found a block at a time: see bfsSeekData.  On success, return
+// 0.  Return ENXDATA, leaving the cursor, if SEEK_DATA or SEEK_HOLE finds
+// 'offset' at or past EOF, or SEEK_DATA finds no data after it.  On any
+// other failure, abort
 // ============================================================================
 i32 fsSeek(i32 fd, i32 offset, i32 whence) {
 
   if (offset < 0) FATAL(EBADCURS);
  
-  i32 inum = bfsFdToInum(fd);
-  i32 ofte = bfsFindOFTE(inum);
+  i64 start = statsNow();
+  i32 ofte = bfsFdToOFTE(fd);
+  i32 end  = (whence == SEEK_END) ? fsSize(fd) : 0;
+  if (whence == SEEK_DATA || whence == SEEK_HOLE) {
+    end = fsSeekData(fd, offset, whence == SEEK_DATA);
+    if (end == ENXDATA) {
+      TRACE(TRCSEEK, fd, offset, whence, start, NULL);
+      return ENXDATA;
+    }
+  }
   
+  pthread_mutex_lock(&g_oft[ofte].lock);
   switch(whence) {
     case SEEK_SET:
       g_oft[ofte].curs = offset;
@@ -170,14 +1069,49 @@ i32 fsSeek(i32 fd, i32 offset, i32 whence) {
     case SEEK_CUR:
       g_oft[ofte].curs += offset;
       break;
-    case SEEK_END: {
-        i32 end = fsSize(fd);
-        g_oft[ofte].curs = end + offset;
-        break;
-      }
+    case SEEK_END:
+      g_oft[ofte].curs = end + offset;
+      break;
+    case SEEK_DATA:
+    case SEEK_HOLE:
+      g_oft[ofte].curs = end;
+      break;
     default:
-        FATAL(EBADWHENCE);
+      pthread_mutex_unlock(&g_oft[ofte].lock);
+      FATAL(EBADWHENCE);
   }
+  pthread_mutex_unlock(&g_oft[ofte].lock);
+  TRACE(TRCSEEK, fd, offset, whence, start, NULL);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Copy the whole mounted disk to a new image at 'path', after making every
+// change so far durable, as fsSync does.  The image can be mounted in place
+// of BFSDISK, and holds the files as they were at the call; with a journal
+// it may first replay the last commit.  It is taken with bioCopy: at once,
+// sharing extents, where the host file system allows, else by copying the
+// metadata and every block in use.  No other fs call may run meanwhile, as
+// for fsUnmount.  On success, return 0.  On failure, EDISKCREATE
+// ============================================================================
+i32 fsSnapshotDisk(str path) {
+  fsSyncAll();
+  return bioCopy(path, bfsInUse);
+}
+
+
+
+// ============================================================================
+// Make every change so far durable.  See fsSyncAll.  On success, return 0.
+// On failure, abort
+// ============================================================================
+i32 fsSync() {
+  i64 start = statsNow();
+  fsSyncAll();
+  statsTime(FSOPSYNC, start);
+  TRACE(TRCSYNC, 0, 0, 0, start, NULL);
   return 0;
 }
 
@@ -192,6 +1126,28 @@ i32 fsTell(i32 fd) {
 
 
 
+// ============================================================================
+// Set the size of the file open on 'fd' to 'size' bytes.  Bytes past the new
+// end are gone, their blocks freed; growing the file adds bytes that read as
+// zeroes.  The cursor is left where it is.  As for fsDelete, blocks freed
+// are committed at once.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsTruncate(i32 fd, i32 size) {
+  i64 start = statsNow();
+  i32 inum  = bfsFdToInum(fd);
+  jnlBegin();
+  bfsLockInode(inum, 1);
+  bfsTruncate(inum, size);
+  bfsUnlockInode(inum);
+  jnlEnd();
+  if (jnlHeld() > 0) fsCommit();            // see jnlDefer
+  statsTime(FSOPTRUNCATE, start);
+  TRACE(TRCTRUNCATE, fd, size, 0, start, NULL);
+  return 0;
+}
+
+
+
 // ============================================================================
 // Retrieve the current file size in bytes.  This depends on the highest offset
 // written to the file, or the highest offset set with the fsSeek function.  On
@@ -204,51 +1160,71 @@ i32 fsSize(i32 fd) {
 
 
 
+// ============================================================================
+// Unmount the BFS disk: stop the background threads, flush the cache and
+// close the handle opened by fsMount
+// ============================================================================
+i32 fsUnmount() {
+  if (g_flushMs > 0) {                      // stop the flush thread
+    pthread_mutex_lock(&g_flushLock);
+    g_flushStop = 1;
+    pthread_cond_signal(&g_flushCond);
+    pthread_mutex_unlock(&g_flushLock);
+    pthread_join(g_flushThread, NULL);
+    g_flushMs   = 0;
+    g_flushStop = 0;
+  }
+  fsAioStop();                              // finish queued fsReadAsync etc
+  bfsStopReadAhead();
+  bfsStopFree();                            // trees deleted, still queued
+  csumCool();                               // last commit seals every block
+  jnlClose();                               // commit, then all in place
+  fsSnapshot();                             // without a journal
+  cacheFree();                              // write back dirty blocks
+  csumClose();
+  trcStop();                                // if this volume is traced
+  return bioClose();
+}
+
+
+
 // ============================================================================
 // Write 'numb' bytes of data from 'buf' into the file currently fsOpen'd on
 // filedescriptor 'fd'.  The write starts at the current file offset for the
-// destination file.  On success, return 0.  On failure, abort
+// destination file.  On success, return 0.  On failure, abort.  The file is
+// locked against other readers and writers for the whole write
 // ============================================================================
 i32 fsWrite(i32 fd, i32 numb, void* buf) {
   i32 currInum = bfsFdToInum(fd);
-  i32 currCursor = bfsTell(fd);
 
-  // find FBNs for the file that is open
-  i32 left = currCursor / BYTESPERBLOCK;
-  i32 right = (currCursor + numb) / BYTESPERBLOCK;
-  i32 fileSize = bfsGetSize(currInum);
+  if (numb <= 0) return 0;
 
-  // check to see if writing within file or more than the size of the file
-  if (currCursor + numb > fileSize) {
-    bfsExtend(currInum, right);
-    bfsSetSize(currInum, currCursor + numb);
-  }
+  i64 start = statsNow();
+  fsHeat(fd, bfsTell(fd), numb);            // the cursor may move: a hint
+  jnlBegin();                               // before the Inode lock
+  bfsLockInode(currInum, 1);
+  i32 currCursor = bfsTell(fd);
 
-  // number of blocks we need to write numb bytes
-  i8 len = right - left + 1;
-  i8 simulatedMem[len * BYTESPERBLOCK];
+  fsWriteAt(fd, currCursor, numb, buf);
 
-  // write the first and last FBN into simulated memory space
-  // because we dont know how many bytes to overwrite
-  bfsRead(currInum, left, simulatedMem);
-  if (len > 1) {
-    bfsRead(currInum, right, simulatedMem + (len - 1) * BYTESPERBLOCK);
-  }
+  // move the current cursor: not with fsSeek, which would be traced
+  bfsSetCursor(fd, currCursor + numb);
+  bfsUnlockInode(currInum);
+  jnlEnd();
+  statsTime(FSOPWRITE, start);
+  TRACE(TRCWRITE, fd, numb, 0, start, NULL);
+  return 0;
+}
 
-  // fill in the rest of the simulated memory with contents from buf
-  memcpy(simulatedMem + currCursor % BYTESPERBLOCK, buf, numb);
 
-  // start writing to memory
-  int offset = 0;
-  i8 tempBuf[BYTESPERBLOCK];
 
-  for (i32 i = left; i <= right; i++) {
-    memcpy(tempBuf, simulatedMem + offset, BYTESPERBLOCK);
-    bioWrite(bfsFbnToDbn(currInum, i), tempBuf);
-    offset += BYTESPERBLOCK;
-  }
 
-  // move the current cursor
-  fsSeek(fd, numb, SEEK_CUR);
-  return 0;
+// ============================================================================
+// Start writing 'aio->numb' bytes from 'aio->buf' at byte 'aio->offset' of
+// the file open on 'aio->fd', and return 0 at once.  As for fsReadAsync, but
+// the write is done as fsPWrite would.  Writes to one file may complete in
+// any order
+// ============================================================================
+i32 fsWriteAsync(FsAio* aio) {
+  return fsAioQueue(aio, BIOWRITE);
 }
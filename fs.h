@@ -7,17 +7,79 @@
 
 #include <stdio.h>
 #include "alias.h"
+#include "bio.h"
+#include "csum.h"
 #include "errors.h"
 
+#ifndef SEEK_DATA                 // fsSeek, as lseek on Linux
+#define SEEK_DATA     3           // to the next byte of data
+#define SEEK_HOLE     4           // to the next byte of a hole, or EOF
+#endif
+
+typedef struct {          // options for fsFormatOpts.  0 => default
+  i32 bytesPerBlock;      // block size: a power of 2, 512 .. 65,536
+  i32 numBlocks;          // # of blocks in BFSDISK
+  i32 numInodes;          // # of files BFSDISK can hold
+  i32 journalBlocks;      // size of the metadata journal.  -1 => none
+} FormatOpts;
+
+typedef struct {          // options for fsMountOpts.  0 => default
+  i32 cacheBlocks;        // # of blocks in the buffer cache
+  i32 inodeWriteThrough;  // 1 => write each Inode change to DBNINODES
+  i32 readAheadBlocks;    // largest readahead window.  -1 => no readahead
+  i32 asyncReadAhead;     // 1 => read ahead on a background thread
+  i32 ioBackend;          // BIOSTDIO, BIOPREAD, BIOURING, BIOMMAP: bio.h
+  i32 aioThreads;         // # of threads serving fsReadAsync etc
+  i32 flushMs;            // fsSync every this many ms, in the background
+  str tracePath;          // trace fs* calls and block IO here: trace.h
+  i32 delayBlocks;        // most appended blocks held per file, unallocated.
+                          //   -1 => allocate at once
+} MountOpts;
+
+typedef struct FsAio {    // an asynchronous read or write.  See fsReadAsync
+  i32   fd;               // file descriptor, from fsOpen or fsCreate
+  i32   offset;           // byte offset in the file
+  i32   numb;             // # of bytes to read or write
+  void* buf;              // 'numb' bytes of memory
+  void (*callback)(struct FsAio* aio);  // on completion, or NULL
+  void* arg;              // for use by 'callback'
+  i32   result;           // once done: as for fsPRead or fsPWrite
+  i32   done;             // 1 => complete.  Set after 'callback' returns
+  i32   op;               // internal: BIOREAD or BIOWRITE
+  struct FsAio* next;     // internal: link in the work queue
+} FsAio;
+
+typedef struct FsState FsState;       // one volume's fs threads: see vol.h
+
+i32 fsAioWait(FsAio* aio);
+
+i32 fsClone (i32 fd, str fname);
 i32 fsClose (i32 fd);
+i32 fsCompress(i32 fd, i32 on);
 i32 fsCreate(str name);
+i32 fsDelete(str fname);
 i32 fsFormat();
+i32 fsFormatOpts(FormatOpts* opts);
+i32 fsFreeState(FsState* state);
+i32 fsFsync (i32 fd);
 i32 fsMount();
+i32 fsMountOpts(MountOpts* opts);
+FsState* fsNewState();
 i32 fsOpen  (str fname);
+i32 fsPRead (i32 fd, i32 offset, i32 numb, void* buf);
+i32 fsPWrite(i32 fd, i32 offset, i32 numb, void* buf);
 i32 fsRead  (i32 fd, i32 numb,   void* buf);
+i32 fsReadAsync (FsAio* aio);
+i32 fsReadView  (i32 fd, i32 offset, i32 numb, void** view);
+i32 fsScrub (i32 numThreads, ScrubStats* stats);
 i32 fsSeek  (i32 fd, i32 offset, i32   whence);
 i32 fsSize  (i32 fd);
+i32 fsSnapshotDisk(str path);
+i32 fsSync  ();
 i32 fsTell  (i32 fd);
+i32 fsTruncate(i32 fd, i32 size);
+i32 fsUnmount();
 i32 fsWrite (i32 fd, i32 numb,   void* buf);
+i32 fsWriteAsync(FsAio* aio);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1927 @@
+// ============================================================================
+// fstest.c : check the fs calls that p5test does not reach.  Each test runs
+// on a scratch disk, TESTDISK, mounted on a volume of its own, so BFSDISK is
+// never touched
+// ============================================================================
+
+#include <pthread.h>      // pthread_create, pthread_join
+#include <stdlib.h>       // malloc
+#include <sys/wait.h>     // waitpid
+#include <unistd.h>       // fork, _exit
+
+#include "bfs.h"          // bfsInUse, g_geo
+#include "fstest.h"
+#include "journal.h"      // jnlGetStats
+#include "stats.h"        // statsGet, statsReset
+#include "trace.h"        // TrcHeader, TrcRec
+#include "vol.h"          // volNew, etc
+
+// ============================================================================
+// Check that 'actual' == 'expected' for test 'testnum'
+// ============================================================================
+void checkValue(i32 testnum, i32 expected, i32 actual) {
+  if (actual == expected) {
+    printf("TEST %d : GOOD \n", testnum);
+  } else {
+    printf("TEST %d : BAD  : got %d but should be %d \n",
+        testnum, actual, expected);
+  }
+}
+
+
+
+// ============================================================================
+// Make the calling thread's volume the disk at 'path' - formatted anew with
+// 'fo', unless it is NULL - and mount it with 'mo'.  Return the volume the
+// thread had before, for testUnmount
+// ============================================================================
+static BfsVolume* testMountWith(str path, FormatOpts* fo, MountOpts* mo) {
+  BfsVolume* prev = volUse(volNew(path));
+  if (fo != NULL) fsFormatOpts(fo);
+  fsMountOpts(mo);
+  return prev;
+}
+
+
+
+// ============================================================================
+// Make the calling thread's volume the disk at 'path' - formatted anew, if
+// 'format' is 1, with 'journalBlocks' as for FormatOpts - and mount it,
+// allocating each block as it is written.  Return the volume the thread had
+// before, for testUnmount
+// ============================================================================
+static BfsVolume* testMountAt(str path, i32 format, i32 journalBlocks) {
+  FormatOpts fo;
+  memset(&fo, 0, sizeof(fo));
+  fo.numBlocks     = TESTBLOCKS;
+  fo.journalBlocks = journalBlocks;
+  MountOpts mo;
+  memset(&mo, 0, sizeof(mo));
+  mo.delayBlocks = -1;
+  return testMountWith(path, format ? &fo : NULL, &mo);
+}
+
+
+
+// ============================================================================
+// As testMountAt, for TESTDISK
+// ============================================================================
+static BfsVolume* testMount(i32 format, i32 journalBlocks) {
+  return testMountAt(TESTDISK, format, journalBlocks);
+}
+
+
+
+// ============================================================================
+// As testMount, with a journal, but holding appended blocks back, as fsMount
+// does by default: see MountOpts.delayBlocks
+// ============================================================================
+static BfsVolume* testMountDelayed(i32 format) {
+  FormatOpts fo;
+  memset(&fo, 0, sizeof(fo));
+  fo.numBlocks = TESTBLOCKS;
+  MountOpts mo;
+  memset(&mo, 0, sizeof(mo));
+  return testMountWith(TESTDISK, format ? &fo : NULL, &mo);
+}
+
+
+
+// ============================================================================
+// Unmount TESTDISK, and switch back to volume 'prev'
+// ============================================================================
+static void testUnmount(BfsVolume* prev) {
+  fsUnmount();
+  volFree(volUse(prev));
+}
+
+
+
+// ============================================================================
+// Return the # of free blocks on the calling thread's volume
+// ============================================================================
+static i32 testFree() {
+  i32 num = 0;
+  for (i32 dbn = 0; dbn < g_geo.numBlocks; ++dbn) num += !bfsInUse(dbn);
+  return num;
+}
+
+
+
+// ============================================================================
+// Return the # of blocks in use for file data, or indirect blocks, on the
+// calling thread's volume
+// ============================================================================
+static i32 testUsed() {
+  return g_geo.numBlocks - g_geo.numMeta - testFree();
+}
+
+
+
+// ============================================================================
+// Run 'fn' in a child process, and return its exit status: 0 if it called
+// _exit(0), as a crash would leave the disk
+// ============================================================================
+static i32 testChild(void (*fn)()) {
+  fflush(stdout);                   // or the child prints it again
+  pid_t pid = fork();
+  if (pid == 0) {
+    fn();
+    _exit(0);
+  }
+  i32 status = -1;
+  waitpid(pid, &status, 0);
+  return status;
+}
+
+
+
+// ============================================================================
+// Write 'num' blocks, every byte 'val', at the cursor of 'fd', in one fsWrite
+// ============================================================================
+static void writeBlocks(i32 fd, i32 num, i32 val) {
+  i8* buf = malloc(num * BYTESPERBLOCK);
+  assert(buf != NULL);
+  memset(buf, val, num * BYTESPERBLOCK);
+  fsWrite(fd, num * BYTESPERBLOCK, buf);
+  free(buf);
+}
+
+
+
+// ============================================================================
+// Write 'num' blocks, every byte 'val', from block 'fbn' on of 'fd', in one
+// fsPWrite
+// ============================================================================
+static void pwriteBlocks(i32 fd, i32 fbn, i32 num, i32 val) {
+  i8* buf = malloc(num * BYTESPERBLOCK);
+  assert(buf != NULL);
+  memset(buf, val, num * BYTESPERBLOCK);
+  fsPWrite(fd, fbn * BYTESPERBLOCK, num * BYTESPERBLOCK, buf);
+  free(buf);
+}
+
+
+
+// ============================================================================
+// Append 'numb' bytes, every one 'val', at the cursor of 'fd', in fsWrites
+// of 100 bytes, so that most do not fill a block
+// ============================================================================
+static void appendBytes(i32 fd, i32 numb, i32 val) {
+  i8 buf[100];
+  memset(buf, val, sizeof(buf));
+  for (i32 done = 0; done < numb; done += sizeof(buf)) {
+    i32 len = (numb - done < (i32)sizeof(buf)) ? numb - done : sizeof(buf);
+    fsWrite(fd, len, buf);
+  }
+}
+
+
+
+// ============================================================================
+// Fill 'buf' with the 'numb' bytes from byte 'offset' on of the pattern the
+// round trips write: not the same in any two blocks, of any size
+// ============================================================================
+static void testPattern(i8* buf, i32 offset, i32 numb) {
+  for (i32 i = 0; i < numb; ++i) {
+    buf[i] = (i8)((offset + i) * 7 + (offset + i) / 509);
+  }
+}
+
+
+
+// ============================================================================
+// Return 1 if the 'numb' bytes at 'buf' are those of testPattern from byte
+// 'offset' on, else 0
+// ============================================================================
+static i32 testIsPattern(i8* buf, i32 offset, i32 numb) {
+  for (i32 i = 0; i < numb; ++i) {
+    if (buf[i] != (i8)((offset + i) * 7 + (offset + i) / 509)) return 0;
+  }
+  return 1;
+}
+
+
+
+// ============================================================================
+// Format TESTDISK with blocks of 'bytesPerBlock' bytes, and mount it with
+// 'mo'.  Write a file of 3.5 blocks of testPattern, in pieces of 1000 bytes,
+// and read it back, at once and after a remount; then scrub.  Results go to
+// test 'testnum'
+// ============================================================================
+static void testRoundTrip(i32 testnum, i32 bytesPerBlock, MountOpts* mo) {
+  FormatOpts fo;
+  memset(&fo, 0, sizeof(fo));
+  fo.bytesPerBlock = bytesPerBlock;
+  fo.numBlocks     = TESTRTBLOCKS;
+  BfsVolume* prev = testMountWith(TESTDISK, &fo, mo);
+  checkValue(testnum, bytesPerBlock, BLOCKSIZE);
+
+  i32 numb = 7 * BLOCKSIZE / 2;
+  i8* buf  = malloc(numb);
+  assert(buf != NULL);
+  i32 fd = fsCreate("RT");
+  for (i32 off = 0; off < numb; off += 1000) {
+    i32 len = (numb - off < 1000) ? numb - off : 1000;
+    testPattern(buf, off, len);
+    fsWrite(fd, len, buf);
+  }
+  memset(buf, 0, numb);
+  checkValue(testnum, numb, fsPRead(fd, 0, numb, buf));
+  checkValue(testnum, 1, testIsPattern(buf, 0, numb));
+  fsClose(fd);
+  testUnmount(prev);
+
+  prev = testMountWith(TESTDISK, NULL, mo);
+  fd = fsOpen("RT");
+  memset(buf, 0, numb);
+  checkValue(testnum, numb, fsPRead(fd, 0, numb, buf));
+  checkValue(testnum, 1, testIsPattern(buf, 0, numb));
+  fsClose(fd);
+  ScrubStats stats;
+  checkValue(testnum, 0, fsScrub(0, &stats));
+  checkValue(testnum, 0, (i32)stats.bad);
+  testUnmount(prev);
+  remove(TESTDISK);
+  free(buf);
+}
+
+
+
+// ============================================================================
+// Seek 'fd' to 'offset' with 'whence', and return where the cursor ends up,
+// or the error fsSeek returned
+// ============================================================================
+static i32 seekTo(i32 fd, i32 offset, i32 whence) {
+  i32 ret = fsSeek(fd, offset, whence);
+  return (ret == 0) ? fsTell(fd) : ret;
+}
+
+
+
+// ============================================================================
+// Read the 'num' blocks from block 'fbn' on of 'fd', and check that every
+// byte is 'val'
+// ============================================================================
+static void checkBlocks(i32 testnum, i32 fd, i32 fbn, i32 num, i32 val) {
+  i8* buf = malloc(num * BYTESPERBLOCK);
+  assert(buf != NULL);
+  i32 ret = fsPRead(fd, fbn * BYTESPERBLOCK, num * BYTESPERBLOCK, buf);
+  checkValue(testnum, num * BYTESPERBLOCK, ret);
+  check(testnum, buf, 0, num * BYTESPERBLOCK, val);
+  free(buf);
+}
+
+
+
+// ============================================================================
+// TEST 7 : Truncate a 4-block file to 700 bytes, then grow it back: the bytes
+//          past 700 read as zeroes
+//          700*7, 1300*0
+// ============================================================================
+void test7() {
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+  BfsVolume* prev = testMount(1, 0);
+
+  i32 fd = fsCreate("T7");
+  writeBlocks(fd, 4, 7);
+  fsTruncate(fd, 700);
+  checkValue(7, 700, fsSize(fd));
+
+  fsTruncate(fd, 4 * BYTESPERBLOCK);
+  memset(buf, 1, BUFSIZE);
+  i32 ret = fsPRead(fd, 0, BUFSIZE, buf);
+  checkValue(7, BUFSIZE, ret);
+
+  check(7, buf,   0,  700, 7);
+  check(7, buf, 700, 1300, 0);
+  fsClose(fd);
+
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 8 : Delete a file, then create one of the same name: it starts empty,
+//          and holds only what is written to it
+// ============================================================================
+void test8() {
+  BfsVolume* prev = testMount(1, 0);
+
+  i32 fd = fsCreate("T8");
+  writeBlocks(fd, 3, 5);
+  fsClose(fd);
+
+  checkValue(8, 0, fsDelete("T8"));
+  checkValue(8, EFNF, fsOpen("T8"));
+
+  fd = fsCreate("T8");
+  checkValue(8, 0, fsSize(fd));
+  writeBlocks(fd, 1, 6);
+  checkValue(8, BYTESPERBLOCK, fsSize(fd));
+  checkBlocks(8, fd, 0, 1, 6);
+  fsClose(fd);
+
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 9 : Fill the disk, delete a file, and write a new one into the space
+//          it freed
+// ============================================================================
+void test9() {
+  BfsVolume* prev = testMount(1, 0);
+
+  i32 fd = fsCreate("A");
+  writeBlocks(fd, 50, 1);
+  fsClose(fd);
+  fsSync();
+
+  i32 num = testFree();
+  fd = fsCreate("FILL");
+  writeBlocks(fd, num, 2);
+  fsClose(fd);
+  fsSync();
+  checkValue(9, 0, testFree());
+
+  checkValue(9, 0, fsDelete("A"));
+  checkValue(9, 50, testFree());
+
+  fd = fsCreate("B");
+  writeBlocks(fd, 50, 3);
+  checkBlocks(9, fd, 0, 50, 3);
+  fsClose(fd);
+  checkValue(9, 0, testFree());
+
+  fd = fsOpen("FILL");
+  checkBlocks(9, fd, 0, num, 2);
+  fsClose(fd);
+
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 10 : As TEST 9, but crash once the new file is written, before any
+//           fsSync.  The delete was committed, so after the journal is
+//           replayed the old file is gone, and every block still mapped
+//           reads back whole
+// ============================================================================
+void test10() {
+  fflush(stdout);                   // or the child prints it again
+  pid_t pid = fork();
+  if (pid == 0) {
+    testMount(1, 0);
+    i32 fd = fsCreate("A");
+    writeBlocks(fd, 50, 1);
+    fsClose(fd);
+    fsSync();
+
+    fd = fsCreate("FILL");
+    writeBlocks(fd, testFree(), 2);
+    fsClose(fd);
+    fsSync();
+
+    fsDelete("A");
+    fd = fsCreate("B");
+    writeBlocks(fd, 50, 3);         // onto the blocks "A" had
+    _exit(0);                       // crash: no fsClose, fsSync or unmount
+  }
+  i32 status = -1;
+  waitpid(pid, &status, 0);
+  checkValue(10, 0, status);
+
+  BfsVolume* prev = testMount(0, 0);
+  checkValue(10, EFNF, fsOpen("A"));
+
+  i32 fd = fsOpen("FILL");
+  checkBlocks(10, fd, 0, fsSize(fd) / BYTESPERBLOCK, 2);
+  fsClose(fd);
+
+  fd = fsOpen("B");                 // not committed: empty, if there
+  if (fd != EFNF) {
+    checkValue(10, 0, fsSize(fd));
+    fsClose(fd);
+  }
+
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// Overwrite 'count' runs of 100 bytes, each 'val', at random offsets in the
+// first 'numb' bytes of 'fd'
+// ============================================================================
+static void overwrite(i32 fd, i32 numb, i32 count, i32 val) {
+  i8 buf[100];
+  memset(buf, val, sizeof(buf));
+  for (i32 i = 0; i < count; ++i) {
+    fsPWrite(fd, rand() % (numb - sizeof(buf)), sizeof(buf), buf);
+  }
+}
+
+
+
+// ============================================================================
+// Put the DBNs of the first 'num' blocks of 'fd' in 'dbns'.  Return the # of
+// checksum table blocks that cover them
+// ============================================================================
+static i32 testDbns(i32 fd, i32 num, i32* dbns) {
+  i32 per = BYTESPERBLOCK / sizeof(u32);          // entries per table block
+  i32 tables = 0;
+  for (i32 fbn = 0; fbn < num; ++fbn) {
+    dbns[fbn] = bfsFdFbnToDbn(fd, fbn);
+    i32 seen = 0;
+    for (i32 i = 0; i < fbn; ++i) seen |= dbns[i] / per == dbns[fbn] / per;
+    tables += !seen;
+  }
+  return tables;
+}
+
+
+
+// ============================================================================
+// Return the # of the first 'num' blocks of 'fd' no longer at the DBN in
+// 'dbns', as testDbns left them
+// ============================================================================
+static i32 testMoved(i32 fd, i32 num, i32* dbns) {
+  i32 moved = 0;
+  for (i32 fbn = 0; fbn < num; ++fbn) {
+    moved += bfsFdFbnToDbn(fd, fbn) != dbns[fbn];
+  }
+  return moved;
+}
+
+
+
+// ============================================================================
+// TEST 11 : Overwrite a file in place, 500 times at random, on a disk with a
+//           journal.  Every block in use still has a checksum, and it
+//           matches.  No block moved, and the writes needed one commit for
+//           each checksum table block the file spans: see csumHeat
+// ============================================================================
+void test11() {
+  BfsVolume* prev = testMount(1, 0);
+  srand(11);
+
+  i32 fd = fsCreate("T11");
+  writeBlocks(fd, 200, 11);
+  fsSync();
+
+  i32 dbns[200];
+  i32 tables = testDbns(fd, 200, dbns);
+  JnlStats before, after;
+  jnlGetStats(&before);
+  overwrite(fd, 200 * BYTESPERBLOCK, 500, 12);
+  jnlGetStats(&after);
+  checkValue(11, tables, (i32)(after.commits - before.commits));
+  checkValue(11, 0, testMoved(fd, 200, dbns));
+  fsClose(fd);
+
+  ScrubStats stats;
+  checkValue(11, 0, fsScrub(0, &stats));
+  checkValue(11, testUsed(), (i32)stats.checked);
+  checkValue(11, 0, (i32)stats.bad);
+
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 12 : As TEST 11, on a disk with no journal
+// ============================================================================
+void test12() {
+  BfsVolume* prev = testMount(1, -1);
+  srand(12);
+
+  i32 fd = fsCreate("T12");
+  writeBlocks(fd, 200, 11);
+  fsSync();
+  overwrite(fd, 200 * BYTESPERBLOCK, 500, 12);
+  fsClose(fd);
+
+  ScrubStats stats;
+  checkValue(12, 0, fsScrub(0, &stats));
+  checkValue(12, testUsed(), (i32)stats.checked);
+  checkValue(12, 0, (i32)stats.bad);
+
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 13 : Clone a file, and overwrite the clone.  The blocks the two still
+//           share keep their checksums
+// ============================================================================
+void test13() {
+  BfsVolume* prev = testMount(1, 0);
+
+  i32 fd = fsCreate("T13");
+  writeBlocks(fd, 100, 13);
+  checkValue(13, 0, fsClone(fd, "T13C"));
+  fsClose(fd);
+  fsSync();
+
+  fd = fsOpen("T13C");
+  srand(13);
+  overwrite(fd, 100 * BYTESPERBLOCK, 20, 14);
+  fsClose(fd);
+
+  ScrubStats stats;
+  checkValue(13, 0, fsScrub(0, &stats));
+  checkValue(13, testUsed(), (i32)stats.checked);
+  checkValue(13, 0, (i32)stats.bad);
+
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// Body of TEST 14 before the crash: commit a file, then overwrite it
+// ============================================================================
+static void test14Crash() {
+  testMount(1, 0);
+  srand(14);
+  i32 fd = fsCreate("T14");
+  writeBlocks(fd, 200, 11);
+  fsSync();
+  overwrite(fd, 200 * BYTESPERBLOCK, 500, 12);
+}
+
+
+
+// ============================================================================
+// Body of TEST 14 after the crash: read the whole file, and scrub.  A block
+// that fails its checksum aborts, with a nonzero status
+// ============================================================================
+static void test14Mount() {
+  testMount(0, 0);
+  i32 fd = fsOpen("T14");
+  i8* buf = malloc(200 * BYTESPERBLOCK);
+  assert(buf != NULL);
+  fsPRead(fd, 0, 200 * BYTESPERBLOCK, buf);
+  free(buf);
+  ScrubStats stats;
+  fsScrub(0, &stats);
+  if (stats.bad != 0) _exit(1);
+}
+
+
+
+// ============================================================================
+// TEST 14 : As TEST 11, but crash before the overwrites are committed.
+//           After the journal is replayed, every block of the file still
+//           matches its checksum
+// ============================================================================
+void test14() {
+  checkValue(14, 0, testChild(test14Crash));
+  checkValue(14, 0, testChild(test14Mount));
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 15 : Clone a file, and write to the clone, in place and past its end.
+//           The original reads as it was; the clone holds the new bytes
+// ============================================================================
+void test15() {
+  BfsVolume* prev = testMount(1, 0);
+
+  i32 fd = fsCreate("T15");
+  writeBlocks(fd, 20, 15);
+  checkValue(15, 0, fsClone(fd, "T15C"));
+  fsSync();
+
+  i32 fdc = fsOpen("T15C");
+  fsSeek(fdc, 5 * BYTESPERBLOCK, SEEK_SET);
+  writeBlocks(fdc, 3, 16);                  // in place
+  fsSeek(fdc, 0, SEEK_END);
+  writeBlocks(fdc, 2, 17);                  // past the end
+
+  checkValue(15, 20 * BYTESPERBLOCK, fsSize(fd));
+  checkBlocks(15, fd, 0, 20, 15);
+
+  checkValue(15, 22 * BYTESPERBLOCK, fsSize(fdc));
+  checkBlocks(15, fdc,  0,  5, 15);
+  checkBlocks(15, fdc,  5,  3, 16);
+  checkBlocks(15, fdc,  8, 12, 15);
+  checkBlocks(15, fdc, 20,  2, 17);
+  fsClose(fdc);
+  fsClose(fd);
+
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 16 : Clone a file, and delete the original.  The clone still reads
+//           whole, before and after a remount, and keeps every block; they
+//           go free only when it is deleted too
+// ============================================================================
+void test16() {
+  BfsVolume* prev = testMount(1, 0);
+
+  i32 fd = fsCreate("T16");
+  writeBlocks(fd, 30, 16);
+  checkValue(16, 0, fsClone(fd, "T16C"));
+  fsClose(fd);
+  fsSync();
+  i32 used = testUsed();
+
+  checkValue(16, 0, fsDelete("T16"));
+  fsSync();
+  fd = fsOpen("T16C");
+  checkBlocks(16, fd, 0, 30, 16);
+  fsClose(fd);
+
+  testUnmount(prev);
+  prev = testMount(0, 0);
+
+  fd = fsOpen("T16C");
+  checkValue(16, 30 * BYTESPERBLOCK, fsSize(fd));
+  checkBlocks(16, fd, 0, 30, 16);
+  fsClose(fd);
+  checkValue(16, used, testUsed());         // all still the clone's
+
+  checkValue(16, 0, fsDelete("T16C"));
+  fsSync();
+  checkValue(16, 0, testUsed());
+
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 17 : Snapshot a disk with fsSnapshotDisk, then change and delete its
+//           files.  The snapshot mounts, and holds the files as they were
+// ============================================================================
+void test17() {
+  BfsVolume* prev = testMount(1, 0);
+
+  i32 fd = fsCreate("T17A");
+  writeBlocks(fd, 40, 17);
+  fsClose(fd);
+  fd = fsCreate("T17B");
+  writeBlocks(fd, 10, 18);                  // not synced: the snapshot is
+
+  remove(TESTSNAP);
+  checkValue(17, 0, fsSnapshotDisk(TESTSNAP));
+
+  writeBlocks(fd, 5, 19);
+  fsClose(fd);
+  fd = fsOpen("T17A");
+  writeBlocks(fd, 40, 20);
+  fsClose(fd);
+  checkValue(17, 0, fsDelete("T17B"));
+  testUnmount(prev);
+
+  prev = testMountAt(TESTSNAP, 0, 0);
+  fd = fsOpen("T17A");
+  checkValue(17, 40 * BYTESPERBLOCK, fsSize(fd));
+  checkBlocks(17, fd, 0, 40, 17);
+  fsClose(fd);
+  fd = fsOpen("T17B");
+  checkValue(17, 10 * BYTESPERBLOCK, fsSize(fd));
+  checkBlocks(17, fd, 0, 10, 18);
+  fsClose(fd);
+  testUnmount(prev);
+
+  prev = testMount(0, 0);                   // the original moved on
+  checkValue(17, EFNF, fsOpen("T17B"));
+  fd = fsOpen("T17A");
+  checkBlocks(17, fd, 0, 40, 20);
+  fsClose(fd);
+  testUnmount(prev);
+
+  remove(TESTSNAP);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// Check where SEEK_DATA and SEEK_HOLE land in the file of TEST 18
+// ============================================================================
+static void test18Seek(i32 fd) {
+  i32 b = BYTESPERBLOCK;
+  checkValue(18,  0 * b,      seekTo(fd,  0,          SEEK_DATA));
+  checkValue(18,  2 * b,      seekTo(fd,  0,          SEEK_HOLE));
+  checkValue(18,  2 * b + 5,  seekTo(fd,  2 * b + 5,  SEEK_HOLE));
+  checkValue(18, 10 * b,      seekTo(fd,  2 * b + 5,  SEEK_DATA));
+  checkValue(18, 11 * b + 7,  seekTo(fd, 11 * b + 7,  SEEK_DATA));
+  checkValue(18, 13 * b,      seekTo(fd, 11 * b + 7,  SEEK_HOLE));
+  checkValue(18, 40 * b,      seekTo(fd, 13 * b,      SEEK_DATA));
+  checkValue(18, 41 * b,      seekTo(fd, 40 * b,      SEEK_HOLE));
+  checkValue(18, ENXDATA,     seekTo(fd, 41 * b,      SEEK_DATA));
+  checkValue(18, ENXDATA,     seekTo(fd, 41 * b,      SEEK_HOLE));
+}
+
+
+
+// ============================================================================
+// TEST 18 : Write three runs, far apart, into a new file.  Only the blocks
+//           written take space; the holes read as zeroes, and SEEK_DATA and
+//           SEEK_HOLE step from run to hole, before and after a remount
+//           2*1, 8*0, 3*2, 27*0, 1*3
+// ============================================================================
+void test18() {
+  BfsVolume* prev = testMount(1, 0);
+
+  i32 fd = fsCreate("T18");
+  pwriteBlocks(fd, 40, 1, 3);               // backwards, so each is a hole
+  pwriteBlocks(fd, 10, 3, 2);               // ... past the end until then
+  pwriteBlocks(fd,  0, 2, 1);
+  checkValue(18, 41 * BYTESPERBLOCK, fsSize(fd));
+  checkValue(18, 6, testUsed());
+
+  checkBlocks(18, fd,  0,  2, 1);
+  checkBlocks(18, fd,  2,  8, 0);
+  checkBlocks(18, fd, 10,  3, 2);
+  checkBlocks(18, fd, 13, 27, 0);
+  checkBlocks(18, fd, 40,  1, 3);
+  test18Seek(fd);
+  fsClose(fd);
+
+  testUnmount(prev);
+  prev = testMount(0, 0);
+  fd = fsOpen("T18");
+  checkValue(18, 6, testUsed());
+  test18Seek(fd);
+  fsClose(fd);
+
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 19 : Write single blocks, every fifth, into a new file - too many runs
+//           for the extents in the Inode, so most go to the indirect tree,
+//           the last one far along it.  SEEK_DATA and SEEK_HOLE find each
+//           block; a file grown by fsTruncate ends in a hole
+// ============================================================================
+void test19() {
+  BfsVolume* prev = testMount(1, 0);
+
+  i32 b    = BYTESPERBLOCK;
+  i32 far  = 2 * NUMINDIRECT + 3;           // skips a whole inner block
+  i32 fd   = fsCreate("T19");
+  for (i32 k = 0; k < 20; ++k) pwriteBlocks(fd, 5 * k + 3, 1, k + 1);
+  pwriteBlocks(fd, far, 1, 21);
+  fsSync();
+
+  i32 pos = 0;
+  for (i32 k = 0; k < 20; ++k) {
+    pos = seekTo(fd, pos, SEEK_DATA);
+    checkValue(19, (5 * k + 3) * b, pos);
+    pos = seekTo(fd, pos, SEEK_HOLE);
+    checkValue(19, (5 * k + 4) * b, pos);
+    checkBlocks(19, fd, 5 * k + 3, 1, k + 1);
+  }
+  checkValue(19, far * b,       seekTo(fd, pos, SEEK_DATA));
+  checkValue(19, (far + 1) * b, seekTo(fd, far * b, SEEK_HOLE));
+  checkBlocks(19, fd, 5 * 19 + 4, far - 5 * 19 - 4, 0);
+  fsClose(fd);
+
+  fd = fsCreate("T19T");
+  writeBlocks(fd, 1, 22);
+  fsTruncate(fd, 10 * b);
+  checkValue(19, b,       seekTo(fd, 0, SEEK_HOLE));
+  checkValue(19, ENXDATA, seekTo(fd, b, SEEK_DATA));
+  checkBlocks(19, fd, 1, 9, 0);
+  fsClose(fd);
+
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// Write 'numb' bytes from 'shadow' + 'offset' at byte 'offset' of 'fd', after
+// filling them with 'val' - or with random bytes, if 'val' is -1 - so that
+// 'shadow' holds what the file should
+// ============================================================================
+static void shadowWrite(i32 fd, i8* shadow, i32 offset, i32 numb, i32 val) {
+  for (i32 i = 0; i < numb; ++i) {
+    shadow[offset + i] = (val < 0) ? rand() : val;
+  }
+  fsPWrite(fd, offset, numb, shadow + offset);
+}
+
+
+
+// ============================================================================
+// Read the first 'numb' bytes of 'fd', and check that they match 'shadow'
+// ============================================================================
+static void shadowCheck(i32 testnum, i32 fd, i8* shadow, i32 numb) {
+  i8* buf = malloc(numb);
+  assert(buf != NULL);
+  checkValue(testnum, numb, fsPRead(fd, 0, numb, buf));
+  checkValue(testnum, 0, memcmp(buf, shadow, numb) != 0);
+  free(buf);
+}
+
+
+
+// ============================================================================
+// TEST 20 : Round trip a compressed file: four clusters that compress well,
+//           one of random bytes that does not, and overwrites of part of a
+//           cluster - within one, across two, and in the random one.  The
+//           file reads back as written, before and after a remount and a
+//           truncate to the middle of a cluster
+// ============================================================================
+void test20() {
+  BfsVolume* prev = testMount(1, 0);
+  srand(20);
+
+  i32 cb     = CLUSTERBLOCKS * BYTESPERBLOCK;
+  i32 numb   = 5 * cb;
+  i8* shadow = calloc(1, numb);
+  assert(shadow != NULL);
+
+  i32 fd = fsCreate("T20");
+  checkValue(20, 0, fsCompress(fd, 1));
+  for (i32 c = 0; c < 4; ++c) shadowWrite(fd, shadow, c * cb, cb, c + 1);
+  fsSync();
+  i32 used = testUsed();
+  checkValue(20, 1, used < 4 * CLUSTERBLOCKS);
+  shadowCheck(20, fd, shadow, 4 * cb);
+
+  shadowWrite(fd, shadow, 4 * cb, cb, -1);  // stored as it is
+  fsSync();
+  checkValue(20, used + CLUSTERBLOCKS, testUsed());
+  shadowCheck(20, fd, shadow, numb);
+  checkValue(20, ENOCOMP, fsCompress(fd, 0));
+
+  shadowWrite(fd, shadow, 3 * BYTESPERBLOCK + 50, 100, 9);
+  shadowWrite(fd, shadow, 2 * cb - 30, 60, -1);
+  shadowWrite(fd, shadow, 4 * cb + 700, 300, 8);
+  shadowCheck(20, fd, shadow, numb);
+  fsClose(fd);
+
+  testUnmount(prev);
+  prev = testMount(0, 0);
+  fd = fsOpen("T20");
+  shadowCheck(20, fd, shadow, numb);
+
+  i32 size = cb + 3 * BYTESPERBLOCK + 100;  // mid cluster 1
+  fsTruncate(fd, size);
+  checkValue(20, size, fsSize(fd));
+  fsTruncate(fd, numb);
+  memset(shadow + size, 0, numb - size);
+  shadowCheck(20, fd, shadow, numb);
+  fsClose(fd);
+
+  ScrubStats stats;
+  checkValue(20, 0, fsScrub(0, &stats));
+  checkValue(20, 0, (i32)stats.bad);
+
+  free(shadow);
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+static str t21Names[] = { "T21A", "T21B", "T21C" };   // files TEST 21 commits
+
+
+
+// ============================================================================
+// Body of TEST 21 before the crash: commit three files, then start a fourth
+// ============================================================================
+static void test21Crash() {
+  testMount(1, 0);
+  for (i32 i = 0; i < 3; ++i) {
+    i32 fd = fsCreate(t21Names[i]);
+    writeBlocks(fd, 10 * (i + 1), 21 + i);
+    fsClose(fd);
+  }
+  fsSync();
+  i32 fd = fsCreate("T21LATE");
+  writeBlocks(fd, 5, 24);
+}
+
+
+
+// ============================================================================
+// TEST 21 : Crash with committed metadata still only in the journal.  The
+//           mount replays it: the committed files are whole, the blocks in
+//           use are just theirs, and a second mount finds the log empty
+// ============================================================================
+void test21() {
+  checkValue(21, 0, testChild(test21Crash));
+
+  BfsVolume* prev = testMount(0, 0);
+  JnlStats st;
+  jnlGetStats(&st);
+  checkValue(21, 1, st.replayed > 0);
+
+  for (i32 i = 0; i < 3; ++i) {
+    i32 fd = fsOpen(t21Names[i]);
+    checkValue(21, 10 * (i + 1) * BYTESPERBLOCK, fsSize(fd));
+    checkBlocks(21, fd, 0, 10 * (i + 1), 21 + i);
+    fsClose(fd);
+  }
+
+  i32 fd = fsOpen("T21LATE");              // not committed: empty, if there
+  if (fd != EFNF) {
+    checkValue(21, 0, fsSize(fd));
+    fsClose(fd);
+  }
+  checkValue(21, 60, testUsed());
+
+  ScrubStats stats;
+  checkValue(21, 0, fsScrub(0, &stats));
+  checkValue(21, 0, (i32)stats.bad);
+  testUnmount(prev);
+
+  prev = testMount(0, 0);
+  jnlGetStats(&st);
+  checkValue(21, 0, (i32)st.replayed);
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+typedef struct {          // one volume of TEST 22, and what its file holds
+  str path;               // the disk
+  i32 val;                // byte the file is first filled with
+  i8* shadow;             // what the file should hold: T22BLOCKS blocks
+} T22Vol;
+
+#define T22BLOCKS 200     // size of the file on each volume of TEST 22
+
+
+
+// ============================================================================
+// Body of each thread of TEST 22: format and mount the disk of 'arg', a
+// T22Vol, on a volume of the thread's own, and write a file on it - filled,
+// then overwritten at random - keeping a copy in its 'shadow'
+// ============================================================================
+static void* test22Thread(void* arg) {
+  T22Vol* tv   = arg;
+  i32     numb = T22BLOCKS * BYTESPERBLOCK;
+  u32     seed = tv->val;
+
+  BfsVolume* prev = testMountAt(tv->path, 1, 0);
+  i32 fd = fsCreate("T22");
+  memset(tv->shadow, tv->val, numb);
+  fsWrite(fd, numb, tv->shadow);
+
+  for (i32 i = 0; i < 300; ++i) {
+    i32 offset = rand_r(&seed) % (numb - 100);
+    memset(tv->shadow + offset, tv->val + 1 + i % 7, 100);
+    fsPWrite(fd, offset, 100, tv->shadow + offset);
+  }
+  fsClose(fd);
+  testUnmount(prev);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// TEST 22 : Write two disks at once, each from a thread of its own on its
+//           own volume.  Then mount both side by side, and check that each
+//           holds just what its thread wrote, and scrubs clean
+// ============================================================================
+void test22() {
+  T22Vol    tv[2] = { { TESTDISK, 30, NULL }, { TESTDISK2, 60, NULL } };
+  pthread_t tid[2];
+  i32       numb  = T22BLOCKS * BYTESPERBLOCK;
+
+  for (i32 v = 0; v < 2; ++v) {
+    tv[v].shadow = malloc(numb);
+    assert(tv[v].shadow != NULL);
+    pthread_create(&tid[v], NULL, test22Thread, &tv[v]);
+  }
+  for (i32 v = 0; v < 2; ++v) pthread_join(tid[v], NULL);
+
+  BfsVolume* vol[2];
+  MountOpts  mo;
+  memset(&mo, 0, sizeof(mo));
+  for (i32 v = 0; v < 2; ++v) {
+    vol[v] = volNew(tv[v].path);
+    volMountOpts(vol[v], &mo);
+  }
+
+  i8* buf = malloc(numb);
+  assert(buf != NULL);
+  for (i32 v = 0; v < 2; ++v) {
+    i32 fd = volOpen(vol[v], "T22");
+    checkValue(22, numb, volSize(vol[v], fd));
+    checkValue(22, numb, volPRead(vol[v], fd, 0, numb, buf));
+    checkValue(22, 0, memcmp(buf, tv[v].shadow, numb) != 0);
+    volClose(vol[v], fd);
+
+    ScrubStats stats;
+    checkValue(22, 0, volScrub(vol[v], 0, &stats));
+    checkValue(22, 0, (i32)stats.bad);
+  }
+  free(buf);
+
+  for (i32 v = 0; v < 2; ++v) {
+    volUnmount(vol[v]);
+    volFree(vol[v]);
+    free(tv[v].shadow);
+    remove(tv[v].path);
+  }
+}
+
+
+
+static str t23Names[] = { "T23A", "T23B", "T23C", "T23D", "T23K" };
+
+
+
+// ============================================================================
+// Body of TEST 23 before the crash: write five files a block at a time, in
+// turn, so that each is too scattered for its extents and has an indirect
+// tree.  Commit them, delete all but the last, and crash as soon as the
+// deletes are committed, with the free thread still at work on the trees
+// ============================================================================
+static void test23Crash() {
+  testMount(1, 0);
+  i32 fd[5];
+  for (i32 f = 0; f < 5; ++f) fd[f] = fsCreate(t23Names[f]);
+  for (i32 i = 0; i < 300; ++i) {
+    for (i32 f = 0; f < 5; ++f) writeBlocks(fd[f], 1, f + 1);
+  }
+  for (i32 f = 0; f < 5; ++f) fsClose(fd[f]);
+  fsSync();
+
+  for (i32 f = 0; f < 4; ++f) fsDelete(t23Names[f]);
+}
+
+
+
+// ============================================================================
+// TEST 23 : Delete files with indirect trees, and crash before the free
+//           thread is done.  The deletes were committed, and the mount
+//           frees what is left of the trees: once the last file is deleted
+//           too, and the disk remounted, no block is in use
+// ============================================================================
+void test23() {
+  checkValue(23, 0, testChild(test23Crash));
+
+  BfsVolume* prev = testMount(0, 0);
+  for (i32 f = 0; f < 4; ++f) checkValue(23, EFNF, fsOpen(t23Names[f]));
+  i32 fd = fsOpen(t23Names[4]);
+  checkBlocks(23, fd, 0, 300, 5);
+  fsClose(fd);
+
+  checkValue(23, 0, fsDelete(t23Names[4]));
+  testUnmount(prev);                        // hands back every block held
+
+  prev = testMount(0, 0);
+  checkValue(23, 0, testUsed());
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 24 : Write a 1000-block file, then open it 10 times, and each time
+//           overwrite it 20 times at random and close it.  No block moves,
+//           so the file stays in one run.  After a remount every block is
+//           checked, and matches
+// ============================================================================
+void test24() {
+  BfsVolume* prev = testMount(1, 0);
+  srand(24);
+
+  i32 fd = fsCreate("T24");
+  writeBlocks(fd, 1000, 24);
+  fsSync();
+  i32* dbns = malloc(1000 * sizeof(i32));
+  assert(dbns != NULL);
+  testDbns(fd, 1000, dbns);
+  fsClose(fd);
+
+  for (i32 i = 0; i < 10; ++i) {
+    fd = fsOpen("T24");
+    overwrite(fd, 1000 * BYTESPERBLOCK, 20, 25 + i);
+    fsClose(fd);
+  }
+  fd = fsOpen("T24");
+  checkValue(24, 0, testMoved(fd, 1000, dbns));
+  checkValue(24, 999, dbns[999] - dbns[0]);
+  fsClose(fd);
+  free(dbns);
+  testUnmount(prev);
+
+  prev = testMount(0, 0);
+  ScrubStats stats;
+  checkValue(24, 0, fsScrub(0, &stats));
+  checkValue(24, testUsed(), (i32)stats.checked);
+  checkValue(24, 0, (i32)stats.bad);
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 25 : On a disk mounted with BIOMMAP, view a file, then write, delete
+//           and commit other files 5 times over.  The view still shows the
+//           file's bytes: see fsReadView.  A view over a hole is of zeroes,
+//           to the end of the block
+// ============================================================================
+void test25() {
+  FormatOpts fo;
+  memset(&fo, 0, sizeof(fo));
+  fo.numBlocks = TESTBLOCKS;
+  MountOpts mo;
+  memset(&mo, 0, sizeof(mo));
+  mo.ioBackend   = BIOMMAP;
+  mo.delayBlocks = -1;
+  BfsVolume* prev = testMountWith(TESTDISK, &fo, &mo);
+
+  i32 fd = fsCreate("PUB");
+  writeBlocks(fd, 8, 25);
+  pwriteBlocks(fd, 12, 1, 25);              // FBNs 8 to 11 are a hole
+  fsSync();
+
+  void* view = NULL;
+  checkValue(25, 8 * BYTESPERBLOCK,
+             fsReadView(fd, 0, 8 * BYTESPERBLOCK, &view));
+  for (i32 i = 0; i < 5; ++i) {
+    i32 other = fsCreate("SECRET");
+    writeBlocks(other, 8, 26);
+    fsClose(other);
+    fsSync();
+    checkValue(25, 0, fsDelete("SECRET"));
+    fsSync();
+  }
+  check(25, view, 0, 8 * BYTESPERBLOCK, 25);
+
+  checkValue(25, BYTESPERBLOCK - 10,
+             fsReadView(fd, 9 * BYTESPERBLOCK + 10, BYTESPERBLOCK, &view));
+  check(25, view, 0, BYTESPERBLOCK - 10, 0);
+  fsClose(fd);
+
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 26 : Mount TESTDISK traced, then TESTDISK2 asking for a trace too:
+//           that mount returns ETRACE, and starts none.  Create a file on
+//           each, unmount TESTDISK2, and create one more on TESTDISK.  The
+//           trace holds just the two TESTDISK creates
+// ============================================================================
+void test26() {
+  FormatOpts fo;
+  memset(&fo, 0, sizeof(fo));
+  fo.numBlocks = TESTBLOCKS;
+  MountOpts mo;
+  memset(&mo, 0, sizeof(mo));
+  mo.delayBlocks = -1;
+  mo.tracePath   = TESTTRACE;
+  remove(TESTTRACE2);                       // left by an earlier run
+  BfsVolume* prev = testMountWith(TESTDISK, &fo, &mo);
+  BfsVolume* one  = t_vol;
+  fsClose(fsCreate("ONE"));
+
+  mo.tracePath = TESTTRACE2;
+  volUse(volNew(TESTDISK2));
+  fsFormatOpts(&fo);
+  checkValue(26, ETRACE, fsMountOpts(&mo));
+  fsClose(fsCreate("TWO"));
+  fsUnmount();
+  volFree(volUse(one));
+
+  fsClose(fsCreate("ONEMORE"));
+  testUnmount(prev);
+  remove(TESTDISK);
+  remove(TESTDISK2);
+
+  FILE* fp = fopen(TESTTRACE2, "rb");
+  checkValue(26, 1, fp == NULL);
+  if (fp != NULL) fclose(fp);
+
+  fp = fopen(TESTTRACE, "rb");
+  assert(fp != NULL);
+  TrcHeader hdr;
+  checkValue(26, 1, (i32)fread(&hdr, sizeof(hdr), 1, fp));
+  checkValue(26, TRCMAGIC, hdr.magic);
+  i32    creates = 0;
+  TrcRec rec;
+  char   name[FNAMESIZE + 1];
+  while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+    memset(name, 0, sizeof(name));
+    if (rec.nameLen > 0 && fread(name, rec.nameLen, 1, fp) != 1) break;
+    if (rec.op != TRCCREATE) continue;
+    ++creates;
+    checkValue(26, 1, strcmp(name, "ONE") == 0 ||
+                      strcmp(name, "ONEMORE") == 0);
+  }
+  checkValue(26, 2, creates);
+  fclose(fp);
+  remove(TESTTRACE);
+}
+
+
+
+// ============================================================================
+// TEST 27 : With appended blocks held back, append 40 blocks 100 bytes at a
+//           time.  They read back while still held, and after fsClose gives
+//           them DBNs, in one run.  After a remount they read back, and use
+//           just 40 blocks
+// ============================================================================
+void test27() {
+  BfsVolume* prev = testMountDelayed(1);
+
+  i32 fd = fsCreate("T27");
+  appendBytes(fd, 20 * BYTESPERBLOCK, 27);
+  appendBytes(fd, 20 * BYTESPERBLOCK, 28);
+  checkValue(27, ENODBN, bfsFdFbnToDbn(fd, 39));    // still held back
+  checkBlocks(27, fd, 0, 20, 27);
+  checkBlocks(27, fd, 20, 20, 28);
+  fsClose(fd);
+
+  fd = fsOpen("T27");
+  checkBlocks(27, fd, 0, 20, 27);
+  checkBlocks(27, fd, 20, 20, 28);
+  i32 dbns[40];
+  testDbns(fd, 40, dbns);
+  checkValue(27, 39, dbns[39] - dbns[0]);
+  fsClose(fd);
+  testUnmount(prev);
+
+  prev = testMountDelayed(0);
+  fd = fsOpen("T27");
+  checkBlocks(27, fd, 0, 20, 27);
+  checkBlocks(27, fd, 20, 20, 28);
+  fsClose(fd);
+  checkValue(27, 40, testUsed());
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// Check that 'fd', as left by TEST 28, holds 10 blocks and 100 bytes of 29,
+// then zeroes to 30 blocks, with only the first 11 blocks in use
+// ============================================================================
+static void test28Check(i32 fd) {
+  checkValue(28, 30 * BYTESPERBLOCK, fsSize(fd));
+  checkBlocks(28, fd, 0, 10, 29);
+  i8* buf = malloc(20 * BYTESPERBLOCK);
+  assert(buf != NULL);
+  fsPRead(fd, 10 * BYTESPERBLOCK, 20 * BYTESPERBLOCK, buf);
+  check(28, buf, 0, 100, 29);
+  check(28, buf, 100, 20 * BYTESPERBLOCK - 100, 0);
+  free(buf);
+  checkValue(28, 11, testUsed());
+}
+
+
+
+// ============================================================================
+// TEST 28 : With appended blocks held back, append 30 blocks, truncate to
+//           10 blocks and 100 bytes while they are all still held, and grow
+//           the file back to 30 blocks.  The bytes cut off read as zeroes,
+//           and only the 11 blocks kept take DBNs: after fsClose, and after
+//           a remount
+// ============================================================================
+void test28() {
+  BfsVolume* prev = testMountDelayed(1);
+
+  i32 fd = fsCreate("T28");
+  appendBytes(fd, 30 * BYTESPERBLOCK, 29);
+  checkValue(28, ENODBN, bfsFdFbnToDbn(fd, 0));     // still held back
+  fsTruncate(fd, 10 * BYTESPERBLOCK + 100);
+  checkValue(28, 10 * BYTESPERBLOCK + 100, fsSize(fd));
+  fsTruncate(fd, 30 * BYTESPERBLOCK);
+  fsClose(fd);
+
+  fd = fsOpen("T28");
+  test28Check(fd);
+  fsClose(fd);
+  testUnmount(prev);
+
+  prev = testMountDelayed(0);
+  fd = fsOpen("T28");
+  test28Check(fd);
+  fsClose(fd);
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// Body of TEST 29 before the crash: commit a file of 10 blocks, then append
+// 10 more to it, and 10 to a new file, all held back
+// ============================================================================
+static void test29Crash() {
+  testMountDelayed(1);
+  i32 fd = fsCreate("T29");
+  appendBytes(fd, 10 * BYTESPERBLOCK, 30);
+  fsClose(fd);
+
+  fd = fsOpen("T29");
+  fsSeek(fd, 0, SEEK_END);
+  appendBytes(fd, 10 * BYTESPERBLOCK, 31);
+  fd = fsCreate("T29B");
+  appendBytes(fd, 10 * BYTESPERBLOCK, 32);
+}
+
+
+
+// ============================================================================
+// TEST 29 : With appended blocks held back, crash with appends not yet
+//           committed.  After the journal is replayed, the committed file
+//           reads back as it was committed; the new file is empty, if there;
+//           and no block is left in use that no file maps
+// ============================================================================
+void test29() {
+  checkValue(29, 0, testChild(test29Crash));
+
+  BfsVolume* prev = testMountDelayed(0);
+  i32 fd = fsOpen("T29");
+  checkValue(29, 10 * BYTESPERBLOCK, fsSize(fd));
+  checkBlocks(29, fd, 0, 10, 30);
+  fsClose(fd);
+
+  fd = fsOpen("T29B");
+  if (fd != EFNF) {
+    checkValue(29, 0, fsSize(fd));
+    fsClose(fd);
+  }
+  checkValue(29, 10, testUsed());
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 30 : Round trips, as testRoundTrip, on disks with blocks of 512,
+//           4096 and 65536 bytes, mounted with the default options
+// ============================================================================
+void test30() {
+  MountOpts mo;
+  memset(&mo, 0, sizeof(mo));
+  testRoundTrip(30, 512,   &mo);
+  testRoundTrip(30, 4096,  &mo);
+  testRoundTrip(30, 65536, &mo);
+}
+
+
+
+typedef struct {          // one thread of TEST 31
+  BfsVolume* vol;         // the volume all the threads share
+  i32 fd;                 // the file they all write, each its own blocks
+  i32 id;                 // 0 .. T31THREADS - 1
+} T31Thread;
+
+#define T31THREADS 4      // threads in TEST 31
+#define T31BLOCKS  25     // blocks each writes of the shared file
+
+
+
+// ============================================================================
+// Check what TEST 31 leaves on the calling thread's volume: each thread's
+// own file, and its blocks of the shared file open on 'fd'
+// ============================================================================
+static void test31Check(i32 fd) {
+  for (i32 t = 0; t < T31THREADS; ++t) {
+    char name[FNAMESIZE];
+    sprintf(name, "T31-%d", t);
+    i32 own = fsOpen(name);
+    checkValue(31, 50 * BYTESPERBLOCK, fsSize(own));
+    checkBlocks(31, own, 0, 50, 31 + t);
+    fsClose(own);
+    checkBlocks(31, fd, t * T31BLOCKS, T31BLOCKS, 41 + t);
+  }
+}
+
+
+
+// ============================================================================
+// Body of each thread of TEST 31, on the volume of 'arg', a T31Thread:
+// append 50 blocks to a file of its own, and write its blocks of the shared
+// file one at a time, reading each back
+// ============================================================================
+static void* test31Thread(void* arg) {
+  T31Thread* tt = arg;
+  volUse(tt->vol);
+
+  char name[FNAMESIZE];
+  sprintf(name, "T31-%d", tt->id);
+  i32 fd = fsCreate(name);
+  appendBytes(fd, 50 * BYTESPERBLOCK, 31 + tt->id);
+  fsClose(fd);
+
+  i8 buf[BYTESPERBLOCK];
+  for (i32 i = 0; i < T31BLOCKS; ++i) {
+    i32 fbn = tt->id * T31BLOCKS + i;
+    memset(buf, 41 + tt->id, BYTESPERBLOCK);
+    fsPWrite(tt->fd, fbn * BYTESPERBLOCK, BYTESPERBLOCK, buf);
+    memset(buf, 0, BYTESPERBLOCK);
+    fsPRead(tt->fd, fbn * BYTESPERBLOCK, BYTESPERBLOCK, buf);
+    check(31, buf, 0, BYTESPERBLOCK, 41 + tt->id);
+  }
+  return NULL;
+}
+
+
+
+// ============================================================================
+// TEST 31 : T31THREADS threads write one volume at once, with appended
+//           blocks held back: each appends to a file of its own, and writes
+//           its own blocks of a shared file.  Each file holds what was
+//           written to it, at once and after a remount, and the disk
+//           scrubs clean
+// ============================================================================
+void test31() {
+  BfsVolume* prev = testMountDelayed(1);
+  i32 fd = fsCreate("T31S");
+
+  pthread_t tid[T31THREADS];
+  T31Thread tt[T31THREADS];
+  for (i32 t = 0; t < T31THREADS; ++t) {
+    tt[t].vol = t_vol;
+    tt[t].fd  = fd;
+    tt[t].id  = t;
+    pthread_create(&tid[t], NULL, test31Thread, &tt[t]);
+  }
+  for (i32 t = 0; t < T31THREADS; ++t) pthread_join(tid[t], NULL);
+
+  checkValue(31, T31THREADS * T31BLOCKS * BYTESPERBLOCK, fsSize(fd));
+  test31Check(fd);
+  fsClose(fd);
+  ScrubStats stats;
+  checkValue(31, 0, fsScrub(0, &stats));
+  checkValue(31, 0, (i32)stats.bad);
+  testUnmount(prev);
+
+  prev = testMountDelayed(0);
+  fd = fsOpen("T31S");
+  test31Check(fd);
+  fsClose(fd);
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// Mount TESTDISK, left by TEST 32, with 'readAheadBlocks' and
+// 'asyncReadAhead' as for MountOpts, and read its file one block at a time
+// with fsRead, checking each.  Each read is followed by a short pause, as
+// if the block were being worked on, so that a readahead thread gets its
+// turn even on one CPU.  Return the # of block reads that missed the cache
+// ============================================================================
+static i32 test32Read(i32 readAheadBlocks, i32 asyncReadAhead) {
+  MountOpts mo;
+  memset(&mo, 0, sizeof(mo));
+  mo.cacheBlocks     = 64;
+  mo.readAheadBlocks = readAheadBlocks;
+  mo.asyncReadAhead  = asyncReadAhead;
+  BfsVolume* prev = testMountWith(TESTDISK, NULL, &mo);
+
+  i32 fd = fsOpen("T32");
+  i8  buf[BYTESPERBLOCK];
+  statsReset();
+  for (i32 fbn = 0; fbn < 200; ++fbn) {
+    checkValue(32, BYTESPERBLOCK, fsRead(fd, BYTESPERBLOCK, buf));
+    check(32, buf, 0, BYTESPERBLOCK, fbn % 100);
+    usleep(200);
+  }
+  IoStats stats;
+  statsGet(&stats);
+  fsClose(fd);
+  testUnmount(prev);
+  return (i32)stats.cacheMisses;
+}
+
+
+
+// ============================================================================
+// TEST 32 : Read a 200-block file from start to end, one block per fsRead:
+//           with no readahead, every block misses the cache; reading ahead
+//           up to 16 blocks, on the caller's thread or in the background,
+//           the file still reads back, and fewer than one block in 4 misses
+// ============================================================================
+void test32() {
+  BfsVolume* prev = testMount(1, 0);
+  i32 fd = fsCreate("T32");
+  for (i32 fbn = 0; fbn < 200; ++fbn) writeBlocks(fd, 1, fbn % 100);
+  fsClose(fd);
+  testUnmount(prev);
+
+  checkValue(32, 1, test32Read(-1, 0) >= 200);
+  checkValue(32, 1, test32Read(16, 0) < 50);
+  checkValue(32, 1, test32Read(16, 1) < 50);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// Callback of each FsAio of TEST 33: count it in the i32 at 'aio->arg'
+// ============================================================================
+static void test33Done(FsAio* aio) {
+  __atomic_add_fetch((i32*)aio->arg, 1, __ATOMIC_RELAXED);
+}
+
+
+
+// ============================================================================
+// Write the first 'num' blocks of 'fd', block i all i + 1, with an FsAio
+// each, or read them back and check them, as 'write' says.  Return how many
+// callbacks ran once every FsAio is waited for
+// ============================================================================
+static i32 test33Aio(i32 fd, i32 num, i32 write) {
+  FsAio* aio = calloc(num, sizeof(FsAio));
+  i8*    buf = malloc(num * BYTESPERBLOCK);
+  assert(aio != NULL && buf != NULL);
+  i32 done = 0;
+  for (i32 i = 0; i < num; ++i) {
+    aio[i].fd       = fd;
+    aio[i].offset   = i * BYTESPERBLOCK;
+    aio[i].numb     = BYTESPERBLOCK;
+    aio[i].buf      = buf + i * BYTESPERBLOCK;
+    aio[i].callback = test33Done;
+    aio[i].arg      = &done;
+    memset(aio[i].buf, write ? i + 1 : 0, BYTESPERBLOCK);
+    if (write) fsWriteAsync(&aio[i]); else fsReadAsync(&aio[i]);
+  }
+  for (i32 i = 0; i < num; ++i) {
+    i32 want = write ? 0 : BYTESPERBLOCK;
+    checkValue(33, want, fsAioWait(&aio[i]));
+    if (!write) check(33, aio[i].buf, 0, BYTESPERBLOCK, i + 1);
+  }
+  free(aio);
+  free(buf);
+  return __atomic_load_n(&done, __ATOMIC_RELAXED);
+}
+
+
+
+// ============================================================================
+// TEST 33 : Round trips, as testRoundTrip, through the stdio, pread and
+//           io_uring backends, with blocks of 512, 4096 and 65536 bytes.
+//           Then write 40 blocks with fsWriteAsync, on 4 worker threads,
+//           and read them back with fsReadAsync: each FsAio completes with
+//           the result fsPWrite or fsPRead would give, after its callback
+// ============================================================================
+void test33() {
+  i32 backends[] = { BIOSTDIO, BIOPREAD, BIOURING };
+  MountOpts mo;
+  memset(&mo, 0, sizeof(mo));
+  for (i32 b = 0; b < 3; ++b) {
+    mo.ioBackend = backends[b];
+    testRoundTrip(33, 512,   &mo);
+    testRoundTrip(33, 4096,  &mo);
+    testRoundTrip(33, 65536, &mo);
+  }
+
+  mo.ioBackend  = BIODEFAULT;
+  mo.aioThreads = 4;
+  FormatOpts fo;
+  memset(&fo, 0, sizeof(fo));
+  fo.numBlocks = TESTBLOCKS;
+  BfsVolume* prev = testMountWith(TESTDISK, &fo, &mo);
+  i32 fd = fsCreate("T33");
+  checkValue(33, 40, test33Aio(fd, 40, 1));
+  checkValue(33, 40 * BYTESPERBLOCK, fsSize(fd));
+  checkValue(33, 40, test33Aio(fd, 40, 0));
+  fsClose(fd);
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// TEST 34 : Round trips, as testRoundTrip, through the mmap backend, with
+//           blocks of 512, 4096 and 65536 bytes.  Then, on a disk of 65536-
+//           byte blocks, a view of a 2-block file written in one piece
+//           covers it all, and shows what was written
+// ============================================================================
+void test34() {
+  MountOpts mo;
+  memset(&mo, 0, sizeof(mo));
+  mo.ioBackend = BIOMMAP;
+  testRoundTrip(34, 512,   &mo);
+  testRoundTrip(34, 4096,  &mo);
+  testRoundTrip(34, 65536, &mo);
+
+  FormatOpts fo;
+  memset(&fo, 0, sizeof(fo));
+  fo.bytesPerBlock = 65536;
+  fo.numBlocks     = TESTRTBLOCKS;
+  mo.delayBlocks   = -1;
+  BfsVolume* prev = testMountWith(TESTDISK, &fo, &mo);
+  i32 numb = 2 * BLOCKSIZE;
+  i8* buf  = malloc(numb);
+  assert(buf != NULL);
+  testPattern(buf, 0, numb);
+  i32 fd = fsCreate("T34");
+  fsWrite(fd, numb, buf);
+  free(buf);
+
+  void* view = NULL;
+  checkValue(34, numb, fsReadView(fd, 0, numb, &view));
+  checkValue(34, 1, testIsPattern(view, 0, numb));
+  fsClose(fd);
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// Body of TEST 35 before the crash: on a disk mounted with a flush thread
+// every 20 ms, write a file and fsFsync it, then write another and leave it
+// to the flush thread.  Exit 1 if no commit ran while we slept
+// ============================================================================
+static void test35Crash() {
+  FormatOpts fo;
+  memset(&fo, 0, sizeof(fo));
+  fo.numBlocks = TESTBLOCKS;
+  MountOpts mo;
+  memset(&mo, 0, sizeof(mo));
+  mo.flushMs = 20;
+  testMountWith(TESTDISK, &fo, &mo);
+
+  i32 fd = fsCreate("T35F");
+  appendBytes(fd, 10 * BYTESPERBLOCK, 35);
+  fsFsync(fd);
+
+  JnlStats before, after;
+  jnlGetStats(&before);
+  fd = fsCreate("T35B");
+  appendBytes(fd, 10 * BYTESPERBLOCK, 36);
+  usleep(500 * 1000);
+  jnlGetStats(&after);
+  if (after.commits == before.commits) _exit(1);
+}
+
+
+
+// ============================================================================
+// TEST 35 : Crash with two files open: one made durable with fsFsync, the
+//           other written before the flush thread's last commit.  After
+//           the journal is replayed, both read back whole
+// ============================================================================
+void test35() {
+  checkValue(35, 0, testChild(test35Crash));
+
+  BfsVolume* prev = testMount(0, 0);
+  i32 fd = fsOpen("T35F");
+  checkValue(35, 10 * BYTESPERBLOCK, fsSize(fd));
+  checkBlocks(35, fd, 0, 10, 35);
+  fsClose(fd);
+  fd = fsOpen("T35B");
+  checkValue(35, 1, fd != EFNF);
+  if (fd != EFNF) {
+    checkValue(35, 10 * BYTESPERBLOCK, fsSize(fd));
+    checkBlocks(35, fd, 0, 10, 36);
+    fsClose(fd);
+  }
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+
+// ============================================================================
+// Body of the second thread of TEST 36: rewrite the first 5 blocks of the
+// file open on 'arg', an i32 fd, one fsPWrite each, on the volume of TEST 36
+// ============================================================================
+static void* test36Thread(void* arg) {
+  i32* fd = arg;
+  for (i32 fbn = 0; fbn < 5; ++fbn) pwriteBlocks(*fd, fbn, 1, 37);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// TEST 36 : Count what a few calls do, with readahead off.  Writing 10 new
+//           blocks in one fsWrite allocates and writes 10 data blocks, and
+//           fsClose writes metadata.  After a remount, one fsPRead of them
+//           reads 10 data blocks, all cache misses.  5 fsPWrites on
+//           another thread are summed in with the calls of this one
+// ============================================================================
+void test36() {
+  FormatOpts fo;
+  memset(&fo, 0, sizeof(fo));
+  fo.numBlocks = TESTBLOCKS;
+  MountOpts mo;
+  memset(&mo, 0, sizeof(mo));
+  mo.readAheadBlocks = -1;
+  mo.delayBlocks     = -1;
+  BfsVolume* prev = testMountWith(TESTDISK, &fo, &mo);
+
+  IoStats stats;
+  statsReset();
+  i32 fd = fsCreate("T36");
+  writeBlocks(fd, 10, 36);
+  statsGet(&stats);
+  checkValue(36, 1,  (i32)stats.fsCalls[FSOPCREATE]);
+  checkValue(36, 1,  (i32)stats.fsCalls[FSOPWRITE]);
+  checkValue(36, 1,  stats.fsNs[FSOPWRITE] > 0);
+  checkValue(36, 10, (i32)stats.allocs);
+  checkValue(36, 10, (i32)stats.dataWrites);
+  fsClose(fd);
+  statsGet(&stats);
+  checkValue(36, 1,  (i32)stats.fsCalls[FSOPCLOSE]);
+  checkValue(36, 1,  stats.metaWrites > 0);
+  testUnmount(prev);
+
+  prev = testMountWith(TESTDISK, NULL, &mo);
+  fd = fsOpen("T36");
+  statsReset();
+  checkBlocks(36, fd, 0, 10, 36);
+  statsGet(&stats);
+  checkValue(36, 1,  (i32)stats.fsCalls[FSOPPREAD]);
+  checkValue(36, 10, (i32)stats.dataReads);
+  checkValue(36, 10, (i32)stats.cacheMisses);
+  checkValue(36, 0,  (i32)stats.cacheHits);
+
+  statsReset();
+  pthread_t tid;
+  volSpawn(&tid, test36Thread, &fd);         // on this volume
+  pthread_join(tid, NULL);
+  pwriteBlocks(fd, 5, 1, 37);
+  statsGet(&stats);
+  checkValue(36, 6, (i32)stats.fsCalls[FSOPPWRITE]);
+  checkValue(36, 0, (i32)stats.allocs);
+  fsClose(fd);
+  testUnmount(prev);
+  remove(TESTDISK);
+}
+
+
+// ============================================================================
+// TEST 37 : Trace a few calls on TESTDISK, then read the trace back.  Its
+//           header holds the geometry, and its fs* records are the calls,
+//           in order, with the fd, sizes and offsets each was made with.
+//           The block IO records hold the data blocks written.  Replaying
+//           the writes on TESTDISK2 makes a file of the same size, in as
+//           many blocks
+// ============================================================================
+void test37() {
+  FormatOpts fo;
+  memset(&fo, 0, sizeof(fo));
+  fo.numBlocks = TESTBLOCKS;
+  MountOpts mo;
+  memset(&mo, 0, sizeof(mo));
+  mo.readAheadBlocks = -1;
+  mo.delayBlocks     = -1;
+  mo.tracePath       = TESTTRACE;
+  BfsVolume* prev = testMountWith(TESTDISK, &fo, &mo);
+  i32 b  = BYTESPERBLOCK;
+  i32 fd = fsCreate("T37");
+  writeBlocks(fd, 3, 37);
+  pwriteBlocks(fd, 3, 2, 38);
+  seekTo(fd, 100, SEEK_SET);
+  i8 buf[50];
+  fsRead(fd, sizeof(buf), buf);
+  checkBlocks(37, fd, 0, 3, 37);
+  fsFsync(fd);
+  fsClose(fd);
+  i32 used = testUsed();
+  testUnmount(prev);
+  remove(TESTDISK);
+
+  TrcRec want[] = {                     // op, fd, a, b of each fs* call
+    { 0, TRCCREATE,   0, 0, fd, 0,     0        },
+    { 0, TRCWRITE,    0, 0, fd, 3 * b, 0        },
+    { 0, TRCPWRITE,   0, 0, fd, 2 * b, 3 * b    },
+    { 0, TRCSEEK,     0, 0, fd, 100,   SEEK_SET },
+    { 0, TRCREAD,     0, 0, fd, 50,    0        },
+    { 0, TRCPREAD,    0, 0, fd, 3 * b, 0        },
+    { 0, TRCFSYNC,    0, 0, fd, 0,     0        },
+    { 0, TRCCLOSE,    0, 0, fd, 0,     0        },
+  };
+  i32 numWant = sizeof(want) / sizeof(want[0]);
+
+  FILE* fp = fopen(TESTTRACE, "rb");
+  assert(fp != NULL);
+  TrcHeader hdr;
+  checkValue(37, 1, (i32)fread(&hdr, sizeof(hdr), 1, fp));
+  checkValue(37, TRCMAGIC,      hdr.magic);
+  checkValue(37, TRCVERSION,    hdr.version);
+  checkValue(37, b,             hdr.bytesPerBlock);
+  checkValue(37, TESTBLOCKS,    hdr.numBlocks);
+
+  TrcRec got[sizeof(want) / sizeof(want[0])];
+  i32    numGot = 0;
+  i32    bioWritten = 0;
+  i32    ordered = 1;
+  i64    lastNs = 0;
+  TrcRec rec;
+  char   name[FNAMESIZE + 1];
+  while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+    memset(name, 0, sizeof(name));
+    if (rec.nameLen > 0 && fread(name, rec.nameLen, 1, fp) != 1) break;
+    if (rec.op == TRCBIOWRITE) bioWritten += rec.a;
+    if (rec.op == TRCBIOREAD || rec.op == TRCBIOWRITE) continue;
+    if (rec.ns < lastNs) ordered = 0;   // a call's bio records come first
+    lastNs = rec.ns;
+    if (rec.op == TRCCREATE) checkValue(37, 0, strcmp(name, "T37"));
+    if (numGot < numWant) got[numGot++] = rec;
+  }
+  fclose(fp);
+  checkValue(37, 1, ordered);
+  checkValue(37, 1, bioWritten >= 5);
+  checkValue(37, numWant, numGot);
+  for (i32 i = 0; i < numGot; ++i) {
+    checkValue(37, want[i].op, got[i].op);
+    checkValue(37, want[i].fd, got[i].fd);
+    checkValue(37, want[i].a,  got[i].a);
+    checkValue(37, want[i].b,  got[i].b);
+  }
+
+  prev = testMountAt(TESTDISK2, 1, 0);  // replay the writes
+  i32 rfd = -1;
+  for (i32 i = 0; i < numGot; ++i) {
+    i8* data = calloc(1, got[i].a + 1);
+    assert(data != NULL);
+    switch (got[i].op) {
+      case TRCCREATE: rfd = fsCreate("T37");                        break;
+      case TRCWRITE:  fsWrite(rfd, got[i].a, data);                 break;
+      case TRCPWRITE: fsPWrite(rfd, got[i].b, got[i].a, data);      break;
+    }
+    free(data);
+  }
+  checkValue(37, 5 * b, fsSize(rfd));
+  checkValue(37, used, testUsed());
+  fsClose(rfd);
+  testUnmount(prev);
+  remove(TESTDISK2);
+  remove(TESTTRACE);
+}
+
+
+
+void fstest() {
+
+  test7();
+  test8();
+  test9();
+  test10();
+  test11();
+  test12();
+  test13();
+  test14();
+  test15();
+  test16();
+  test17();
+  test18();
+  test19();
+  test20();
+  test21();
+  test22();
+  test23();
+  test24();
+  test25();
+  test26();
+  test27();
+  test28();
+  test29();
+  test30();
+  test31();
+  test32();
+  test33();
+  test34();
+  test35();
+  test36();
+  test37();
+
+}
@@ -0,0 +1,54 @@
+#ifndef FSTEST_H
+#define FSTEST_H
+
+#include <assert.h>       // assert
+#include <stdio.h>        // printf, remove
+#include <string.h>       // memset
+
+#include "alias.h"        // i32, etc
+#include "fs.h"           // fsOpen, etc
+#include "p5test.h"       // check
+
+#define TESTDISK      "BFSTEST"   // scratch disk, deleted after each test
+#define TESTBLOCKS    3000        // # of blocks in TESTDISK
+#define TESTRTBLOCKS  400         // # of blocks in a round trip's TESTDISK
+#define TESTSNAP      "BFSSNAP"   // snapshot of TESTDISK, for TEST 17
+#define TESTDISK2     "BFSTEST2"  // second scratch disk, for TEST 22
+#define TESTTRACE     "BFSTRACE"  // trace file, for TEST 26
+#define TESTTRACE2    "BFSTRACE2" // trace file never made, for TEST 26
+
+void checkValue(i32 testnum, i32 expected, i32 actual);
+void fstest();
+void test7();
+void test8();
+void test9();
+void test10();
+void test11();
+void test12();
+void test13();
+void test14();
+void test15();
+void test16();
+void test17();
+void test18();
+void test19();
+void test20();
+void test21();
+void test22();
+void test23();
+void test24();
+void test25();
+void test26();
+void test27();
+void test28();
+void test29();
+void test30();
+void test31();
+void test32();
+void test33();
+void test34();
+void test35();
+void test36();
+void test37();
+
+#endif
@@ -0,0 +1,818 @@
+// ============================================================================
+// journal.c - write-ahead journal of metadata blocks, with group commit
+//
+// Once jnlOpen finds a journal on the mounted disk, every metadata block
+// written through cacheWrite is logged here instead of being written in
+// place.  fs operations that change metadata run between jnlBegin and
+// jnlEnd, and all the blocks they log join the running transaction.
+// jnlCommit closes it: it waits for the operations in it to end, holds
+// new ones back while the in-memory Inode table and bitmap are logged too,
+// and then writes the transaction to the journal as one sequential run:
+//
+//   DESC (DBNs) | blocks ... | DESC | blocks ... | COMMIT (count, checksum)
+//
+// Threads that call jnlCommit while a commit is being written wait for it,
+// and the first of them then commits everything the rest logged meanwhile:
+// one journal write serves them all (group commit).  Committed blocks stay
+// in memory, and reach their home DBNs only at a checkpoint - when the
+// journal is full, and at jnlClose - in one DBN-sorted bioWritev.  Block 0
+// of the journal is the header: the sequence # of the first transaction in
+// the log.  jnlOpen replays every whole transaction from there on, so after
+// a crash the metadata is as of the last commit.
+//
+// File data is not journaled.  Each commit starts with a bioSync, so the
+// data a transaction's metadata points to is on disk before it is.
+//
+// A metadata block that is freed (an indirect block of a file deleted or
+// truncated) must not be reused for file data while an older copy of it
+// could still be written over that data: by a checkpoint, or by replay
+// after a crash.  jnlForget drops it from the running transaction; if it is
+// also in the log, the journal keeps it until two checkpoints have passed -
+// the first may still leave it in the transaction being committed - and
+// only then hands it back to the allocator.
+//
+// A data block freed in the running transaction must not be reused either,
+// until that transaction has committed: until then, the committed metadata
+// still maps it, and a crash would bring back the file that held it over
+// whatever data was written to it since.  jnlDefer keeps such runs, and
+// jnlCommit hands them back to the allocator right after the commit point.
+//
+// Lock order: cache lock, then g_jnlLock.  No lock is held across the IO of
+// a commit or a checkpoint: only the committing thread touches g_commit,
+// or changes g_done, meanwhile
+// ============================================================================
+
+#include <pthread.h>
+
+#include "bfs.h"
+#include "journal.h"
+
+#define JNLMAGIC    0x4c4e524a          // "JRNL"
+#define JNLHEADER   1                   // JnlBlock.type
+#define JNLDESC     2
+#define JNLCOMMIT   3
+#define FNVBASIS    2166136261u         // FNV-1a, as for the Directory hash
+#define FNVPRIME    16777619u
+
+typedef struct {          // start of each journal block
+  u32 magic;              // JNLMAGIC
+  u32 type;               // JNLHEADER, JNLDESC or JNLCOMMIT
+  u32 seq;                // transaction #.  HEADER: first one in the log
+  i32 num;                // DESC: # of DBNs that follow.  COMMIT: # of
+                          //   blocks in the transaction
+  u32 sum;                // COMMIT: FNV-1a of each DBN and block, in order
+} JnlBlock;
+
+typedef struct {          // freed runs of blocks not yet safe to reuse
+  i32  num;
+  i32  cap;
+  i32* dbns;              // first DBN of each run
+  i32* lens;              // # of blocks in each run
+} JnlPins;
+
+typedef struct {          // a set of logged blocks, keyed on DBN
+  i32  num;               // # of blocks held
+  i32  cap;               // room for this many: 0, or a power of 2
+  i32* dbns;
+  i8*  data;              // 'cap' blocks
+  i32* hash;              // 2 * cap slots, each an index + 1.  0 => empty
+} JnlSet;
+
+struct JnlState {         // one volume's journal.  See jnlNewState
+  i32    jnlDbn;                        // header block of the journal
+  i32    jnlBlocks;                     // # of journal blocks.  0 => none
+  i32    jnlBps;                        // bytes per block
+  void (*jnlSnapshot)();                // logs the in-memory tables
+  i32  (*jnlRelease)(i32 dbn, i32 num); // frees pinned blocks
+
+  JnlSet run;                           // running transaction
+  JnlSet commit;                        // transaction being committed
+  JnlSet done;                          // committed, not yet in place
+
+  JnlPins pinNew;                       // forgotten since the last checkpoint
+  JnlPins pinOld;                       // forgotten before it
+  JnlPins held;                         // freed in the running transaction
+
+  u32 runSeq;                           // running transaction
+  u32 doneSeq;                          // all before this are committed
+  u32 diskSeq;                          // # for the next one logged on disk
+  u32 syncedSeq;                        // all before this ended in a sync
+  i32 logNext;                          // next free journal block
+  i32 handles;                          // # of operations in 'run'
+  i32 locked;                           // 1 => jnlBegin must wait
+  i32 committing;                       // 1 => a thread is committing
+
+  JnlStats        stats;
+  pthread_mutex_t jnlLock;
+  pthread_cond_t  jnlCond;
+};
+
+#define g_jnlDbn      (t_vol->jnl->jnlDbn)
+#define g_jnlBlocks   (t_vol->jnl->jnlBlocks)
+#define g_jnlBps      (t_vol->jnl->jnlBps)
+#define g_jnlSnapshot (t_vol->jnl->jnlSnapshot)
+#define g_jnlRelease  (t_vol->jnl->jnlRelease)
+#define g_run         (t_vol->jnl->run)
+#define g_commit      (t_vol->jnl->commit)
+#define g_done        (t_vol->jnl->done)
+#define g_pinNew      (t_vol->jnl->pinNew)
+#define g_pinOld      (t_vol->jnl->pinOld)
+#define g_held        (t_vol->jnl->held)
+#define g_runSeq      (t_vol->jnl->runSeq)
+#define g_doneSeq     (t_vol->jnl->doneSeq)
+#define g_diskSeq     (t_vol->jnl->diskSeq)
+#define g_syncedSeq   (t_vol->jnl->syncedSeq)
+#define g_logNext     (t_vol->jnl->logNext)
+#define g_handles     (t_vol->jnl->handles)
+#define g_locked      (t_vol->jnl->locked)
+#define g_committing  (t_vol->jnl->committing)
+#define g_stats       (t_vol->jnl->stats)
+#define g_jnlLock     (t_vol->jnl->jnlLock)
+#define g_jnlCond     (t_vol->jnl->jnlCond)
+
+
+
+// ============================================================================
+// Home slot of 'dbn' in a JnlSet hash table
+// ============================================================================
+static u32 jnlHash(i32 dbn) { return (u32)dbn * 2654435761u; }
+
+
+
+// ============================================================================
+// Enter block 'i' of 's' into its hash table
+// ============================================================================
+static void jnlIndex(JnlSet* s, i32 i) {
+  u32 mask = 2 * s->cap - 1;
+  u32 h    = jnlHash(s->dbns[i]) & mask;
+  while (s->hash[h] != 0) h = (h + 1) & mask;
+  s->hash[h] = i + 1;
+}
+
+
+
+// ============================================================================
+// Return the index of block 'dbn' in 's', or -1 if it is not there
+// ============================================================================
+static i32 jnlFind(JnlSet* s, i32 dbn) {
+  if (s->cap == 0) return -1;
+  u32 mask = 2 * s->cap - 1;
+  for (u32 h = jnlHash(dbn) & mask; s->hash[h] != 0; h = (h + 1) & mask) {
+    if (s->dbns[s->hash[h] - 1] == dbn) return s->hash[h] - 1;
+  }
+  return -1;
+}
+
+
+
+// ============================================================================
+// Double the room in 's'
+// ============================================================================
+static void jnlGrow(JnlSet* s) {
+  i32  cap  = (s->cap == 0) ? 16 : 2 * s->cap;
+  i32* dbns = realloc(s->dbns, cap * sizeof(i32));
+  i8*  data = realloc(s->data, (size_t)cap * g_jnlBps);
+  i32* hash = calloc(2 * cap, sizeof(i32));
+  if (dbns == NULL || data == NULL || hash == NULL) FATAL(ENOMEM);
+
+  free(s->hash);
+  s->dbns = dbns;
+  s->data = data;
+  s->hash = hash;
+  s->cap  = cap;
+  for (i32 i = 0; i < s->num; ++i) jnlIndex(s, i);
+}
+
+
+
+// ============================================================================
+// Put a copy of 'buf', the new contents of block 'dbn', into 's'.  A block
+// already there is overwritten
+// ============================================================================
+static void jnlPut(JnlSet* s, i32 dbn, void* buf) {
+  i32 i = jnlFind(s, dbn);
+  if (i < 0) {
+    if (s->num == s->cap) jnlGrow(s);
+    i = s->num++;
+    s->dbns[i] = dbn;
+    jnlIndex(s, i);
+  }
+  memcpy(s->data + (size_t)i * g_jnlBps, buf, g_jnlBps);
+}
+
+
+
+// ============================================================================
+// Empty 's', keeping its memory
+// ============================================================================
+static void jnlClear(JnlSet* s) {
+  s->num = 0;
+  if (s->hash != NULL) memset(s->hash, 0, 2 * s->cap * sizeof(i32));
+}
+
+
+
+// ============================================================================
+// Take block 'dbn' out of 's'.  The last block moves into its place, and the
+// hash table is rebuilt.  Return 1 if it was there
+// ============================================================================
+static i32 jnlRemove(JnlSet* s, i32 dbn) {
+  i32 i = jnlFind(s, dbn);
+  if (i < 0) return 0;
+
+  i32 last = --s->num;
+  if (i != last) {
+    s->dbns[i] = s->dbns[last];
+    memcpy(s->data + (size_t)i * g_jnlBps, s->data + (size_t)last * g_jnlBps,
+           g_jnlBps);
+  }
+  memset(s->hash, 0, 2 * s->cap * sizeof(i32));
+  for (i32 k = 0; k < s->num; ++k) jnlIndex(s, k);
+  return 1;
+}
+
+
+
+// ============================================================================
+// Hand the blocks in 'p' back to the allocator, and empty it.  Called with
+// no lock held
+// ============================================================================
+static void jnlRelease(JnlPins* p) {
+  for (i32 i = 0; i < p->num; ++i) g_jnlRelease(p->dbns[i], p->lens[i]);
+  free(p->dbns);
+  free(p->lens);
+  memset(p, 0, sizeof(JnlPins));
+}
+
+
+
+// ============================================================================
+// Add the run of 'num' blocks from 'dbn' on to 'p'.  Called with g_jnlLock
+// held
+// ============================================================================
+static void jnlPin(JnlPins* p, i32 dbn, i32 num) {
+  if (p->num == p->cap) {
+    i32  cap  = (p->cap == 0) ? 16 : 2 * p->cap;
+    i32* dbns = realloc(p->dbns, cap * sizeof(i32));
+    if (dbns != NULL) p->dbns = dbns;
+    i32* lens = realloc(p->lens, cap * sizeof(i32));
+    if (lens != NULL) p->lens = lens;
+    if (dbns == NULL || lens == NULL) FATAL(ENOMEM);
+    p->cap = cap;
+  }
+  p->dbns[p->num]   = dbn;
+  p->lens[p->num++] = num;
+}
+
+
+
+// ============================================================================
+// Release the memory of 's'
+// ============================================================================
+static void jnlFreeSet(JnlSet* s) {
+  free(s->dbns);
+  free(s->data);
+  free(s->hash);
+  memset(s, 0, sizeof(JnlSet));
+}
+
+
+
+// ============================================================================
+// Fold the 'numb' bytes at 'p' into the FNV-1a checksum 'sum'
+// ============================================================================
+static u32 jnlSum(u32 sum, void* p, i32 numb) {
+  for (i32 i = 0; i < numb; ++i) sum = (sum ^ ((u8*)p)[i]) * FNVPRIME;
+  return sum;
+}
+
+
+
+// ============================================================================
+// Order BioVecs by DBN, for qsort
+// ============================================================================
+static int jnlCompare(const void* a, const void* b) {
+  i32 x = ((BioVec*)a)->dbn;
+  i32 y = ((BioVec*)b)->dbn;
+  return (x > y) - (x < y);
+}
+
+
+
+// ============================================================================
+// Write every block in 's' to its home DBN, in DBN order, so runs of
+// neighbours merge into single requests
+// ============================================================================
+static void jnlWriteInPlace(JnlSet* s) {
+  if (s->num == 0) return;
+
+  BioVec* vec = malloc(s->num * sizeof(BioVec));
+  if (vec == NULL) FATAL(ENOMEM);
+  for (i32 i = 0; i < s->num; ++i) {
+    vec[i].dbn = s->dbns[i];
+    vec[i].buf = s->data + (size_t)i * g_jnlBps;
+  }
+  qsort(vec, s->num, sizeof(BioVec), jnlCompare);
+  bioWritev(vec, s->num);
+  free(vec);
+}
+
+
+
+// ============================================================================
+// Write the header of the journal at 'dbn': the log starts with transaction
+// 'seq'
+// ============================================================================
+static void jnlWriteHeader(i32 dbn, i32 bytesPerBlock, u32 seq) {
+  i8* buf = calloc(1, bytesPerBlock);
+  if (buf == NULL) FATAL(ENOMEM);
+  JnlBlock* hdr = (JnlBlock*)buf;
+  hdr->magic = JNLMAGIC;
+  hdr->type  = JNLHEADER;
+  hdr->seq   = seq;
+  bioWrite(dbn, buf);
+  free(buf);
+}
+
+
+
+// ============================================================================
+// Empty the journal: write the committed blocks in place - and, if
+// 'withCommit' is 1, then those of g_commit, which were never logged - and
+// restart the log at the next transaction.  Called by the committing thread
+// ============================================================================
+static void jnlCheckpoint(i32 withCommit) {
+  if (g_logNext == 1 && g_done.num == 0 && !withCommit) return;
+
+  jnlWriteInPlace(&g_done);
+  if (withCommit) jnlWriteInPlace(&g_commit);
+  bioSync();                            // in place before the log is dropped
+  jnlWriteHeader(g_jnlDbn, g_jnlBps, g_diskSeq);
+  bioSync();
+
+  pthread_mutex_lock(&g_jnlLock);
+  jnlClear(&g_done);
+  ++g_stats.checkpoints;
+  JnlPins safe = g_pinOld;              // forgotten two checkpoints ago
+  g_pinOld = g_pinNew;
+  memset(&g_pinNew, 0, sizeof(JnlPins));
+  pthread_mutex_unlock(&g_jnlLock);
+  g_logNext = 1;
+
+  jnlRelease(&safe);
+}
+
+
+
+// ============================================================================
+// Write g_commit to the journal as one transaction, after the file data
+// already written.  If the journal has too little room left, checkpoint it
+// first.  A transaction too big for even an empty journal is written in
+// place instead: it is then not atomic.  Return 1 if the device was synced
+// after the write; 0 if g_commit was empty.  Called by the committing thread
+// ============================================================================
+static i32 jnlWriteTxn() {
+  JnlSet* s = &g_commit;
+  if (s->num == 0) return 0;
+
+  i32 perDesc = (g_jnlBps - sizeof(JnlBlock)) / sizeof(i32);
+  i32 numDesc = (s->num + perDesc - 1) / perDesc;
+  i32 need    = numDesc + s->num + 1;
+
+  bioSync();                            // file data, and the last header
+
+  if (need > g_jnlBlocks - 1) {
+    jnlCheckpoint(1);
+    pthread_mutex_lock(&g_jnlLock);
+    ++g_stats.overflows;
+    pthread_mutex_unlock(&g_jnlLock);
+    return 1;
+  }
+  if (g_logNext + need > g_jnlBlocks) jnlCheckpoint(0);
+
+  i8*     meta = calloc(numDesc + 1, g_jnlBps);
+  BioVec* vec  = malloc(need * sizeof(BioVec));
+  if (meta == NULL || vec == NULL) FATAL(ENOMEM);
+
+  u32 sum = FNVBASIS;
+  i32 pos = g_logNext;
+  i32 v   = 0;
+  for (i32 d = 0; d < numDesc; ++d) {
+    i32 first = d * perDesc;
+    i32 num   = (s->num - first < perDesc) ? s->num - first : perDesc;
+
+    JnlBlock* desc = (JnlBlock*)(meta + (size_t)d * g_jnlBps);
+    i32*      dbns = (i32*)(desc + 1);
+    desc->magic = JNLMAGIC;
+    desc->type  = JNLDESC;
+    desc->seq   = g_diskSeq;
+    desc->num   = num;
+    vec[v].dbn  = g_jnlDbn + pos++;
+    vec[v++].buf = desc;
+
+    for (i32 i = 0; i < num; ++i) {
+      i8* block = s->data + (size_t)(first + i) * g_jnlBps;
+      dbns[i] = s->dbns[first + i];
+      sum = jnlSum(sum, &dbns[i], sizeof(i32));
+      sum = jnlSum(sum, block, g_jnlBps);
+      vec[v].dbn   = g_jnlDbn + pos++;
+      vec[v++].buf = block;
+    }
+  }
+
+  JnlBlock* commit = (JnlBlock*)(meta + (size_t)numDesc * g_jnlBps);
+  commit->magic = JNLMAGIC;
+  commit->type  = JNLCOMMIT;
+  commit->seq   = g_diskSeq;
+  commit->num   = s->num;
+  commit->sum   = sum;
+  vec[v].dbn    = g_jnlDbn + pos++;
+  vec[v++].buf  = commit;
+
+  bioWritev(vec, v);                    // one sequential run of blocks
+  bioSync();                            // the commit point
+  free(vec);
+  free(meta);
+
+  g_logNext = pos;
+  ++g_diskSeq;
+  pthread_mutex_lock(&g_jnlLock);
+  ++g_stats.commits;
+  g_stats.blocks += s->num;
+  pthread_mutex_unlock(&g_jnlLock);
+  return 1;
+}
+
+
+
+// ============================================================================
+// Start an fs operation that may change metadata: everything it logs, up
+// to jnlEnd, is committed together.  Call before taking any other lock.
+// Waits while a commit is gathering the running transaction, and commits
+// first if that transaction has grown to half the journal.  With no
+// journal, do nothing.  Return 0
+// ============================================================================
+i32 jnlBegin() {
+  if (g_jnlBlocks == 0) return 0;
+
+  pthread_mutex_lock(&g_jnlLock);
+  while (g_locked) pthread_cond_wait(&g_jnlCond, &g_jnlLock);
+  if (g_run.num >= (g_jnlBlocks - 1) / 2 && !g_committing) {
+    pthread_mutex_unlock(&g_jnlLock);
+    jnlCommit();
+    pthread_mutex_lock(&g_jnlLock);
+    while (g_locked) pthread_cond_wait(&g_jnlCond, &g_jnlLock);
+  }
+  ++g_handles;
+  pthread_mutex_unlock(&g_jnlLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Commit everything logged so far, then checkpoint the journal, so each
+// block is in place and the log is empty.  Later metadata writes go straight
+// to the cache.  Called by fsUnmount.  Return 0
+// ============================================================================
+i32 jnlClose() {
+  if (g_jnlBlocks == 0) return 0;
+
+  jnlCommit();
+  jnlCheckpoint(0);
+  jnlRelease(&g_pinOld);                // the log is empty: all are safe
+  jnlRelease(&g_pinNew);
+  jnlRelease(&g_held);
+
+  jnlFreeSet(&g_run);
+  jnlFreeSet(&g_commit);
+  jnlFreeSet(&g_done);
+  g_jnlBlocks = 0;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Make durable every metadata change logged before this call.  If another
+// thread is already committing, wait for it; then, if our changes were not
+// in its transaction, commit the running one - which also holds the changes
+// of every thread that waited alongside.  Return 1 if the commit ended with
+// a device sync, so the file data written before this call is durable too.
+// Return 0 if there was nothing to commit, or no journal
+// ============================================================================
+i32 jnlCommit() {
+  if (g_jnlBlocks == 0) return 0;
+
+  pthread_mutex_lock(&g_jnlLock);
+  ++g_stats.commitCalls;
+  u32 target = g_runSeq;                // holds all of our changes
+
+  while (g_doneSeq <= target) {
+    if (g_committing) {
+      pthread_cond_wait(&g_jnlCond, &g_jnlLock);
+      continue;
+    }
+
+    // gather the running transaction: wait for its operations to end, and
+    // log the in-memory tables while no new operation can start
+    g_committing = 1;
+    g_locked     = 1;
+    while (g_handles > 0) pthread_cond_wait(&g_jnlCond, &g_jnlLock);
+    pthread_mutex_unlock(&g_jnlLock);
+    if (g_jnlSnapshot != NULL) g_jnlSnapshot();
+    pthread_mutex_lock(&g_jnlLock);
+
+    JnlSet empty = g_commit;
+    g_commit = g_run;
+    g_run    = empty;
+    JnlPins freed = g_held;               // reusable once g_commit is
+    memset(&g_held, 0, sizeof(JnlPins));
+    u32 seq  = g_runSeq++;
+    g_locked = 0;
+    pthread_cond_broadcast(&g_jnlCond);
+    pthread_mutex_unlock(&g_jnlLock);
+
+    i32 synced = jnlWriteTxn();
+    jnlRelease(&freed);
+
+    pthread_mutex_lock(&g_jnlLock);
+    if (synced) g_syncedSeq = seq + 1;
+    for (i32 i = 0; i < g_commit.num; ++i) {
+      jnlPut(&g_done, g_commit.dbns[i],
+             g_commit.data + (size_t)i * g_jnlBps);
+    }
+    jnlClear(&g_commit);
+    g_doneSeq    = seq + 1;
+    g_committing = 0;
+    pthread_cond_broadcast(&g_jnlCond);
+  }
+
+  i32 synced = (g_syncedSeq > target);
+  pthread_mutex_unlock(&g_jnlLock);
+  return synced;
+}
+
+
+
+// ============================================================================
+// Note that the 'num' data blocks from 'dbn' on have been freed in the
+// running transaction.  Return 1: the journal keeps them, and frees them
+// through the 'release' given to jnlOpen once that transaction commits.
+// With no journal, return 0: they may be reused at once
+// ============================================================================
+i32 jnlDefer(i32 dbn, i32 num) {
+  if (g_jnlBlocks == 0) return 0;
+
+  pthread_mutex_lock(&g_jnlLock);
+  jnlPin(&g_held, dbn, num);
+  pthread_mutex_unlock(&g_jnlLock);
+  return 1;
+}
+
+
+
+// ============================================================================
+// End the fs operation started by jnlBegin.  Return 0
+// ============================================================================
+i32 jnlEnd() {
+  if (g_jnlBlocks == 0) return 0;
+
+  pthread_mutex_lock(&g_jnlLock);
+  if (--g_handles == 0 && g_locked) pthread_cond_broadcast(&g_jnlCond);
+  pthread_mutex_unlock(&g_jnlLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Note that metadata block 'dbn' has been freed: drop it from the running
+// transaction.  Return 0 if its DBN may be reused at once.  Return 1 if the
+// log still holds it: the journal then frees it itself, through the
+// 'release' given to jnlOpen, once no checkpoint or replay can write it.
+// With no journal, return 0
+// ============================================================================
+i32 jnlForget(i32 dbn) {
+  if (g_jnlBlocks == 0) return 0;
+
+  pthread_mutex_lock(&g_jnlLock);
+  jnlRemove(&g_run, dbn);
+  i32 logged = jnlFind(&g_commit, dbn) >= 0 || jnlFind(&g_done, dbn) >= 0;
+  if (logged) jnlPin(&g_pinNew, dbn, 1);
+  pthread_mutex_unlock(&g_jnlLock);
+  return logged;
+}
+
+
+
+// ============================================================================
+// Write an empty journal of 'numBlocks' blocks, from 'dbnJournal' on, for
+// fsFormat.  Only the header is written.  With 'numBlocks' 0, do nothing.
+// Return 0
+// ============================================================================
+i32 jnlFormat(i32 dbnJournal, i32 numBlocks, i32 bytesPerBlock) {
+  if (numBlocks == 0) return 0;
+  jnlWriteHeader(dbnJournal, bytesPerBlock, 1);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Free 'state', made by jnlNewState.  Its journal must be closed
+// ============================================================================
+i32 jnlFreeState(JnlState* state) {
+  if (state == NULL)          FATAL(ENULLPTR);
+  if (state->jnlBlocks != 0)  FATAL(EBADVOLUME);
+  jnlFreeSet(&state->run);
+  jnlFreeSet(&state->commit);
+  jnlFreeSet(&state->done);
+  free(state->pinNew.dbns);
+  free(state->pinNew.lens);
+  free(state->pinOld.dbns);
+  free(state->pinOld.lens);
+  free(state->held.dbns);
+  free(state->held.lens);
+  pthread_mutex_destroy(&state->jnlLock);
+  pthread_cond_destroy(&state->jnlCond);
+  free(state);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Copy the journal counters into 'stats'
+// ============================================================================
+i32 jnlGetStats(JnlStats* stats) {
+  if (stats == NULL) FATAL(ENULLPTR);
+  pthread_mutex_lock(&g_jnlLock);
+  *stats = g_stats;
+  pthread_mutex_unlock(&g_jnlLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return the # of blocks jnlDefer holds for the running transaction
+// ============================================================================
+i32 jnlHeld() {
+  pthread_mutex_lock(&g_jnlLock);
+  i32 num = 0;
+  for (i32 i = 0; i < g_held.num; ++i) num += g_held.lens[i];
+  pthread_mutex_unlock(&g_jnlLock);
+  return num;
+}
+
+
+
+// ============================================================================
+// Log 'buf' as the new contents of metadata block 'dbn', in the running
+// transaction.  Return 1 if logged: the journal now owns writing it back.
+// With no journal, return 0: the caller must write it itself
+// ============================================================================
+i32 jnlLog(i32 dbn, void* buf) {
+  if (g_jnlBlocks == 0) return 0;
+
+  pthread_mutex_lock(&g_jnlLock);
+  jnlPut(&g_run, dbn, buf);
+  pthread_mutex_unlock(&g_jnlLock);
+  return 1;
+}
+
+
+
+// ============================================================================
+// Return the journal state of a new volume, with no journal open.  See vol.c
+// ============================================================================
+JnlState* jnlNewState() {
+  JnlState* state = calloc(1, sizeof(JnlState));
+  if (state == NULL) FATAL(ENOMEM);
+  state->logNext = 1;
+  pthread_mutex_init(&state->jnlLock, NULL);
+  pthread_cond_init(&state->jnlCond, NULL);
+  return state;
+}
+
+
+
+// ============================================================================
+// Open the journal of 'numBlocks' blocks from 'dbnJournal' on, for the disk
+// just mounted, and replay into place every whole transaction it holds.
+// 'snapshot' is called at each commit to log the in-memory tables, and
+// 'release' to free the blocks jnlForget and jnlDefer kept back.  With
+// 'numBlocks' 0, there is no journal: metadata is written in place.  Must run
+// before any metadata is loaded.  Return 0
+// ============================================================================
+i32 jnlOpen(i32 dbnJournal, i32 numBlocks, i32 bytesPerBlock,
+            void (*snapshot)(), i32 (*release)(i32 dbn, i32 num)) {
+
+  g_jnlDbn      = dbnJournal;
+  g_jnlBps      = bytesPerBlock;
+  g_jnlSnapshot = snapshot;
+  g_jnlRelease  = release;
+  g_jnlBlocks   = 0;                    // off, until replay is done
+  g_handles     = 0;
+  g_locked      = 0;
+  g_committing  = 0;
+  g_logNext     = 1;
+  memset(&g_stats, 0, sizeof(JnlStats));
+  if (numBlocks == 0) return 0;
+
+  i8* buf = malloc(bytesPerBlock);
+  if (buf == NULL) FATAL(ENOMEM);
+
+  bioRead(dbnJournal, buf);
+  JnlBlock* blk = (JnlBlock*)buf;
+  u32 seq = (blk->magic == JNLMAGIC && blk->type == JNLHEADER) ? blk->seq : 1;
+
+  i32    perDesc  = (bytesPerBlock - sizeof(JnlBlock)) / sizeof(i32);
+  i32*   dbns     = malloc(perDesc * sizeof(i32));
+  if (dbns == NULL) FATAL(ENOMEM);
+  i32    pos      = 1;
+  i32    replayed = 0;
+  JnlSet txn;
+  memset(&txn, 0, sizeof(JnlSet));
+
+  for (;;) {                            // one transaction per pass
+    jnlClear(&txn);
+    u32 sum   = FNVBASIS;
+    i32 whole = 0;
+    while (pos < numBlocks) {
+      bioRead(dbnJournal + pos, buf);
+      if (blk->magic != JNLMAGIC || blk->seq != seq) break;
+      if (blk->type == JNLCOMMIT) {
+        whole = (blk->num == txn.num && blk->sum == sum);
+        ++pos;
+        break;
+      }
+      i32 num = blk->num;
+      if (blk->type != JNLDESC || num <= 0 || num > perDesc) break;
+      if (pos + num + 1 >= numBlocks) break;
+
+      memcpy(dbns, blk + 1, num * sizeof(i32));
+      ++pos;
+
+      i32 i = 0;
+      for (; i < num; ++i) {
+        i32 dbn = dbns[i];
+        if (dbn < 0 || dbn >= g_geo.numBlocks) break;
+        if (dbn >= dbnJournal && dbn < dbnJournal + numBlocks) break;
+        bioRead(dbnJournal + pos++, buf);
+        sum = jnlSum(sum, &dbn, sizeof(i32));
+        sum = jnlSum(sum, buf, bytesPerBlock);
+        jnlPut(&txn, dbn, buf);
+      }
+      if (i < num) break;
+    }
+    if (!whole) break;
+
+    jnlWriteInPlace(&txn);
+    replayed += txn.num;
+    ++seq;
+  }
+  jnlFreeSet(&txn);
+
+  if (replayed > 0) {                   // in place, then drop the log
+    bioSync();
+    jnlWriteHeader(dbnJournal, bytesPerBlock, seq);
+    bioSync();
+  }
+  free(dbns);
+  free(buf);
+
+  g_diskSeq = seq;
+  g_runSeq    = 0;
+  g_doneSeq   = 0;
+  g_syncedSeq = 0;
+  g_stats.replayed = replayed;
+  g_jnlBlocks = numBlocks;
+  return 0;
+}
+
+
+
+// ============================================================================
+// If the journal holds a newer copy of metadata block 'dbn' than its home
+// DBN does, copy it into 'buf' and return 1.  Else return 0
+// ============================================================================
+i32 jnlRead(i32 dbn, void* buf) {
+  if (g_jnlBlocks == 0) return 0;
+
+  pthread_mutex_lock(&g_jnlLock);
+  i32 found = 1;
+  i32 i;
+  if      ((i = jnlFind(&g_run,    dbn)) >= 0) {
+    memcpy(buf, g_run.data    + (size_t)i * g_jnlBps, g_jnlBps);
+  } else if ((i = jnlFind(&g_commit, dbn)) >= 0) {
+    memcpy(buf, g_commit.data + (size_t)i * g_jnlBps, g_jnlBps);
+  } else if ((i = jnlFind(&g_done,   dbn)) >= 0) {
+    memcpy(buf, g_done.data   + (size_t)i * g_jnlBps, g_jnlBps);
+  } else {
+    found = 0;
+  }
+  pthread_mutex_unlock(&g_jnlLock);
+  return found;
+}
@@ -0,0 +1,41 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+// ===================================================================
+// journal.h - Write-ahead journal of metadata blocks, with group
+// commit.  Sits between the cache and block IO (bio)
+// ===================================================================
+
+#include "alias.h"
+
+#define JNLMINBLOCKS  8           // smallest journal fsFormat lays out
+#define JNLMAXBLOCKS  1024        // largest default journal
+
+typedef struct {          // Journal counters
+  i64 commitCalls;        // calls of jnlCommit
+  i64 commits;            // transactions written to the journal
+  i64 blocks;             // metadata blocks written to the journal
+  i64 checkpoints;        // times the journal was emptied in place
+  i64 overflows;          // transactions too big for the journal
+  i64 replayed;           // blocks replayed by jnlOpen
+} JnlStats;
+
+typedef struct JnlState JnlState;     // one volume's journal: see vol.h
+
+i32 jnlBegin   ();
+i32 jnlClose   ();
+i32 jnlCommit  ();
+i32 jnlDefer   (i32 dbn, i32 num);
+i32 jnlEnd     ();
+i32 jnlForget  (i32 dbn);
+i32 jnlFormat  (i32 dbnJournal, i32 numBlocks, i32 bytesPerBlock);
+i32 jnlFreeState(JnlState* state);
+i32 jnlGetStats(JnlStats* stats);
+i32 jnlHeld    ();
+i32 jnlLog     (i32 dbn, void* buf);
+JnlState* jnlNewState();
+i32 jnlOpen    (i32 dbnJournal, i32 numBlocks, i32 bytesPerBlock,
+                void (*snapshot)(), i32 (*release)(i32 dbn, i32 num));
+i32 jnlRead    (i32 dbn, void* buf);
+
+#endif
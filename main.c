@@ -2,10 +2,15 @@
 
 #include "bfs.h"
 #include "errors.h"
+#include "fs.h"
+#include "fstest.h"
 #include "p5test.h"
 
 int main() {
+  fsMount();
   bfsInitOFT();
   p5test();
+  fstest();
+  fsUnmount();
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,200 @@
+// ============================================================================
+// stats.c - per-thread IO counters
+//
+// Each thread's IoStats is allocated on its first count, and linked into
+// g_statsList so statsGet can sum them.  When the thread exits, its counts
+// are folded into g_statsGone and its IoStats freed.  statsReset does not
+// touch other threads' counters: it records the current totals in
+// g_statsBase, which statsGet then subtracts
+// ============================================================================
+
+#include <time.h>
+
+#include "bfs.h"
+#include "stats.h"
+
+#define STATSFIELDS ((i32)(sizeof(IoStats) / sizeof(i64)))
+
+typedef struct StatsNode {  // one thread's counters, on g_statsList
+  IoStats           stats;  // first, so an IoStats* is a StatsNode*
+  struct StatsNode* prev;
+  struct StatsNode* next;
+} StatsNode;
+
+__thread IoStats* t_stats = NULL;
+
+static pthread_mutex_t g_statsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  g_statsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t   g_statsKey;          // runs statsRetire at exit
+static StatsNode*      g_statsList = NULL;  // threads still running
+static IoStats         g_statsGone;         // threads that have exited
+static IoStats         g_statsBase;         // totals at the last statsReset
+
+static str g_fsOpNames[NUMFSOPS] = {
+  "fsClone", "fsClose", "fsCreate", "fsDelete", "fsFsync", "fsOpen",
+  "fsPRead", "fsPWrite", "fsRead", "fsSync", "fsTruncate", "fsWrite"
+};
+
+
+
+// ============================================================================
+// Add the counters in 'from' to 'to'
+// ============================================================================
+static void statsAdd(IoStats* to, IoStats* from) {
+  i64* t = (i64*)to;
+  i64* f = (i64*)from;
+  for (i32 i = 0; i < STATSFIELDS; ++i) {
+    t[i] += __atomic_load_n(&f[i], __ATOMIC_RELAXED);
+  }
+}
+
+
+
+// ============================================================================
+// Sum every thread's counters, since start, into 'sum'.  Called with
+// g_statsLock held
+// ============================================================================
+static void statsSum(IoStats* sum) {
+  *sum = g_statsGone;
+  for (StatsNode* n = g_statsList; n != NULL; n = n->next) {
+    statsAdd(sum, &n->stats);
+  }
+}
+
+
+
+// ============================================================================
+// Destructor of g_statsKey: fold an exiting thread's counters into
+// g_statsGone, and free them
+// ============================================================================
+static void statsRetire(void* arg) {
+  StatsNode* n = (StatsNode*)arg;
+
+  pthread_mutex_lock(&g_statsLock);
+  statsAdd(&g_statsGone, &n->stats);
+  if (n->prev != NULL) n->prev->next = n->next;
+  else                 g_statsList   = n->next;
+  if (n->next != NULL) n->next->prev = n->prev;
+  pthread_mutex_unlock(&g_statsLock);
+  free(n);
+  t_stats = NULL;
+}
+
+
+
+// ============================================================================
+// Create g_statsKey, once
+// ============================================================================
+static void statsInitKey() {
+  if (pthread_key_create(&g_statsKey, statsRetire) != 0) FATAL(ENOMEM);
+}
+
+
+
+// ============================================================================
+// Return the name of fs operation 'op', one of FSOPCLONE etc
+// ============================================================================
+str statsFsOpName(i32 op) {
+  return (op >= 0 && op < NUMFSOPS) ? g_fsOpNames[op] : "?";
+}
+
+
+
+// ============================================================================
+// Copy into 'stats' the counters of all threads, summed, since the last
+// statsReset.  Return 0
+// ============================================================================
+i32 statsGet(IoStats* stats) {
+  if (stats == NULL) FATAL(ENULLPTR);
+
+  IoStats sum;
+  pthread_mutex_lock(&g_statsLock);
+  statsSum(&sum);
+  i64* s = (i64*)&sum;
+  i64* b = (i64*)&g_statsBase;
+  for (i32 i = 0; i < STATSFIELDS; ++i) s[i] -= b[i];
+  pthread_mutex_unlock(&g_statsLock);
+
+  *stats = sum;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Count a BioReq of 'num' blocks from 'dbn', read or written ('op'), as
+// metadata or data blocks.  Return 0
+// ============================================================================
+i32 statsIo(i32 op, i32 dbn, i32 num) {
+  i32 meta = g_geo.numMeta - dbn;
+  if (meta < 0)   meta = 0;
+  if (meta > num) meta = num;
+
+  STATSADD(requests, 1);
+  if (op == BIOREAD) {
+    if (meta > 0)       STATSADD(metaReads, meta);
+    if (num - meta > 0) STATSADD(dataReads, num - meta);
+  } else {
+    if (meta > 0)       STATSADD(metaWrites, meta);
+    if (num - meta > 0) STATSADD(dataWrites, num - meta);
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return a monotonic clock, in ns, for statsTime
+// ============================================================================
+i64 statsNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (i64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+// ============================================================================
+// Give the calling thread counters of its own, and return them.  Called by
+// STATSADD, on a thread's first count
+// ============================================================================
+IoStats* statsRegister() {
+  pthread_once(&g_statsOnce, statsInitKey);
+
+  StatsNode* n = calloc(1, sizeof(StatsNode));
+  if (n == NULL) FATAL(ENOMEM);
+
+  pthread_mutex_lock(&g_statsLock);
+  n->next = g_statsList;
+  if (g_statsList != NULL) g_statsList->prev = n;
+  g_statsList = n;
+  pthread_mutex_unlock(&g_statsLock);
+
+  pthread_setspecific(g_statsKey, n);
+  t_stats = &n->stats;
+  return t_stats;
+}
+
+
+
+// ============================================================================
+// Start all counters again from 0.  Return 0
+// ============================================================================
+i32 statsReset() {
+  pthread_mutex_lock(&g_statsLock);
+  statsSum(&g_statsBase);
+  pthread_mutex_unlock(&g_statsLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Count one call of fs operation 'op', one of FSOPCLONE etc, which began at
+// statsNow() 'start'.  Return 0
+// ============================================================================
+i32 statsTime(i32 op, i64 start) {
+  STATSADD(fsCalls[op], 1);
+  STATSADD(fsNs[op], statsNow() - start);
+  return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef STATS_H
+#define STATS_H
+
+// ===================================================================
+// stats.h - Per-thread counters of block IO, cache use, allocation
+// and time spent in each fs* call.  Each thread bumps counters of
+// its own, so they never contend; statsGet sums them
+// ===================================================================
+
+#include "alias.h"
+
+#define FSOPCLONE     0           // IoStats.fsCalls and fsNs
+#define FSOPCLOSE     1
+#define FSOPCREATE    2
+#define FSOPDELETE    3
+#define FSOPFSYNC     4
+#define FSOPOPEN      5
+#define FSOPPREAD     6
+#define FSOPPWRITE    7
+#define FSOPREAD      8
+#define FSOPSYNC      9
+#define FSOPTRUNCATE  10
+#define FSOPWRITE     11
+#define NUMFSOPS      12
+
+typedef struct {          // IO counters: all i64, summed field by field
+  i64 metaReads;          // blocks read below Geo.numMeta
+  i64 metaWrites;         // blocks written below Geo.numMeta
+  i64 dataReads;          // file blocks read
+  i64 dataWrites;         // file blocks written
+  i64 requests;           // BioReqs submitted
+  i64 cacheHits;          // cache lookups that found the block
+  i64 cacheMisses;        // ... that had to bring it in
+  i64 allocs;             // blocks allocated
+  i64 fsCalls[NUMFSOPS];  // calls of each fs* function, by FSOPCLONE etc
+  i64 fsNs[NUMFSOPS];     // ns spent in each, nested calls included
+} IoStats;
+
+extern __thread IoStats* t_stats;     // this thread's, once registered
+
+// add 'n' to this thread's counter 'field'.  Only the owner writes it, so
+// a relaxed store is enough: no locked instruction on the hot path
+#define STATSADD(field, n) do {                                         \
+  IoStats* s_ = (t_stats != NULL) ? t_stats : statsRegister();          \
+  __atomic_store_n(&s_->field, s_->field + (n), __ATOMIC_RELAXED);      \
+} while (0)
+
+str      statsFsOpName(i32 op);
+i32      statsGet     (IoStats* stats);
+i32      statsIo      (i32 op, i32 dbn, i32 num);
+i64      statsNow     ();
+IoStats* statsRegister();
+i32      statsReset   ();
+i32      statsTime    (i32 op, i64 start);
+
+#endif
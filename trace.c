@@ -0,0 +1,131 @@
+// ============================================================================
+// trace.c - binary trace of fs* calls and block IO
+//
+// trcStart creates the trace file and writes a TrcHeader with the geometry
+// of the mounted disk.  From then on each fs* call, and each BioReq, adds
+// a TrcRec (and, for fsOpen and fsCreate, the file name) to a buffer that
+// is written out whenever it fills, and at trcStop.  One lock serializes
+// the records, so tracing costs a little: it is off unless asked for.
+// Only one trace runs at a time.  It belongs to the volume that started it:
+// only that volume's calls are traced, and only its trcStop ends it
+// ============================================================================
+
+#include "bfs.h"
+#include "trace.h"
+
+#define TRCBUFSIZE (64 * 1024)          // bytes buffered before each fwrite
+
+i32 g_trcOn = 0;
+
+static FILE*           g_trcFp    = NULL;
+static BfsVolume*      g_trcVol   = NULL;  // the volume traced
+static i64             g_trcStart = 0;  // statsNow() at trcStart
+static i8              g_trcBuf[TRCBUFSIZE];
+static i32             g_trcLen   = 0;  // bytes in g_trcBuf
+static i32             g_trcTids  = 0;  // threads seen, over all traces
+static pthread_mutex_t g_trcLock  = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread i32 t_trcTid = -1;      // this thread's TrcRec.tid
+
+
+
+// ============================================================================
+// Write out g_trcBuf.  Called with g_trcLock held
+// ============================================================================
+static void trcFlush() {
+  if (g_trcLen > 0 && fwrite(g_trcBuf, g_trcLen, 1, g_trcFp) != 1) {
+    FATAL(ETRACE);
+  }
+  g_trcLen = 0;
+}
+
+
+
+// ============================================================================
+// Trace one call of 'op', TRCOPEN etc, which began at statsNow() 'start':
+// see TrcRec for 'fd', 'a' and 'b'.  'fname', if not NULL, follows the
+// record.  Return 0
+// ============================================================================
+i32 trcLog(i32 op, i32 fd, i32 a, i32 b, i64 start, str fname) {
+  TrcRec rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.op      = op;
+  rec.fd      = fd;
+  rec.a       = a;
+  rec.b       = b;
+  rec.nameLen = (fname == NULL) ? 0 : strnlen(fname, FNAMESIZE);
+
+  pthread_mutex_lock(&g_trcLock);
+  if (!g_trcOn || t_vol != g_trcVol) {  // stopped, or another volume
+    pthread_mutex_unlock(&g_trcLock);
+    return 0;
+  }
+  if (t_trcTid < 0) t_trcTid = g_trcTids++;
+  rec.tid = t_trcTid;
+  rec.ns  = start - g_trcStart;
+
+  if (g_trcLen + sizeof(rec) + rec.nameLen > TRCBUFSIZE) trcFlush();
+  memcpy(g_trcBuf + g_trcLen, &rec, sizeof(rec));
+  g_trcLen += sizeof(rec);
+  memcpy(g_trcBuf + g_trcLen, fname, rec.nameLen);
+  g_trcLen += rec.nameLen;
+  pthread_mutex_unlock(&g_trcLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Start tracing the calling thread's volume into a new file 'path'.  Call
+// once the disk is mounted, as the header records its geometry.  On
+// success, return 0.  Return ETRACE if a trace is already running, for this
+// volume or another.  On failure, abort
+// ============================================================================
+i32 trcStart(str path) {
+  if (path == NULL) FATAL(ENULLPTR);
+
+  pthread_mutex_lock(&g_trcLock);
+  if (g_trcOn) {
+    pthread_mutex_unlock(&g_trcLock);
+    return ETRACE;
+  }
+  g_trcFp = fopen(path, "wb");
+  if (g_trcFp == NULL) FATAL(ETRACE);
+
+  TrcHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic         = TRCMAGIC;
+  hdr.version       = TRCVERSION;
+  hdr.bytesPerBlock = g_geo.bytesPerBlock;
+  hdr.numBlocks     = g_geo.numBlocks;
+  hdr.numInodes     = g_geo.numInodes;
+  hdr.journalBlocks = g_geo.numJournalBlocks;
+  if (fwrite(&hdr, sizeof(hdr), 1, g_trcFp) != 1) FATAL(ETRACE);
+
+  g_trcStart = statsNow();
+  g_trcLen   = 0;
+  g_trcVol   = t_vol;
+  __atomic_store_n(&g_trcOn, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&g_trcLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Stop tracing the calling thread's volume: write out what is buffered, and
+// close the trace file.  With no trace of this volume running, do nothing.
+// Return 0
+// ============================================================================
+i32 trcStop() {
+  pthread_mutex_lock(&g_trcLock);
+  if (g_trcOn && g_trcVol == t_vol) {
+    trcFlush();
+    if (fclose(g_trcFp) != 0) FATAL(ETRACE);
+    g_trcFp  = NULL;
+    g_trcVol = NULL;
+    __atomic_store_n(&g_trcOn, 0, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&g_trcLock);
+  return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// ===================================================================
+// trace.h - Optional binary trace of fs* calls and block IO, for
+// bfsreplay.  Turned on by MountOpts.tracePath
+// ===================================================================
+
+#include "alias.h"
+
+#define TRCMAGIC      0x54534642  // "BFST"
+#define TRCVERSION    1
+
+#define TRCOPEN       1           // TrcRec.op
+#define TRCCREATE     2
+#define TRCCLOSE      3
+#define TRCREAD       4
+#define TRCWRITE      5
+#define TRCPREAD      6
+#define TRCPWRITE     7
+#define TRCSEEK       8
+#define TRCSYNC       9
+#define TRCFSYNC      10
+#define TRCBIOREAD    11
+#define TRCBIOWRITE   12
+#define TRCDELETE     13
+#define TRCTRUNCATE   14
+#define TRCCLONE      15
+
+typedef struct {          // start of a trace file
+  u32 magic;              // TRCMAGIC
+  u32 version;            // TRCVERSION
+  i32 bytesPerBlock;      // geometry of the disk traced
+  i32 numBlocks;
+  i32 numInodes;
+  i32 journalBlocks;
+} TrcHeader;
+
+typedef struct {          // one traced call.  Records follow the header
+  i64 ns;                 // when it began: ns since trcStart
+  u8  op;                 // TRCOPEN etc
+  u8  tid;                // calling thread: 0, 1, .. in order of first call
+  i16 nameLen;            // TRCOPEN, TRCCREATE, TRCDELETE, TRCCLONE: bytes
+                          //   of fname that follow
+  i32 fd;                 // fd; for TRCOPEN, TRCCREATE the one returned.
+                          //   TRCDELETE: result.  TRCBIOREAD, TRCBIOWRITE:
+                          //   first DBN
+  i32 a;                  // # of bytes.  TRCSEEK: offset.  TRCTRUNCATE:
+                          //   size.  TRCCLONE: result.  bio: # blocks
+  i32 b;                  // TRCPREAD, TRCPWRITE: offset.  TRCSEEK: whence
+} TrcRec;
+
+extern i32 g_trcOn;                   // 1 => between trcStart and trcStop
+
+// trace a call of 'op' begun at statsNow() 'start'.  With tracing off,
+// this costs one load
+#define TRACE(op, fd, a, b, start, fname) do {                          \
+  if (__atomic_load_n(&g_trcOn, __ATOMIC_RELAXED)) {                    \
+    trcLog(op, fd, a, b, start, fname);                                 \
+  }                                                                     \
+} while (0)
+
+i32 trcLog  (i32 op, i32 fd, i32 a, i32 b, i64 start, str fname);
+i32 trcStart(str path);
+i32 trcStop ();
+
+#endif
@@ -0,0 +1,252 @@
+// ============================================================================
+// vol.c - several BFS disks, mounted at once.  See vol.h
+// ============================================================================
+
+#include "bfs.h"
+#include "fs.h"
+#include "vol.h"
+
+// Each module keeps its state for one volume in a struct of its own, private
+// to its .c file, and reaches it through t_vol - so the code of the modules
+// reads as if there were just one disk.  The default volume serves callers
+// that never pick another
+
+static BfsVolume g_volDefault = { .path = BFSDISK };
+
+__thread BfsVolume* t_vol = &g_volDefault;
+
+typedef struct {          // a thread to start on a volume.  See volSpawn
+  BfsVolume* vol;
+  void* (*fn)(void*);
+  void* arg;
+} VolStart;
+
+// Switch the calling thread to 'vol', make 'call', and switch back
+#define VOLCALL(vol, call)                                                    \
+  BfsVolume* prev = volUse(vol);                                              \
+  i32 ret = call;                                                             \
+  volUse(prev);                                                               \
+  return ret
+
+
+
+// ============================================================================
+// Fill in the state of 'vol', with nothing mounted, and every OFT slot free
+// ============================================================================
+static void volInit(BfsVolume* vol) {
+  vol->bfs   = bfsNewState();
+  vol->bio   = bioNewState();
+  vol->cache = cacheNewState();
+  vol->csum  = csumNewState();
+  vol->fs    = fsNewState();
+  vol->jnl   = jnlNewState();
+
+  BfsVolume* prev = t_vol;
+  t_vol = vol;
+  bfsInitOFT();
+  t_vol = prev;
+}
+
+
+
+// ============================================================================
+// Ready the default volume, before main runs
+// ============================================================================
+__attribute__((constructor)) static void volInitDefault() {
+  volInit(&g_volDefault);
+}
+
+
+
+// ============================================================================
+// Run a thread started by volSpawn on the volume of its parent
+// ============================================================================
+static void* volThread(void* arg) {
+  VolStart start = *(VolStart*)arg;
+  free(arg);
+  t_vol = start.vol;
+  return start.fn(start.arg);
+}
+
+
+
+// ============================================================================
+// Free 'vol', made by volNew, and all of its state.  It must be unmounted.
+// The default volume cannot be freed: EBADVOLUME
+// ============================================================================
+i32 volFree(BfsVolume* vol) {
+  if (vol == NULL)            FATAL(ENULLPTR);
+  if (vol == &g_volDefault)   FATAL(EBADVOLUME);
+  if (vol == t_vol)           FATAL(EBADVOLUME);
+
+  fsFreeState(vol->fs);
+  bfsFreeState(vol->bfs);
+  csumFreeState(vol->csum);
+  jnlFreeState(vol->jnl);
+  cacheFreeState(vol->cache);
+  bioFreeState(vol->bio);
+  free(vol->path);
+  free(vol);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Make a volume whose disk is the host file 'path', as yet unmounted.  Format
+// it with volFormat, or mount a disk already there with volMount
+// ============================================================================
+BfsVolume* volNew(str path) {
+  if (path == NULL) FATAL(ENULLPTR);
+  BfsVolume* vol = calloc(1, sizeof(BfsVolume));
+  if (vol == NULL) FATAL(ENOMEM);
+  vol->path = strdup(path);
+  if (vol->path == NULL) FATAL(ENOMEM);
+  volInit(vol);
+  return vol;
+}
+
+
+
+// ============================================================================
+// Start a thread, as pthread_create, that runs 'fn' on the calling thread's
+// volume.  Every background thread of a module starts here, so that its
+// t_vol matches the volume it serves
+// ============================================================================
+i32 volSpawn(pthread_t* thread, void* (*fn)(void*), void* arg) {
+  VolStart* start = malloc(sizeof(VolStart));
+  if (start == NULL) return ENOMEM;
+  start->vol = t_vol;
+  start->fn  = fn;
+  start->arg = arg;
+  if (pthread_create(thread, NULL, volThread, start) != 0) {
+    free(start);
+    return ENOMEM;
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Make 'vol' the volume of the calling thread: the one its fs* calls work on.
+// NULL => the default volume, on BFSDISK.  Return the volume it had before
+// ============================================================================
+BfsVolume* volUse(BfsVolume* vol) {
+  BfsVolume* prev = t_vol;
+  t_vol = vol ? vol : &g_volDefault;
+  return prev;
+}
+
+
+
+// ============================================================================
+// The fs* calls, each on volume 'vol'.  See fs.c
+// ============================================================================
+i32 volAioWait(BfsVolume* vol, FsAio* aio) {
+  VOLCALL(vol, fsAioWait(aio));
+}
+
+i32 volClone(BfsVolume* vol, i32 fd, str fname) {
+  VOLCALL(vol, fsClone(fd, fname));
+}
+
+i32 volClose(BfsVolume* vol, i32 fd) {
+  VOLCALL(vol, fsClose(fd));
+}
+
+i32 volCompress(BfsVolume* vol, i32 fd, i32 on) {
+  VOLCALL(vol, fsCompress(fd, on));
+}
+
+i32 volCreate(BfsVolume* vol, str fname) {
+  VOLCALL(vol, fsCreate(fname));
+}
+
+i32 volDelete(BfsVolume* vol, str fname) {
+  VOLCALL(vol, fsDelete(fname));
+}
+
+i32 volFormat(BfsVolume* vol) {
+  VOLCALL(vol, fsFormat());
+}
+
+i32 volFormatOpts(BfsVolume* vol, FormatOpts* opts) {
+  VOLCALL(vol, fsFormatOpts(opts));
+}
+
+i32 volFsync(BfsVolume* vol, i32 fd) {
+  VOLCALL(vol, fsFsync(fd));
+}
+
+i32 volMount(BfsVolume* vol) {
+  VOLCALL(vol, fsMount());
+}
+
+i32 volMountOpts(BfsVolume* vol, MountOpts* opts) {
+  VOLCALL(vol, fsMountOpts(opts));
+}
+
+i32 volOpen(BfsVolume* vol, str fname) {
+  VOLCALL(vol, fsOpen(fname));
+}
+
+i32 volPRead(BfsVolume* vol, i32 fd, i32 offset, i32 numb, void* buf) {
+  VOLCALL(vol, fsPRead(fd, offset, numb, buf));
+}
+
+i32 volPWrite(BfsVolume* vol, i32 fd, i32 offset, i32 numb, void* buf) {
+  VOLCALL(vol, fsPWrite(fd, offset, numb, buf));
+}
+
+i32 volRead(BfsVolume* vol, i32 fd, i32 numb, void* buf) {
+  VOLCALL(vol, fsRead(fd, numb, buf));
+}
+
+i32 volReadAsync(BfsVolume* vol, FsAio* aio) {
+  VOLCALL(vol, fsReadAsync(aio));
+}
+
+i32 volReadView(BfsVolume* vol, i32 fd, i32 offset, i32 numb, void** view) {
+  VOLCALL(vol, fsReadView(fd, offset, numb, view));
+}
+
+i32 volScrub(BfsVolume* vol, i32 numThreads, ScrubStats* stats) {
+  VOLCALL(vol, fsScrub(numThreads, stats));
+}
+
+i32 volSeek(BfsVolume* vol, i32 fd, i32 offset, i32 whence) {
+  VOLCALL(vol, fsSeek(fd, offset, whence));
+}
+
+i32 volSize(BfsVolume* vol, i32 fd) {
+  VOLCALL(vol, fsSize(fd));
+}
+
+i32 volSnapshotDisk(BfsVolume* vol, str path) {
+  VOLCALL(vol, fsSnapshotDisk(path));
+}
+
+i32 volSync(BfsVolume* vol) {
+  VOLCALL(vol, fsSync());
+}
+
+i32 volTell(BfsVolume* vol, i32 fd) {
+  VOLCALL(vol, fsTell(fd));
+}
+
+i32 volTruncate(BfsVolume* vol, i32 fd, i32 size) {
+  VOLCALL(vol, fsTruncate(fd, size));
+}
+
+i32 volUnmount(BfsVolume* vol) {
+  VOLCALL(vol, fsUnmount());
+}
+
+i32 volWrite(BfsVolume* vol, i32 fd, i32 numb, void* buf) {
+  VOLCALL(vol, fsWrite(fd, numb, buf));
+}
+
+i32 volWriteAsync(BfsVolume* vol, FsAio* aio) {
+  VOLCALL(vol, fsWriteAsync(aio));
+}
@@ -0,0 +1,52 @@
+#ifndef VOL_H
+#define VOL_H
+
+// ===================================================================
+// vol.h - several BFS disks, mounted at once
+//
+// Each BfsVolume is one disk, held in its own host file, with its own
+// tables, locks, buffer cache, journal and background threads.  The vol*
+// calls work as their fs* namesakes, on the volume they name; calls on
+// different volumes run side by side.  The plain fs* calls work on the
+// calling thread's volume: the default one, on BFSDISK, unless volUse has
+// picked another.  A NULL volume means the default one
+// ===================================================================
+
+#include "alias.h"
+#include "fs.h"
+
+typedef struct BfsVolume BfsVolume;
+
+BfsVolume* volNew(str path);
+i32        volFree(BfsVolume* vol);
+BfsVolume* volUse(BfsVolume* vol);
+
+i32 volAioWait(BfsVolume* vol, FsAio* aio);
+i32 volClone  (BfsVolume* vol, i32 fd, str fname);
+i32 volClose  (BfsVolume* vol, i32 fd);
+i32 volCompress(BfsVolume* vol, i32 fd, i32 on);
+i32 volCreate (BfsVolume* vol, str fname);
+i32 volDelete (BfsVolume* vol, str fname);
+i32 volFormat (BfsVolume* vol);
+i32 volFormatOpts(BfsVolume* vol, FormatOpts* opts);
+i32 volFsync  (BfsVolume* vol, i32 fd);
+i32 volMount  (BfsVolume* vol);
+i32 volMountOpts(BfsVolume* vol, MountOpts* opts);
+i32 volOpen   (BfsVolume* vol, str fname);
+i32 volPRead  (BfsVolume* vol, i32 fd, i32 offset, i32 numb, void* buf);
+i32 volPWrite (BfsVolume* vol, i32 fd, i32 offset, i32 numb, void* buf);
+i32 volRead   (BfsVolume* vol, i32 fd, i32 numb, void* buf);
+i32 volReadAsync(BfsVolume* vol, FsAio* aio);
+i32 volReadView (BfsVolume* vol, i32 fd, i32 offset, i32 numb, void** view);
+i32 volScrub  (BfsVolume* vol, i32 numThreads, ScrubStats* stats);
+i32 volSeek   (BfsVolume* vol, i32 fd, i32 offset, i32 whence);
+i32 volSize   (BfsVolume* vol, i32 fd);
+i32 volSnapshotDisk(BfsVolume* vol, str path);
+i32 volSync   (BfsVolume* vol);
+i32 volTell   (BfsVolume* vol, i32 fd);
+i32 volTruncate(BfsVolume* vol, i32 fd, i32 size);
+i32 volUnmount(BfsVolume* vol);
+i32 volWrite  (BfsVolume* vol, i32 fd, i32 numb, void* buf);
+i32 volWriteAsync(BfsVolume* vol, FsAio* aio);
+
+#endif